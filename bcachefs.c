@@ -61,6 +61,11 @@ static void usage(void)
 	     "Commands for managing filesystem data:\n"
 	     "  data rereplicate         Rereplicate degraded data\n"
 	     "  data job                 Kick off low level data jobs\n"
+	     "  dedup                    Deduplicate data on an unmounted filesystem, with reflink\n"
+	     "  defrag                   Rewrite fragmented files on an unmounted filesystem\n"
+	     "  export                   Write out changes to an unmounted filesystem, for replication\n"
+	     "  import                   Apply the output of export to an unmounted replica\n"
+	     "  train-dict               Train a zstd dictionary for compressing small files\n"
 	     "\n"
 	     "Encryption:\n"
 	     "  unlock                   Unlock an encrypted filesystem prior to running/mounting\n"
@@ -73,6 +78,11 @@ static void usage(void)
 	     "\n"
 	     "Commands for operating on files in a bcachefs filesystem:\n"
 	     "  setattr                  Set various per file attributes\n"
+	     "\n"
+	     "Queries (offline, unmounted filesystems):\n"
+	     "  du                       Show space used per directory\n"
+	     "  query                    Find inodes by type, size, mtime or owner\n"
+	     "\n"
 	     "Debug:\n"
 	     "These commands work on offline, unmounted filesystems\n"
 	     "  dump                     Dump filesystem metadata to a qcow2 image\n"
@@ -190,6 +200,17 @@ int main(int argc, char *argv[])
 	if (!strcmp(cmd, "data"))
 		return data_cmds(argc, argv);
 
+	if (!strcmp(cmd, "dedup"))
+		return cmd_dedup(argc, argv);
+	if (!strcmp(cmd, "defrag"))
+		return cmd_defrag(argc, argv);
+	if (!strcmp(cmd, "export"))
+		return cmd_export(argc, argv);
+	if (!strcmp(cmd, "import"))
+		return cmd_import(argc, argv);
+	if (!strcmp(cmd, "train-dict"))
+		return cmd_train_dict(argc, argv);
+
 	if (!strcmp(cmd, "unlock"))
 		return cmd_unlock(argc, argv);
 	if (!strcmp(cmd, "set-passphrase"))
@@ -202,6 +223,11 @@ int main(int argc, char *argv[])
 	if (!strcmp(cmd, "migrate-superblock"))
 		return cmd_migrate_superblock(argc, argv);
 
+	if (!strcmp(cmd, "du"))
+		return cmd_du(argc, argv);
+	if (!strcmp(cmd, "query"))
+		return cmd_query(argc, argv);
+
 	if (!strcmp(cmd, "dump"))
 		return cmd_dump(argc, argv);
 	if (!strcmp(cmd, "list"))
@@ -0,0 +1,703 @@
+/*
+ * Offline deduplication: bcachefs dedup
+ *
+ * File data is split into chunks: --block-size aligned (within the file)
+ * ranges that are entirely data, i.e. no holes and no inline data. Chunks are
+ * fingerprinted with BLAKE2b, chunks with matching fingerprints are compared
+ * byte for byte, and then duplicates are replaced with reflink pointers to the
+ * first copy, with bch2_remap_range().
+ *
+ * Passes:
+ *  - scan the extents btree, a thread per range, collecting data extents
+ *  - build the list of chunks from runs of contiguous extents
+ *  - optionally, for chunks that are exactly one checksummed extent, use the
+ *    existing checksum as a prefilter: only chunks that share a checksum with
+ *    another chunk have to be read
+ *  - read and hash chunks, in parallel
+ *  - sort by hash; confirm every duplicate against the first chunk with that
+ *    hash, in parallel
+ *  - merge runs of adjacent duplicates - so that duplicate files become a
+ *    single remap - and remap them
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sodium/crypto_generichash.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/buckets.h"
+#include "libbcachefs/checksum.h"
+#include "libbcachefs/error.h"
+#include "libbcachefs/extents.h"
+#include "libbcachefs/inode.h"
+#include "libbcachefs/io.h"
+#include "libbcachefs/reflink.h"
+#include "libbcachefs/super.h"
+
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sort.h>
+
+#define DEDUP_THREADS_MAX	64
+#define DEDUP_HASH_BYTES	16
+
+struct dedup_extent {
+	u64			inum;
+	u64			start;
+	u64			end;
+	struct bch_csum		csum;
+	u8			csum_type;	/* 0 if not usable as a prefilter */
+};
+
+enum dedup_chunk_state {
+	DEDUP_CHUNK_CSUM,	/* hash is the extent checksum */
+	DEDUP_CHUNK_READ,	/* needs to be read and hashed */
+	DEDUP_CHUNK_HASHED,
+	DEDUP_CHUNK_SKIP,
+};
+
+struct dedup_chunk {
+	u64			inum;
+	u64			offset;
+	u8			hash[DEDUP_HASH_BYTES];
+	u8			csum_type;
+	u8			state;
+};
+
+struct dedup_remap {
+	u64			dst_inum;
+	u64			dst_offset;
+	u64			src_inum;
+	u64			src_offset;
+	u64			sectors;
+	bool			confirmed;
+};
+
+typedef darray(struct dedup_extent)	dedup_extents;
+typedef darray(struct dedup_chunk)	dedup_chunks;
+typedef darray(struct dedup_remap)	dedup_remaps;
+
+struct dedup {
+	struct bch_fs		*c;
+	unsigned		nr_threads;
+	unsigned		chunk_sectors;
+	bool			csum_prefilter;
+
+	dedup_extents		extents;
+	dedup_chunks		chunks;
+	dedup_remaps		remaps;
+
+	/* stats: */
+	u64			chunks_read;
+	u64			chunks_mismatched;
+};
+
+struct dedup_thread {
+	struct dedup		*d;
+	struct btree_range	r;
+	size_t			start;
+	size_t			end;
+	dedup_extents		extents;
+	u64			chunks_read;
+	u64			chunks_mismatched;
+	int			ret;
+};
+
+static void dedup_threads_run(struct dedup_thread *t, unsigned nr,
+			      int (*fn)(void *))
+{
+	struct task_struct *p[DEDUP_THREADS_MAX];
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		p[i] = kthread_create(fn, &t[i], "bch-dedup/%u", i);
+		if (IS_ERR(p[i]))
+			die("error creating thread: %s", strerror(-PTR_ERR(p[i])));
+
+		get_task_struct(p[i]);
+		wake_up_process(p[i]);
+	}
+
+	for (i = 0; i < nr; i++) {
+		kthread_stop(p[i]);
+		put_task_struct(p[i]);
+	}
+}
+
+/* Split items [0, @nr) evenly between threads: */
+static unsigned dedup_threads_split(struct dedup *d, struct dedup_thread *t,
+				    size_t nr)
+{
+	unsigned i, nr_threads = clamp_t(size_t, nr, 1, d->nr_threads);
+
+	memset(t, 0, sizeof(*t) * nr_threads);
+
+	for (i = 0; i < nr_threads; i++) {
+		t[i].d		= d;
+		t[i].start	= nr * i / nr_threads;
+		t[i].end	= nr * (i + 1) / nr_threads;
+	}
+
+	return nr_threads;
+}
+
+/* Scanning extents: */
+
+static u8 dedup_extent_csum_type(struct bkey_s_c k,
+				 struct bch_extent_crc_unpacked *crc)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		*crc = p.crc;
+
+		/*
+		 * Encrypted checksums depend on the nonce, so identical data
+		 * never has the same checksum:
+		 */
+		return  crc->csum_type &&
+			!bch2_csum_type_is_encryption(crc->csum_type) &&
+			!crc->offset &&
+			crc->live_size == crc->uncompressed_size &&
+			crc->live_size == k.k->size
+			? crc->csum_type : 0;
+	}
+
+	return 0;
+}
+
+static int dedup_scan_thread(void *arg)
+{
+	struct dedup_thread *t = arg;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	bch2_trans_init(&trans, t->d->c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_extents, t->r.start,
+			   BTREE_ITER_PREFETCH, k, ret) {
+		struct bch_extent_crc_unpacked crc;
+		struct dedup_extent e;
+
+		if (bkey_cmp(k.k->p, t->r.end) > 0)
+			break;
+
+		/* Already shared extents (reflink_p) are left alone: */
+		if (k.k->type != KEY_TYPE_extent)
+			continue;
+
+		e = (struct dedup_extent) {
+			.inum		= k.k->p.inode,
+			.start		= bkey_start_offset(k.k),
+			.end		= k.k->p.offset,
+			.csum_type	= dedup_extent_csum_type(k, &crc),
+		};
+
+		if (e.csum_type)
+			e.csum = crc.csum;
+
+		darray_append(t->extents, e);
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	t->ret = bch2_trans_exit(&trans) ?: ret;
+	return 0;
+}
+
+static void dedup_scan(struct dedup *d)
+{
+	struct dedup_thread t[DEDUP_THREADS_MAX];
+	struct btree_range r[DEDUP_THREADS_MAX];
+	unsigned i, nr;
+
+	memset(t, 0, sizeof(t));
+
+	nr = btree_split_ranges(d->c, BTREE_ID_extents, r, d->nr_threads);
+
+	for (i = 0; i < nr; i++) {
+		t[i].d = d;
+		t[i].r = r[i];
+		darray_init(t[i].extents);
+	}
+
+	dedup_threads_run(t, nr, dedup_scan_thread);
+
+	/* Each thread's extents are in btree order, and so are the ranges: */
+	for (i = 0; i < nr; i++) {
+		if (t[i].ret)
+			die("error scanning extents: %s", strerror(-t[i].ret));
+
+		darray_append_items(d->extents, t[i].extents.item,
+				    t[i].extents.size);
+		darray_free(t[i].extents);
+	}
+}
+
+/*
+ * Chunks are the aligned ranges that are entirely within a run of contiguous
+ * data extents:
+ */
+static void dedup_build_chunks(struct dedup *d)
+{
+	struct dedup_extent *e;
+	u64 inum = 0, end = 0, next = 0;
+	unsigned sectors = d->chunk_sectors;
+
+	darray_foreach(e, d->extents) {
+		if (e->inum != inum || e->start != end) {
+			inum	= e->inum;
+			next	= round_up(e->start, sectors);
+		}
+		end = e->end;
+
+		for (; next + sectors <= end; next += sectors) {
+			struct dedup_chunk c = {
+				.inum	= inum,
+				.offset	= next,
+				.state	= DEDUP_CHUNK_READ,
+			};
+
+			if (d->csum_prefilter &&
+			    e->csum_type &&
+			    e->start == next &&
+			    e->end == next + sectors) {
+				c.state		= DEDUP_CHUNK_CSUM;
+				c.csum_type	= e->csum_type;
+				memcpy(c.hash, &e->csum, sizeof(c.hash));
+			}
+
+			darray_append(d->chunks, c);
+		}
+	}
+
+	darray_free(d->extents);
+	darray_init(d->extents);
+}
+
+static int dedup_chunk_pos_cmp(const void *_l, const void *_r)
+{
+	const struct dedup_chunk *l = _l, *r = _r;
+
+	return  cmp_int(l->inum, r->inum) ?:
+		cmp_int(l->offset, r->offset);
+}
+
+static int dedup_chunk_hash_cmp(const void *_l, const void *_r)
+{
+	const struct dedup_chunk *l = _l, *r = _r;
+
+	return  cmp_int(l->state, r->state) ?:
+		cmp_int(l->csum_type, r->csum_type) ?:
+		memcmp(l->hash, r->hash, sizeof(l->hash)) ?:
+		dedup_chunk_pos_cmp(l, r);
+}
+
+static bool dedup_chunk_hash_eq(struct dedup_chunk *l, struct dedup_chunk *r)
+{
+	return  l->state == r->state &&
+		l->csum_type == r->csum_type &&
+		!memcmp(l->hash, r->hash, sizeof(l->hash));
+}
+
+/*
+ * Calls @fn on each group of chunks (in state @state) with the same hash; chunks
+ * must be sorted with dedup_chunk_hash_cmp:
+ */
+static void dedup_for_each_group(struct dedup *d, enum dedup_chunk_state state,
+				 void (*fn)(struct dedup *, struct dedup_chunk *,
+					    size_t))
+{
+	struct dedup_chunk *c = d->chunks.item;
+	struct dedup_chunk *end = c + d->chunks.size;
+
+	while (c < end) {
+		struct dedup_chunk *n = c + 1;
+
+		while (n < end && dedup_chunk_hash_eq(c, n))
+			n++;
+
+		if (c->state == state)
+			fn(d, c, n - c);
+		c = n;
+	}
+}
+
+static void dedup_prefilter_group(struct dedup *d, struct dedup_chunk *c,
+				  size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		c[i].state = nr > 1 ? DEDUP_CHUNK_READ : DEDUP_CHUNK_SKIP;
+}
+
+static void dedup_prefilter(struct dedup *d)
+{
+	sort(d->chunks.item, d->chunks.size, sizeof(d->chunks.item[0]),
+	     dedup_chunk_hash_cmp, NULL);
+
+	dedup_for_each_group(d, DEDUP_CHUNK_CSUM, dedup_prefilter_group);
+}
+
+/* Reading and hashing: */
+
+static void dedup_read_endio(struct bio *bio)
+{
+	closure_put(bio->bi_private);
+}
+
+static int dedup_read(struct bch_fs *c, u64 inum, u64 offset,
+		      void *buf, unsigned sectors)
+{
+	struct bch_inode_unpacked inode;
+	struct bch_read_bio rbio;
+	struct bio_vec bv;
+	struct closure cl;
+	int ret;
+
+	ret = bch2_inode_find_by_inum(c, inum, &inode);
+	if (ret)
+		return ret;
+
+	bio_init(&rbio.bio, &bv, 1);
+	rbio.bio.bi_iter.bi_size	= sectors << 9;
+	rbio.bio.bi_iter.bi_sector	= offset;
+	bv.bv_page			= buf;
+	bv.bv_len			= sectors << 9;
+	bv.bv_offset			= 0;
+	bio_set_op_attrs(&rbio.bio, REQ_OP_READ, REQ_SYNC);
+
+	closure_init_stack(&cl);
+	closure_get(&cl);
+	rbio.bio.bi_end_io		= dedup_read_endio;
+	rbio.bio.bi_private		= &cl;
+
+	bch2_read(c, rbio_init(&rbio.bio, io_opts(c, &inode)), inum);
+
+	closure_sync(&cl);
+
+	return -blk_status_to_errno(rbio.bio.bi_status);
+}
+
+static int dedup_hash_thread(void *arg)
+{
+	struct dedup_thread *t = arg;
+	struct dedup *d = t->d;
+	unsigned sectors = d->chunk_sectors;
+	void *buf = xmalloc(sectors << 9);
+	size_t i;
+
+	for (i = t->start; i < t->end && !t->ret; i++) {
+		struct dedup_chunk *c = &d->chunks.item[i];
+
+		if (c->state != DEDUP_CHUNK_READ)
+			continue;
+
+		t->ret = dedup_read(d->c, c->inum, c->offset, buf, sectors);
+		if (t->ret)
+			break;
+
+		crypto_generichash(c->hash, sizeof(c->hash),
+				   buf, sectors << 9, NULL, 0);
+		c->csum_type	= 0;
+		c->state	= DEDUP_CHUNK_HASHED;
+		t->chunks_read++;
+	}
+
+	free(buf);
+	return 0;
+}
+
+static void dedup_hash(struct dedup *d)
+{
+	struct dedup_thread t[DEDUP_THREADS_MAX];
+	unsigned i, nr;
+
+	/* Read in file order: */
+	sort(d->chunks.item, d->chunks.size, sizeof(d->chunks.item[0]),
+	     dedup_chunk_pos_cmp, NULL);
+
+	nr = dedup_threads_split(d, t, d->chunks.size);
+	dedup_threads_run(t, nr, dedup_hash_thread);
+
+	for (i = 0; i < nr; i++) {
+		if (t[i].ret)
+			die("error reading data: %s", strerror(-t[i].ret));
+		d->chunks_read += t[i].chunks_read;
+	}
+}
+
+/* Finding and confirming duplicates: */
+
+static void dedup_group_remaps(struct dedup *d, struct dedup_chunk *c,
+			       size_t nr)
+{
+	size_t i;
+
+	/* c[0] has the lowest position, and is kept: */
+	for (i = 1; i < nr; i++) {
+		struct dedup_remap r = {
+			.dst_inum	= c[i].inum,
+			.dst_offset	= c[i].offset,
+			.src_inum	= c[0].inum,
+			.src_offset	= c[0].offset,
+			.sectors	= d->chunk_sectors,
+		};
+
+		darray_append(d->remaps, r);
+	}
+}
+
+static int dedup_confirm_thread(void *arg)
+{
+	struct dedup_thread *t = arg;
+	struct dedup *d = t->d;
+	unsigned sectors = d->chunk_sectors;
+	void *src = xmalloc(sectors << 9);
+	void *dst = xmalloc(sectors << 9);
+	u64 src_inum = 0, src_offset = U64_MAX;
+	size_t i;
+
+	for (i = t->start; i < t->end; i++) {
+		struct dedup_remap *r = &d->remaps.item[i];
+
+		/* remaps for the same source are adjacent: */
+		if (r->src_inum != src_inum || r->src_offset != src_offset) {
+			t->ret = dedup_read(d->c, r->src_inum, r->src_offset,
+					    src, sectors);
+			if (t->ret)
+				break;
+
+			src_inum	= r->src_inum;
+			src_offset	= r->src_offset;
+		}
+
+		t->ret = dedup_read(d->c, r->dst_inum, r->dst_offset,
+				    dst, sectors);
+		if (t->ret)
+			break;
+
+		r->confirmed = !memcmp(src, dst, sectors << 9);
+		t->chunks_mismatched += !r->confirmed;
+	}
+
+	free(dst);
+	free(src);
+	return 0;
+}
+
+static int dedup_remap_dst_cmp(const void *_l, const void *_r)
+{
+	const struct dedup_remap *l = _l, *r = _r;
+
+	return  cmp_int(l->dst_inum, r->dst_inum) ?:
+		cmp_int(l->dst_offset, r->dst_offset);
+}
+
+static void dedup_find_remaps(struct dedup *d)
+{
+	struct dedup_thread t[DEDUP_THREADS_MAX];
+	struct dedup_remap *r, *prev = NULL;
+	dedup_remaps merged;
+	unsigned i, nr;
+
+	sort(d->chunks.item, d->chunks.size, sizeof(d->chunks.item[0]),
+	     dedup_chunk_hash_cmp, NULL);
+
+	dedup_for_each_group(d, DEDUP_CHUNK_HASHED, dedup_group_remaps);
+
+	darray_free(d->chunks);
+	darray_init(d->chunks);
+
+	nr = dedup_threads_split(d, t, d->remaps.size);
+	dedup_threads_run(t, nr, dedup_confirm_thread);
+
+	for (i = 0; i < nr; i++) {
+		if (t[i].ret)
+			die("error reading data: %s", strerror(-t[i].ret));
+		d->chunks_mismatched += t[i].chunks_mismatched;
+	}
+
+	/*
+	 * Merge remaps of adjacent chunks to adjacent chunks, so that duplicate
+	 * files (or runs of blocks) are remapped with a single call:
+	 */
+	sort(d->remaps.item, d->remaps.size, sizeof(d->remaps.item[0]),
+	     dedup_remap_dst_cmp, NULL);
+
+	darray_init(merged);
+
+	darray_foreach(r, d->remaps) {
+		if (!r->confirmed)
+			continue;
+
+		if (prev &&
+		    prev->dst_inum == r->dst_inum &&
+		    prev->dst_offset + prev->sectors == r->dst_offset &&
+		    prev->src_inum == r->src_inum &&
+		    prev->src_offset + prev->sectors == r->src_offset) {
+			prev->sectors += r->sectors;
+			continue;
+		}
+
+		darray_append(merged, *r);
+		prev = &merged.item[merged.size - 1];
+	}
+
+	darray_free(d->remaps);
+	d->remaps = merged;
+}
+
+/* Remapping: */
+
+static u64 dedup_remap(struct dedup *d)
+{
+	struct bch_fs *c = d->c;
+	struct dedup_remap *r;
+	u64 done = 0;
+
+	darray_foreach(r, d->remaps) {
+		s64 i_sectors_delta = 0;
+		s64 ret;
+
+		ret = bch2_remap_range(c,
+				       POS(r->dst_inum, r->dst_offset),
+				       POS(r->src_inum, r->src_offset),
+				       r->sectors, NULL, 0, &i_sectors_delta);
+		if (ret < 0)
+			die("error remapping %llu:%llu: %s",
+			    r->dst_inum, r->dst_offset, strerror(-ret));
+
+		done += ret;
+	}
+
+	return done;
+}
+
+static void dedup_usage(void)
+{
+	puts("bcachefs dedup - deduplicate data on an unmounted filesystem, with reflink\n"
+	     "Usage: bcachefs dedup [OPTION]... <devices>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -b, --block-size=size       Granularity to deduplicate at (default 64k)\n"
+	     "  -c, --csum-prefilter        Only read extents that have the same checksum as\n"
+	     "                              another extent; faster, but misses duplicates\n"
+	     "                              that were written differently\n"
+	     "  -n, --dry-run               Only report what would be deduplicated\n"
+	     "  -j, --threads=N             Number of threads to scan and read with\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+int cmd_dedup(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "block-size",		required_argument,	NULL, 'b' },
+		{ "csum-prefilter",	no_argument,		NULL, 'c' },
+		{ "dry-run",		no_argument,		NULL, 'n' },
+		{ "threads",		required_argument,	NULL, 'j' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	struct dedup d = {
+		.nr_threads	= clamp_t(long, sysconf(_SC_NPROCESSORS_ONLN),
+					  1, DEDUP_THREADS_MAX),
+		.chunk_sectors	= 128,
+	};
+	struct bch_fs_usage_short before, after;
+	struct dedup_remap *r;
+	bool dry_run = false;
+	u64 sectors = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "b:cnj:h",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'b':
+			d.chunk_sectors = hatoi_validate(optarg, "block size");
+			break;
+		case 'c':
+			d.csum_prefilter = true;
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		case 'j':
+			if (kstrtouint(optarg, 10, &d.nr_threads) ||
+			    !d.nr_threads ||
+			    d.nr_threads > DEDUP_THREADS_MAX)
+				die("invalid number of threads %s", optarg);
+			break;
+		case 'h':
+			dedup_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			dedup_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s)");
+
+	if (dry_run)
+		opt_set(opts, nochanges, true);
+
+	d.c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(d.c))
+		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(d.c)));
+
+	if (d.chunk_sectors % d.c->opts.block_size)
+		die("block size must be a multiple of the filesystem block size (%u)",
+		    d.c->opts.block_size << 9);
+
+	darray_init(d.extents);
+	darray_init(d.chunks);
+	darray_init(d.remaps);
+
+	dedup_scan(&d);
+	dedup_build_chunks(&d);
+	if (d.csum_prefilter)
+		dedup_prefilter(&d);
+	dedup_hash(&d);
+	dedup_find_remaps(&d);
+
+	darray_foreach(r, d.remaps)
+		sectors += r->sectors;
+
+	printf("read %llu chunks, %llu hash collisions, found %s duplicate",
+	       d.chunks_read, d.chunks_mismatched,
+	       pr_units(sectors, HUMAN_READABLE));
+	printf(" in %zu ranges\n", d.remaps.size);
+
+	if (!dry_run) {
+		before = bch2_fs_usage_read_short(d.c);
+		sectors = dedup_remap(&d);
+		after = bch2_fs_usage_read_short(d.c);
+
+		printf("deduplicated %s,", pr_units(sectors, HUMAN_READABLE));
+		printf(" reclaimed %s\n",
+		       pr_units(before.used > after.used
+				? before.used - after.used : 0,
+				HUMAN_READABLE));
+	}
+
+	darray_free(d.remaps);
+	bch2_fs_stop(d.c);
+	return 0;
+}
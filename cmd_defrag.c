@@ -0,0 +1,532 @@
+/*
+ * Offline defragmentation: bcachefs defrag
+ *
+ * A file's fragmentation is measured as the number of physically contiguous
+ * runs ("fragments") its extents make up - following the first non cached
+ * pointer of each extent.
+ *
+ * Fragmented files are rewritten with the normal data move path, one device at
+ * a time, through a write point used for nothing else: moves complete in order,
+ * so the new extents are allocated back to back, and adjacent extents get
+ * merged as they're inserted.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/alloc_foreground.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/dirent.h"
+#include "libbcachefs/disk_groups.h"
+#include "libbcachefs/error.h"
+#include "libbcachefs/extents.h"
+#include "libbcachefs/inode.h"
+#include "libbcachefs/move.h"
+#include "libbcachefs/str_hash.h"
+#include "libbcachefs/super.h"
+
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sort.h>
+
+#define DEFRAG_THREADS_MAX	64
+
+struct defrag_file {
+	u64			inum;
+	u64			sectors;
+	u64			extents;
+	u64			fragments;
+
+	/* physical position of the first and last extents: */
+	unsigned		first_dev;
+	u64			first_start;
+	unsigned		last_dev;
+	u64			last_end;
+};
+
+typedef darray(struct defrag_file) defrag_files;
+
+struct defrag_thread {
+	struct bch_fs		*c;
+	struct btree_range	r;
+	defrag_files		files;
+	int			ret;
+};
+
+/* Measuring: */
+
+static bool defrag_extent_pos(struct bkey_s_c k, unsigned *dev,
+			      u64 *start, u64 *end)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry)
+		if (!p.ptr.cached) {
+			*dev	= p.ptr.dev;
+
+			if (crc_is_compressed(p.crc)) {
+				*start	= p.ptr.offset;
+				*end	= *start + p.crc.compressed_size;
+			} else {
+				*start	= p.ptr.offset + p.crc.offset;
+				*end	= *start + k.k->size;
+			}
+			return true;
+		}
+
+	return false;
+}
+
+static void defrag_account(struct defrag_file *f, struct bkey_s_c k)
+{
+	unsigned dev;
+	u64 start, end;
+
+	if (!defrag_extent_pos(k, &dev, &start, &end))
+		return;
+
+	if (!f->extents) {
+		f->first_dev	= dev;
+		f->first_start	= start;
+		f->fragments	= 1;
+	} else if (dev != f->last_dev || start != f->last_end) {
+		f->fragments++;
+	}
+
+	f->extents++;
+	f->sectors	+= k.k->size;
+	f->last_dev	= dev;
+	f->last_end	= end;
+}
+
+static void defrag_files_add(defrag_files *files, struct defrag_file *f)
+{
+	struct defrag_file *l = files->size
+		? &files->item[files->size - 1] : NULL;
+
+	/* an inode split between two threads' ranges: */
+	if (l && l->inum == f->inum) {
+		l->sectors	+= f->sectors;
+		l->extents	+= f->extents;
+		l->fragments	+= f->fragments;
+		l->fragments	-= l->last_dev == f->first_dev &&
+				   l->last_end == f->first_start;
+		l->last_dev	= f->last_dev;
+		l->last_end	= f->last_end;
+		return;
+	}
+
+	darray_append(*files, *f);
+}
+
+static int defrag_measure(struct bch_fs *c, struct btree_range r,
+			  defrag_files *files)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct defrag_file f = { 0 };
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_extents, r.start,
+			   BTREE_ITER_PREFETCH, k, ret) {
+		if (bkey_cmp(k.k->p, r.end) > 0)
+			break;
+
+		/* Reflinked data lives in the reflink btree, and is skipped: */
+		if (k.k->type != KEY_TYPE_extent)
+			continue;
+
+		if (f.extents && f.inum != k.k->p.inode) {
+			defrag_files_add(files, &f);
+			memset(&f, 0, sizeof(f));
+		}
+
+		f.inum = k.k->p.inode;
+		defrag_account(&f, k);
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	if (f.extents)
+		defrag_files_add(files, &f);
+
+	return bch2_trans_exit(&trans) ?: ret;
+}
+
+static struct defrag_file defrag_measure_inode(struct bch_fs *c, u64 inum)
+{
+	struct btree_range r = {
+		.start	= POS(inum, 0),
+		.end	= POS(inum, U64_MAX),
+	};
+	struct defrag_file ret = { .inum = inum };
+	defrag_files files;
+	int err;
+
+	darray_init(files);
+
+	err = defrag_measure(c, r, &files);
+	if (err)
+		die("error reading extents: %s", strerror(-err));
+
+	if (files.size)
+		ret = files.item[0];
+	darray_free(files);
+	return ret;
+}
+
+static int defrag_measure_thread(void *arg)
+{
+	struct defrag_thread *t = arg;
+
+	t->ret = defrag_measure(t->c, t->r, &t->files);
+	return 0;
+}
+
+static void defrag_measure_all(struct bch_fs *c, unsigned nr_threads,
+			       defrag_files *files)
+{
+	struct defrag_thread t[DEFRAG_THREADS_MAX];
+	struct task_struct *p[DEFRAG_THREADS_MAX];
+	struct btree_range r[DEFRAG_THREADS_MAX];
+	struct defrag_file *f;
+	unsigned i, nr;
+
+	memset(t, 0, sizeof(t));
+
+	nr = btree_split_ranges(c, BTREE_ID_extents, r, nr_threads);
+
+	for (i = 0; i < nr; i++) {
+		t[i].c = c;
+		t[i].r = r[i];
+		darray_init(t[i].files);
+
+		p[i] = kthread_create(defrag_measure_thread, &t[i],
+				      "bch-defrag/%u", i);
+		if (IS_ERR(p[i]))
+			die("error creating thread: %s", strerror(-PTR_ERR(p[i])));
+
+		get_task_struct(p[i]);
+		wake_up_process(p[i]);
+	}
+
+	for (i = 0; i < nr; i++) {
+		kthread_stop(p[i]);
+		put_task_struct(p[i]);
+
+		if (t[i].ret)
+			die("error reading extents: %s", strerror(-t[i].ret));
+
+		darray_foreach(f, t[i].files)
+			defrag_files_add(files, f);
+		darray_free(t[i].files);
+	}
+}
+
+static bool defrag_file_fragmented(struct defrag_file *f,
+				   unsigned min_fragment)
+{
+	return f->fragments > 1 &&
+		f->sectors < f->fragments * (u64) min_fragment;
+}
+
+static int defrag_fragments_cmp(const void *_l, const void *_r)
+{
+	const struct defrag_file *l = _l, *r = _r;
+
+	return  cmp_int(r->fragments, l->fragments) ?:
+		cmp_int(l->inum, r->inum);
+}
+
+/* Rewriting: */
+
+struct defrag_pred_arg {
+	unsigned		dev;
+};
+
+static enum data_cmd defrag_pred(struct bch_fs *c, void *_arg,
+				 struct bkey_s_c k,
+				 struct bch_io_opts *io_opts,
+				 struct data_opts *data_opts)
+{
+	struct defrag_pred_arg *arg = _arg;
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+
+	if (k.k->type != KEY_TYPE_extent)
+		return DATA_SKIP;
+
+	bkey_for_each_ptr(ptrs, ptr)
+		if (ptr->dev == arg->dev && !ptr->cached) {
+			/* rewrite this replica on the same device: */
+			data_opts->target		= dev_to_target(arg->dev);
+			data_opts->nr_replicas		= 1;
+			data_opts->btree_insert_flags	= 0;
+			data_opts->rewrite_dev		= arg->dev;
+			return DATA_REWRITE;
+		}
+
+	return DATA_SKIP;
+}
+
+static void defrag_inode(struct bch_fs *c, u64 inum, bool verbose)
+{
+	struct defrag_file before = defrag_measure_inode(c, inum), after;
+	struct bch_move_stats stats;
+	struct bch_dev *ca;
+	unsigned i;
+	int ret;
+
+	if (before.fragments <= 1) {
+		if (verbose)
+			printf("inode %llu: not fragmented\n", inum);
+		return;
+	}
+
+	for_each_online_member(ca, c, i) {
+		struct defrag_pred_arg arg = { .dev = i };
+
+		memset(&stats, 0, sizeof(stats));
+
+		ret = bch2_move_data(c,
+				     BTREE_ID_extents, POS(inum, 0),
+				     BTREE_ID_extents, POS(inum + 1, 0),
+				     NULL,
+				     writepoint_ptr(&c->defrag_write_point),
+				     defrag_pred, &arg,
+				     &stats);
+		if (ret)
+			die("error rewriting inode %llu: %s", inum, strerror(-ret));
+	}
+
+	after = defrag_measure_inode(c, inum);
+
+	printf("inode %llu: %llu extents in %llu fragments -> %llu extents in %llu fragments\n",
+	       inum, before.extents, before.fragments,
+	       after.extents, after.fragments);
+}
+
+/* Resolving paths: */
+
+static u64 defrag_lookup_path(struct bch_fs *c, const char *path)
+{
+	char *p = strdup(path), *name, *s = p;
+	u64 inum = BCACHEFS_ROOT_INO;
+
+	while ((name = strsep(&s, "/"))) {
+		struct bch_inode_unpacked dir;
+		struct bch_hash_info hash_info;
+		struct qstr qstr = QSTR_INIT(name, strlen(name));
+
+		if (!*name || !strcmp(name, "."))
+			continue;
+
+		if (bch2_inode_find_by_inum(c, inum, &dir))
+			die("error looking up inode %llu", inum);
+
+		if (!S_ISDIR(dir.bi_mode))
+			die("%s: not a directory", path);
+
+		hash_info = bch2_hash_info_init(c, &dir);
+
+		inum = bch2_dirent_lookup(c, inum, &hash_info, &qstr);
+		if (!inum)
+			die("%s: not found", path);
+	}
+
+	free(p);
+	return inum;
+}
+
+static void defrag_usage(void)
+{
+	puts("bcachefs defrag - rewrite fragmented files contiguously, on an unmounted filesystem\n"
+	     "Usage: bcachefs defrag [OPTION]... <devices>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -p, --path=path             Defragment a file, by path within the filesystem\n"
+	     "  -i, --inode=inum            Defragment a file, by inode number\n"
+	     "  -a, --all                   Defragment all fragmented files\n"
+	     "      --older-than=time       With --all, only files not modified since time\n"
+	     "                              (seconds since the epoch)\n"
+	     "  -m, --min-fragment=size     Files whose fragments are smaller than this on\n"
+	     "                              average are fragmented (default 1M)\n"
+	     "  -r, --report                Only report fragmentation\n"
+	     "  -n, --top=N                 Number of files to list in the report (default 20)\n"
+	     "  -j, --threads=N             Number of threads to scan with\n"
+	     "  -v, --verbose\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "With no files given, reports fragmentation.\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+int cmd_defrag(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "path",		required_argument,	NULL, 'p' },
+		{ "inode",		required_argument,	NULL, 'i' },
+		{ "all",		no_argument,		NULL, 'a' },
+		{ "older-than",		required_argument,	NULL, 'o' },
+		{ "min-fragment",	required_argument,	NULL, 'm' },
+		{ "report",		no_argument,		NULL, 'r' },
+		{ "top",		required_argument,	NULL, 'n' },
+		{ "threads",		required_argument,	NULL, 'j' },
+		{ "verbose",		no_argument,		NULL, 'v' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	struct bch_fs *c;
+	darray(char *) paths;
+	darray(u64) inums;
+	defrag_files files;
+	struct defrag_file *f;
+	unsigned nr_threads = clamp_t(long, sysconf(_SC_NPROCESSORS_ONLN),
+				      1, DEFRAG_THREADS_MAX);
+	unsigned min_fragment = 2048, top = 20;
+	u64 v, *inum, nr_fragmented = 0, extents = 0, fragments = 0;
+	long long older_than = LLONG_MAX;
+	bool all = false, report = false, verbose = false;
+	char **path;
+	int opt;
+
+	darray_init(paths);
+	darray_init(inums);
+
+	while ((opt = getopt_long(argc, argv, "p:i:am:rn:j:vh",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'p':
+			darray_append(paths, optarg);
+			break;
+		case 'i':
+			if (kstrtoull(optarg, 10, &v))
+				die("invalid inode number %s", optarg);
+			darray_append(inums, v);
+			break;
+		case 'a':
+			all = true;
+			break;
+		case 'o':
+			if (kstrtoll(optarg, 10, &older_than))
+				die("invalid time %s", optarg);
+			break;
+		case 'm':
+			if (bch2_strtoull_h(optarg, &v) || !(v >> 9) || v >> 41)
+				die("invalid size %s", optarg);
+			min_fragment = v >> 9;
+			break;
+		case 'r':
+			report = true;
+			break;
+		case 'n':
+			if (kstrtouint(optarg, 10, &top))
+				die("invalid number %s", optarg);
+			break;
+		case 'j':
+			if (kstrtouint(optarg, 10, &nr_threads) ||
+			    !nr_threads || nr_threads > DEFRAG_THREADS_MAX)
+				die("invalid number of threads %s", optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			defrag_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			defrag_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s)");
+
+	if (older_than != LLONG_MAX && !all)
+		die("--older-than only applies to --all");
+
+	if (!paths.size && !inums.size && !all)
+		report = true;
+
+	if (report)
+		opt_set(opts, nochanges, true);
+
+	c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
+
+	darray_foreach(path, paths)
+		darray_append(inums, defrag_lookup_path(c, *path));
+
+	if (report || all) {
+		darray_init(files);
+		defrag_measure_all(c, nr_threads, &files);
+
+		darray_foreach(f, files) {
+			extents		+= f->extents;
+			fragments	+= f->fragments;
+			nr_fragmented	+= defrag_file_fragmented(f, min_fragment);
+		}
+
+		printf("%zu files, %llu extents, %llu fragments, %llu files fragmented\n",
+		       files.size, extents, fragments, nr_fragmented);
+	}
+
+	if (report) {
+		sort(files.item, files.size, sizeof(files.item[0]),
+		     defrag_fragments_cmp, NULL);
+
+		printf("%-12s %12s %10s %10s %12s\n",
+		       "inode", "size", "extents", "fragments", "avg fragment");
+
+		darray_foreach(f, files) {
+			if (!top--)
+				break;
+
+			printf("%-12llu %12s", f->inum,
+			       pr_units(f->sectors, HUMAN_READABLE));
+			printf(" %10llu %10llu %12s\n", f->extents, f->fragments,
+			       pr_units(f->sectors / f->fragments, HUMAN_READABLE));
+		}
+	} else if (all) {
+		darray_foreach(f, files) {
+			struct bch_inode_unpacked u;
+
+			if (!defrag_file_fragmented(f, min_fragment))
+				continue;
+
+			if (older_than != LLONG_MAX &&
+			    (bch2_inode_find_by_inum(c, f->inum, &u) ||
+			     bch2_time_to_timespec(c, u.bi_mtime).tv_sec >= older_than))
+				continue;
+
+			darray_append(inums, f->inum);
+		}
+	}
+
+	if (!report)
+		darray_foreach(inum, inums)
+			defrag_inode(c, *inum, verbose);
+
+	if (report || all)
+		darray_free(files);
+	darray_free(inums);
+	darray_free(paths);
+	bch2_fs_stop(c);
+	return 0;
+}
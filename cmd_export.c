@@ -0,0 +1,941 @@
+/*
+ * Incremental replication: bcachefs export, bcachefs import
+ *
+ * Export walks the inodes, dirents, xattrs and extents btrees of an unmounted
+ * filesystem and writes out the parts that changed since a previous export,
+ * identified by a token; import applies the stream to a replica.
+ *
+ * Changes are found at two granularities:
+ *
+ *  - btree nodes: every bset records the newest journal sequence number of the
+ *    keys it contains, and that's preserved when nodes are sorted, split and
+ *    merged - so a leaf node whose journal_seq is older than the token hasn't
+ *    changed since. Changed leaf nodes are exported as ranges, which replace
+ *    the corresponding range on the replica: keys on the replica that aren't
+ *    in the stream are deleted, which is how deletions are propagated.
+ *
+ *  - key versions: within a changed range of the extents btree, extents with a
+ *    nonzero version older than the token were written before the previous
+ *    export, and are sent as "keep this range" instead of as data. Extents
+ *    only get versions if the filesystem has track_changes set; otherwise all
+ *    data in a changed range is sent. Collapse/insert range give the extents
+ *    they move a new version. Encrypted extents are always sent: their
+ *    version is the nonce, so it can't be changed when they're moved.
+ *
+ * Both are conservative - data is never skipped that has changed - but not
+ * exact, so the stream is proportional to the number of btree nodes touched
+ * (plus the data written) since the last export, not to the size of the
+ * filesystem.
+ *
+ * Streams must be applied in order, starting from an export with --since=0,
+ * and the replica must not be modified otherwise. Import records the source
+ * filesystem's uuid and the token of the last stream applied in the replica's
+ * superblock (BCH_SB_FIELD_import), and refuses streams from a different
+ * filesystem, and incremental streams that don't continue from that token.
+ *
+ * Stream format, in host byte order: a struct export_header, then records -
+ * struct export_rec followed by @len bytes of payload - terminated by an
+ * EXPORT_END record:
+ *
+ *  EXPORT_RANGE	a changed range, [start, end] for normal btrees and
+ *			[start, end) in sectors for extents
+ *  EXPORT_KEY		a key within the current range; payload is a bkey_i
+ *  EXPORT_KEEP		extents: [start, end) is unchanged
+ *  EXPORT_DATA		extents: [start, end) has new data; payload is the data
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <uuid/uuid.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/alloc_foreground.h"
+#include "libbcachefs/bkey_buf.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/btree_update.h"
+#include "libbcachefs/buckets.h"
+#include "libbcachefs/error.h"
+#include "libbcachefs/extents.h"
+#include "libbcachefs/inode.h"
+#include "libbcachefs/io.h"
+#include "libbcachefs/journal.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/super-io.h"
+
+#define EXPORT_MAGIC		"bcachefs export"
+#define EXPORT_VERSION		1
+#define EXPORT_DATA_MAX		(1U << 20)
+#define IMPORT_BATCH		32
+
+struct export_header {
+	char			magic[16];
+	u32			version;
+	u32			block_size;	/* sectors */
+	u8			uuid[16];
+	u64			since_seq;
+	u64			since_keyver;
+	u64			seq;
+	u64			keyver;
+};
+
+enum export_rec_type {
+	EXPORT_RANGE		= 1,
+	EXPORT_KEY,
+	EXPORT_KEEP,
+	EXPORT_DATA,
+	EXPORT_END,
+};
+
+struct export_rec {
+	u8			type;
+	u8			btree_id;
+	u16			pad;
+	u32			len;
+	struct bpos		start;
+	struct bpos		end;
+};
+
+static const enum btree_id export_btrees[] = {
+	BTREE_ID_inodes,
+	BTREE_ID_dirents,
+	BTREE_ID_xattrs,
+	BTREE_ID_extents,
+};
+
+struct export_token {
+	u64			seq;
+	u64			keyver;
+};
+
+static struct export_token export_token_parse(const char *s)
+{
+	struct export_token t = { 0 };
+
+	if (!strcmp(s, "0"))
+		return t;
+
+	if (sscanf(s, "%llu:%llu", &t.seq, &t.keyver) != 2)
+		die("invalid token %s", s);
+
+	return t;
+}
+
+static void export_fwrite(FILE *f, const void *buf, size_t len)
+{
+	if (len && fwrite(buf, len, 1, f) != 1)
+		die("error writing stream: %m");
+}
+
+static void export_fread(FILE *f, void *buf, size_t len)
+{
+	if (len && fread(buf, len, 1, f) != 1)
+		die(feof(f) ? "truncated stream" : "error reading stream: %m");
+}
+
+static void export_rec_write(FILE *f, enum export_rec_type type,
+			     enum btree_id id, struct bpos start,
+			     struct bpos end, const void *buf, size_t len)
+{
+	struct export_rec r = {
+		.type		= type,
+		.btree_id	= id,
+		.len		= len,
+		.start		= start,
+		.end		= end,
+	};
+
+	export_fwrite(f, &r, sizeof(r));
+	export_fwrite(f, buf, len);
+}
+
+/* Export: */
+
+struct export_range {
+	struct bpos		start;
+	struct bpos		end;
+};
+
+typedef darray(struct export_range) export_ranges;
+
+struct export {
+	struct bch_fs		*c;
+	FILE			*f;
+	struct export_token	since;
+	void			*buf;
+
+	u64			nodes;
+	u64			nodes_changed;
+	u64			keys;
+	u64			sectors_kept;
+	u64			sectors_sent;
+};
+
+static u64 btree_node_journal_seq(struct btree *b)
+{
+	struct bset_tree *t;
+	u64 seq = 0;
+
+	for_each_bset(b, t)
+		seq = max(seq, le64_to_cpu(bset(b, t)->journal_seq));
+	return seq;
+}
+
+/* Leaf nodes changed since the token, with adjacent nodes merged: */
+static void export_changed_ranges(struct export *e, enum btree_id id,
+				  export_ranges *ranges)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct btree *b;
+
+	bch2_trans_init(&trans, e->c, 0, 0);
+
+	for_each_btree_node(&trans, iter, id, POS_MIN, 0, b) {
+		struct export_range *r = ranges->size
+			? &ranges->item[ranges->size - 1] : NULL;
+
+		e->nodes++;
+
+		if (btree_node_journal_seq(b) < e->since.seq)
+			continue;
+
+		e->nodes_changed++;
+
+		if (r && !bpos_cmp(bpos_successor(r->end), b->data->min_key))
+			r->end = b->key.k.p;
+		else
+			darray_append(*ranges, ((struct export_range) {
+				.start	= b->data->min_key,
+				.end	= b->key.k.p,
+			}));
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	if (bch2_trans_exit(&trans))
+		die("error walking btree %s", bch2_btree_ids[id]);
+}
+
+static void export_read_endio(struct bio *bio)
+{
+	closure_put(bio->bi_private);
+}
+
+static int export_read(struct bch_fs *c, u64 inum, u64 offset,
+		       void *buf, unsigned sectors)
+{
+	struct bch_inode_unpacked inode;
+	struct bch_read_bio rbio;
+	struct bio_vec bv;
+	struct closure cl;
+	int ret;
+
+	ret = bch2_inode_find_by_inum(c, inum, &inode);
+	if (ret)
+		return ret;
+
+	bio_init(&rbio.bio, &bv, 1);
+	rbio.bio.bi_iter.bi_size	= sectors << 9;
+	rbio.bio.bi_iter.bi_sector	= offset;
+	bv.bv_page			= buf;
+	bv.bv_len			= sectors << 9;
+	bv.bv_offset			= 0;
+	bio_set_op_attrs(&rbio.bio, REQ_OP_READ, REQ_SYNC);
+
+	closure_init_stack(&cl);
+	closure_get(&cl);
+	rbio.bio.bi_end_io		= export_read_endio;
+	rbio.bio.bi_private		= &cl;
+
+	bch2_read(c, rbio_init(&rbio.bio, io_opts(c, &inode)), inum);
+
+	closure_sync(&cl);
+
+	return -blk_status_to_errno(rbio.bio.bi_status);
+}
+
+static void export_data(struct export *e, struct bkey_s_c k)
+{
+	u64 inum = k.k->p.inode, offset = bkey_start_offset(k.k);
+	unsigned sectors;
+	int ret;
+
+	while (offset < k.k->p.offset) {
+		sectors = min_t(u64, k.k->p.offset - offset,
+				EXPORT_DATA_MAX >> 9);
+
+		ret = export_read(e->c, inum, offset, e->buf, sectors);
+		if (ret)
+			die("error reading %llu:%llu: %s",
+			    inum, offset, strerror(-ret));
+
+		export_rec_write(e->f, EXPORT_DATA, BTREE_ID_extents,
+				 POS(inum, offset), POS(inum, offset + sectors),
+				 e->buf, sectors << 9);
+
+		offset			+= sectors;
+		e->sectors_sent		+= sectors;
+	}
+}
+
+/*
+ * Extents in a data range are sent as data, unless they have a version that's
+ * older than the token - then the replica already has them at this position:
+ */
+static void export_extent(struct export *e, struct bkey_i *i)
+{
+	struct bkey_s_c k = bkey_i_to_s_c(i);
+
+	if (!bkey_extent_is_data(k.k) ||
+	    bkey_extent_is_inline_data(k.k)) {
+		export_rec_write(e->f, EXPORT_KEY, BTREE_ID_extents,
+				 bkey_start_pos(k.k), k.k->p,
+				 i, bkey_bytes(k.k));
+		e->keys++;
+	} else if (!k.k->version.hi &&
+		   k.k->version.lo &&
+		   k.k->version.lo <= e->since.keyver &&
+		   !bch2_bkey_is_encrypted(k)) {
+		export_rec_write(e->f, EXPORT_KEEP, BTREE_ID_extents,
+				 bkey_start_pos(k.k), k.k->p, NULL, 0);
+		e->sectors_kept += k.k->size;
+	} else {
+		export_data(e, k);
+	}
+}
+
+/*
+ * A range of the extents btree covers the sectors from the end of the last
+ * extent before it to the start of the first extent after it - those are
+ * holes, but might have been data on the replica:
+ */
+static struct bpos export_extents_start(struct btree_trans *trans,
+					struct bpos pos)
+{
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_extents, pos, 0);
+
+	while ((k = bch2_btree_iter_peek_prev(iter)).k &&
+	       !bkey_err(k) &&
+	       bkey_cmp(k.k->p, pos) >= 0)
+		bch2_btree_iter_set_pos(iter, bkey_start_pos(k.k));
+
+	if (bkey_err(k))
+		die("error reading extents: %s", strerror(-bkey_err(k)));
+
+	pos = k.k ? k.k->p : POS_MIN;
+	bch2_trans_iter_put(trans, iter);
+	return pos;
+}
+
+static struct bpos export_extents_end(struct btree_trans *trans,
+				      struct bpos pos)
+{
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_extents, pos, 0);
+	k = bch2_btree_iter_peek(iter);
+
+	if (bkey_err(k))
+		die("error reading extents: %s", strerror(-bkey_err(k)));
+
+	pos = k.k ? bkey_start_pos(k.k) : POS_MAX;
+	bch2_trans_iter_put(trans, iter);
+	return pos;
+}
+
+static void export_range(struct export *e, enum btree_id id,
+			 struct export_range r)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bkey_buf sk;
+	struct bpos start = r.start, end = r.end;
+	int ret;
+
+	bch2_bkey_buf_init(&sk);
+	bch2_trans_init(&trans, e->c, 0, 0);
+
+	if (id == BTREE_ID_extents) {
+		start	= export_extents_start(&trans, r.start);
+		end	= export_extents_end(&trans, r.end);
+	}
+
+	export_rec_write(e->f, EXPORT_RANGE, id, start, end, NULL, 0);
+
+	for_each_btree_key(&trans, iter, id, r.start,
+			   BTREE_ITER_PREFETCH, k, ret) {
+		if (bpos_cmp(k.k->p, r.end) > 0)
+			break;
+
+		bch2_bkey_buf_reassemble(&sk, e->c, k);
+
+		if (id == BTREE_ID_extents) {
+			/* Don't hold btree locks while reading data: */
+			bch2_trans_unlock(&trans);
+			export_extent(e, sk.k);
+		} else {
+			export_rec_write(e->f, EXPORT_KEY, id,
+					 k.k->p, k.k->p,
+					 sk.k, bkey_bytes(k.k));
+			e->keys++;
+		}
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	ret = bch2_trans_exit(&trans) ?: ret;
+	bch2_bkey_buf_exit(&sk, e->c);
+	if (ret)
+		die("error exporting btree %s: %s",
+		    bch2_btree_ids[id], strerror(-ret));
+}
+
+static void export_usage(void)
+{
+	puts("bcachefs export - write out changes to an unmounted filesystem, for replication\n"
+	     "Usage: bcachefs export [OPTION]... <devices>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -s, --since=token           Only export changes since the export that\n"
+	     "                              returned token (default 0: everything)\n"
+	     "  -o, --output=file           Write the stream to file instead of stdout\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "The token for the next export is printed on stderr when done.\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+int cmd_export(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "since",		required_argument,	NULL, 's' },
+		{ "output",		required_argument,	NULL, 'o' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	struct export e = { .f = stdout };
+	struct export_header h;
+	const char *output = NULL;
+	unsigned i;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "s:o:h",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 's':
+			e.since = export_token_parse(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'h':
+			export_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			export_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s)");
+
+	if (output) {
+		e.f = fopen(output, "w");
+		if (!e.f)
+			die("error opening %s: %m", output);
+	} else if (isatty(STDOUT_FILENO)) {
+		die("not writing export stream to a terminal; use -o");
+	}
+
+	opt_set(opts, nochanges, true);
+
+	e.c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(e.c))
+		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(e.c)));
+
+	if (!e.c->opts.track_changes && e.since.seq)
+		fprintf(stderr, "track_changes is not set: "
+			"all data in changed ranges will be exported\n");
+
+	e.buf = xmalloc(EXPORT_DATA_MAX);
+
+	h = (struct export_header) {
+		.version	= EXPORT_VERSION,
+		.block_size	= e.c->opts.block_size,
+		.since_seq	= e.since.seq,
+		.since_keyver	= e.since.keyver,
+		.seq		= journal_cur_seq(&e.c->journal),
+		.keyver		= atomic64_read(&e.c->key_version),
+	};
+	strncpy(h.magic, EXPORT_MAGIC, sizeof(h.magic));
+	memcpy(h.uuid, e.c->sb.user_uuid.b, sizeof(h.uuid));
+	export_fwrite(e.f, &h, sizeof(h));
+
+	for (i = 0; i < ARRAY_SIZE(export_btrees); i++) {
+		export_ranges ranges;
+		struct export_range *r;
+
+		darray_init(ranges);
+		export_changed_ranges(&e, export_btrees[i], &ranges);
+
+		darray_foreach(r, ranges)
+			export_range(&e, export_btrees[i], *r);
+		darray_free(ranges);
+	}
+
+	export_rec_write(e.f, EXPORT_END, 0, POS_MIN, POS_MIN, NULL, 0);
+
+	if (fflush(e.f) || (output && fclose(e.f)))
+		die("error writing stream: %m");
+
+	fprintf(stderr, "%llu/%llu btree nodes changed, %llu keys,",
+		e.nodes_changed, e.nodes, e.keys);
+	fprintf(stderr, " %s data sent,",
+		pr_units(e.sectors_sent, HUMAN_READABLE));
+	fprintf(stderr, " %s unchanged\n",
+		pr_units(e.sectors_kept, HUMAN_READABLE));
+	fprintf(stderr, "token: %llu:%llu\n", h.seq, h.keyver);
+
+	free(e.buf);
+	bch2_fs_stop(e.c);
+	return 0;
+}
+
+/* Import: */
+
+typedef darray(struct bkey_i *) import_keys;
+
+struct import {
+	struct bch_fs		*c;
+	FILE			*f;
+	void			*buf;
+
+	/* current range: */
+	bool			in_range;
+	enum btree_id		btree_id;
+	struct bpos		pos;
+	struct bpos		end;
+
+	import_keys		pending;
+	/* inodes are rewritten at the end, after i_sectors has been changed: */
+	import_keys		inodes;
+
+	u64			keys;
+	u64			deleted;
+	u64			sectors;
+};
+
+static unsigned import_iter_flags(enum btree_id id)
+{
+	/* inodes are updated through the key cache: */
+	return id == BTREE_ID_inodes
+		? BTREE_ITER_CACHED|BTREE_ITER_INTENT
+		: BTREE_ITER_INTENT;
+}
+
+/* Apply updates in batches, IMPORT_BATCH to a transaction: */
+static void import_flush(struct import *i, enum btree_id id, import_keys *keys)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_i **u;
+	size_t b, j;
+	int ret;
+
+	bch2_trans_init(&trans, i->c, 0, 0);
+
+	for (b = 0; b < keys->size; b += IMPORT_BATCH) {
+		do {
+			bch2_trans_begin(&trans);
+			ret = 0;
+
+			for (j = b; j < min_t(size_t, b + IMPORT_BATCH, keys->size); j++) {
+				struct bkey_i *k = keys->item[j];
+
+				iter = bch2_trans_get_iter(&trans, id,
+						bkey_start_pos(&k->k),
+						import_iter_flags(id));
+				ret = bch2_btree_iter_traverse(iter) ?:
+					bch2_trans_update(&trans, iter, k, 0);
+				bch2_trans_iter_put(&trans, iter);
+				if (ret)
+					break;
+			}
+
+			ret = ret ?: bch2_trans_commit(&trans, NULL, NULL,
+						       BTREE_INSERT_NOFAIL);
+		} while (ret == -EINTR);
+
+		if (ret)
+			die("error updating btree %s: %s",
+			    bch2_btree_ids[id], strerror(-ret));
+	}
+
+	bch2_trans_exit(&trans);
+
+	darray_foreach(u, *keys)
+		free(*u);
+	keys->size = 0;
+}
+
+static void import_update(struct import *i, struct bkey_i *k)
+{
+	darray_append(i->pending, k);
+
+	if (i->pending.size >= IMPORT_BATCH)
+		import_flush(i, i->btree_id, &i->pending);
+}
+
+/* Delete keys in [start, end) that weren't in the stream: */
+static void import_delete(struct import *i, struct bpos start, struct bpos end)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	if (i->btree_id == BTREE_ID_extents) {
+		if (bkey_cmp(start, end) >= 0)
+			return;
+
+		import_flush(i, i->btree_id, &i->pending);
+
+		ret = bch2_btree_delete_range(i->c, BTREE_ID_extents,
+					      start, end, NULL);
+		if (ret)
+			die("error deleting extents: %s", strerror(-ret));
+		return;
+	}
+
+	if (bpos_cmp(start, end) >= 0)
+		return;
+
+	bch2_trans_init(&trans, i->c, 0, 0);
+
+	for_each_btree_key(&trans, iter, i->btree_id, start, 0, k, ret) {
+		struct bkey_i *d;
+
+		if (bpos_cmp(k.k->p, end) >= 0)
+			break;
+
+		d = xmalloc(sizeof(*d));
+		bkey_init(&d->k);
+		d->k.p = k.k->p;
+		darray_append(i->pending, d);
+		i->deleted++;
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	ret = bch2_trans_exit(&trans) ?: ret;
+	if (ret)
+		die("error reading btree %s: %s",
+		    bch2_btree_ids[i->btree_id], strerror(-ret));
+
+	if (i->pending.size >= IMPORT_BATCH)
+		import_flush(i, i->btree_id, &i->pending);
+}
+
+static void import_range_finish(struct import *i)
+{
+	struct bpos end = i->end;
+
+	if (!i->in_range)
+		return;
+
+	/* normal btrees: the range is inclusive */
+	if (i->btree_id != BTREE_ID_extents && bpos_cmp(end, POS_MAX))
+		end = bpos_successor(end);
+
+	import_delete(i, i->pos, end);
+	import_flush(i, i->btree_id, &i->pending);
+}
+
+static struct bkey_i *import_key_read(struct import *i, struct export_rec *r)
+{
+	struct bkey_i *k;
+
+	if (r->len < sizeof(struct bkey) ||
+	    r->len > BKEY_U64s_MAX * sizeof(u64))
+		die("invalid key in stream");
+
+	k = xmalloc(r->len);
+	export_fread(i->f, k, r->len);
+
+	if (bkey_bytes(&k->k) != r->len)
+		die("invalid key in stream");
+	return k;
+}
+
+static int import_write(struct import *i, struct bpos pos,
+			void *buf, unsigned sectors)
+{
+	struct bch_inode_unpacked inode;
+	struct bch_write_op op;
+	struct bio_vec bv;
+	struct closure cl;
+	int ret;
+
+	ret = bch2_inode_find_by_inum(i->c, pos.inode, &inode);
+	if (ret)
+		return ret;
+
+	closure_init_stack(&cl);
+
+	bch2_write_op_init(&op, i->c, io_opts(i->c, &inode));
+	op.write_point	= writepoint_hashed(0);
+	op.nr_replicas	= op.opts.data_replicas;
+	op.target	= op.opts.foreground_target;
+	op.pos		= POS(pos.inode, pos.offset);
+	op.new_i_size	= 0;
+
+	bio_init(&op.wbio.bio, &bv, 1);
+	op.wbio.bio.bi_iter.bi_size	= sectors << 9;
+	bv.bv_page			= buf;
+	bv.bv_len			= sectors << 9;
+	bv.bv_offset			= 0;
+	bio_set_op_attrs(&op.wbio.bio, REQ_OP_WRITE, REQ_SYNC);
+
+	ret = bch2_disk_reservation_get(i->c, &op.res, sectors,
+					op.nr_replicas, 0);
+	if (ret)
+		return ret;
+
+	closure_call(&op.cl, bch2_write, NULL, &cl);
+	closure_sync(&cl);
+
+	return op.error;
+}
+
+static void import_rec(struct import *i, struct export_rec *r)
+{
+	struct bkey_i *k;
+	unsigned sectors;
+	int ret;
+
+	switch (r->type) {
+	case EXPORT_RANGE:
+		import_range_finish(i);
+
+		if (r->btree_id >= BTREE_ID_NR)
+			die("invalid btree in stream");
+
+		i->in_range	= true;
+		i->btree_id	= r->btree_id;
+		i->pos		= r->start;
+		i->end		= r->end;
+		break;
+	case EXPORT_KEY:
+		k = import_key_read(i, r);
+
+		if (i->btree_id == BTREE_ID_extents) {
+			import_delete(i, i->pos, bkey_start_pos(&k->k));
+			i->pos = k->k.p;
+		} else {
+			import_delete(i, i->pos, k->k.p);
+			i->pos = bpos_cmp(k->k.p, POS_MAX)
+				? bpos_successor(k->k.p) : POS_MAX;
+		}
+
+		if (i->btree_id == BTREE_ID_inodes) {
+			struct bkey_i *copy = xmalloc(r->len);
+
+			memcpy(copy, k, r->len);
+			darray_append(i->inodes, copy);
+		}
+
+		import_update(i, k);
+		i->keys++;
+		break;
+	case EXPORT_KEEP:
+		import_delete(i, i->pos, r->start);
+		i->pos = r->end;
+		break;
+	case EXPORT_DATA:
+		sectors = r->end.offset - r->start.offset;
+
+		if (r->len != sectors << 9 ||
+		    r->len > EXPORT_DATA_MAX)
+			die("invalid data record in stream");
+
+		export_fread(i->f, i->buf, r->len);
+
+		/* existing data is overwritten by the write: */
+		import_delete(i, i->pos, r->start);
+		i->pos = r->end;
+
+		import_flush(i, i->btree_id, &i->pending);
+
+		ret = import_write(i, r->start, i->buf, sectors);
+		if (ret)
+			die("error writing %llu:%llu: %s",
+			    r->start.inode, r->start.offset, strerror(-ret));
+
+		i->sectors += sectors;
+		break;
+	default:
+		die("invalid record type %u in stream", r->type);
+	}
+}
+
+/* Refuses streams that don't apply to this replica, before we touch it: */
+static void import_check_stream(struct bch_fs *c, struct export_header *h)
+{
+	struct bch_sb_field_import *f = bch2_sb_get_import(c->disk_sb.sb);
+	char uuid[40], replica_of[40];
+
+	uuid_unparse(h->uuid, uuid);
+
+	if (!memcmp(h->uuid, c->sb.user_uuid.b, sizeof(h->uuid)))
+		die("stream was exported from this filesystem (%s)", uuid);
+
+	if (f && memcmp(f->uuid, h->uuid, sizeof(h->uuid))) {
+		uuid_unparse(f->uuid, replica_of);
+		die("stream is from filesystem %s, but this is a replica of %s",
+		    uuid, replica_of);
+	}
+
+	/* A stream exported with --since=0 has everything: */
+	if (!h->since_seq && !h->since_keyver)
+		return;
+
+	if (!f)
+		die("no stream has been applied to this replica yet: "
+		    "start with an export with --since=0");
+
+	if (le64_to_cpu(f->seq)		!= h->since_seq ||
+	    le64_to_cpu(f->keyver)	!= h->since_keyver)
+		die("stream has changes since token %llu:%llu, "
+		    "but this replica is at token %llu:%llu",
+		    h->since_seq, h->since_keyver,
+		    le64_to_cpu(f->seq), le64_to_cpu(f->keyver));
+}
+
+static void import_set_token(struct bch_fs *c, struct export_header *h)
+{
+	struct bch_sb_field_import *f;
+
+	mutex_lock(&c->sb_lock);
+	f = bch2_sb_resize_import(&c->disk_sb, sizeof(*f) / sizeof(u64));
+	if (!f)
+		die("no room in superblock to record the import token");
+
+	memcpy(f->uuid, h->uuid, sizeof(f->uuid));
+	f->seq		= cpu_to_le64(h->seq);
+	f->keyver	= cpu_to_le64(h->keyver);
+
+	bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+}
+
+static void import_usage(void)
+{
+	puts("bcachefs import - apply a stream from bcachefs export to an unmounted replica\n"
+	     "Usage: bcachefs import [OPTION]... <devices>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -i, --input=file            Read the stream from file instead of stdin\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Streams must be applied in the order they were exported, starting with\n"
+	     "one exported with --since=0.\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+int cmd_import(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "input",		required_argument,	NULL, 'i' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	struct import i = { .f = stdin };
+	struct export_header h;
+	struct export_rec r;
+	const char *input = NULL;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "i:h",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'i':
+			input = optarg;
+			break;
+		case 'h':
+			import_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			import_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s)");
+
+	if (input) {
+		i.f = fopen(input, "r");
+		if (!i.f)
+			die("error opening %s: %m", input);
+	}
+
+	export_fread(i.f, &h, sizeof(h));
+	if (strncmp(h.magic, EXPORT_MAGIC, sizeof(h.magic)))
+		die("not a bcachefs export stream");
+	if (h.version != EXPORT_VERSION)
+		die("unsupported export stream version %u", h.version);
+
+	i.c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(i.c))
+		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(i.c)));
+
+	if (h.block_size % i.c->opts.block_size)
+		die("replica block size (%u) must divide the exported filesystem's block size (%u)",
+		    i.c->opts.block_size << 9, h.block_size << 9);
+
+	import_check_stream(i.c, &h);
+
+	i.buf = xmalloc(EXPORT_DATA_MAX);
+	darray_init(i.pending);
+	darray_init(i.inodes);
+
+	while (1) {
+		export_fread(i.f, &r, sizeof(r));
+		if (r.type == EXPORT_END)
+			break;
+		import_rec(&i, &r);
+	}
+
+	import_range_finish(&i);
+
+	/* Restore i_sectors, which the data writes changed: */
+	import_flush(&i, BTREE_ID_inodes, &i.inodes);
+
+	import_set_token(i.c, &h);
+
+	printf("imported %llu keys, deleted %llu, wrote %s\n",
+	       i.keys, i.deleted, pr_units(i.sectors, HUMAN_READABLE));
+	printf("token: %llu:%llu\n", h.seq, h.keyver);
+
+	darray_free(i.pending);
+	darray_free(i.inodes);
+	free(i.buf);
+	if (input)
+		fclose(i.f);
+	bch2_fs_stop(i.c);
+	return 0;
+}
@@ -32,6 +32,7 @@
 #define OPTS						\
 x(0,	replicas,		required_argument)	\
 x(0,	encrypted,		no_argument)		\
+x(0,	encryption_type,	required_argument)	\
 x(0,	no_passphrase,		no_argument)		\
 x('L',	label,			required_argument)	\
 x('U',	uuid,			required_argument)	\
@@ -60,6 +61,8 @@ static void usage(void)
 	puts(
 	     "      --replicas=#            Sets both data and metadata replicas\n"
 	     "      --encrypted             Enable whole filesystem encryption (chacha20/poly1305)\n"
+	     "      --encryption_type=(chacha20_poly1305|aes256_gcm)\n"
+	     "                              Cipher to encrypt with; implies --encrypted\n"
 	     "      --no_passphrase         Don't encrypt master encryption key\n"
 	     "  -L, --label=label\n"
 	     "  -U, --uuid=uuid\n"
@@ -144,6 +147,13 @@ int cmd_format(int argc, char *argv[])
 		case O_encrypted:
 			opts.encrypted = true;
 			break;
+		case O_encryption_type:
+			opts.encryption_type = read_string_list_or_die(optarg,
+					bch2_encryption_types, "encryption type");
+			if (opts.encryption_type == BCH_ENCRYPTION_none)
+				die("invalid encryption type %s", optarg);
+			opts.encrypted = true;
+			break;
 		case O_no_passphrase:
 			no_passphrase = true;
 			break;
@@ -238,8 +248,13 @@ int cmd_format(int argc, char *argv[])
 			    devices.item, darray_size(devices));
 	bch2_opt_strs_free(&fs_opt_strs);
 
-	if (!quiet)
+	if (!quiet) {
 		bch2_sb_print(sb, false, 1 << BCH_SB_FIELD_members, HUMAN_READABLE);
+
+		darray_foreach(dev, devices)
+			printf("%s: formatted in %llu ms\n",
+			       dev->path, dev->format_ns / NSEC_PER_MSEC);
+	}
 	free(sb);
 
 	if (opts.passphrase) {
@@ -250,6 +265,10 @@ int cmd_format(int argc, char *argv[])
 	darray_free(devices);
 
 	if (initialize) {
+		struct timespec start, end;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
 		/*
 		 * Start the filesystem once, to allocate the journal and create
 		 * the root directory:
@@ -262,6 +281,13 @@ int cmd_format(int argc, char *argv[])
 			    strerror(-PTR_ERR(c)));
 
 		bch2_fs_stop(c);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if (!quiet)
+			printf("initialized in %llu ms\n",
+			       (u64) ((end.tv_sec - start.tv_sec) * MSEC_PER_SEC +
+				      (end.tv_nsec - start.tv_nsec) / NSEC_PER_MSEC));
 	}
 
 	darray_free(device_paths);
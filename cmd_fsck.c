@@ -16,6 +16,8 @@ static void usage(void)
 	     "  -n                     Don't repair, only check for errors\n"
 	     "  -y                     Assume \"yes\" to all questions\n"
 	     "  -f                     Force checking even if filesystem is marked clean\n"
+	     "  -i, --incremental      Only check inodes touched by keys in the journal,\n"
+	     "                         i.e. what was being modified before a crash\n"
 	     " --reconstruct_alloc     Reconstruct the alloc btree\n"
 	     "  -v                     Be verbose\n"
 	     "  -h                     Display this help and exit\n"
@@ -26,6 +28,7 @@ int cmd_fsck(int argc, char *argv[])
 {
 	static const struct option longopts[] = {
 		{ "reconstruct_alloc",	no_argument,		NULL, 'R' },
+		{ "incremental",	no_argument,		NULL, 'i' },
 		{ NULL }
 	};
 	struct bch_opts opts = bch2_opts_empty();
@@ -37,7 +40,7 @@ int cmd_fsck(int argc, char *argv[])
 	opt_set(opts, fix_errors, FSCK_OPT_ASK);
 
 	while ((opt = getopt_long(argc, argv,
-				  "apynfo:vh",
+				  "apynfio:vh",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'a': /* outdated alias for -p */
@@ -54,6 +57,9 @@ int cmd_fsck(int argc, char *argv[])
 		case 'f':
 			/* force check, even if filesystem marked clean: */
 			break;
+		case 'i':
+			opt_set(opts, fsck_incremental, true);
+			break;
 		case 'o':
 			ret = bch2_parse_mount_opts(NULL, &opts, optarg);
 			if (ret)
@@ -21,6 +21,7 @@
 #include "libbcachefs/fs-common.h"
 #include "libbcachefs/inode.h"
 #include "libbcachefs/io.h"
+#include "libbcachefs/journal.h"
 #include "libbcachefs/opts.h"
 #include "libbcachefs/super.h"
 
@@ -28,6 +29,7 @@
 #include "libbcachefs/fs.h"
 
 #include <linux/dcache.h>
+#include <linux/kthread.h>
 
 /* XXX cut and pasted from fsck.c */
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
@@ -42,12 +44,133 @@ static inline u64 unmap_root_ino(u64 ino)
 	return ino == 4096 ? 1 : ino;
 }
 
-static struct stat inode_to_stat(struct bch_fs *c,
+/*
+ * Delayed allocation:
+ *
+ * Small writes are buffered per inode instead of being written out (with a
+ * read-modify-write of the partial blocks and an inode update) one request at
+ * a time. Each inode has at most one dirty buffer, covering a single
+ * contiguous, block aligned range; writes that extend or overlap it are merged,
+ * anything else flushes it first. Buffers are written out as one extent when
+ * they reach FUSE_WBUF_MAX, when they've been dirty for FUSE_WBUF_EXPIRE_MS,
+ * when total buffered data exceeds FUSE_WBUF_DIRTY_MAX, and on
+ * flush/fsync/release/truncate.
+ *
+ * When the kernel's writeback cache is enabled, small writes are already
+ * merged in the page cache and arrive in max_write sized requests at writeback
+ * time; each write is then written out as soon as it's been buffered, so that
+ * dirty data isn't kept twice.
+ *
+ * If writing out a buffer fails, its data is dropped but the error is kept, in
+ * a buffer with no data, until the next flush/fsync/release returns it.
+ *
+ * wbufs.lock protects the table, the dirty list and the buffered data, but
+ * isn't held across IO. A buffer being written out stays in the table, read
+ * only, until the write completes - so that reads never see a range that's
+ * neither in a buffer nor on disk - and writes and flushes to the same inode
+ * wait for it.
+ */
+
+#define FUSE_WBUF_MAX		(1U << 20)
+#define FUSE_WBUF_DIRTY_MAX	(64U << 20)
+#define FUSE_WBUF_EXPIRE_MS	5000
+#define FUSE_WBUF_HASH_BITS	8
+
+struct fuse_wbuf {
+	struct list_head	hash;
+	struct list_head	list;		/* dirty list, oldest first */
+	u64			inum;
+	u64			start;		/* block aligned */
+	size_t			bytes;		/* valid bytes from start */
+	size_t			size;		/* size of data */
+	unsigned long		dirtied;
+	void			*data;
+	bool			flushing;	/* being written out */
+	int			err;		/* writeback error */
+};
+
+struct fuse_wbufs {
+	struct mutex		lock;
+	struct task_struct	*flusher;
+	wait_queue_head_t	wait;		/* for flushes to finish */
+	unsigned		flush_seq;
+	size_t			dirty;		/* size of buffers on dirty_list */
+	struct list_head	dirty_list;
+	struct list_head	table[1U << FUSE_WBUF_HASH_BITS];
+};
+
+/* Per mount state, the FUSE session's private data: */
+struct bch_fuse {
+	struct bch_fs		*c;
+	bool			writeback_cache;
+	struct fuse_wbufs	wbufs;
+};
+
+static inline struct list_head *fuse_wbuf_slot(struct bch_fuse *f, u64 inum)
+{
+	return &f->wbufs.table[hash_64(inum, FUSE_WBUF_HASH_BITS)];
+}
+
+static struct fuse_wbuf *fuse_wbuf_find(struct bch_fuse *f, u64 inum)
+{
+	struct fuse_wbuf *w;
+
+	lockdep_assert_held(&f->wbufs.lock);
+
+	list_for_each_entry(w, fuse_wbuf_slot(f, inum), hash)
+		if (w->inum == inum)
+			return w;
+	return NULL;
+}
+
+/*
+ * Like fuse_wbuf_find(), but if the inode's buffer is being written out, drops
+ * wbufs.lock and waits for it to finish:
+ */
+static struct fuse_wbuf *fuse_wbuf_find_idle(struct bch_fuse *f, u64 inum)
+{
+	struct fuse_wbuf *w;
+	unsigned seq;
+
+	while ((w = fuse_wbuf_find(f, inum)) && w->flushing) {
+		seq = f->wbufs.flush_seq;
+		mutex_unlock(&f->wbufs.lock);
+
+		wait_event(f->wbufs.wait,
+			   READ_ONCE(f->wbufs.flush_seq) != seq);
+
+		mutex_lock(&f->wbufs.lock);
+	}
+
+	return w;
+}
+
+/* i_size including data that hasn't been written out yet: */
+static u64 fuse_wbuf_i_size(struct bch_fuse *f, u64 inum, u64 i_size)
+{
+	struct fuse_wbuf *w;
+
+	mutex_lock(&f->wbufs.lock);
+	w = fuse_wbuf_find(f, inum);
+	if (w)
+		i_size = max(i_size, w->start + w->bytes);
+	mutex_unlock(&f->wbufs.lock);
+
+	return i_size;
+}
+
+static int fuse_wbuf_flush_inum(struct bch_fuse *, u64);
+static void fuse_wbufs_exit(struct bch_fuse *);
+static void fuse_wbufs_init(struct bch_fuse *);
+
+static struct stat inode_to_stat(struct bch_fuse *f,
 				 struct bch_inode_unpacked *bi)
 {
+	struct bch_fs *c = f->c;
+
 	return (struct stat) {
 		.st_ino		= unmap_root_ino(bi->bi_inum),
-		.st_size	= bi->bi_size,
+		.st_size	= fuse_wbuf_i_size(f, bi->bi_inum, bi->bi_size),
 		.st_mode	= bi->bi_mode,
 		.st_uid		= bi->bi_uid,
 		.st_gid		= bi->bi_gid,
@@ -61,13 +184,13 @@ static struct stat inode_to_stat(struct bch_fs *c,
 	};
 }
 
-static struct fuse_entry_param inode_to_entry(struct bch_fs *c,
+static struct fuse_entry_param inode_to_entry(struct bch_fuse *f,
 					      struct bch_inode_unpacked *bi)
 {
 	return (struct fuse_entry_param) {
 		.ino		= unmap_root_ino(bi->bi_inum),
 		.generation	= bi->bi_generation,
-		.attr		= inode_to_stat(c, bi),
+		.attr		= inode_to_stat(f, bi),
 		.attr_timeout	= DBL_MAX,
 		.entry_timeout	= DBL_MAX,
 	};
@@ -75,9 +198,14 @@ static struct fuse_entry_param inode_to_entry(struct bch_fs *c,
 
 static void bcachefs_fuse_init(void *arg, struct fuse_conn_info *conn)
 {
+	struct bch_fuse *f = arg;
+
+	fuse_wbufs_init(f);
+
 	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: activating writeback\n");
 		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		f->writeback_cache = true;
 	} else
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: writeback not capable\n");
 
@@ -86,15 +214,17 @@ static void bcachefs_fuse_init(void *arg, struct fuse_conn_info *conn)
 
 static void bcachefs_fuse_destroy(void *arg)
 {
-	struct bch_fs *c = arg;
+	struct bch_fuse *f = arg;
 
-	bch2_fs_stop(c);
+	fuse_wbufs_exit(f);
+	bch2_fs_stop(f->c);
 }
 
 static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 				 const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	struct bch_inode_unpacked bi;
 	struct qstr qstr = QSTR(name);
 	u64 inum;
@@ -130,7 +260,7 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 	fuse_log(FUSE_LOG_DEBUG, "fuse_lookup ret(inum=%llu)\n",
 		 bi.bi_inum);
 
-	struct fuse_entry_param e = inode_to_entry(c, &bi);
+	struct fuse_entry_param e = inode_to_entry(f, &bi);
 	fuse_reply_entry(req, &e);
 	return;
 err:
@@ -141,7 +271,8 @@ err:
 static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t inum,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	struct bch_inode_unpacked bi;
 	struct stat attr;
 	int ret;
@@ -160,7 +291,7 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t inum,
 
 	fuse_log(FUSE_LOG_DEBUG, "fuse_getattr success\n");
 
-	attr = inode_to_stat(c, &bi);
+	attr = inode_to_stat(f, &bi);
 	fuse_reply_attr(req, &attr, DBL_MAX);
 }
 
@@ -168,7 +299,8 @@ static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t inum,
 				  struct stat *attr, int to_set,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	struct bch_inode_unpacked inode_u;
 	struct btree_trans trans;
 	struct btree_iter *iter;
@@ -180,6 +312,14 @@ static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t inum,
 
 	inum = map_root_ino(inum);
 
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		ret = fuse_wbuf_flush_inum(f, inum);
+		if (ret) {
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+
 	bch2_trans_init(&trans, c, 0, 0);
 retry:
 	bch2_trans_begin(&trans);
@@ -219,7 +359,7 @@ err:
 	bch2_trans_exit(&trans);
 
 	if (!ret) {
-		*attr = inode_to_stat(c, &inode_u);
+		*attr = inode_to_stat(f, &inode_u);
 		fuse_reply_attr(req, attr, DBL_MAX);
 	} else {
 		fuse_reply_err(req, -ret);
@@ -248,7 +388,8 @@ static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir,
 				const char *name, mode_t mode,
 				dev_t rdev)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	struct bch_inode_unpacked new_inode;
 	int ret;
 
@@ -258,7 +399,7 @@ static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir,
 	if (ret)
 		goto err;
 
-	struct fuse_entry_param e = inode_to_entry(c, &new_inode);
+	struct fuse_entry_param e = inode_to_entry(f, &new_inode);
 	fuse_reply_entry(req, &e);
 	return;
 err:
@@ -280,7 +421,8 @@ static void bcachefs_fuse_mkdir(fuse_req_t req, fuse_ino_t dir,
 static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir,
 				 const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	struct bch_inode_unpacked dir_u, inode_u;
 	struct qstr qstr = QSTR(name);
 	int ret;
@@ -311,7 +453,8 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 				 fuse_ino_t dst_dir, const char *dstname,
 				 unsigned flags)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	struct bch_inode_unpacked dst_dir_u, src_dir_u;
 	struct bch_inode_unpacked src_inode_u, dst_inode_u;
 	struct qstr dst_name = QSTR(srcname);
@@ -340,7 +483,8 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 			       fuse_ino_t newparent, const char *newname)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	struct bch_inode_unpacked dir_u, inode_u;
 	struct qstr qstr = QSTR(newname);
 	int ret;
@@ -355,7 +499,7 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 					    inum, &dir_u, &inode_u, &qstr));
 
 	if (!ret) {
-		struct fuse_entry_param e = inode_to_entry(c, &inode_u);
+		struct fuse_entry_param e = inode_to_entry(f, &inode_u);
 		fuse_reply_entry(req, &e);
 	} else {
 		fuse_reply_err(req, -ret);
@@ -482,7 +626,8 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 			       size_t size, off_t offset,
 			       struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_read(%llu, %zd, %lld)\n",
 		 inum, size, offset);
@@ -495,23 +640,59 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 		return;
 	}
 
+	/*
+	 * Copy buffered data before reading what's on disk: a buffer that's
+	 * written out in the meantime stays in the table until the write
+	 * completes, so we see its data one way or the other:
+	 */
+	mutex_lock(&f->wbufs.lock);
+	struct fuse_wbuf *w = fuse_wbuf_find(f, inum);
+	if (w)
+		bi.bi_size = max(bi.bi_size, w->start + w->bytes);
+
 	off_t end = min_t(u64, bi.bi_size, offset + size);
 	if (end <= offset) {
+		mutex_unlock(&f->wbufs.lock);
 		fuse_reply_buf(req, NULL, 0);
 		return;
 	}
 	size = end - offset;
 
 	struct fuse_align_io align = align_io(c, size, offset);
+	u64 s = 0, e = 0;
+	void *buffered = NULL;
+
+	if (w) {
+		s = max_t(u64, align.start, w->start);
+		e = min_t(u64, align.end, w->start + w->bytes);
+	}
+
+	if (s < e) {
+		buffered = malloc(e - s);
+		if (!buffered) {
+			mutex_unlock(&f->wbufs.lock);
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+
+		memcpy(buffered, w->data + s - w->start, e - s);
+	}
+	mutex_unlock(&f->wbufs.lock);
 
 	void *buf = aligned_alloc(PAGE_SIZE, align.size);
 	if (!buf) {
+		free(buffered);
 		fuse_reply_err(req, ENOMEM);
 		return;
 	}
 
 	ret = read_aligned(c, inum, align.size, align.start, buf);
 
+	/* Overlay buffered data: */
+	if (!ret && buffered)
+		memcpy(buf + s - align.start, buffered, e - s);
+	free(buffered);
+
 	if (likely(!ret))
 		fuse_reply_buf(req, buf + align.pad_start, size);
 	else
@@ -598,98 +779,377 @@ static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
 	return op.error;
 }
 
-static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
-				const char *buf, size_t size,
-				off_t offset,
-				struct fuse_file_info *fi)
+static void fuse_wbuf_free(struct fuse_wbuf *w)
 {
-	struct bch_fs *c	= fuse_req_userdata(req);
-	struct bch_io_opts	io_opts;
-	size_t			aligned_written;
-	int			ret = 0;
+	list_del(&w->hash);
+	list_del(&w->list);
+	free(w->data);
+	free(w);
+}
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
-		 inum, size, offset);
+/*
+ * Write out a dirty buffer as a single extent, then free it - on error the
+ * buffered data is dropped, like the kernel does on writeback errors, and the
+ * buffer only keeps the error.
+ *
+ * Drops wbufs.lock for the IO:
+ */
+static int fuse_wbuf_flush(struct bch_fuse *f, struct fuse_wbuf *w)
+{
+	struct bch_fs *c = f->c;
+	struct bch_inode_unpacked bi;
+	struct bch_io_opts io_opts;
+	u64 end		= w->start + w->bytes;
+	u64 aligned_end	= round_up(end, block_bytes(c));
+	size_t written;
+	int ret;
 
-	struct fuse_align_io align = align_io(c, size, offset);
-	void *aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
-	BUG_ON(!aligned_buf);
+	lockdep_assert_held(&f->wbufs.lock);
+	BUG_ON(w->flushing || !w->data);
 
-	if (get_inode_io_opts(c, inum, &io_opts)) {
-		ret = -ENOENT;
-		goto err;
+	w->flushing = true;
+	list_del_init(&w->list);
+	f->wbufs.dirty -= w->size;
+	mutex_unlock(&f->wbufs.lock);
+
+	ret = bch2_inode_find_by_inum(c, w->inum, &bi);
+	if (ret)
+		goto out;
+
+	io_opts = bch2_opts_to_inode_opts(c->opts);
+	bch2_io_opts_apply(&io_opts, bch2_inode_opts_get(&bi));
+
+	/* Read partial end data, if there's anything on disk there: */
+	memset(w->data + w->bytes, 0, aligned_end - end);
+
+	if (aligned_end != end &&
+	    aligned_end - block_bytes(c) < bi.bi_size) {
+		u64 partial_end_start = aligned_end - block_bytes(c);
+		void *buf = aligned_alloc(PAGE_SIZE, block_bytes(c));
+
+		ret = -ENOMEM;
+		if (!buf)
+			goto out;
+
+		memset(buf, 0, block_bytes(c));
+
+		ret = read_aligned(c, w->inum, block_bytes(c),
+				   partial_end_start, buf);
+		if (!ret)
+			memcpy(w->data + w->bytes,
+			       buf + end - partial_end_start,
+			       aligned_end - end);
+		free(buf);
+		if (ret)
+			goto out;
+	}
+
+	ret = write_aligned(c, w->inum, io_opts, w->data,
+			    aligned_end - w->start, w->start,
+			    end, &written);
+	if (!ret && written != aligned_end - w->start)
+		ret = -EIO;
+
+	if (!ret)
+		ret = inode_update_times(c, w->inum);
+out:
+	if (ret)
+		fuse_log(FUSE_LOG_ERR,
+			 "bcachefs_fuse: error %i writing back inode %llu\n",
+			 ret, w->inum);
+
+	fuse_log(FUSE_LOG_DEBUG, "fuse_wbuf_flush(%llu, %llu, %zu)\n",
+		 w->inum, w->start, w->bytes);
+
+	mutex_lock(&f->wbufs.lock);
+	w->flushing = false;
+	f->wbufs.flush_seq++;
+	wake_up(&f->wbufs.wait);
+
+	if (ret && !w->err)
+		w->err = ret;
+
+	if (!w->err) {
+		fuse_wbuf_free(w);
+		return 0;
+	}
+
+	free(w->data);
+	w->data		= NULL;
+	w->start	= 0;
+	w->bytes	= 0;
+	w->size		= 0;
+	return ret;
+}
+
+static int fuse_wbuf_flush_inum(struct bch_fuse *f, u64 inum)
+{
+	struct fuse_wbuf *w;
+	int ret = 0;
+
+	mutex_lock(&f->wbufs.lock);
+	w = fuse_wbuf_find_idle(f, inum);
+	if (w && w->data)
+		fuse_wbuf_flush(f, w);
+
+	/*
+	 * Return, and clear, any writeback error - there may be a new buffer,
+	 * written since we flushed:
+	 */
+	w = fuse_wbuf_find_idle(f, inum);
+	if (w) {
+		ret = w->err;
+		w->err = 0;
+
+		if (!w->data)
+			fuse_wbuf_free(w);
 	}
+	mutex_unlock(&f->wbufs.lock);
+
+	return ret;
+}
+
+static size_t fuse_wbuf_size(size_t bytes)
+{
+	return max_t(size_t, PAGE_SIZE, roundup_pow_of_two(bytes));
+}
 
-	/* Realign the data and read in start and end, if needed */
+/* Called without wbufs.lock - doesn't add the new buffer to the table: */
+static struct fuse_wbuf *fuse_wbuf_alloc(struct bch_fs *c, u64 inum,
+					 size_t size, off_t offset)
+{
+	struct fuse_align_io align = align_io(c, size, offset);
+	struct fuse_wbuf *w;
+	int ret;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return ERR_PTR(-ENOMEM);
+
+	INIT_LIST_HEAD(&w->hash);
+	INIT_LIST_HEAD(&w->list);
+
+	w->inum		= inum;
+	w->start	= align.start;
+	w->bytes	= align.pad_start;
+	w->size		= fuse_wbuf_size(align.size);
+	w->data		= aligned_alloc(PAGE_SIZE, w->size);
+	if (!w->data) {
+		free(w);
+		return ERR_PTR(-ENOMEM);
+	}
 
 	/* Read partial start data. */
 	if (align.pad_start) {
-		memset(aligned_buf, 0, block_bytes(c));
+		memset(w->data, 0, block_bytes(c));
 
 		ret = read_aligned(c, inum, block_bytes(c), align.start,
-				   aligned_buf);
-		if (ret)
-			goto err;
+				   w->data);
+		if (ret) {
+			free(w->data);
+			free(w);
+			return ERR_PTR(ret);
+		}
 	}
 
-	/*
-	 * Read partial end data. If the whole write fits in one block, the
-	 * start data and the end data are the same so this isn't needed.
-	 */
-	if (align.pad_end &&
-	    !(align.pad_start && align.size == block_bytes(c))) {
-		off_t partial_end_start = align.end - block_bytes(c);
-		size_t buf_offset = align.size - block_bytes(c);
+	return w;
+}
+
+static void fuse_wbuf_add(struct bch_fuse *f, struct fuse_wbuf *w)
+{
+	lockdep_assert_held(&f->wbufs.lock);
+
+	w->dirtied = jiffies;
+	list_add(&w->hash, fuse_wbuf_slot(f, w->inum));
+	list_add_tail(&w->list, &f->wbufs.dirty_list);
+	f->wbufs.dirty += w->size;
+}
+
+static int fuse_wbuf_write(struct bch_fuse *f, u64 inum,
+			   const char *buf, size_t size, off_t offset)
+{
+	struct bch_fs *c = f->c;
+	struct fuse_wbuf *w, *n;
+	unsigned seq;
+	int ret = 0;
 
-		memset(aligned_buf + buf_offset, 0, block_bytes(c));
+	mutex_lock(&f->wbufs.lock);
+retry:
+	/* Only one contiguous range per inode: */
+	w = fuse_wbuf_find_idle(f, inum);
+	if (w && w->data &&
+	    (offset < w->start ||
+	     offset > w->start + w->bytes ||
+	     offset + size - w->start > FUSE_WBUF_MAX)) {
+		fuse_wbuf_flush(f, w);
+		goto retry;
+	}
+
+	if (!w || !w->data) {
+		seq = f->wbufs.flush_seq;
+		mutex_unlock(&f->wbufs.lock);
+
+		n = fuse_wbuf_alloc(c, inum, size, offset);
 
-		ret = read_aligned(c, inum, block_bytes(c), partial_end_start,
-				   aligned_buf + buf_offset);
+		mutex_lock(&f->wbufs.lock);
+		ret = PTR_ERR_OR_ZERO(n);
 		if (ret)
-			goto err;
+			goto out;
+
+		/*
+		 * Another write to this inode got in while we were reading the
+		 * partial start block, which may now be stale:
+		 */
+		w = fuse_wbuf_find(f, inum);
+		if ((w && w->data) ||
+		    (offset & (block_bytes(c) - 1) &&
+		     f->wbufs.flush_seq != seq)) {
+			fuse_wbuf_free(n);
+			goto retry;
+		}
+
+		/* Carry over a writeback error that hasn't been returned: */
+		if (w) {
+			n->err = w->err;
+			fuse_wbuf_free(w);
+		}
+		fuse_wbuf_add(f, n);
+		w = n;
 	}
 
-	/* Overlay what we want to write. */
-	memcpy(aligned_buf + align.pad_start, buf, size);
+	size_t bytes = round_up(offset + size - w->start, block_bytes(c));
+	if (bytes > w->size) {
+		size_t new_size = fuse_wbuf_size(bytes);
+		void *n = aligned_alloc(PAGE_SIZE, new_size);
 
-	/* Actually write. */
-	ret = write_aligned(c, inum, io_opts, aligned_buf,
-			    align.size, align.start,
-			    offset + size, &aligned_written);
+		ret = -ENOMEM;
+		if (!n)
+			goto out;
 
-	/* Figure out how many unaligned bytes were written. */
-	size_t written = align_fix_up_bytes(&align, aligned_written);
-	BUG_ON(written > size);
+		memcpy(n, w->data, w->bytes);
+		free(w->data);
+		w->data = n;
+		f->wbufs.dirty += new_size - w->size;
+		w->size = new_size;
+	}
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
-		 written);
+	memcpy(w->data + offset - w->start, buf, size);
+	w->bytes = max_t(size_t, w->bytes, offset + size - w->start);
+	ret = 0;
 
-	if (written > 0)
-		ret = 0;
+	if (w->bytes >= FUSE_WBUF_MAX)
+		fuse_wbuf_flush(f, w);
 
-	/*
-	 * Update inode times.
-	 * TODO: Integrate with bch2_extent_update()
-	 */
-	if (!ret)
-		ret = inode_update_times(c, inum);
+	/* Memory pressure - write out the oldest buffers: */
+	while (f->wbufs.dirty > FUSE_WBUF_DIRTY_MAX &&
+	       (w = list_first_entry_or_null(&f->wbufs.dirty_list,
+					     struct fuse_wbuf, list)))
+		fuse_wbuf_flush(f, w);
+out:
+	mutex_unlock(&f->wbufs.lock);
+	return ret;
+}
 
-	if (!ret) {
-		BUG_ON(written == 0);
-		fuse_reply_write(req, written);
-		free(aligned_buf);
+static int fuse_wbuf_flusher(void *arg)
+{
+	struct bch_fuse *f = arg;
+	struct fuse_wbuf *w;
+	unsigned long expire = msecs_to_jiffies(FUSE_WBUF_EXPIRE_MS);
+
+	while (!kthread_should_stop()) {
+		mutex_lock(&f->wbufs.lock);
+		while ((w = list_first_entry_or_null(&f->wbufs.dirty_list,
+						     struct fuse_wbuf, list)) &&
+		       time_after_eq(jiffies, w->dirtied + expire))
+			fuse_wbuf_flush(f, w);
+		mutex_unlock(&f->wbufs.lock);
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		schedule_timeout(expire / 4);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static void fuse_wbufs_exit(struct bch_fuse *f)
+{
+	struct fuse_wbuf *w;
+	unsigned i;
+
+	if (f->wbufs.flusher) {
+		kthread_stop(f->wbufs.flusher);
+		put_task_struct(f->wbufs.flusher);
+		f->wbufs.flusher = NULL;
+	}
+
+	mutex_lock(&f->wbufs.lock);
+	while ((w = list_first_entry_or_null(&f->wbufs.dirty_list,
+					     struct fuse_wbuf, list)))
+		fuse_wbuf_flush(f, w);
+
+	/* Writeback errors nobody asked for: */
+	for (i = 0; i < ARRAY_SIZE(f->wbufs.table); i++)
+		while ((w = list_first_entry_or_null(&f->wbufs.table[i],
+						     struct fuse_wbuf, hash)))
+			fuse_wbuf_free(w);
+	mutex_unlock(&f->wbufs.lock);
+}
+
+static void fuse_wbufs_init(struct bch_fuse *f)
+{
+	struct task_struct *t;
+	unsigned i;
+
+	mutex_init(&f->wbufs.lock);
+	init_waitqueue_head(&f->wbufs.wait);
+	INIT_LIST_HEAD(&f->wbufs.dirty_list);
+	for (i = 0; i < ARRAY_SIZE(f->wbufs.table); i++)
+		INIT_LIST_HEAD(&f->wbufs.table[i]);
+
+	t = kthread_create(fuse_wbuf_flusher, f, "bch-fuse-wbuf");
+	if (IS_ERR(t)) {
+		/* Buffers will still be flushed on size, close and fsync */
+		fuse_log(FUSE_LOG_ERR,
+			 "bcachefs_fuse: error creating flusher thread: %li\n",
+			 PTR_ERR(t));
 		return;
 	}
 
-err:
-	fuse_reply_err(req, -ret);
-	free(aligned_buf);
+	get_task_struct(t);
+	f->wbufs.flusher = t;
+	wake_up_process(t);
+}
+
+static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
+				const char *buf, size_t size,
+				off_t offset,
+				struct fuse_file_info *fi)
+{
+	struct bch_fuse *f	= fuse_req_userdata(req);
+	int			ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
+		 inum, size, offset);
+
+	ret = fuse_wbuf_write(f, inum, buf, size, offset);
+
+	/* Already buffered in the kernel's page cache: */
+	if (!ret && f->writeback_cache)
+		ret = fuse_wbuf_flush_inum(f, inum);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, size);
 }
 
 static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 				  fuse_ino_t dir, const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	struct bch_inode_unpacked new_inode;
 	size_t link_len = strlen(link);
 	int ret;
@@ -734,7 +1194,7 @@ static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 
 	new_inode.bi_size = written;
 
-	struct fuse_entry_param e = inode_to_entry(c, &new_inode);
+	struct fuse_entry_param e = inode_to_entry(f, &new_inode);
 	fuse_reply_entry(req, &e);
 	return;
 
@@ -744,7 +1204,8 @@ err:
 
 static void bcachefs_fuse_readlink(fuse_req_t req, fuse_ino_t inum)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	char *buf = NULL;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readlink(%llu)\n", inum);
@@ -776,38 +1237,45 @@ err:
 	free(buf);
 }
 
-#if 0
 /*
  * FUSE flush is essentially the close() call, however it is not guaranteed
- * that one flush happens per open/create.
- *
- * It doesn't have to do anything, and is mostly relevant for NFS-style
- * filesystems where close has some relationship to caching.
+ * that one flush happens per open/create - it's where close() gets writeback
+ * errors from, so write out buffered data here too.
  */
 static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t inum,
 				struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_flush(%llu)\n", inum);
+
+	fuse_reply_err(req, -fuse_wbuf_flush_inum(f, inum));
 }
 
 static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_release(%llu)\n", inum);
+
+	fuse_reply_err(req, -fuse_wbuf_flush_inum(f, inum));
 }
 
 static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t inum, int datasync,
 				struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
-}
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
+	int ret;
 
-static void bcachefs_fuse_opendir(fuse_req_t req, fuse_ino_t inum,
-				  struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_fsync(%llu)\n", inum);
+
+	ret = fuse_wbuf_flush_inum(f, inum) ?:
+		bch2_journal_flush(&c->journal);
+
+	fuse_reply_err(req, -ret);
 }
-#endif
 
 struct fuse_dir_context {
 	struct dir_context	ctx;
@@ -899,12 +1367,173 @@ static bool handle_dots(struct fuse_dir_context *ctx, fuse_ino_t dir)
 	return true;
 }
 
+/*
+ * Per opendir() state: rather than starting a new bch2_readdir() from the
+ * btree root for every readdir call, we read entries a batch at a time into
+ * @entries, and serve readdir calls from there while the requested offset is
+ * within the range of dirent positions the batch covers.
+ *
+ * The batch is only reused by a readdir call that continues exactly where the
+ * previous reply left off; a rewind (offset 0) or seek elsewhere rereads the
+ * btree, as does continuing past the end of a batch that hit end of directory,
+ * so entries created after the batch was read are seen on the next pass.
+ *
+ * Resuming is purely position based, so entries added or removed while the
+ * directory is being read may or may not be seen - as with any other
+ * filesystem - but entries are never skipped or returned twice:
+ */
+#define FUSE_DIR_STREAM_BYTES	(32 << 10)
+
+struct fuse_dir_stream_entry {
+	u64			pos;
+	u64			ino;
+	u16			type;
+	u16			namelen;
+	char			name[];
+};
+
+struct fuse_dir_stream {
+	u64			inum;
+
+	/* dirent positions covered by @entries: [start, end) */
+	u64			start;
+	u64			end;
+	bool			eof;
+
+	/* offset the previous readdir reply ended at: */
+	u64			next;
+
+	unsigned		bytes;
+	u64			entries[FUSE_DIR_STREAM_BYTES / sizeof(u64)];
+};
+
+static inline unsigned fuse_dir_stream_entry_bytes(unsigned namelen)
+{
+	return round_up(sizeof(struct fuse_dir_stream_entry) + namelen,
+			sizeof(u64));
+}
+
+#define for_each_fuse_dir_stream_entry(_s, _e)				\
+	for (_e = (void *) (_s)->entries;				\
+	     (void *) _e < (void *) (_s)->entries + (_s)->bytes;	\
+	     _e = (void *) _e + fuse_dir_stream_entry_bytes(_e->namelen))
+
+struct fuse_dir_stream_context {
+	struct dir_context	ctx;
+	struct fuse_dir_stream	*s;
+};
+
+static int fuse_dir_stream_fill(struct dir_context *_ctx,
+				const char *name, int namelen,
+				loff_t pos, u64 ino, unsigned type)
+{
+	struct fuse_dir_stream *s =
+		container_of(_ctx, struct fuse_dir_stream_context, ctx)->s;
+	struct fuse_dir_stream_entry *e = (void *) s->entries + s->bytes;
+	unsigned bytes = fuse_dir_stream_entry_bytes(namelen);
+
+	if (s->bytes + bytes > sizeof(s->entries)) {
+		/* out of buffer space, not end of directory: */
+		s->eof = false;
+		return -1;
+	}
+
+	e->pos		= pos;
+	e->ino		= ino;
+	e->type		= type;
+	e->namelen	= namelen;
+	memcpy(e->name, name, namelen);
+
+	s->bytes += bytes;
+	return 0;
+}
+
+static int fuse_dir_stream_refill(struct bch_fs *c, struct fuse_dir_stream *s,
+				  u64 pos)
+{
+	struct fuse_dir_stream_context ctx = {
+		.ctx.actor	= fuse_dir_stream_fill,
+		.ctx.pos	= pos,
+		.s		= s,
+	};
+	int ret;
+
+	s->bytes	= 0;
+	s->start	= pos;
+	s->eof		= true;
+
+	ret = bch2_readdir(c, s->inum, &ctx.ctx);
+	if (ret) {
+		s->start = s->end = 0;
+		s->bytes = 0;
+		return ret;
+	}
+
+	s->end		= ctx.ctx.pos;
+	return 0;
+}
+
+static void fuse_dir_stream_invalidate(struct fuse_dir_stream *s)
+{
+	s->start	= 0;
+	s->end		= 0;
+	s->eof		= false;
+	s->bytes	= 0;
+}
+
+static void bcachefs_fuse_opendir(fuse_req_t req, fuse_ino_t inum,
+				  struct fuse_file_info *fi)
+{
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
+	struct bch_inode_unpacked bi;
+	struct fuse_dir_stream *s;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_opendir(%llu)\n", inum);
+
+	inum = map_root_ino(inum);
+
+	ret = bch2_inode_find_by_inum(c, inum, &bi);
+	if (ret)
+		goto err;
+
+	if (!S_ISDIR(bi.bi_mode)) {
+		ret = -ENOTDIR;
+		goto err;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	s->inum		= inum;
+
+	fi->fh = (uintptr_t) s;
+	fuse_reply_open(req, fi);
+	return;
+err:
+	fuse_reply_err(req, -ret);
+}
+
+static void bcachefs_fuse_releasedir(fuse_req_t req, fuse_ino_t inum,
+				     struct fuse_file_info *fi)
+{
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_releasedir(%llu)\n", inum);
+
+	free((void *) (uintptr_t) fi->fh);
+	fuse_reply_err(req, 0);
+}
+
 static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir,
 				  size_t size, off_t off,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
-	struct bch_inode_unpacked bi;
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
+	struct fuse_dir_stream *s = (void *) (uintptr_t) fi->fh;
 	char *buf = calloc(size, 1);
 	struct fuse_dir_context ctx = {
 		.ctx.actor	= fuse_filldir,
@@ -913,6 +1542,7 @@ static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir,
 		.buf		= buf,
 		.bufsize	= size,
 	};
+	struct fuse_dir_stream_entry *e;
 	int ret = 0;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdir(dir=%llu, size=%zu, "
@@ -920,21 +1550,41 @@ static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir,
 
 	dir = map_root_ino(dir);
 
-	ret = bch2_inode_find_by_inum(c, dir, &bi);
-	if (ret)
-		goto reply;
-
-	if (!S_ISDIR(bi.bi_mode)) {
-		ret = -ENOTDIR;
-		goto reply;
-	}
+	if (!off || off != s->next)
+		fuse_dir_stream_invalidate(s);
 
 	if (!handle_dots(&ctx, dir))
 		goto reply;
 
-	ret = bch2_readdir(c, dir, &ctx.ctx);
+	while (1) {
+		u64 pos = ctx.ctx.pos;
+
+		if (pos < s->start || pos >= s->end) {
+			ret = fuse_dir_stream_refill(c, s, pos);
+			if (ret)
+				goto reply;
+		}
+
+		for_each_fuse_dir_stream_entry(s, e) {
+			if (e->pos < pos)
+				continue;
+
+			if (fuse_filldir(&ctx.ctx, e->name, e->namelen,
+					 e->pos, e->ino, e->type) < 0)
+				goto reply;
+
+			ctx.ctx.pos = e->pos + 1;
+		}
+
+		if (s->eof)
+			break;
+
+		ctx.ctx.pos = s->end;
+	}
 reply:
 	if (!ret) {
+		s->next = ctx.ctx.pos;
+
 		fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdir reply %zd\n",
 					ctx.buf - buf);
 		fuse_reply_buf(req, buf, ctx.buf - buf);
@@ -953,22 +1603,18 @@ static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir,
 
 }
 
-static void bcachefs_fuse_releasedir(fuse_req_t req, fuse_ino_t inum,
-				     struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
-}
-
 static void bcachefs_fuse_fsyncdir(fuse_req_t req, fuse_ino_t inum, int datasync,
 				   struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 }
 #endif
 
 static void bcachefs_fuse_statfs(fuse_req_t req, fuse_ino_t inum)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	struct bch_fs_usage_short usage = bch2_fs_usage_read_short(c);
 	unsigned shift = c->block_bits;
 	struct statvfs statbuf = {
@@ -990,26 +1636,30 @@ static void bcachefs_fuse_setxattr(fuse_req_t req, fuse_ino_t inum,
 				   const char *name, const char *value,
 				   size_t size, int flags)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 }
 
 static void bcachefs_fuse_getxattr(fuse_req_t req, fuse_ino_t inum,
 				   const char *name, size_t size)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 
 	fuse_reply_xattr(req, );
 }
 
 static void bcachefs_fuse_listxattr(fuse_req_t req, fuse_ino_t inum, size_t size)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 }
 
 static void bcachefs_fuse_removexattr(fuse_req_t req, fuse_ino_t inum,
 				      const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 }
 #endif
 
@@ -1017,7 +1667,8 @@ static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir,
 				 const char *name, mode_t mode,
 				 struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 	struct bch_inode_unpacked new_inode;
 	int ret;
 
@@ -1028,7 +1679,7 @@ static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir,
 	if (ret)
 		goto err;
 
-	struct fuse_entry_param e = inode_to_entry(c, &new_inode);
+	struct fuse_entry_param e = inode_to_entry(f, &new_inode);
 	fuse_reply_create(req, &e, fi);
 	return;
 err:
@@ -1041,14 +1692,16 @@ static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
 				    struct fuse_bufvec *bufv, off_t off,
 				    struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 }
 
 static void bcachefs_fuse_fallocate(fuse_req_t req, fuse_ino_t inum, int mode,
 				    off_t offset, off_t length,
 				    struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fuse *f = fuse_req_userdata(req);
+	struct bch_fs *c = f->c;
 }
 #endif
 
@@ -1069,13 +1722,13 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.open		= bcachefs_fuse_open,
 	.read		= bcachefs_fuse_read,
 	.write		= bcachefs_fuse_write,
-	//.flush	= bcachefs_fuse_flush,
-	//.release	= bcachefs_fuse_release,
-	//.fsync	= bcachefs_fuse_fsync,
-	//.opendir	= bcachefs_fuse_opendir,
+	.flush		= bcachefs_fuse_flush,
+	.release	= bcachefs_fuse_release,
+	.fsync		= bcachefs_fuse_fsync,
+	.opendir	= bcachefs_fuse_opendir,
 	.readdir	= bcachefs_fuse_readdir,
 	//.readdirplus	= bcachefs_fuse_readdirplus,
-	//.releasedir	= bcachefs_fuse_releasedir,
+	.releasedir	= bcachefs_fuse_releasedir,
 	//.fsyncdir	= bcachefs_fuse_fsyncdir,
 	.statfs		= bcachefs_fuse_statfs,
 	//.setxattr	= bcachefs_fuse_setxattr,
@@ -1184,7 +1837,7 @@ int cmd_fusemount(int argc, char *argv[])
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct bch_opts bch_opts = bch2_opts_empty();
 	struct bf_context ctx = { 0 };
-	struct bch_fs *c = NULL;
+	struct bch_fuse f = { 0 };
 	int ret = 0, i;
 
 	/* Parse arguments. */
@@ -1228,15 +1881,15 @@ int cmd_fusemount(int argc, char *argv[])
 	for (i = 0; i < ctx.nr_devices; ++i)
                 printf("\t%s\n", ctx.devices[i]);
 
-	c = bch2_fs_open(ctx.devices, ctx.nr_devices, bch_opts);
-	if (IS_ERR(c))
+	f.c = bch2_fs_open(ctx.devices, ctx.nr_devices, bch_opts);
+	if (IS_ERR(f.c))
 		die("error opening %s: %s", ctx.devices_str,
-		    strerror(-PTR_ERR(c)));
+		    strerror(-PTR_ERR(f.c)));
 
 	/* Fuse */
 	struct fuse_session *se =
 		fuse_session_new(&args, &bcachefs_fuse_ops,
-				 sizeof(bcachefs_fuse_ops), c);
+				 sizeof(bcachefs_fuse_ops), &f);
 	if (!se)
 		die("fuse_lowlevel_new err: %m");
 
@@ -0,0 +1,806 @@
+/*
+ * Offline metadata queries: bcachefs du, bcachefs query
+ *
+ * Instead of walking the namespace a syscall at a time, these scan the inodes
+ * and dirents btrees directly - split into ranges at interior node boundaries,
+ * with a thread per range - and then join them with sorted passes:
+ *
+ *  - inodes come out of the btree sorted by inode number
+ *  - dirents are sorted by the inode they point to, and merge joined with
+ *    inodes to find each inode's parent directory and name
+ *
+ * Only directory names (for building paths) and the names of inodes we're
+ * going to print are kept in memory.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/dirent.h"
+#include "libbcachefs/error.h"
+#include "libbcachefs/inode.h"
+#include "libbcachefs/opts.h"
+#include "libbcachefs/super.h"
+
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sort.h>
+
+#define QUERY_THREADS_MAX	64
+
+struct query_inode {
+	u64			inum;
+	u64			size;
+	u64			sectors;
+	s64			mtime;
+	u32			mode;
+	u32			uid;
+	u32			gid;
+	u32			nlink;
+};
+
+struct query_dirent {
+	u64			parent;
+	u64			inum;
+	char			*name;
+	u8			type;
+};
+
+typedef darray(struct query_inode)	query_inodes;
+typedef darray(struct query_dirent)	query_dirents;
+typedef darray(struct du_dir)		du_dirs;
+
+struct query_pred {
+	int			type;	/* DT_*, or -1 */
+	u64			min_size;
+	u64			max_size;
+	s64			newer_than;
+	s64			older_than;
+	s64			uid;
+	s64			gid;
+};
+
+struct query {
+	struct bch_fs		*c;
+	unsigned		nr_threads;
+
+	/* If set, only inodes matching are kept: */
+	struct query_pred	*pred;
+
+	query_inodes		inodes;
+	query_dirents		dirents;
+};
+
+struct scan_thread {
+	struct query		*q;
+	struct btree_range	r;
+	query_inodes		inodes;
+	query_dirents		dirents;
+	int			ret;
+};
+
+/* Scanning: */
+
+static bool query_pred_match(struct query_pred *p, struct query_inode *i)
+{
+	return  (p->type < 0		|| mode_to_type(i->mode) == p->type) &&
+		(!p->min_size		|| i->size >= p->min_size) &&
+		(!p->max_size		|| i->size <= p->max_size) &&
+		(p->newer_than == S64_MIN || i->mtime > p->newer_than) &&
+		(p->older_than == S64_MAX || i->mtime < p->older_than) &&
+		(p->uid < 0		|| i->uid == p->uid) &&
+		(p->gid < 0		|| i->gid == p->gid);
+}
+
+static int scan_inodes_thread(void *arg)
+{
+	struct scan_thread *t = arg;
+	struct query *q = t->q;
+	struct bch_fs *c = q->c;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bch_inode_unpacked u;
+	struct query_inode i;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_inodes, t->r.start,
+			   BTREE_ITER_PREFETCH, k, ret) {
+		if (bkey_cmp(k.k->p, t->r.end) > 0)
+			break;
+
+		if (k.k->type != KEY_TYPE_inode)
+			continue;
+
+		ret = bch2_inode_unpack(bkey_s_c_to_inode(k), &u);
+		if (ret)
+			break;
+
+		if (u.bi_flags & BCH_INODE_UNLINKED)
+			continue;
+
+		i = (struct query_inode) {
+			.inum		= u.bi_inum,
+			.size		= u.bi_size,
+			.sectors	= u.bi_sectors,
+			.mtime		= bch2_time_to_timespec(c, u.bi_mtime).tv_sec,
+			.mode		= u.bi_mode,
+			.uid		= u.bi_uid,
+			.gid		= u.bi_gid,
+			.nlink		= bch2_inode_nlink_get(&u),
+		};
+
+		if (!q->pred || query_pred_match(q->pred, &i))
+			darray_append(t->inodes, i);
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	t->ret = bch2_trans_exit(&trans) ?: ret;
+	return 0;
+}
+
+static int query_inode_cmp(const void *_l, const void *_r)
+{
+	const struct query_inode *l = _l, *r = _r;
+
+	return cmp_int(l->inum, r->inum);
+}
+
+static struct query_inode *query_inode_find(struct query *q, u64 inum)
+{
+	struct query_inode search = { .inum = inum };
+
+	return bsearch(&search, q->inodes.item, q->inodes.size,
+		       sizeof(search), query_inode_cmp);
+}
+
+static int scan_dirents_thread(void *arg)
+{
+	struct scan_thread *t = arg;
+	struct query *q = t->q;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	bch2_trans_init(&trans, q->c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_dirents, t->r.start,
+			   BTREE_ITER_PREFETCH, k, ret) {
+		struct bkey_s_c_dirent d;
+		struct query_dirent i;
+
+		if (bkey_cmp(k.k->p, t->r.end) > 0)
+			break;
+
+		if (k.k->type != KEY_TYPE_dirent)
+			continue;
+
+		d = bkey_s_c_to_dirent(k);
+
+		i = (struct query_dirent) {
+			.parent		= d.k->p.inode,
+			.inum		= le64_to_cpu(d.v->d_inum),
+			.type		= d.v->d_type,
+		};
+
+		/*
+		 * Names are only needed for building paths, and for the inodes
+		 * we'll print; when filtering, other dirents aren't needed at
+		 * all:
+		 */
+		if (i.type == DT_DIR ||
+		    (q->pred && query_inode_find(q, i.inum)))
+			i.name = strndup((const char *) d.v->d_name,
+					 bch2_dirent_name_bytes(d));
+		else if (q->pred)
+			continue;
+
+		darray_append(t->dirents, i);
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	t->ret = bch2_trans_exit(&trans) ?: ret;
+	return 0;
+}
+
+static void query_scan(struct query *q, enum btree_id btree_id,
+		       int (*fn)(void *))
+{
+	struct scan_thread t[QUERY_THREADS_MAX];
+	struct task_struct *p[QUERY_THREADS_MAX];
+	struct btree_range r[QUERY_THREADS_MAX];
+	unsigned i, nr;
+
+	memset(t, 0, sizeof(t));
+
+	nr = btree_split_ranges(q->c, btree_id, r, q->nr_threads);
+
+	for (i = 0; i < nr; i++) {
+		t[i].q = q;
+		t[i].r = r[i];
+		darray_init(t[i].inodes);
+		darray_init(t[i].dirents);
+
+		p[i] = kthread_create(fn, &t[i], "bch-query/%u", i);
+		if (IS_ERR(p[i]))
+			die("error creating thread: %s", strerror(-PTR_ERR(p[i])));
+
+		get_task_struct(p[i]);
+		wake_up_process(p[i]);
+	}
+
+	/* Each thread's results are in btree order, and so are the ranges: */
+	for (i = 0; i < nr; i++) {
+		kthread_stop(p[i]);
+		put_task_struct(p[i]);
+
+		if (t[i].ret)
+			die("error scanning %s btree: %s",
+			    bch2_btree_ids[btree_id], strerror(-t[i].ret));
+
+		darray_append_items(q->inodes, t[i].inodes.item,
+				    t[i].inodes.size);
+		darray_append_items(q->dirents, t[i].dirents.item,
+				    t[i].dirents.size);
+		darray_free(t[i].inodes);
+		darray_free(t[i].dirents);
+	}
+}
+
+static int query_dirent_cmp(const void *_l, const void *_r)
+{
+	const struct query_dirent *l = _l, *r = _r;
+
+	return  cmp_int(l->inum, r->inum) ?:
+		cmp_int(l->parent, r->parent);
+}
+
+/*
+ * Scan inodes, then dirents, and sort dirents by the inode they point to for
+ * joining:
+ */
+static void query_run(struct query *q)
+{
+	query_scan(q, BTREE_ID_inodes, scan_inodes_thread);
+	query_scan(q, BTREE_ID_dirents, scan_dirents_thread);
+
+	sort(q->dirents.item, q->dirents.size, sizeof(q->dirents.item[0]),
+	     query_dirent_cmp, NULL);
+}
+
+static void query_exit(struct query *q)
+{
+	struct query_dirent *d;
+
+	darray_foreach(d, q->dirents)
+		free(d->name);
+	darray_free(q->dirents);
+	darray_free(q->inodes);
+}
+
+static struct query_dirent *query_dirent_find(struct query *q, u64 inum)
+{
+	size_t l = 0, r = q->dirents.size;
+
+	/* first dirent pointing to @inum: */
+	while (l < r) {
+		size_t m = l + (r - l) / 2;
+
+		if (q->dirents.item[m].inum < inum)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l < q->dirents.size && q->dirents.item[l].inum == inum
+		? &q->dirents.item[l]
+		: NULL;
+}
+
+/* Paths: */
+
+static void query_path(struct query *q, struct query_dirent *d,
+		       char *buf, size_t size)
+{
+	struct query_dirent *chain[256];
+	unsigned nr = 0;
+	char *out = buf, *end = buf + size;
+
+	*out = '\0';
+
+	while (d && nr < ARRAY_SIZE(chain)) {
+		chain[nr++] = d;
+
+		if (d->parent == BCACHEFS_ROOT_INO)
+			break;
+		d = query_dirent_find(q, d->parent);
+	}
+
+	while (nr && out < end)
+		out += scnprintf(out, end - out, "/%s", chain[--nr]->name ?: "?");
+
+	if (out == buf)
+		scnprintf(out, end - out, "/");
+}
+
+static void json_str(const char *s)
+{
+	putchar('"');
+	for (; *s; s++)
+		switch (*s) {
+		case '"':
+		case '\\':
+			printf("\\%c", *s);
+			break;
+		case '\n':
+			fputs("\\n", stdout);
+			break;
+		case '\t':
+			fputs("\\t", stdout);
+			break;
+		default:
+			if ((unsigned char) *s < 0x20)
+				printf("\\u%04x", *s);
+			else
+				putchar(*s);
+		}
+	putchar('"');
+}
+
+static struct bch_fs *query_fs_open(char *argv[], int argc)
+{
+	struct bch_opts opts = bch2_opts_empty();
+	struct bch_fs *c;
+
+	opt_set(opts, nochanges,	true);
+	opt_set(opts, read_only,	true);
+	opt_set(opts, degraded,		true);
+	opt_set(opts, errors,		BCH_ON_ERROR_continue);
+	opt_set(opts, fix_errors,	FSCK_OPT_NO);
+
+	c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
+	return c;
+}
+
+static unsigned query_threads_default(void)
+{
+	long nr = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return clamp_t(long, nr, 1, QUERY_THREADS_MAX);
+}
+
+static unsigned parse_threads(const char *s)
+{
+	unsigned v;
+
+	if (kstrtouint(s, 10, &v) || !v || v > QUERY_THREADS_MAX)
+		die("invalid number of threads %s", s);
+	return v;
+}
+
+/* bcachefs du: */
+
+struct du_dir {
+	u64			inum;
+	u64			parent;
+	struct query_dirent	*d;
+	u64			sectors;
+	u64			size;
+	u64			nr_inodes;
+	unsigned		depth;
+};
+
+static int du_dir_cmp(const void *_l, const void *_r)
+{
+	const struct du_dir *l = _l, *r = _r;
+
+	return cmp_int(l->inum, r->inum);
+}
+
+static struct du_dir *du_dir_find(du_dirs *dirs, u64 inum)
+{
+	struct du_dir search = { .inum = inum };
+
+	return bsearch(&search, dirs->item, dirs->size,
+		       sizeof(search), du_dir_cmp);
+}
+
+static bool du_apparent;
+
+static int du_size_cmp(const void *_l, const void *_r)
+{
+	const struct du_dir *l = *((struct du_dir **) _l);
+	const struct du_dir *r = *((struct du_dir **) _r);
+
+	return du_apparent
+		? cmp_int(r->size, l->size)
+		: cmp_int(r->sectors, l->sectors);
+}
+
+static int du_depth_cmp(const void *_l, const void *_r)
+{
+	const struct du_dir *l = *((struct du_dir **) _l);
+	const struct du_dir *r = *((struct du_dir **) _r);
+
+	return cmp_int(r->depth, l->depth);
+}
+
+static void du_usage(void)
+{
+	puts("bcachefs du - show space used per directory, on an unmounted filesystem\n"
+	     "Usage: bcachefs du [OPTION]... <devices>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -d, --max-depth=N           Only show directories at most N levels deep\n"
+	     "  -n, --top=N                 Only show the N biggest directories\n"
+	     "  -a, --apparent-size         Use file sizes, not disk usage\n"
+	     "  -H, --human-readable        Human readable units\n"
+	     "  -j, --threads=N             Number of threads to scan with\n"
+	     "      --json                  Output newline delimited JSON\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Directories are listed biggest first.\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+int cmd_du(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "max-depth",		required_argument,	NULL, 'd' },
+		{ "top",		required_argument,	NULL, 'n' },
+		{ "apparent-size",	no_argument,		NULL, 'a' },
+		{ "human-readable",	no_argument,		NULL, 'H' },
+		{ "threads",		required_argument,	NULL, 'j' },
+		{ "json",		no_argument,		NULL, 'J' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct query q = { .nr_threads = query_threads_default() };
+	du_dirs dirs;
+	darray(struct du_dir *) order;
+	darray(struct du_dir *) chain;
+	struct query_inode *i;
+	struct query_dirent *d;
+	struct du_dir *dir, **dp, root = {
+		.inum	= BCACHEFS_ROOT_INO,
+		.depth	= 0,
+	};
+	unsigned max_depth = UINT_MAX, units = BYTES;
+	u64 top = U64_MAX;
+	bool json = false;
+	char path[4096];
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "d:n:aHj:h",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'd':
+			if (kstrtouint(optarg, 10, &max_depth))
+				die("invalid depth %s", optarg);
+			break;
+		case 'n':
+			if (kstrtoull(optarg, 10, &top))
+				die("invalid number %s", optarg);
+			break;
+		case 'a':
+			du_apparent = true;
+			break;
+		case 'H':
+			units = HUMAN_READABLE;
+			break;
+		case 'j':
+			q.nr_threads = parse_threads(optarg);
+			break;
+		case 'J':
+			json = true;
+			break;
+		case 'h':
+			du_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			du_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s)");
+
+	q.c = query_fs_open(argv, argc);
+
+	darray_init(q.inodes);
+	darray_init(q.dirents);
+	query_run(&q);
+
+	/* Directories, from their dirents - already sorted by inode number: */
+	darray_init(dirs);
+	darray_append(dirs, root);
+
+	darray_foreach(d, q.dirents)
+		if (d->type == DT_DIR &&
+		    (!dirs.size || darray_item(dirs, dirs.size - 1).inum != d->inum)) {
+			struct du_dir n = {
+				.inum	= d->inum,
+				.parent	= d->parent,
+				.d	= d,
+				.depth	= UINT_MAX,
+			};
+
+			darray_append(dirs, n);
+		}
+
+	sort(dirs.item, dirs.size, sizeof(dirs.item[0]), du_dir_cmp, NULL);
+
+	/* Join inodes with their (first) dirent, and charge them to a directory: */
+	darray_foreach(i, q.inodes) {
+		if (S_ISDIR(i->mode)) {
+			dir = du_dir_find(&dirs, i->inum);
+		} else {
+			d = query_dirent_find(&q, i->inum);
+			dir = d ? du_dir_find(&dirs, d->parent) : NULL;
+		}
+
+		if (dir) {
+			dir->sectors	+= i->sectors;
+			dir->size	+= i->size;
+			dir->nr_inodes++;
+		}
+	}
+
+	/* Depth of each directory: */
+	darray_init(chain);
+	darray_foreach(dir, dirs) {
+		struct du_dir *p = dir;
+		unsigned depth;
+
+		chain.size = 0;
+		while (p->depth == UINT_MAX) {
+			darray_append(chain, p);
+			p = du_dir_find(&dirs, p->parent);
+			if (!p || chain.size > dirs.size)
+				break;
+		}
+
+		/* disconnected directories are charged to nothing: */
+		depth = p && p->depth != UINT_MAX ? p->depth : UINT_MAX - 1;
+
+		while (chain.size) {
+			p = chain.item[--chain.size];
+			p->depth = depth != UINT_MAX - 1 ? ++depth : depth;
+		}
+	}
+	darray_free(chain);
+
+	/* Add each directory's totals to its parent's, deepest first: */
+	darray_init(order);
+	darray_foreach(dir, dirs)
+		if (dir->depth != UINT_MAX - 1)
+			darray_append(order, dir);
+
+	sort(order.item, order.size, sizeof(order.item[0]), du_depth_cmp, NULL);
+
+	darray_foreach(dp, order)
+		if ((*dp)->depth &&
+		    (dir = du_dir_find(&dirs, (*dp)->parent))) {
+			dir->sectors	+= (*dp)->sectors;
+			dir->size	+= (*dp)->size;
+			dir->nr_inodes	+= (*dp)->nr_inodes;
+		}
+
+	sort(order.item, order.size, sizeof(order.item[0]), du_size_cmp, NULL);
+
+	darray_foreach(dp, order) {
+		dir = *dp;
+
+		if (dir->depth > max_depth)
+			continue;
+		if (!top--)
+			break;
+
+		if (dir->d)
+			query_path(&q, dir->d, path, sizeof(path));
+		else
+			strcpy(path, "/");
+
+		if (json) {
+			printf("{\"path\":");
+			json_str(path);
+			printf(",\"inum\":%llu,\"bytes\":%llu,\"apparent_bytes\":%llu,\"inodes\":%llu}\n",
+			       dir->inum, dir->sectors << 9, dir->size, dir->nr_inodes);
+		} else {
+			printf("%s\t%s\n",
+			       du_apparent
+			       ? (units == BYTES
+				  ? mprintf("%llu", dir->size)
+				  : pr_units(DIV_ROUND_UP(dir->size, 512), units))
+			       : pr_units(dir->sectors, units),
+			       path);
+		}
+	}
+
+	darray_free(order);
+	darray_free(dirs);
+	query_exit(&q);
+	bch2_fs_stop(q.c);
+	return 0;
+}
+
+/* bcachefs query: */
+
+static const char * const query_types[] = {
+	[DT_UNKNOWN]	= "unknown",
+	[DT_FIFO]	= "fifo",
+	[DT_CHR]	= "char",
+	[DT_DIR]	= "dir",
+	[DT_BLK]	= "block",
+	[DT_REG]	= "file",
+	[DT_LNK]	= "symlink",
+	[DT_SOCK]	= "socket",
+	[DT_WHT]	= NULL,
+};
+
+static void query_usage(void)
+{
+	puts("bcachefs query - find inodes matching some predicates, on an unmounted filesystem\n"
+	     "Usage: bcachefs query [OPTION]... <devices>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -t, --type=(file|dir|symlink|block|char|fifo|socket)\n"
+	     "      --min-size=size         Files of at least this size\n"
+	     "      --max-size=size         Files of at most this size\n"
+	     "      --newer-than=time       Modified after time (seconds since the epoch)\n"
+	     "      --older-than=time       Modified before time (seconds since the epoch)\n"
+	     "      --uid=uid\n"
+	     "      --gid=gid\n"
+	     "  -j, --threads=N             Number of threads to scan with\n"
+	     "      --json                  Output newline delimited JSON\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Prints size, mtime and path of matching inodes - every path, for\n"
+	     "inodes with multiple hardlinks.\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+static void query_print(struct query *q, struct query_inode *i,
+			const char *path, bool json)
+{
+	if (json) {
+		printf("{\"path\":");
+		json_str(path);
+		printf(",\"inum\":%llu,\"type\":\"%s\",\"size\":%llu,\"bytes\":%llu,"
+		       "\"mtime\":%lli,\"mode\":%u,\"uid\":%u,\"gid\":%u,\"nlink\":%u}\n",
+		       i->inum, query_types[mode_to_type(i->mode)] ?: "unknown",
+		       i->size, i->sectors << 9, i->mtime,
+		       i->mode & 07777, i->uid, i->gid, i->nlink);
+	} else {
+		printf("%llu\t%lli\t%s\n", i->size, i->mtime, path);
+	}
+}
+
+int cmd_query(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "type",		required_argument,	NULL, 't' },
+		{ "min-size",		required_argument,	NULL, 's' },
+		{ "max-size",		required_argument,	NULL, 'S' },
+		{ "newer-than",		required_argument,	NULL, 'm' },
+		{ "older-than",		required_argument,	NULL, 'M' },
+		{ "uid",		required_argument,	NULL, 'u' },
+		{ "gid",		required_argument,	NULL, 'g' },
+		{ "threads",		required_argument,	NULL, 'j' },
+		{ "json",		no_argument,		NULL, 'J' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct query_pred pred = {
+		.type		= -1,
+		.newer_than	= S64_MIN,
+		.older_than	= S64_MAX,
+		.uid		= -1,
+		.gid		= -1,
+	};
+	struct query q = {
+		.nr_threads	= query_threads_default(),
+		.pred		= &pred,
+	};
+	struct query_inode *i;
+	struct query_dirent *d;
+	bool json = false;
+	char path[4096];
+	unsigned long long v;
+	long long t;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "t:j:h",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 't':
+			pred.type = read_string_list_or_die(optarg,
+						query_types, "type");
+			break;
+		case 's':
+		case 'S':
+			if (bch2_strtoull_h(optarg, &v))
+				die("invalid size %s", optarg);
+			if (opt == 's')
+				pred.min_size = v;
+			else
+				pred.max_size = v;
+			break;
+		case 'm':
+		case 'M':
+			if (kstrtoll(optarg, 10, &t))
+				die("invalid time %s", optarg);
+			if (opt == 'm')
+				pred.newer_than = t;
+			else
+				pred.older_than = t;
+			break;
+		case 'u':
+		case 'g':
+			if (kstrtoull(optarg, 10, &v) || v > U32_MAX)
+				die("invalid id %s", optarg);
+			if (opt == 'u')
+				pred.uid = v;
+			else
+				pred.gid = v;
+			break;
+		case 'j':
+			q.nr_threads = parse_threads(optarg);
+			break;
+		case 'J':
+			json = true;
+			break;
+		case 'h':
+			query_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			query_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s)");
+
+	q.c = query_fs_open(argv, argc);
+
+	darray_init(q.inodes);
+	darray_init(q.dirents);
+	query_run(&q);
+
+	darray_foreach(i, q.inodes) {
+		if (i->inum == BCACHEFS_ROOT_INO) {
+			query_print(&q, i, "/", json);
+			continue;
+		}
+
+		for (d = query_dirent_find(&q, i->inum);
+		     d && d < q.dirents.item + q.dirents.size && d->inum == i->inum;
+		     d++) {
+			query_path(&q, d, path, sizeof(path));
+			query_print(&q, i, path, json);
+		}
+	}
+
+	query_exit(&q);
+	bch2_fs_stop(q.c);
+	return 0;
+}
@@ -0,0 +1,384 @@
+/*
+ * Training zstd dictionaries: bcachefs train-dict
+ *
+ * zstd does poorly on small inputs - there isn't enough data in a small file
+ * for it to learn from. A dictionary trained on a sample of the small files
+ * already on the filesystem fixes that, for data that has repetitive
+ * structure (source code, logs, config files, json...).
+ *
+ * Files no bigger than --max-file-size are sampled evenly, in inode number
+ * order, until --samples bytes have been read; the dictionary trained on them
+ * is appended to the superblock (BCH_SB_FIELD_zstd_dicts) under the next free
+ * id. Data is then compressed with it wherever the compression_dict option -
+ * per filesystem, or per file or directory via bcachefs setattr - is set to
+ * that id, and compression is zstd.
+ *
+ * Dictionaries can't be removed: existing extents may be compressed with them.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ZDICT_STATIC_LINKING_ONLY
+#include <zdict.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/compress.h"
+#include "libbcachefs/inode.h"
+#include "libbcachefs/io.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/super-io.h"
+
+struct train_file {
+	u64			inum;
+	u64			size;
+};
+
+typedef darray(struct train_file) train_files;
+
+struct train {
+	struct bch_fs		*c;
+	u64			max_file_size;
+	u64			sample_bytes;
+
+	train_files		files;
+	u64			files_bytes;
+
+	void			*samples;
+	size_t			*sample_sizes;
+	unsigned		nr_samples;
+	u64			samples_len;
+};
+
+static void train_scan(struct train *t)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bch_inode_unpacked u;
+	int ret;
+
+	bch2_trans_init(&trans, t->c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_inodes, POS_MIN,
+			   BTREE_ITER_PREFETCH, k, ret) {
+		if (k.k->type != KEY_TYPE_inode)
+			continue;
+
+		ret = bch2_inode_unpack(bkey_s_c_to_inode(k), &u);
+		if (ret)
+			break;
+
+		if (!S_ISREG(u.bi_mode) ||
+		    (u.bi_flags & BCH_INODE_UNLINKED) ||
+		    !u.bi_size ||
+		    u.bi_size > t->max_file_size)
+			continue;
+
+		darray_append(t->files, ((struct train_file) {
+			.inum	= u.bi_inum,
+			.size	= u.bi_size,
+		}));
+		t->files_bytes += u.bi_size;
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	ret = bch2_trans_exit(&trans) ?: ret;
+	if (ret)
+		die("error scanning inodes: %s", strerror(-ret));
+}
+
+static void train_read_endio(struct bio *bio)
+{
+	closure_put(bio->bi_private);
+}
+
+static int train_read(struct bch_fs *c, u64 inum, void *buf, unsigned sectors)
+{
+	struct bch_inode_unpacked inode;
+	struct bch_read_bio rbio;
+	struct bio_vec bv;
+	struct closure cl;
+	int ret;
+
+	ret = bch2_inode_find_by_inum(c, inum, &inode);
+	if (ret)
+		return ret;
+
+	bio_init(&rbio.bio, &bv, 1);
+	rbio.bio.bi_iter.bi_size	= sectors << 9;
+	rbio.bio.bi_iter.bi_sector	= 0;
+	bv.bv_page			= buf;
+	bv.bv_len			= sectors << 9;
+	bv.bv_offset			= 0;
+	bio_set_op_attrs(&rbio.bio, REQ_OP_READ, REQ_SYNC);
+
+	closure_init_stack(&cl);
+	closure_get(&cl);
+	rbio.bio.bi_end_io		= train_read_endio;
+	rbio.bio.bi_private		= &cl;
+
+	bch2_read(c, rbio_init(&rbio.bio, io_opts(c, &inode)), inum);
+
+	closure_sync(&cl);
+
+	return -blk_status_to_errno(rbio.bio.bi_status);
+}
+
+/* Read every n'th file, so that the sample covers the whole filesystem: */
+static void train_read_samples(struct train *t)
+{
+	u64 stride = max_t(u64, 1, DIV_ROUND_UP(t->files_bytes, t->sample_bytes));
+	u64 block = block_bytes(t->c);
+	void *buf = xmalloc(round_up(t->max_file_size, block));
+	struct train_file *f;
+	unsigned i = 0;
+	int ret;
+
+	t->samples	= xmalloc(min(t->files_bytes, t->sample_bytes) +
+				  t->max_file_size);
+	t->sample_sizes	= xcalloc(t->files.size, sizeof(size_t));
+
+	darray_foreach(f, t->files) {
+		if (i++ % stride)
+			continue;
+
+		if (t->samples_len >= t->sample_bytes)
+			break;
+
+		ret = train_read(t->c, f->inum, buf,
+				 round_up(f->size, block) >> 9);
+		if (ret) {
+			fprintf(stderr, "error reading inode %llu: %s\n",
+				f->inum, strerror(-ret));
+			continue;
+		}
+
+		memcpy(t->samples + t->samples_len, buf, f->size);
+		t->samples_len += f->size;
+		t->sample_sizes[t->nr_samples++] = f->size;
+	}
+
+	free(buf);
+}
+
+/* Compressed size of the samples, with and without the dictionary: */
+static u64 train_eval(struct train *t, void *dict, size_t dict_len)
+{
+	ZSTD_CCtx *ctx = ZSTD_createCCtx();
+	size_t dst_len = ZSTD_compressBound(t->max_file_size);
+	void *dst = xmalloc(dst_len), *src = t->samples;
+	u64 ret = 0;
+	unsigned i;
+
+	if (!ctx)
+		die("error allocating zstd context");
+
+	for (i = 0; i < t->nr_samples; i++) {
+		size_t len = ZSTD_compress_usingDict(ctx, dst, dst_len,
+					src, t->sample_sizes[i],
+					dict, dict_len, 0);
+		if (ZSTD_isError(len))
+			die("error compressing samples");
+
+		ret += len;
+		src += t->sample_sizes[i];
+	}
+
+	free(dst);
+	ZSTD_freeCCtx(ctx);
+	return ret;
+}
+
+static unsigned train_next_id(struct bch_fs *c)
+{
+	struct bch_sb_field_zstd_dicts *f =
+		bch2_sb_get_zstd_dicts(c->disk_sb.sb);
+	struct bch_zstd_dict *d;
+	unsigned id = 0;
+
+	if (f)
+		for_each_zstd_dict(f, d)
+			id = max(id, le32_to_cpu(d->id));
+
+	/*
+	 * Inode options are stored biased by one in a 16 bit field, so the
+	 * largest id compression_dict can refer to is U16_MAX - 1:
+	 */
+	if (id >= U16_MAX - 1)
+		die("no free dictionary ids");
+
+	return id + 1;
+}
+
+static void train_add_dict(struct bch_fs *c, unsigned id,
+			   void *dict, size_t dict_len, bool set_default)
+{
+	struct bch_sb_field_zstd_dicts *f;
+	struct bch_zstd_dict *d;
+	unsigned bytes = round_up(sizeof(*d) + dict_len, sizeof(u64));
+	unsigned u64s;
+
+	mutex_lock(&c->sb_lock);
+	f = bch2_sb_get_zstd_dicts(c->disk_sb.sb);
+	u64s = f ? le32_to_cpu(f->field.u64s) : sizeof(*f) / sizeof(u64);
+
+	f = bch2_sb_resize_zstd_dicts(&c->disk_sb, u64s + bytes / sizeof(u64));
+	if (!f)
+		die("no room in superblock for a %zu byte dictionary", dict_len);
+
+	d = (void *) f + u64s * sizeof(u64);
+	memset(d, 0, bytes);
+	d->id	= cpu_to_le32(id);
+	d->len	= cpu_to_le32(dict_len);
+	memcpy(d->data, dict, dict_len);
+
+	c->disk_sb.sb->features[0] |= cpu_to_le64(1ULL << BCH_FEATURE_zstd_dict);
+	if (set_default)
+		SET_BCH_SB_COMPRESSION_DICT(c->disk_sb.sb, id);
+
+	bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+}
+
+static void train_dict_usage(void)
+{
+	puts("bcachefs train-dict - train a zstd dictionary on the small files of an unmounted filesystem\n"
+	     "Usage: bcachefs train-dict [OPTION]... <devices>\n"
+	     "\n"
+	     "Options:\n"
+	     "  -s, --size=size             Dictionary size (default 16k)\n"
+	     "  -m, --max-file-size=size    Only sample files up to this size (default 64k)\n"
+	     "  -S, --samples=size          Amount of data to sample (default 100 times\n"
+	     "                              the dictionary size)\n"
+	     "  -d, --default               Make the new dictionary the filesystem default\n"
+	     "                              (compression_dict option)\n"
+	     "  -n, --dry-run               Train and report, but don't add the dictionary\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+int cmd_train_dict(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "size",		required_argument,	NULL, 's' },
+		{ "max-file-size",	required_argument,	NULL, 'm' },
+		{ "samples",		required_argument,	NULL, 'S' },
+		{ "default",		no_argument,		NULL, 'd' },
+		{ "dry-run",		no_argument,		NULL, 'n' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	struct train t = {
+		.max_file_size	= 64 << 10,
+	};
+	ZDICT_fastCover_params_t params = {
+		.d		= 8,
+		.steps		= 4,
+	};
+	u64 dict_size = 16 << 10, plain, with_dict;
+	bool set_default = false, dry_run = false;
+	unsigned id;
+	size_t dict_len;
+	void *dict;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "s:m:S:dnh",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 's':
+			if (bch2_strtoull_h(optarg, &dict_size) ||
+			    dict_size < 256 || dict_size > U32_MAX)
+				die("invalid dictionary size %s", optarg);
+			break;
+		case 'm':
+			if (bch2_strtoull_h(optarg, &t.max_file_size) ||
+			    !t.max_file_size)
+				die("invalid max file size %s", optarg);
+			break;
+		case 'S':
+			if (bch2_strtoull_h(optarg, &t.sample_bytes) ||
+			    !t.sample_bytes)
+				die("invalid sample size %s", optarg);
+			break;
+		case 'd':
+			set_default = true;
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		case 'h':
+			train_dict_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			train_dict_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s)");
+
+	if (!t.sample_bytes)
+		t.sample_bytes = dict_size * 100;
+
+	if (dry_run)
+		opt_set(opts, nochanges, true);
+
+	t.c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(t.c))
+		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(t.c)));
+
+	darray_init(t.files);
+
+	train_scan(&t);
+	train_read_samples(&t);
+
+	printf("sampled %u of %zu files, %s\n",
+	       t.nr_samples, t.files.size,
+	       pr_units(t.samples_len >> 9, HUMAN_READABLE));
+
+	if (t.nr_samples < 8)
+		die("not enough small files to train a dictionary on");
+
+	id = train_next_id(t.c);
+	params.zParams.dictID = id;
+
+	dict = xmalloc(dict_size);
+	dict_len = ZDICT_optimizeTrainFromBuffer_fastCover(dict, dict_size,
+					t.samples, t.sample_sizes,
+					t.nr_samples, &params);
+	if (ZDICT_isError(dict_len))
+		die("error training dictionary: %s",
+		    ZDICT_getErrorName(dict_len));
+
+	BUG_ON(ZDICT_getDictID(dict, dict_len) != id);
+
+	plain		= train_eval(&t, NULL, 0);
+	with_dict	= train_eval(&t, dict, dict_len);
+
+	printf("dictionary %u: %zu bytes, samples compress to %llu%% (%llu%% without)\n",
+	       id, dict_len,
+	       with_dict * 100 / max_t(u64, t.samples_len, 1),
+	       plain * 100 / max_t(u64, t.samples_len, 1));
+
+	if (!dry_run)
+		train_add_dict(t.c, id, dict, dict_len, set_default);
+
+	free(dict);
+	free(t.sample_sizes);
+	free(t.samples);
+	darray_free(t.files);
+
+	bch2_fs_stop(t.c);
+	return 0;
+}
@@ -32,6 +32,11 @@ int cmd_device_resize_journal(int argc, char *argv[]);
 
 int cmd_data_rereplicate(int argc, char *argv[]);
 int cmd_data_job(int argc, char *argv[]);
+int cmd_dedup(int argc, char *argv[]);
+int cmd_defrag(int argc, char *argv[]);
+int cmd_export(int argc, char *argv[]);
+int cmd_import(int argc, char *argv[]);
+int cmd_train_dict(int argc, char *argv[]);
 
 int cmd_unlock(int argc, char *argv[]);
 int cmd_set_passphrase(int argc, char *argv[]);
@@ -39,6 +44,9 @@ int cmd_remove_passphrase(int argc, char *argv[]);
 
 int cmd_fsck(int argc, char *argv[]);
 
+int cmd_du(int argc, char *argv[]);
+int cmd_query(int argc, char *argv[]);
+
 int cmd_dump(int argc, char *argv[]);
 int cmd_list(int argc, char *argv[]);
 int cmd_list_journal(int argc, char *argv[]);
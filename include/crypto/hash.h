@@ -14,10 +14,14 @@
 #define _CRYPTO_HASH_H
 
 #include <linux/crypto.h>
+#include <linux/errno.h>
 
+struct crypto_shash;
 struct shash_desc;
 
 struct shash_alg {
+	int (*setkey)(struct crypto_shash *tfm, const u8 *key,
+		      unsigned keylen);
 	int (*init)(struct shash_desc *desc);
 	int (*update)(struct shash_desc *desc, const u8 *data, unsigned len);
 	int (*final)(struct shash_desc *desc, u8 *out);
@@ -61,6 +65,14 @@ static inline unsigned crypto_shash_descsize(struct crypto_shash *tfm)
 	return tfm->descsize;
 }
 
+static inline int crypto_shash_setkey(struct crypto_shash *tfm,
+				      const u8 *key, unsigned keylen)
+{
+	struct shash_alg *alg = crypto_shash_alg(tfm);
+
+	return alg->setkey ? alg->setkey(tfm, key, keylen) : -ENOSYS;
+}
+
 struct shash_desc {
 	struct crypto_shash	*tfm;
 	u32			flags;
@@ -210,14 +210,23 @@ static inline struct bio *bio_next_split(struct bio *bio, int sectors,
 	return bio_split(bio, sectors, gfp, bs);
 }
 
+/* Bios with up to this many vecs are allocated from the bio_set's slab: */
+#define BIO_INLINE_VECS		4
+
 struct bio_set {
 	unsigned int front_pad;
+	struct kmem_cache *bio_slab;
 };
 
-static inline void bioset_exit(struct bio_set *bs) {}
+static inline void bioset_exit(struct bio_set *bs)
+{
+	kmem_cache_destroy(bs->bio_slab);
+	bs->bio_slab = NULL;
+}
 
 static inline void bioset_free(struct bio_set *bs)
 {
+	bioset_exit(bs);
 	kfree(bs);
 }
 
@@ -227,7 +236,10 @@ static inline int bioset_init(struct bio_set *bs,
 			      int flags)
 {
 	bs->front_pad = front_pad;
-	return 0;
+	bs->bio_slab = kmem_cache_create("bio", front_pad +
+				sizeof(struct bio) +
+				BIO_INLINE_VECS * sizeof(struct bio_vec));
+	return bs->bio_slab ? 0 : -ENOMEM;
 }
 
 extern struct bio_set *bioset_create(unsigned int, unsigned int);
@@ -24,6 +24,9 @@ typedef struct mempool_s {
 	mempool_alloc_t *alloc;
 	mempool_free_t *free;
 	wait_queue_head_t wait;
+
+	/* Backs kmalloc pools, freed by mempool_exit(): */
+	struct kmem_cache *slab;
 } mempool_t;
 
 static inline bool mempool_initialized(mempool_t *pool)
@@ -78,17 +81,12 @@ mempool_create_slab_pool(int min_nr, struct kmem_cache *kc)
 void *mempool_kmalloc(gfp_t gfp_mask, void *pool_data);
 void mempool_kfree(void *element, void *pool_data);
 
-static inline int mempool_init_kmalloc_pool(mempool_t *pool, int min_nr, size_t size)
-{
-	return mempool_init(pool, min_nr, mempool_kmalloc,
-			    mempool_kfree, (void *) size);
-}
-
-static inline mempool_t *mempool_create_kmalloc_pool(int min_nr, size_t size)
-{
-	return mempool_create(min_nr, mempool_kmalloc, mempool_kfree,
-			      (void *) size);
-}
+/*
+ * In userspace, kmalloc pools get their own slab cache: elements are allocated
+ * from a per thread magazine, with the reserve on top:
+ */
+int mempool_init_kmalloc_pool(mempool_t *pool, int min_nr, size_t size);
+mempool_t *mempool_create_kmalloc_pool(int min_nr, size_t size);
 
 /*
  * A mempool_alloc_t and mempool_free_t for a simple page allocator that
@@ -7,8 +7,10 @@
 
 #include <linux/kernel.h>
 #include <linux/log2.h>
+#include <linux/list.h>
 #include <linux/page.h>
 #include <linux/shrinker.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 
 #define ARCH_KMALLOC_MINALIGN		16
@@ -135,35 +137,103 @@ static inline void *kmemdup(const void *src, size_t len, gfp_t gfp)
 	return p;
 }
 
+/*
+ * Slab caches: fixed size objects, with a per thread magazine of free objects
+ * in front of a shared depot, so that allocating and freeing doesn't touch the
+ * system allocator or any shared state in the common case.
+ *
+ * Objects are individually allocated from the system allocator, so an object
+ * that's kfree()d instead of returned to its cache is merely not recycled.
+ */
+
+#define KMEM_CACHES_MAX			64
+#define KMEM_MAGAZINE_SIZE		32
+#define KMEM_DEPOT_MAX			(8 * KMEM_MAGAZINE_SIZE)
+
+struct kmem_magazine {
+	struct kmem_cache	*cache;
+	struct list_head	list;
+	unsigned		nr;
+	u64			allocs;
+	u64			frees;
+	void			*objs[KMEM_MAGAZINE_SIZE];
+};
+
+struct kmem_cache_stats {
+	u64			allocs;
+	u64			frees;
+	u64			refills;
+	u64			flushes;
+	u64			backing_allocs;
+	u64			backing_frees;
+};
+
 struct kmem_cache {
-	size_t		    obj_size;
+	const char		*name;
+	size_t			obj_size;
+	size_t			align;
+	/* slot in the per thread magazine array, or -1 if none */
+	int			idx;
+
+	spinlock_t		lock;
+	struct list_head	magazines;
+	unsigned		depot_nr;
+	void			*depot[KMEM_DEPOT_MAX];
+	struct kmem_cache_stats	stats;
 };
 
-static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
-{
-	return kmalloc(c->obj_size, gfp);
-}
+void *__kmem_cache_refill(struct kmem_cache *, struct kmem_magazine *);
+void __kmem_cache_flush(struct kmem_cache *, struct kmem_magazine *, void *);
+struct kmem_magazine *__kmem_cache_magazine(struct kmem_cache *);
 
-static inline void kmem_cache_free(struct kmem_cache *c, void *p)
+extern __thread struct kmem_magazine *kmem_magazines[KMEM_CACHES_MAX];
+
+static inline struct kmem_magazine *kmem_cache_magazine(struct kmem_cache *c)
 {
-	kfree(p);
+	struct kmem_magazine *m = c->idx >= 0 ? kmem_magazines[c->idx] : NULL;
+
+	return likely(m && READ_ONCE(m->cache) == c)
+		? m : __kmem_cache_magazine(c);
 }
 
-static inline void kmem_cache_destroy(struct kmem_cache *p)
+static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
 {
-	kfree(p);
+	struct kmem_magazine *m = kmem_cache_magazine(c);
+	void *p;
+
+	if (likely(m && m->nr)) {
+		p = m->objs[--m->nr];
+		m->allocs++;
+	} else {
+		p = __kmem_cache_refill(c, m);
+	}
+
+	if (p && (gfp & __GFP_ZERO))
+		memset(p, 0, c->obj_size);
+	return p;
 }
 
-static inline struct kmem_cache *kmem_cache_create(size_t obj_size)
+static inline void kmem_cache_free(struct kmem_cache *c, void *p)
 {
-	struct kmem_cache *p = kmalloc(sizeof(*p), GFP_KERNEL);
-	if (!p)
-		return NULL;
+	struct kmem_magazine *m;
 
-	p->obj_size = obj_size;
-	return p;
+	if (unlikely(!p))
+		return;
+
+	m = kmem_cache_magazine(c);
+	if (likely(m && m->nr < KMEM_MAGAZINE_SIZE)) {
+		m->objs[m->nr++] = p;
+		m->frees++;
+	} else {
+		__kmem_cache_flush(c, m, p);
+	}
 }
 
-#define KMEM_CACHE(_struct, _flags)	kmem_cache_create(sizeof(struct _struct))
+void kmem_cache_stats(struct kmem_cache *, struct kmem_cache_stats *);
+void kmem_cache_destroy(struct kmem_cache *);
+struct kmem_cache *kmem_cache_create(const char *, size_t);
+
+#define KMEM_CACHE(_struct, _flags)					\
+	kmem_cache_create(#_struct, sizeof(struct _struct))
 
 #endif /* __TOOLS_LINUX_SLAB_H */
@@ -8,3 +8,15 @@
 
 #define ZSTD_CCtxWorkspaceBound(p)	ZSTD_estimateCCtxSize(0)
 #define ZSTD_DCtxWorkspaceBound()	ZSTD_estimateDCtxSize()
+
+#define ZSTD_CDictWorkspaceBound(p)					\
+	ZSTD_estimateCDictSize_advanced(0, p, ZSTD_dlm_byRef)
+#define ZSTD_DDictWorkspaceBound()					\
+	ZSTD_estimateDDictSize(0, ZSTD_dlm_byRef)
+
+#define ZSTD_initCDict(dict, dict_len, params, w, s)			\
+	ZSTD_initStaticCDict(w, s, dict, dict_len, ZSTD_dlm_byRef,	\
+			     ZSTD_dct_auto, (params).cParams)
+#define ZSTD_initDDict(dict, dict_len, w, s)				\
+	ZSTD_initStaticDDict(w, s, dict, dict_len, ZSTD_dlm_byRef,	\
+			     ZSTD_dct_auto)
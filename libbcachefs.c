@@ -18,8 +18,11 @@
 #include "libbcachefs.h"
 #include "crypto.h"
 #include "libbcachefs/bcachefs_format.h"
+#include "libbcachefs/bset.h"
 #include "libbcachefs/btree_cache.h"
+#include "libbcachefs/btree_iter.h"
 #include "libbcachefs/checksum.h"
+#include "libbcachefs/compress.h"
 #include "libbcachefs/disk_groups.h"
 #include "libbcachefs/journal_seq_blacklist.h"
 #include "libbcachefs/opts.h"
@@ -27,6 +30,9 @@
 #include "libbcachefs/super-io.h"
 #include "tools-util.h"
 
+#include <linux/kthread.h>
+#include <linux/sched.h>
+
 #define NSEC_PER_SEC	1000000000L
 
 /* minimum size filesystem we can create, given a bucket size: */
@@ -135,6 +141,108 @@ static unsigned parse_target(struct bch_sb_handle *sb,
 	return 0;
 }
 
+/*
+ * Per device work is done in parallel, a thread per device - with hundreds of
+ * devices, probing, discarding and writing superblocks one at a time adds up:
+ */
+#define FORMAT_THREADS_MAX	64
+
+struct format_dev {
+	struct dev_opts		*dev;
+	unsigned		block_size;
+	struct bch_sb		*sb;
+};
+
+static void format_threads_run(struct format_dev *d, size_t nr,
+			       int (*fn)(void *))
+{
+	struct task_struct *p[FORMAT_THREADS_MAX];
+	size_t i, j, n;
+
+	for (i = 0; i < nr; i += n) {
+		n = min_t(size_t, nr - i, FORMAT_THREADS_MAX);
+
+		for (j = 0; j < n; j++) {
+			p[j] = kthread_create(fn, &d[i + j], "bch-format/%zu", i + j);
+			if (IS_ERR(p[j]))
+				die("error creating thread: %s",
+				    strerror(-PTR_ERR(p[j])));
+
+			get_task_struct(p[j]);
+			wake_up_process(p[j]);
+		}
+
+		for (j = 0; j < n; j++) {
+			kthread_stop(p[j]);
+			put_task_struct(p[j]);
+		}
+	}
+}
+
+static u64 format_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int format_dev_probe(void *arg)
+{
+	struct format_dev *d = arg;
+	struct dev_opts *dev = d->dev;
+	u64 start = format_time_ns();
+	struct stat statbuf = xfstat(dev->fd);
+
+	d->block_size = get_blocksize(dev->path, dev->fd);
+
+	if (!dev->size)
+		dev->size = get_size(dev->path, dev->fd) >> 9;
+
+	/*
+	 * Image files: the old contents are garbage now, so punch them out and
+	 * size the file - leaving it sparse. Not when formatting in place, from
+	 * the migrate tool:
+	 */
+	if (S_ISREG(statbuf.st_mode) && !dev->sb_offset) {
+		discard_range(dev->fd, 0, statbuf.st_size);
+
+		if (dev->size << 9 > statbuf.st_size &&
+		    ftruncate(dev->fd, dev->size << 9))
+			die("error resizing %s: %m", dev->path);
+	} else if (dev->discard && !dev->sb_offset) {
+		discard_range(dev->fd, 0, dev->size << 9);
+	}
+
+	dev->format_ns += format_time_ns() - start;
+	return 0;
+}
+
+static int format_dev_write(void *arg)
+{
+	struct format_dev *d = arg;
+	struct dev_opts *dev = d->dev;
+	struct bch_sb_layout *l = &d->sb->layout;
+	u64 start = format_time_ns();
+	unsigned i;
+
+	if (dev->sb_offset == BCH_SB_SECTOR)
+		/* Zero start of disk */
+		zero_range(dev->fd, 0, BCH_SB_SECTOR << 9);
+
+	/* Allocate space for superblocks, in image files: */
+	if (S_ISREG(xfstat(dev->fd).st_mode))
+		for (i = 0; i < l->nr_superblocks; i++)
+			fallocate(dev->fd, 0, le64_to_cpu(l->sb_offset[i]) << 9,
+				  512 << l->sb_max_size_bits);
+
+	bch2_super_write(dev->fd, d->sb);
+	close(dev->fd);
+
+	dev->format_ns += format_time_ns() - start;
+	return 0;
+}
+
 struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 			   struct bch_opts	fs_opts,
 			   struct format_opts	opts,
@@ -143,13 +251,19 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 {
 	struct bch_sb_handle sb = { NULL };
 	struct dev_opts *i;
+	struct format_dev *d = xcalloc(nr_devs, sizeof(*d));
 	struct bch_sb_field_members *mi;
 	unsigned max_dev_block_size = 0;
 	unsigned opt_id;
 
+	for (i = devs; i < devs + nr_devs; i++)
+		d[i - devs].dev = i;
+
+	format_threads_run(d, nr_devs, format_dev_probe);
+
 	for (i = devs; i < devs + nr_devs; i++)
 		max_dev_block_size = max(max_dev_block_size,
-					 get_blocksize(i->path, i->fd));
+					 d[i - devs].block_size);
 
 	/* calculate block size: */
 	if (!opt_defined(fs_opts, block_size)) {
@@ -277,7 +391,11 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 			bch2_sb_resize_crypt(&sb, sizeof(*crypt) / sizeof(u64));
 
 		bch_sb_crypt_init(sb.sb, crypt, opts.passphrase);
-		SET_BCH_SB_ENCRYPTION_TYPE(sb.sb, 1);
+		SET_BCH_SB_ENCRYPTION_TYPE(sb.sb, opts.encryption_type);
+
+		if (opts.encryption_type == BCH_ENCRYPTION_aes256_gcm)
+			sb.sb->features[0] |=
+				cpu_to_le64(1ULL << BCH_FEATURE_aes256_gcm);
 	}
 
 	for (i = devs; i < devs + nr_devs; i++) {
@@ -307,16 +425,16 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 			l->sb_offset[l->nr_superblocks++] = cpu_to_le64(backup_sb);
 		}
 
-		if (i->sb_offset == BCH_SB_SECTOR) {
-			/* Zero start of disk */
-			static const char zeroes[BCH_SB_SECTOR << 9];
+		/* Each device gets its own copy, with its index and layout: */
+		d[i - devs].sb = xmalloc(vstruct_bytes(sb.sb));
+		memcpy(d[i - devs].sb, sb.sb, vstruct_bytes(sb.sb));
+	}
 
-			xpwrite(i->fd, zeroes, BCH_SB_SECTOR << 9, 0);
-		}
+	format_threads_run(d, nr_devs, format_dev_write);
 
-		bch2_super_write(i->fd, sb.sb);
-		close(i->fd);
-	}
+	for (i = devs; i < devs + nr_devs; i++)
+		free(d[i - devs].sb);
+	free(d);
 
 	return sb.sb;
 }
@@ -651,6 +769,32 @@ static void bch2_sb_print_journal_seq_blacklist(struct bch_sb *sb, struct bch_sb
 	}
 }
 
+static void bch2_sb_print_zstd_dicts(struct bch_sb *sb, struct bch_sb_field *f,
+				     enum units units)
+{
+	struct bch_sb_field_zstd_dicts *dicts = field_to_type(f, zstd_dicts);
+	struct bch_zstd_dict *d;
+
+	for_each_zstd_dict(dicts, d)
+		printf("  %u: %u bytes\n",
+		       le32_to_cpu(d->id),
+		       le32_to_cpu(d->len));
+}
+
+static void bch2_sb_print_import(struct bch_sb *sb, struct bch_sb_field *f,
+				 enum units units)
+{
+	struct bch_sb_field_import *import = field_to_type(f, import);
+	char uuid_str[40];
+
+	uuid_unparse(import->uuid, uuid_str);
+
+	printf("  replica of:  %s\n", uuid_str);
+	printf("  token:       %llu:%llu\n",
+	       le64_to_cpu(import->seq),
+	       le64_to_cpu(import->keyver));
+}
+
 typedef void (*sb_field_print_fn)(struct bch_sb *, struct bch_sb_field *, enum units);
 
 struct bch_sb_field_toolops {
@@ -1215,3 +1359,53 @@ dev_names bchu_fs_get_devices(struct bchfs_handle fs)
 
 	return devs;
 }
+
+/* Offline btree scanning: */
+
+/*
+ * Split @btree_id into up to @nr ranges with roughly equal numbers of leaf
+ * nodes - the leaf boundaries come from the keys in the nodes one level up, so
+ * we don't have to read the leaves to find them:
+ */
+unsigned btree_split_ranges(struct bch_fs *c, enum btree_id btree_id,
+			    struct btree_range *r, unsigned nr)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct btree_node_iter node_iter;
+	struct bkey unpacked;
+	struct bkey_s_c k;
+	struct btree *b;
+	darray(struct bpos) ends;
+	unsigned i;
+
+	r[0].start	= POS_MIN;
+	r[0].end	= POS_MAX;
+
+	if (nr <= 1 || c->btree_roots[btree_id].level < 1)
+		return 1;
+
+	darray_init(ends);
+	bch2_trans_init(&trans, c, 0, 0);
+
+	__for_each_btree_node(&trans, iter, btree_id, POS_MIN, 0, 1, 0, b) {
+		if (b->c.level != 1)
+			break;
+
+		for_each_btree_node_key_unpack(b, k, &node_iter, &unpacked)
+			darray_append(ends, k.k->p);
+	}
+	bch2_trans_iter_put(&trans, iter);
+	bch2_trans_exit(&trans);
+
+	nr = clamp_t(size_t, ends.size, 1, nr);
+
+	for (i = 0; i + 1 < nr; i++) {
+		r[i].end	= ends.item[(ends.size * (i + 1)) / nr - 1];
+		r[i + 1].start	= bpos_successor(r[i].end);
+		r[i + 1].end	= POS_MAX;
+	}
+
+	darray_free(ends);
+	return nr;
+}
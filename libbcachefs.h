@@ -37,6 +37,7 @@ struct format_opts {
 	unsigned	superblock_size;
 	unsigned	encoded_extent_max;
 	bool		encrypted;
+	unsigned	encryption_type;
 	char		*passphrase;
 };
 
@@ -46,6 +47,7 @@ static inline struct format_opts format_opts_default()
 		.version		= bcachefs_metadata_version_current,
 		.superblock_size	= SUPERBLOCK_SIZE_DEFAULT,
 		.encoded_extent_max	= 128,
+		.encryption_type	= BCH_ENCRYPTION_chacha20_poly1305,
 	};
 }
 
@@ -63,6 +65,8 @@ struct dev_opts {
 
 	u64		sb_offset;
 	u64		sb_end;
+
+	u64		format_ns;	/* time spent on this device */
 };
 
 static inline struct dev_opts dev_opts_default()
@@ -245,4 +249,14 @@ typedef darray(struct dev_name) dev_names;
 
 dev_names bchu_fs_get_devices(struct bchfs_handle);
 
+/* For splitting up offline scans of a btree between threads: */
+struct btree_range {
+	struct bpos	start;
+	struct bpos	end;
+};
+
+struct bch_fs;
+unsigned btree_split_ranges(struct bch_fs *, enum btree_id,
+			    struct btree_range *, unsigned);
+
 #endif /* _LIBBCACHE_H */
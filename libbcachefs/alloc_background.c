@@ -8,11 +8,13 @@
 #include "btree_update.h"
 #include "btree_update_interior.h"
 #include "btree_gc.h"
+#include "btree_write_buffer.h"
 #include "buckets.h"
 #include "clock.h"
 #include "debug.h"
 #include "ec.h"
 #include "error.h"
+#include "nocow_locking.h"
 #include "recovery.h"
 #include "varint.h"
 
@@ -312,16 +314,11 @@ static int bch2_alloc_write_key(struct btree_trans *trans,
 	struct bucket *g;
 	struct bucket_mark m;
 	struct bkey_alloc_unpacked old_u, new_u;
-	struct bkey_alloc_buf a;
+	struct bkey_alloc_buf *a;
 	int ret;
 retry:
 	bch2_trans_begin(trans);
 
-	ret = bch2_btree_key_cache_flush(trans,
-			BTREE_ID_alloc, iter->pos);
-	if (ret)
-		goto err;
-
 	k = bch2_btree_iter_peek_slot(iter);
 	ret = bkey_err(k);
 	if (ret)
@@ -333,15 +330,20 @@ retry:
 	ca	= bch_dev_bkey_exists(c, iter->pos.inode);
 	g	= bucket(ca, iter->pos.offset);
 	m	= READ_ONCE(g->mark);
-	new_u	= alloc_mem_to_key(iter, g, m);
+	new_u	= alloc_mem_to_key(iter->pos, g, m);
 	percpu_up_read(&c->mark_lock);
 
 	if (!bkey_alloc_unpacked_cmp(old_u, new_u))
 		return 0;
 
-	bch2_alloc_pack(c, &a, new_u);
-	ret   = bch2_trans_update(trans, iter, &a.k,
-				  BTREE_TRIGGER_NORUN) ?:
+	a = bch2_trans_kmalloc(trans, sizeof(*a));
+	ret = PTR_ERR_OR_ZERO(a);
+	if (ret)
+		goto err;
+
+	bch2_alloc_pack(c, a, new_u);
+	ret   = bch2_trans_update_buffered(trans, BTREE_ID_alloc, &a->k, NULL,
+					   BTREE_TRIGGER_NORUN) ?:
 		bch2_trans_commit(trans, NULL, NULL,
 				BTREE_INSERT_NOFAIL|flags);
 err:
@@ -358,9 +360,14 @@ int bch2_alloc_write(struct bch_fs *c, unsigned flags)
 	unsigned i;
 	int ret = 0;
 
+	/* Make sure the btree is up to date before comparing against it: */
+	ret = bch2_btree_write_buffer_flush(c);
+	if (ret)
+		return ret;
+
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_alloc, POS_MIN,
-				   BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
+				   BTREE_ITER_SLOTS);
 
 	for_each_member_device(ca, c, i) {
 		bch2_btree_iter_set_pos(iter,
@@ -390,44 +397,52 @@ int bch2_bucket_io_time_reset(struct btree_trans *trans, unsigned dev,
 {
 	struct bch_fs *c = trans->c;
 	struct bch_dev *ca = bch_dev_bkey_exists(c, dev);
-	struct btree_iter *iter;
+	struct bpos pos = POS(dev, bucket_nr);
 	struct bucket *g;
-	struct bkey_alloc_buf *a;
+	struct bkey_alloc_buf *a, *old;
 	struct bkey_alloc_unpacked u;
 	u64 *time, now;
-	int ret = 0;
-
-	iter = bch2_trans_get_iter(trans, BTREE_ID_alloc, POS(dev, bucket_nr),
-				   BTREE_ITER_CACHED|
-				   BTREE_ITER_CACHED_NOFILL|
-				   BTREE_ITER_INTENT);
-	ret = bch2_btree_iter_traverse(iter);
-	if (ret)
-		goto out;
+	int ret;
 
-	a = bch2_trans_kmalloc(trans, sizeof(struct bkey_alloc_buf));
-	ret = PTR_ERR_OR_ZERO(a);
+	a	= bch2_trans_kmalloc(trans, sizeof(*a));
+	old	= bch2_trans_kmalloc(trans, sizeof(*old));
+	ret = PTR_ERR_OR_ZERO(a) ?: PTR_ERR_OR_ZERO(old);
 	if (ret)
-		goto out;
+		return ret;
 
 	percpu_down_read(&c->mark_lock);
 	g = bucket(ca, bucket_nr);
-	u = alloc_mem_to_key(iter, g, READ_ONCE(g->mark));
+	u = alloc_mem_to_key(pos, g, READ_ONCE(g->mark));
 	percpu_up_read(&c->mark_lock);
 
 	time = rw == READ ? &u.read_time : &u.write_time;
 	now = atomic64_read(&c->io_clock[rw].now);
 	if (*time == now)
-		goto out;
+		return 0;
+
+	bch2_alloc_pack(c, old, u);
 
 	*time = now;
 
 	bch2_alloc_pack(c, a, u);
-	ret   = bch2_trans_update(trans, iter, &a->k, 0) ?:
+	return  bch2_trans_update_buffered(trans, BTREE_ID_alloc,
+					   &a->k, &old->k, 0) ?:
 		bch2_trans_commit(trans, NULL, NULL, 0);
-out:
-	bch2_trans_iter_put(trans, iter);
-	return ret;
+}
+
+/*
+ * Returns true if the in-memory state of the bucket @k refers to no longer
+ * matches @k, i.e. an alloc update computed from @k would clobber a newer one.
+ *
+ * Must be called with mark_lock held:
+ */
+bool bch2_alloc_key_stale(struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bch_dev *ca = bch_dev_bkey_exists(c, k.k->p.inode);
+	struct bucket *g = bucket(ca, k.k->p.offset);
+
+	return bkey_alloc_unpacked_cmp(bch2_alloc_unpack(k),
+			alloc_mem_to_key(k.k->p, g, READ_ONCE(g->mark)));
 }
 
 /* Background allocator thread: */
@@ -453,6 +468,9 @@ static bool bch2_can_invalidate_bucket(struct bch_dev *ca, size_t b,
 	    test_bit(b, ca->buckets_nouse))
 		return false;
 
+	if (bch2_bucket_nocow_is_locked(&ca->fs->nocow_locks, ca->dev_idx, b))
+		return false;
+
 	gc_gen = bucket_gc_gen(bucket(ca, b));
 
 	ca->inc_gen_needs_gc		+= gc_gen >= BUCKET_GC_GEN_MAX / 2;
@@ -691,33 +709,29 @@ static int bucket_invalidate_btree(struct btree_trans *trans,
 				   struct bch_dev *ca, u64 b)
 {
 	struct bch_fs *c = trans->c;
-	struct bkey_alloc_buf *a;
+	struct bpos pos = POS(ca->dev_idx, b);
+	struct bkey_alloc_buf *a, *old;
 	struct bkey_alloc_unpacked u;
 	struct bucket *g;
 	struct bucket_mark m;
-	struct btree_iter *iter =
-		bch2_trans_get_iter(trans, BTREE_ID_alloc,
-				    POS(ca->dev_idx, b),
-				    BTREE_ITER_CACHED|
-				    BTREE_ITER_CACHED_NOFILL|
-				    BTREE_ITER_INTENT);
 	int ret;
 
-	a = bch2_trans_kmalloc(trans, sizeof(*a));
-	ret = PTR_ERR_OR_ZERO(a);
-	if (ret)
-		goto err;
-
-	ret = bch2_btree_iter_traverse(iter);
+	a	= bch2_trans_kmalloc(trans, sizeof(*a));
+	old	= bch2_trans_kmalloc(trans, sizeof(*old));
+	ret = PTR_ERR_OR_ZERO(a) ?: PTR_ERR_OR_ZERO(old);
 	if (ret)
-		goto err;
+		return ret;
 
 	percpu_down_read(&c->mark_lock);
 	g = bucket(ca, b);
 	m = READ_ONCE(g->mark);
-	u = alloc_mem_to_key(iter, g, m);
+	u = alloc_mem_to_key(pos, g, m);
 	percpu_up_read(&c->mark_lock);
 
+	bch2_alloc_pack(c, old, u);
+
+	u.oldest_gen	= bucket_invalidate_oldest_gen(u.oldest_gen, u.gen,
+						       u.cached_sectors);
 	u.gen++;
 	u.data_type	= 0;
 	u.dirty_sectors	= 0;
@@ -726,11 +740,8 @@ static int bucket_invalidate_btree(struct btree_trans *trans,
 	u.write_time	= atomic64_read(&c->io_clock[WRITE].now);
 
 	bch2_alloc_pack(c, a, u);
-	ret = bch2_trans_update(trans, iter, &a->k,
-				BTREE_TRIGGER_BUCKET_INVALIDATE);
-err:
-	bch2_trans_iter_put(trans, iter);
-	return ret;
+	return bch2_trans_update_buffered(trans, BTREE_ID_alloc, &a->k, &old->k,
+					  BTREE_TRIGGER_BUCKET_INVALIDATE);
 }
 
 static int bch2_invalidate_one_bucket(struct bch_fs *c, struct bch_dev *ca,
@@ -767,7 +778,9 @@ static int bch2_invalidate_one_bucket(struct bch_fs *c, struct bch_dev *ca,
 	if (!m.cached_sectors &&
 	    !bucket_needs_journal_commit(m, c->journal.last_seq_ondisk)) {
 		BUG_ON(m.data_type);
-		bucket_cmpxchg(g, m, m.gen++);
+		m = bucket_cmpxchg(g, m, m.gen++);
+		g->oldest_gen = bucket_invalidate_oldest_gen(g->oldest_gen,
+							     m.gen, 0);
 		percpu_up_read(&c->mark_lock);
 		goto out;
 	}
@@ -1116,15 +1129,19 @@ void bch2_dev_allocator_remove(struct bch_fs *c, struct bch_dev *ca)
 
 	bch2_writepoint_stop(c, ca, &c->copygc_write_point);
 	bch2_writepoint_stop(c, ca, &c->rebalance_write_point);
+	bch2_writepoint_stop(c, ca, &c->defrag_write_point);
 	bch2_writepoint_stop(c, ca, &c->btree_write_point);
 
+	bch2_dev_alloc_caches_drain(c, ca);
+
 	mutex_lock(&c->btree_reserve_cache_lock);
-	while (c->btree_reserve_cache_nr) {
-		struct btree_alloc *a =
-			&c->btree_reserve_cache[--c->btree_reserve_cache_nr];
+	for (i = 0; i < ARRAY_SIZE(c->btree_reserve_cache); i++)
+		while (c->btree_reserve_cache_nr[i]) {
+			struct btree_alloc *a =
+				&c->btree_reserve_cache[i][--c->btree_reserve_cache_nr[i]];
 
-		bch2_open_buckets_put(c, &a->ob);
-	}
+			bch2_open_buckets_put(c, &a->ob);
+		}
 	mutex_unlock(&c->btree_reserve_cache_lock);
 
 	while (1) {
@@ -4,6 +4,7 @@
 
 #include "bcachefs.h"
 #include "alloc_types.h"
+#include "alloc_foreground.h"
 #include "debug.h"
 
 extern const char * const bch2_allocator_states[];
@@ -57,14 +58,15 @@ void bch2_alloc_pack(struct bch_fs *, struct bkey_alloc_buf *,
 		     const struct bkey_alloc_unpacked);
 
 int bch2_bucket_io_time_reset(struct btree_trans *, unsigned, size_t, int);
+bool bch2_alloc_key_stale(struct bch_fs *, struct bkey_s_c);
 
 static inline struct bkey_alloc_unpacked
-alloc_mem_to_key(struct btree_iter *iter,
+alloc_mem_to_key(struct bpos pos,
 		 struct bucket *g, struct bucket_mark m)
 {
 	return (struct bkey_alloc_unpacked) {
-		.dev		= iter->pos.inode,
-		.bucket		= iter->pos.offset,
+		.dev		= pos.inode,
+		.bucket		= pos.offset,
 		.gen		= m.gen,
 		.oldest_gen	= g->oldest_gen,
 		.data_type	= m.data_type,
@@ -117,6 +119,7 @@ static inline void verify_not_on_freelist(struct bch_fs *c, struct bch_dev *ca,
 				BUG_ON(i == bucket);
 		fifo_for_each_entry(i, &ca->free_inc, iter)
 			BUG_ON(i == bucket);
+		BUG_ON(bch2_bucket_in_alloc_caches(c, ca, bucket));
 	}
 }
 
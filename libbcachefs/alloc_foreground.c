@@ -173,6 +173,202 @@ static inline unsigned open_buckets_reserved(enum alloc_reserve reserve)
 	}
 }
 
+/* A successful allocation ends any period of allocations blocking: */
+static void bucket_alloc_unblocked(struct bch_fs *c)
+{
+	lockdep_assert_held(&c->freelist_lock);
+
+	if (c->blocked_allocate_open_bucket) {
+		bch2_time_stats_update(
+			&c->times[BCH_TIME_blocked_allocate_open_bucket],
+			c->blocked_allocate_open_bucket);
+		c->blocked_allocate_open_bucket = 0;
+	}
+
+	if (c->blocked_allocate) {
+		bch2_time_stats_update(
+			&c->times[BCH_TIME_blocked_allocate],
+			c->blocked_allocate);
+		c->blocked_allocate = 0;
+	}
+}
+
+/* Per cpu allocation caches: */
+
+static void alloc_cache_refill(struct bch_fs *c, struct bch_dev *ca,
+			       struct alloc_cache *a,
+			       struct dev_alloc_cache *d)
+{
+	long b;
+
+	lockdep_assert_held(&c->freelist_lock);
+
+	/*
+	 * Only take open_buckets and free buckets that a RESERVE_NONE
+	 * allocation could have used, so that the reserves are never stranded
+	 * in a cache:
+	 */
+	while (a->nr < ALLOC_CACHE_NR &&
+	       c->open_buckets_nr_free > open_buckets_reserved(RESERVE_NONE) &&
+	       atomic_read(&c->alloc_caches_nr_open_buckets) <
+	       ALLOC_CACHES_OPEN_BUCKETS_MAX) {
+		a->open_buckets[a->nr++] =
+			bch2_open_bucket_alloc(c) - c->open_buckets;
+		atomic_inc(&c->alloc_caches_nr_open_buckets);
+	}
+
+	while (d->nr < ALLOC_CACHE_NR &&
+	       fifo_used(&ca->free[RESERVE_NONE]) >
+	       ca->free[RESERVE_NONE].size / 2 &&
+	       fifo_pop(&ca->free[RESERVE_NONE], b)) {
+		d->buckets[d->nr++] = b;
+		ca->nr_open_buckets++;
+	}
+}
+
+static struct open_bucket *bch2_bucket_alloc_cached(struct bch_fs *c,
+						     struct bch_dev *ca)
+{
+	unsigned idx = bch2_alloc_cache_idx();
+	struct alloc_cache *a = c->alloc_caches + idx;
+	struct dev_alloc_cache *d = ca->alloc_caches + idx;
+	struct open_bucket *ob;
+	long b;
+
+	spin_lock(&a->lock);
+	if (likely(a->nr && d->nr))
+		goto got_bucket;
+	spin_unlock(&a->lock);
+
+	/* Lock ordering: freelist_lock, then alloc_cache lock */
+	spin_lock(&c->freelist_lock);
+	spin_lock(&a->lock);
+	alloc_cache_refill(c, ca, a, d);
+	spin_unlock(&c->freelist_lock);
+
+	if (!a->nr || !d->nr) {
+		spin_unlock(&a->lock);
+		return NULL;
+	}
+got_bucket:
+	ob = c->open_buckets + a->open_buckets[--a->nr];
+	b = d->buckets[--d->nr];
+	spin_unlock(&a->lock);
+
+	atomic_dec(&c->alloc_caches_nr_open_buckets);
+
+	spin_lock(&ob->lock);
+
+	ob->valid	= true;
+	ob->sectors_free = ca->mi.bucket_size;
+	ob->alloc_reserve = RESERVE_NONE;
+	ob->ptr		= (struct bch_extent_ptr) {
+		.type	= 1 << BCH_EXTENT_ENTRY_ptr,
+		.gen	= bucket(ca, b)->mark.gen,
+		.offset	= bucket_to_sector(ca, b),
+		.dev	= ca->dev_idx,
+	};
+
+	spin_unlock(&ob->lock);
+
+	if (unlikely(READ_ONCE(c->blocked_allocate) ||
+		     READ_ONCE(c->blocked_allocate_open_bucket))) {
+		spin_lock(&c->freelist_lock);
+		bucket_alloc_unblocked(c);
+		spin_unlock(&c->freelist_lock);
+	}
+
+	bch2_wake_allocator(ca);
+
+	trace_bucket_alloc(ca, RESERVE_NONE);
+	return ob;
+}
+
+/*
+ * Before a slow path allocation blocks, take back the open_buckets and buckets
+ * sitting in the caches - otherwise ones cached by cpus that have gone idle
+ * would never be used:
+ */
+static void alloc_caches_steal(struct bch_fs *c, struct bch_dev *ca)
+{
+	unsigned i;
+
+	lockdep_assert_held(&c->freelist_lock);
+
+	for (i = 0; i < BCH_ALLOC_CACHES_NR; i++) {
+		struct alloc_cache *a = c->alloc_caches + i;
+		struct dev_alloc_cache *d = ca->alloc_caches + i;
+
+		spin_lock(&a->lock);
+		while (a->nr) {
+			struct open_bucket *ob =
+				c->open_buckets + a->open_buckets[--a->nr];
+
+			ob->freelist = c->open_buckets_freelist;
+			c->open_buckets_freelist = ob - c->open_buckets;
+			c->open_buckets_nr_free++;
+			atomic_dec(&c->alloc_caches_nr_open_buckets);
+		}
+
+		while (d->nr &&
+		       fifo_push(&ca->free[RESERVE_NONE], d->buckets[d->nr - 1])) {
+			d->nr--;
+			ca->nr_open_buckets--;
+		}
+		spin_unlock(&a->lock);
+	}
+}
+
+/*
+ * Called when a device is going read-only: buckets in the alloc caches are
+ * released the same way as an unused open_bucket, so the allocator will find
+ * and invalidate them again:
+ */
+void bch2_dev_alloc_caches_drain(struct bch_fs *c, struct bch_dev *ca)
+{
+	long buckets[ALLOC_CACHE_NR];
+	unsigned i, j, nr;
+
+	for (i = 0; i < BCH_ALLOC_CACHES_NR; i++) {
+		spin_lock(&c->alloc_caches[i].lock);
+		nr = ca->alloc_caches[i].nr;
+		memcpy(buckets, ca->alloc_caches[i].buckets,
+		       nr * sizeof(buckets[0]));
+		ca->alloc_caches[i].nr = 0;
+		spin_unlock(&c->alloc_caches[i].lock);
+
+		if (!nr)
+			continue;
+
+		percpu_down_read(&c->mark_lock);
+		for (j = 0; j < nr; j++)
+			bch2_mark_alloc_bucket(c, ca, buckets[j], false);
+		percpu_up_read(&c->mark_lock);
+
+		spin_lock(&c->freelist_lock);
+		ca->nr_open_buckets -= nr;
+		spin_unlock(&c->freelist_lock);
+	}
+
+	closure_wake_up(&c->freelist_wait);
+}
+
+bool bch2_bucket_in_alloc_caches(struct bch_fs *c, struct bch_dev *ca,
+				 size_t bucket)
+{
+	unsigned i, j;
+	bool ret = false;
+
+	for (i = 0; i < BCH_ALLOC_CACHES_NR && !ret; i++) {
+		spin_lock(&c->alloc_caches[i].lock);
+		for (j = 0; j < ca->alloc_caches[i].nr; j++)
+			ret |= ca->alloc_caches[i].buckets[j] == bucket;
+		spin_unlock(&c->alloc_caches[i].lock);
+	}
+
+	return ret;
+}
+
 /**
  * bch_bucket_alloc - allocate a single bucket from a specific device
  *
@@ -186,6 +382,13 @@ struct open_bucket *bch2_bucket_alloc(struct bch_fs *c, struct bch_dev *ca,
 	struct open_bucket *ob;
 	long b = 0;
 
+	if (reserve == RESERVE_NONE &&
+	    !(may_alloc_partial && READ_ONCE(ca->open_buckets_partial_nr))) {
+		ob = bch2_bucket_alloc_cached(c, ca);
+		if (ob)
+			return ob;
+	}
+
 	spin_lock(&c->freelist_lock);
 
 	if (may_alloc_partial) {
@@ -206,6 +409,9 @@ struct open_bucket *bch2_bucket_alloc(struct bch_fs *c, struct bch_dev *ca,
 		}
 	}
 
+	if (unlikely(c->open_buckets_nr_free <= open_buckets_reserved(reserve)))
+		alloc_caches_steal(c, ca);
+
 	if (unlikely(c->open_buckets_nr_free <= open_buckets_reserved(reserve))) {
 		if (cl)
 			closure_wait(&c->open_buckets_wait, cl);
@@ -231,6 +437,10 @@ struct open_bucket *bch2_bucket_alloc(struct bch_fs *c, struct bch_dev *ca,
 		break;
 	}
 
+	alloc_caches_steal(c, ca);
+	if (fifo_pop(&ca->free[RESERVE_NONE], b))
+		goto out;
+
 	if (cl)
 		closure_wait(&c->freelist_wait, cl);
 
@@ -260,19 +470,7 @@ out:
 
 	spin_unlock(&ob->lock);
 
-	if (c->blocked_allocate_open_bucket) {
-		bch2_time_stats_update(
-			&c->times[BCH_TIME_blocked_allocate_open_bucket],
-			c->blocked_allocate_open_bucket);
-		c->blocked_allocate_open_bucket = 0;
-	}
-
-	if (c->blocked_allocate) {
-		bch2_time_stats_update(
-			&c->times[BCH_TIME_blocked_allocate],
-			c->blocked_allocate);
-		c->blocked_allocate = 0;
-	}
+	bucket_alloc_unblocked(c);
 
 	ca->nr_open_buckets++;
 	spin_unlock(&c->freelist_lock);
@@ -924,6 +1122,26 @@ static inline void writepoint_init(struct write_point *wp,
 	wp->type = type;
 }
 
+void bch2_fs_alloc_caches_exit(struct bch_fs *c)
+{
+	kfree(c->alloc_caches);
+}
+
+int bch2_fs_alloc_caches_init(struct bch_fs *c)
+{
+	unsigned i;
+
+	c->alloc_caches = kcalloc(BCH_ALLOC_CACHES_NR,
+				  sizeof(*c->alloc_caches), GFP_KERNEL);
+	if (!c->alloc_caches)
+		return -ENOMEM;
+
+	for (i = 0; i < BCH_ALLOC_CACHES_NR; i++)
+		spin_lock_init(&c->alloc_caches[i].lock);
+
+	return 0;
+}
+
 void bch2_fs_allocator_foreground_init(struct bch_fs *c)
 {
 	struct open_bucket *ob;
@@ -947,6 +1165,7 @@ void bch2_fs_allocator_foreground_init(struct bch_fs *c)
 	writepoint_init(&c->btree_write_point,		BCH_DATA_btree);
 	writepoint_init(&c->rebalance_write_point,	BCH_DATA_user);
 	writepoint_init(&c->copygc_write_point,		BCH_DATA_user);
+	writepoint_init(&c->defrag_write_point,		BCH_DATA_user);
 
 	for (wp = c->write_points;
 	     wp < c->write_points + c->write_points_nr; wp++) {
@@ -29,6 +29,17 @@ struct dev_alloc_list bch2_dev_alloc_list(struct bch_fs *,
 					  struct bch_devs_mask *);
 void bch2_dev_stripe_increment(struct bch_dev *, struct dev_stripe_state *);
 
+#ifdef __KERNEL__
+#define BCH_ALLOC_CACHES_NR	nr_cpu_ids
+#define bch2_alloc_cache_idx()	raw_smp_processor_id()
+#else
+#define BCH_ALLOC_CACHES_NR	16U
+#define bch2_alloc_cache_idx()	hash_ptr(current, ilog2(BCH_ALLOC_CACHES_NR))
+#endif
+
+void bch2_dev_alloc_caches_drain(struct bch_fs *, struct bch_dev *);
+bool bch2_bucket_in_alloc_caches(struct bch_fs *, struct bch_dev *, size_t);
+
 long bch2_bucket_alloc_new_fs(struct bch_dev *);
 
 struct open_bucket *bch2_bucket_alloc(struct bch_fs *, struct bch_dev *,
@@ -133,6 +144,8 @@ static inline struct write_point_specifier writepoint_ptr(struct write_point *wp
 	return (struct write_point_specifier) { .v = (unsigned long) wp };
 }
 
+void bch2_fs_alloc_caches_exit(struct bch_fs *);
+int bch2_fs_alloc_caches_init(struct bch_fs *);
 void bch2_fs_allocator_foreground_init(struct bch_fs *);
 
 #endif /* _BCACHEFS_ALLOC_FOREGROUND_H */
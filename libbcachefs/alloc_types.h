@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_ALLOC_TYPES_H
 #define _BCACHEFS_ALLOC_TYPES_H
 
+#include <linux/cache.h>
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
 
@@ -65,6 +66,35 @@ struct open_buckets {
 	open_bucket_idx_t	v[OPEN_BUCKET_LIST_MAX];
 };
 
+/*
+ * bch2_bucket_alloc() keeps small per cpu caches (per thread in userspace,
+ * where we don't have real percpu variables) of open_bucket slots and free
+ * buckets, refilled in batches from the global freelists, so that
+ * RESERVE_NONE allocations don't have to take c->freelist_lock each time.
+ *
+ * Cached buckets are marked owned_by_allocator and counted in
+ * ca->nr_open_buckets, same as buckets that have an open_bucket:
+ */
+#define ALLOC_CACHE_NR		8
+
+/*
+ * Bound on the open_buckets held by all the caches together, so that with many
+ * cpus they don't take every open_bucket a RESERVE_NONE allocation could use:
+ */
+#define ALLOC_CACHES_OPEN_BUCKETS_MAX	(OPEN_BUCKETS_COUNT / 8)
+
+struct alloc_cache {
+	spinlock_t		lock;
+	unsigned		nr;
+	open_bucket_idx_t	open_buckets[ALLOC_CACHE_NR];
+} ____cacheline_aligned_in_smp;
+
+/* Protected by the corresponding struct alloc_cache's lock: */
+struct dev_alloc_cache {
+	unsigned		nr;
+	long			buckets[ALLOC_CACHE_NR];
+};
+
 struct dev_stripe_state {
 	u64			next_alloc[BCH_SB_MEMBERS_MAX];
 };
@@ -333,7 +333,8 @@ BCH_DEBUG_PARAMS_DEBUG()
 	x(journal_flush_seq)			\
 	x(blocked_journal)			\
 	x(blocked_allocate)			\
-	x(blocked_allocate_open_bucket)
+	x(blocked_allocate_open_bucket)		\
+	x(blocked_btree_reserve)
 
 enum bch_time_stats {
 #define x(name) BCH_TIME_##name,
@@ -365,6 +366,9 @@ enum bch_time_stats {
 
 #define BTREE_NODE_OPEN_BUCKET_RESERVE	(BTREE_RESERVE_MAX * BCH_REPLICAS_MAX)
 
+/* Size of each of the leaf/interior btree node reserve caches: */
+#define BTREE_RESERVE_CACHE_NR	BTREE_NODE_RESERVE
+
 struct btree;
 
 enum gc_phase {
@@ -398,6 +402,25 @@ struct reflink_gc {
 
 typedef GENRADIX(struct reflink_gc) reflink_gc_table;
 
+struct reflink_free_range {
+	u64		start;
+	u64		end;
+};
+
+/*
+ * Free space in the reflink btree: free ranges below @end, sorted both by start
+ * and by size; everything from @end on is free:
+ */
+struct reflink_free_index {
+	struct mutex			lock;
+	bool				valid;
+	u64				end;
+	size_t				nr;
+	size_t				size;
+	struct reflink_free_range	*by_start;
+	struct reflink_free_range	*by_size;
+};
+
 struct io_count {
 	u64			sectors[2][BCH_DATA_NR];
 };
@@ -462,6 +485,8 @@ struct bch_dev {
 	open_bucket_idx_t	open_buckets_partial[OPEN_BUCKETS_COUNT];
 	open_bucket_idx_t	open_buckets_partial_nr;
 
+	struct dev_alloc_cache	*alloc_caches;
+
 	size_t			fifo_last_bucket;
 
 	size_t			inc_gen_needs_gc;
@@ -557,10 +582,18 @@ struct journal_keys {
 	u64			journal_seq_base;
 };
 
-struct btree_iter_buf {
+/*
+ * Iterator arrays and transaction memory, cached across bch2_trans_exit() and
+ * bch2_trans_init():
+ */
+struct btree_trans_buf {
 	struct btree_iter	*iter;
+	void			*mem;
 };
 
+/* Userspace doesn't have real percpu variables, it uses an array of these: */
+#define BTREE_TRANS_BUFS_NR	32
+
 #define REPLICAS_DELTA_LIST_MAX	(1U << 16)
 
 struct bch_fs {
@@ -634,6 +667,17 @@ struct bch_fs {
 	struct closure		sb_write;
 	struct mutex		sb_lock;
 
+	/*
+	 * Superblock changes that haven't been written yet: a write covers
+	 * every change made before it started, so changes made while a write
+	 * is in flight are batched into the next one
+	 */
+	u64			sb_seq_changed;
+	u64			sb_seq_written;
+	u64			sb_nr_writes;
+	int			sb_write_ret;
+	struct work_struct	sb_write_work;
+
 	/* BTREE CACHE */
 	struct bio_set		btree_bio;
 	struct workqueue_struct	*io_complete_wq;
@@ -648,11 +692,17 @@ struct bch_fs {
 	 * don't use it, if we free it that space can't be reused until going
 	 * _all_ the way through the allocator (which exposes us to a livelock
 	 * when allocating btree reserves fail halfway through) - instead, we
-	 * can stick them here:
+	 * can stick them here.
+	 *
+	 * Leaf and interior nodes are cached separately, indexed by !!level;
+	 * btree_reserve_cache_work keeps both topped up so that splits normally
+	 * don't have to wait on the allocator:
 	 */
-	struct btree_alloc	btree_reserve_cache[BTREE_NODE_RESERVE * 2];
-	unsigned		btree_reserve_cache_nr;
+	struct btree_alloc	btree_reserve_cache[2][BTREE_RESERVE_CACHE_NR];
+	unsigned		btree_reserve_cache_nr[2];
 	struct mutex		btree_reserve_cache_lock;
+	struct work_struct	btree_reserve_cache_work;
+	u64			blocked_btree_reserve;
 
 	mempool_t		btree_interior_update_pool;
 	struct list_head	btree_interior_update_list;
@@ -668,11 +718,12 @@ struct bch_fs {
 	struct list_head	btree_trans_list;
 	mempool_t		btree_iters_pool;
 	mempool_t		btree_trans_mem_pool;
-	struct btree_iter_buf  __percpu	*btree_iters_bufs;
+	struct btree_trans_buf __percpu	*btree_trans_bufs;
 
 	struct srcu_struct	btree_trans_barrier;
 
 	struct btree_key_cache	btree_key_cache;
+	struct btree_write_buffer btree_write_buffer;
 
 	struct workqueue_struct	*btree_update_wq;
 	struct workqueue_struct	*btree_error_wq;
@@ -724,10 +775,14 @@ struct bch_fs {
 	open_bucket_idx_t	open_buckets_freelist;
 	open_bucket_idx_t	open_buckets_nr_free;
 	struct closure_waitlist	open_buckets_wait;
+	struct alloc_cache	*alloc_caches;
+	atomic_t		alloc_caches_nr_open_buckets;
 	struct open_bucket	open_buckets[OPEN_BUCKETS_COUNT];
 
 	struct write_point	btree_write_point;
 	struct write_point	rebalance_write_point;
+	/* for rewriting files contiguously: */
+	struct write_point	defrag_write_point;
 
 	struct write_point	write_points[WRITE_POINT_MAX];
 	struct hlist_head	write_points_hash[WRITE_POINT_HASH_NR];
@@ -768,15 +823,20 @@ struct bch_fs {
 	struct mutex		bio_bounce_pages_lock;
 	mempool_t		bio_bounce_pages;
 	struct rhashtable	promote_table;
+	struct bucket_nocow_lock_table nocow_locks;
 
 	mempool_t		compression_bounce[2];
 	mempool_t		compress_workspace[BCH_COMPRESSION_TYPE_NR];
 	mempool_t		decompress_workspace;
 	ZSTD_parameters		zstd_params;
+	struct zstd_dict	*zstd_dicts;
+	unsigned		nr_zstd_dicts;
 
 	struct crypto_shash	*sha256;
 	struct crypto_sync_skcipher *chacha20;
 	struct crypto_shash	*poly1305;
+	struct crypto_sync_skcipher *aes256;
+	struct crypto_shash	*ghash;
 
 	atomic64_t		key_version;
 
@@ -814,6 +874,7 @@ struct bch_fs {
 
 	/* REFLINK */
 	u64			reflink_hint;
+	struct reflink_free_index reflink_free;
 	reflink_gc_table	reflink_gc_table;
 	size_t			reflink_gc_nr;
 	size_t			reflink_gc_idx;
@@ -837,6 +898,7 @@ struct bch_fs {
 
 	/* QUOTAS */
 	struct bch_memquota_type quotas[QTYP_NR];
+	struct quota_pcpu __percpu *quotas_pcpu;
 
 	/* DEBUG JUNK */
 	struct dentry		*debug;
@@ -845,7 +907,7 @@ struct bch_fs {
 	struct btree_node	*verify_ondisk;
 	struct mutex		verify_lock;
 
-	u64			*unused_inode_hints;
+	struct inode_alloc_shard *inode_alloc_shards;
 	unsigned		inode_shard_bits;
 
 	/*
@@ -708,7 +708,10 @@ struct bch_inode_generation {
 	x(bi_erasure_code,		16)	\
 	x(bi_fields_set,		16)	\
 	x(bi_dir,			64)	\
-	x(bi_dir_offset,		64)
+	x(bi_dir_offset,		64)	\
+	x(bi_csum_granularity,		16)	\
+	x(bi_compression_dict,		16)	\
+	x(bi_nocow,			8)
 
 /* subset of BCH_INODE_FIELDS */
 #define BCH_INODE_OPTS()			\
@@ -720,7 +723,10 @@ struct bch_inode_generation {
 	x(promote_target,		16)	\
 	x(foreground_target,		16)	\
 	x(background_target,		16)	\
-	x(erasure_code,			16)
+	x(erasure_code,			16)	\
+	x(csum_granularity,		16)	\
+	x(compression_dict,		16)	\
+	x(nocow,			8)
 
 enum inode_opt_id {
 #define x(name, ...)				\
@@ -944,7 +950,9 @@ struct bch_sb_field {
 	x(disk_groups,	5)	\
 	x(clean,	6)	\
 	x(replicas,	7)	\
-	x(journal_seq_blacklist, 8)
+	x(journal_seq_blacklist, 8)	\
+	x(zstd_dicts,	9)	\
+	x(import,	10)
 
 enum bch_sb_field_type {
 #define x(f, nr)	BCH_SB_FIELD_##f = nr,
@@ -1192,6 +1200,42 @@ struct bch_sb_field_journal_seq_blacklist {
 	};
 };
 
+/* BCH_SB_FIELD_zstd_dicts: */
+
+/*
+ * Trained zstd dictionaries, for compressing small files: the id is also the
+ * dictionary id in the zstd dictionary header, which zstd records in every
+ * frame compressed with it - so extents don't need to store it separately.
+ */
+struct bch_zstd_dict {
+	__le32			id;
+	__le32			len;	/* bytes, not including padding */
+	__u8			data[0];
+} __attribute__((packed, aligned(8)));
+
+struct bch_sb_field_zstd_dicts {
+	struct bch_sb_field	field;
+
+	union {
+		struct bch_zstd_dict start[0];
+		__u64		_data[0];
+	};
+};
+
+/* BCH_SB_FIELD_import: */
+
+/*
+ * Set on a replica by bcachefs import: the user uuid of the filesystem it's a
+ * replica of, and the token of the last export stream applied to it, which the
+ * next incremental stream must continue from.
+ */
+struct bch_sb_field_import {
+	struct bch_sb_field	field;
+	__u8			uuid[16];
+	__le64			seq;
+	__le64			keyver;
+};
+
 /* Superblock: */
 
 /*
@@ -1286,7 +1330,7 @@ struct bch_sb {
  * BCH_SB_128_BIT_MACS	- 128 bit macs instead of 80
  * BCH_SB_ENCRYPTION_TYPE - if nonzero encryption is enabled; overrides
  *			   DATA/META_CSUM_TYPE. Also indicates encryption
- *			   algorithm in use, if/when we get more than one
+ *			   algorithm in use (enum bch_encryption_type)
  */
 
 LE16_BITMASK(BCH_SB_BLOCK_SIZE,		struct bch_sb, block_size, 0, 16);
@@ -1345,6 +1389,14 @@ LE64_BITMASK(BCH_SB_GC_RESERVE_BYTES,	struct bch_sb, flags[2],  4, 64);
 LE64_BITMASK(BCH_SB_ERASURE_CODE,	struct bch_sb, flags[3],  0, 16);
 LE64_BITMASK(BCH_SB_METADATA_TARGET,	struct bch_sb, flags[3], 16, 28);
 LE64_BITMASK(BCH_SB_SHARD_INUMS,	struct bch_sb, flags[3], 28, 29);
+LE64_BITMASK(BCH_SB_CSUM_GRANULARITY,	struct bch_sb, flags[3], 29, 45);
+
+LE64_BITMASK(BCH_SB_BACKGROUND_MIN_AGE,	struct bch_sb, flags[4],  0, 32);
+LE64_BITMASK(BCH_SB_FOREGROUND_WATERMARK,
+					struct bch_sb, flags[4], 32, 39);
+LE64_BITMASK(BCH_SB_TRACK_CHANGES,	struct bch_sb, flags[4], 39, 40);
+LE64_BITMASK(BCH_SB_COMPRESSION_DICT,	struct bch_sb, flags[4], 40, 56);
+LE64_BITMASK(BCH_SB_NOCOW,		struct bch_sb, flags[4], 56, 57);
 
 /*
  * Features:
@@ -1354,6 +1406,8 @@ LE64_BITMASK(BCH_SB_SHARD_INUMS,	struct bch_sb, flags[3], 28, 29);
  * inline_data:			gates KEY_TYPE_inline_data
  * new_siphash:			gates BCH_STR_HASH_SIPHASH
  * new_extent_overwrite:	gates BTREE_NODE_NEW_EXTENT_OVERWRITE
+ * aes256_gcm:			gates BCH_ENCRYPTION_aes256_gcm
+ * zstd_dict:			gates zstd extents compressed with a dictionary
  */
 #define BCH_SB_FEATURES()			\
 	x(lz4,				0)	\
@@ -1374,7 +1428,9 @@ LE64_BITMASK(BCH_SB_SHARD_INUMS,	struct bch_sb, flags[3], 28, 29);
 	x(new_varint,			15)	\
 	x(journal_no_flush,		16)	\
 	x(alloc_v2,			17)	\
-	x(extents_across_btree_nodes,	18)
+	x(extents_across_btree_nodes,	18)	\
+	x(aes256_gcm,			19)	\
+	x(zstd_dict,			20)
 
 #define BCH_SB_FEATURES_ALWAYS				\
 	((1ULL << BCH_FEATURE_new_extent_overwrite)|	\
@@ -1456,7 +1512,9 @@ enum bch_csum_type {
 	BCH_CSUM_CHACHA20_POLY1305_128	= 4,
 	BCH_CSUM_CRC32C			= 5,
 	BCH_CSUM_CRC64			= 6,
-	BCH_CSUM_NR			= 7,
+	BCH_CSUM_AES256_GCM_80		= 7,
+	BCH_CSUM_AES256_GCM_128		= 8,
+	BCH_CSUM_NR			= 9,
 };
 
 static const unsigned bch_crc_bytes[] = {
@@ -1467,6 +1525,8 @@ static const unsigned bch_crc_bytes[] = {
 	[BCH_CSUM_CRC64]			= 8,
 	[BCH_CSUM_CHACHA20_POLY1305_80]		= 10,
 	[BCH_CSUM_CHACHA20_POLY1305_128]	= 16,
+	[BCH_CSUM_AES256_GCM_80]		= 10,
+	[BCH_CSUM_AES256_GCM_128]		= 16,
 };
 
 static inline _Bool bch2_csum_type_is_encryption(enum bch_csum_type type)
@@ -1474,12 +1534,37 @@ static inline _Bool bch2_csum_type_is_encryption(enum bch_csum_type type)
 	switch (type) {
 	case BCH_CSUM_CHACHA20_POLY1305_80:
 	case BCH_CSUM_CHACHA20_POLY1305_128:
+	case BCH_CSUM_AES256_GCM_80:
+	case BCH_CSUM_AES256_GCM_128:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline _Bool bch2_csum_type_is_aes(enum bch_csum_type type)
+{
+	switch (type) {
+	case BCH_CSUM_AES256_GCM_80:
+	case BCH_CSUM_AES256_GCM_128:
 		return true;
 	default:
 		return false;
 	}
 }
 
+#define BCH_ENCRYPTION_TYPES()		\
+	x(none,			0)	\
+	x(chacha20_poly1305,	1)	\
+	x(aes256_gcm,		2)
+
+enum bch_encryption_type {
+#define x(t, n) BCH_ENCRYPTION_##t = n,
+	BCH_ENCRYPTION_TYPES()
+#undef x
+	BCH_ENCRYPTION_NR
+};
+
 #define BCH_CSUM_OPTS()			\
 	x(none,			0)	\
 	x(crc32c,		1)	\
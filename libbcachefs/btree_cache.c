@@ -614,6 +614,46 @@ err:
 	return ERR_PTR(-ENOMEM);
 }
 
+/*
+ * Make sure there's at least @nr nodes with buffers on the freeable list, so
+ * that bch2_btree_node_mem_alloc() can be satisfied without allocating or
+ * cannibalizing; called from the btree node reserve refill worker:
+ */
+void bch2_btree_cache_prefill(struct bch_fs *c, unsigned nr)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	struct btree *b;
+	unsigned flags, have = 0;
+
+	flags = memalloc_nofs_save();
+	mutex_lock(&bc->lock);
+
+	list_for_each_entry(b, &bc->freeable, list)
+		if (++have >= nr)
+			break;
+
+	while (have < nr) {
+		mutex_unlock(&bc->lock);
+
+		b = __btree_node_mem_alloc(c);
+		if (b && btree_node_data_alloc(c, b, __GFP_NOWARN|GFP_KERNEL)) {
+			kfree(b);
+			b = NULL;
+		}
+
+		mutex_lock(&bc->lock);
+		if (!b)
+			break;
+
+		bc->used++;
+		list_add(&b->list, &bc->freeable);
+		have++;
+	}
+
+	mutex_unlock(&bc->lock);
+	memalloc_nofs_restore(flags);
+}
+
 /* Slowpath, don't want it inlined into btree_iter_traverse() */
 static noinline struct btree *bch2_btree_node_fill(struct bch_fs *c,
 				struct btree_iter *iter,
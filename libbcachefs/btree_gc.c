@@ -1742,13 +1742,53 @@ static int bch2_gc_btree_gens(struct bch_fs *c, enum btree_id btree_id)
 	return ret;
 }
 
+/*
+ * Buckets whose gc_gen is below this don't need their oldest_gen recalculated
+ * yet:
+ */
+#define GC_GENS_THRESHOLD	(BUCKET_GC_GEN_MAX / 4)
+
+/*
+ * Since oldest_gen follows gen when buckets without cached data are
+ * invalidated (bucket_invalidate_oldest_gen()), only buckets that had cached
+ * data invalidated accumulate a gc_gen: check for those before doing a full
+ * walk of the btrees:
+ */
+static bool bch2_gc_gens_needed(struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	struct bucket_array *buckets;
+	struct bucket *g;
+	unsigned i;
+	bool ret = false;
+
+	for_each_member_device(ca, c, i) {
+		down_read(&ca->bucket_lock);
+		buckets = bucket_array(ca);
+
+		for_each_bucket(g, buckets)
+			if (bucket_gc_gen(g) >= GC_GENS_THRESHOLD) {
+				ret = true;
+				break;
+			}
+		up_read(&ca->bucket_lock);
+
+		if (ret) {
+			percpu_ref_put(&ca->ref);
+			break;
+		}
+	}
+
+	return ret;
+}
+
 int bch2_gc_gens(struct bch_fs *c)
 {
 	struct bch_dev *ca;
 	struct bucket_array *buckets;
 	struct bucket *g;
 	unsigned i;
-	int ret;
+	int ret = 0;
 
 	/*
 	 * Ideally we would be using state_lock and not gc_lock here, but that
@@ -1757,6 +1797,9 @@ int bch2_gc_gens(struct bch_fs *c)
 	 */
 	down_read(&c->gc_lock);
 
+	if (!bch2_gc_gens_needed(c))
+		goto out;
+
 	for_each_member_device(ca, c, i) {
 		down_read(&ca->bucket_lock);
 		buckets = bucket_array(ca);
@@ -1788,7 +1831,7 @@ int bch2_gc_gens(struct bch_fs *c)
 
 	c->gc_gens_btree	= 0;
 	c->gc_gens_pos		= POS_MIN;
-
+out:
 	c->gc_count++;
 err:
 	up_read(&c->gc_lock);
@@ -338,7 +338,8 @@ void bch2_btree_sort_into(struct bch_fs *c,
 {
 	struct btree_nr_keys nr;
 	struct btree_node_iter src_iter;
-	u64 start_time = local_clock();
+	struct bset_tree *t;
+	u64 start_time = local_clock(), seq;
 
 	BUG_ON(dst->nsets != 1);
 
@@ -362,6 +363,12 @@ void bch2_btree_sort_into(struct bch_fs *c,
 
 	set_btree_bset_end(dst, dst->set);
 
+	/* Make sure we preserve bset journal_seq: */
+	seq = le64_to_cpu(btree_bset_first(dst)->journal_seq);
+	for_each_bset(src, t)
+		seq = max(seq, le64_to_cpu(bset(src, t)->journal_seq));
+	btree_bset_first(dst)->journal_seq = cpu_to_le64(seq);
+
 	dst->nr.live_u64s	+= nr.live_u64s;
 	dst->nr.bset_u64s[0]	+= nr.bset_u64s[0];
 	dst->nr.packed_keys	+= nr.packed_keys;
@@ -620,7 +627,7 @@ static int validate_bset(struct bch_fs *c, struct bch_dev *ca,
 			 version, c->sb.version_min)) {
 		mutex_lock(&c->sb_lock);
 		c->disk_sb.sb->version_min = cpu_to_le16(version);
-		bch2_write_super(c);
+		bch2_write_super_async(c);
 		mutex_unlock(&c->sb_lock);
 	}
 
@@ -630,7 +637,7 @@ static int validate_bset(struct bch_fs *c, struct bch_dev *ca,
 			 version, c->sb.version)) {
 		mutex_lock(&c->sb_lock);
 		c->disk_sb.sb->version = cpu_to_le16(version);
-		bch2_write_super(c);
+		bch2_write_super_async(c);
 		mutex_unlock(&c->sb_lock);
 	}
 
@@ -816,6 +823,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 		BTREE_PTR_RANGE_UPDATED(&bkey_i_to_btree_ptr_v2(&b->key)->v);
 	unsigned u64s;
 	unsigned nonblacklisted_written = 0;
+	u64 journal_seq = 0;
 	int ret, retry_read = 0, write = READ;
 
 	b->version_ondisk = U16_MAX;
@@ -929,6 +937,8 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 		if (blacklisted && !first)
 			continue;
 
+		journal_seq = max(journal_seq, le64_to_cpu(i->journal_seq));
+
 		sort_iter_add(iter, i->start,
 			      vstruct_idx(i, whiteout_u64s));
 
@@ -970,6 +980,8 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 	u64s = le16_to_cpu(sorted->keys.u64s);
 	*sorted = *b->data;
 	sorted->keys.u64s = cpu_to_le16(u64s);
+	/* the bsets were sorted together, keep the newest journal_seq: */
+	sorted->keys.journal_seq = cpu_to_le64(journal_seq);
 	swap(sorted, b->data);
 	set_btree_bset(b, b->set, &b->data->keys);
 	b->nsets = 1;
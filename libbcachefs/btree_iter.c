@@ -14,6 +14,7 @@
 #include "journal.h"
 #include "replicas.h"
 
+#include <linux/hash.h>
 #include <linux/prefetch.h>
 #include <trace/events/bcachefs.h>
 
@@ -2240,6 +2241,50 @@ struct btree_iter *__bch2_trans_copy_iter(struct btree_trans *trans,
 	return iter;
 }
 
+/*
+ * Iterator arrays and transaction memory are cached across bch2_trans_exit()
+ * and bch2_trans_init(), so that in steady state starting a transaction doesn't
+ * allocate.
+ *
+ * Userspace doesn't have a real percpu implementation: there we use a small
+ * array of slots instead, starting from a slot picked by the current thread so
+ * that threads mostly get back the buffers they last used:
+ */
+#ifdef __KERNEL__
+#define btree_trans_buf_get(_c, _field)					\
+	this_cpu_xchg((_c)->btree_trans_bufs->_field, NULL)
+#define btree_trans_buf_put(_c, _field, _p)				\
+	this_cpu_xchg((_c)->btree_trans_bufs->_field, (_p))
+#else
+#define btree_trans_buf_slot(_i)					\
+	((hash_ptr(current, ilog2(BTREE_TRANS_BUFS_NR)) + (_i)) %	\
+	 BTREE_TRANS_BUFS_NR)
+
+#define btree_trans_buf_get(_c, _field)					\
+({									\
+	typeof((_c)->btree_trans_bufs->_field) _p = NULL;		\
+	unsigned _i;							\
+									\
+	for (_i = 0; _i < BTREE_TRANS_BUFS_NR && !_p; _i++)		\
+		_p = xchg(&(_c)->btree_trans_bufs[btree_trans_buf_slot(_i)]._field,\
+			  NULL);					\
+	_p;								\
+})
+
+/* Returns the buffer that didn't fit in the cache, if any: */
+#define btree_trans_buf_put(_c, _field, _new)				\
+({									\
+	typeof((_c)->btree_trans_bufs->_field) _p = (_new);		\
+	unsigned _i;							\
+									\
+	for (_i = 0; _i < BTREE_TRANS_BUFS_NR && _p; _i++)		\
+		if (!cmpxchg(&(_c)->btree_trans_bufs[btree_trans_buf_slot(_i)]._field,\
+			     NULL, _p))					\
+			_p = NULL;					\
+	_p;								\
+})
+#endif
+
 void *bch2_trans_kmalloc(struct btree_trans *trans, size_t size)
 {
 	size_t new_top = trans->mem_top + size;
@@ -2252,7 +2297,14 @@ void *bch2_trans_kmalloc(struct btree_trans *trans, size_t size)
 
 		WARN_ON_ONCE(new_bytes > BTREE_TRANS_MEM_MAX);
 
-		new_mem = krealloc(trans->mem, new_bytes, GFP_NOFS);
+		new_mem = !old_bytes && new_bytes <= BTREE_TRANS_MEM_MAX
+			? btree_trans_buf_get(trans->c, mem)
+			: NULL;
+		if (new_mem)
+			new_bytes = BTREE_TRANS_MEM_MAX;
+		else
+			new_mem = krealloc(trans->mem, new_bytes, GFP_NOFS);
+
 		if (!new_mem && new_bytes <= BTREE_TRANS_MEM_MAX) {
 			new_mem = mempool_alloc(&trans->c->btree_trans_mem_pool, GFP_KERNEL);
 			new_bytes = BTREE_TRANS_MEM_MAX;
@@ -2307,6 +2359,7 @@ void bch2_trans_reset(struct btree_trans *trans, unsigned flags)
 
 	trans->extra_journal_res	= 0;
 	trans->nr_updates		= 0;
+	trans->nr_wb_updates		= 0;
 	trans->mem_top			= 0;
 
 	trans->hooks			= NULL;
@@ -2332,18 +2385,18 @@ static void bch2_trans_alloc_iters(struct btree_trans *trans, struct bch_fs *c)
 {
 	size_t iters_bytes	= sizeof(struct btree_iter) * BTREE_ITER_MAX;
 	size_t updates_bytes	= sizeof(struct btree_insert_entry) * BTREE_ITER_MAX;
+	size_t wb_updates_bytes	= sizeof(struct btree_write_buffered_update) * BTREE_ITER_MAX;
 	void *p = NULL;
 
 	BUG_ON(trans->used_mempool);
 
-#ifdef __KERNEL__
-	p = this_cpu_xchg(c->btree_iters_bufs->iter, NULL);
-#endif
+	p = btree_trans_buf_get(c, iter);
 	if (!p)
 		p = mempool_alloc(&trans->c->btree_iters_pool, GFP_NOFS);
 
 	trans->iters		= p; p += iters_bytes;
 	trans->updates		= p; p += updates_bytes;
+	trans->wb_updates	= p; p += wb_updates_bytes;
 }
 
 void bch2_trans_init(struct btree_trans *trans, struct bch_fs *c,
@@ -2361,7 +2414,10 @@ void bch2_trans_init(struct btree_trans *trans, struct bch_fs *c,
 	 */
 	bch2_trans_alloc_iters(trans, c);
 
-	if (expected_mem_bytes) {
+	if (expected_mem_bytes <= BTREE_TRANS_MEM_MAX &&
+	    (trans->mem = btree_trans_buf_get(c, mem))) {
+		trans->mem_bytes = BTREE_TRANS_MEM_MAX;
+	} else if (expected_mem_bytes) {
 		trans->mem_bytes = roundup_pow_of_two(expected_mem_bytes);
 		trans->mem = kmalloc(trans->mem_bytes, GFP_KERNEL|__GFP_NOFAIL);
 
@@ -2427,18 +2483,15 @@ int bch2_trans_exit(struct btree_trans *trans)
 			kfree(trans->fs_usage_deltas);
 	}
 
-	if (trans->mem_bytes == BTREE_TRANS_MEM_MAX)
-		mempool_free(trans->mem, &trans->c->btree_trans_mem_pool);
-	else
+	if (trans->mem_bytes == BTREE_TRANS_MEM_MAX) {
+		trans->mem = btree_trans_buf_put(c, mem, trans->mem);
+		if (trans->mem)
+			mempool_free(trans->mem, &trans->c->btree_trans_mem_pool);
+	} else {
 		kfree(trans->mem);
+	}
 
-#ifdef __KERNEL__
-	/*
-	 * Userspace doesn't have a real percpu implementation:
-	 */
-	trans->iters = this_cpu_xchg(c->btree_iters_bufs->iter, trans->iters);
-#endif
-
+	trans->iters = btree_trans_buf_put(c, iter, trans->iters);
 	if (trans->iters)
 		mempool_free(trans->iters, &trans->c->btree_iters_pool);
 
@@ -2530,8 +2583,30 @@ void bch2_btree_trans_to_text(struct printbuf *out, struct bch_fs *c)
 #endif
 }
 
+static void btree_trans_buf_exit(struct bch_fs *c, struct btree_trans_buf *buf)
+{
+	if (buf->iter)
+		mempool_free(buf->iter, &c->btree_iters_pool);
+	if (buf->mem)
+		mempool_free(buf->mem, &c->btree_trans_mem_pool);
+}
+
 void bch2_fs_btree_iter_exit(struct bch_fs *c)
 {
+	int i;
+
+	if (c->btree_trans_bufs) {
+#ifdef __KERNEL__
+		for_each_possible_cpu(i)
+			btree_trans_buf_exit(c, per_cpu_ptr(c->btree_trans_bufs, i));
+		free_percpu(c->btree_trans_bufs);
+#else
+		for (i = 0; i < BTREE_TRANS_BUFS_NR; i++)
+			btree_trans_buf_exit(c, c->btree_trans_bufs + i);
+		kfree(c->btree_trans_bufs);
+#endif
+	}
+
 	mempool_exit(&c->btree_trans_mem_pool);
 	mempool_exit(&c->btree_iters_pool);
 	cleanup_srcu_struct(&c->btree_trans_barrier);
@@ -2544,10 +2619,20 @@ int bch2_fs_btree_iter_init(struct bch_fs *c)
 	INIT_LIST_HEAD(&c->btree_trans_list);
 	mutex_init(&c->btree_trans_lock);
 
+#ifdef __KERNEL__
+	c->btree_trans_bufs = alloc_percpu(struct btree_trans_buf);
+#else
+	c->btree_trans_bufs = kcalloc(BTREE_TRANS_BUFS_NR,
+				      sizeof(struct btree_trans_buf), GFP_KERNEL);
+#endif
+	if (!c->btree_trans_bufs)
+		return -ENOMEM;
+
 	return  init_srcu_struct(&c->btree_trans_barrier) ?:
 		mempool_init_kmalloc_pool(&c->btree_iters_pool, 1,
 			sizeof(struct btree_iter) * nr +
-			sizeof(struct btree_insert_entry) * nr) ?:
+			sizeof(struct btree_insert_entry) * nr +
+			sizeof(struct btree_write_buffered_update) * nr) ?:
 		mempool_init_kmalloc_pool(&c->btree_trans_mem_pool, 1,
 					  BTREE_TRANS_MEM_MAX);
 }
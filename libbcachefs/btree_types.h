@@ -339,6 +339,42 @@ struct bkey_cached {
 	struct bkey_i		*k;
 };
 
+/*
+ * Btree write buffer: updates to btrees that are written far more often than
+ * they're read (the alloc btree) are appended to this buffer at commit time
+ * instead of going to a btree node or the key cache; journal reclaim sorts the
+ * buffer and flushes it to the btree in one batch.
+ */
+#define BTREE_WRITE_BUFFERED_VAL_U64s_MAX	16
+
+struct btree_write_buffered_key {
+	u64			journal_seq;
+	u32			idx;
+	u8			btree;
+	__BKEY_PADDED(k, BTREE_WRITE_BUFFERED_VAL_U64s_MAX);
+};
+
+struct btree_write_buffer {
+	/* Held across journal reservation + append, to keep keys in order: */
+	struct mutex		lock;
+	/* Held while flushing, protects @flushing: */
+	struct mutex		flush_lock;
+	struct journal_entry_pin journal_pin;
+	struct journal_entry_pin flushing_pin;
+
+	u32			idx;
+	size_t			nr;
+	size_t			size;
+	struct btree_write_buffered_key *keys;
+
+	size_t			nr_flushing;
+	struct btree_write_buffered_key *flushing;
+
+	u64			nr_flushes;
+	u64			nr_keys_flushed;
+	u64			nr_keys_fast_path;
+};
+
 struct btree_insert_entry {
 	unsigned		trigger_flags;
 	u8			bkey_type;
@@ -349,6 +385,17 @@ struct btree_insert_entry {
 	struct btree_iter	*iter;
 };
 
+struct btree_write_buffered_update {
+	unsigned		trigger_flags;
+	enum btree_id		btree_id:8;
+	struct bkey_i		*k;
+	/*
+	 * In-memory state @k was computed from, if any: the commit restarts if
+	 * it no longer matches:
+	 */
+	struct bkey_i		*old;
+};
+
 #ifndef CONFIG_LOCKDEP
 #define BTREE_ITER_MAX		64
 #else
@@ -380,6 +427,7 @@ struct btree_trans {
 	int			srcu_idx;
 
 	u8			nr_updates;
+	u8			nr_wb_updates;
 	unsigned		used_mempool:1;
 	unsigned		error:1;
 	unsigned		in_traverse_all:1;
@@ -399,6 +447,7 @@ struct btree_trans {
 
 	struct btree_iter	*iters;
 	struct btree_insert_entry *updates;
+	struct btree_write_buffered_update *wb_updates;
 
 	/* update path: */
 	struct btree_trans_commit_hook *hooks;
@@ -630,10 +679,18 @@ static inline bool btree_iter_is_extents(struct btree_iter *iter)
 	 (1U << BTREE_ID_dirents)|			\
 	 (1U << BTREE_ID_xattrs))
 
+#define BTREE_ID_HAS_WRITE_BUFFER			\
+	(1U << BTREE_ID_alloc)
+
 #define BTREE_ID_HAS_PTRS				\
 	((1U << BTREE_ID_extents)|			\
 	 (1U << BTREE_ID_reflink))
 
+static inline bool btree_type_uses_write_buffer(enum btree_id id)
+{
+	return (1 << id) & BTREE_ID_HAS_WRITE_BUFFER;
+}
+
 static inline bool btree_type_has_snapshots(enum btree_id id)
 {
 	return (1 << id) & BTREE_ID_HAS_SNAPSHOTS;
@@ -690,6 +747,7 @@ enum btree_insert_ret {
 	BTREE_INSERT_NEED_MARK_REPLICAS,
 	BTREE_INSERT_NEED_JOURNAL_RES,
 	BTREE_INSERT_NEED_JOURNAL_RECLAIM,
+	BTREE_INSERT_NEED_FLUSH_WRITE_BUFFER,
 };
 
 enum btree_gc_coalesce_fail_reason {
@@ -13,6 +13,8 @@ void bch2_btree_node_lock_for_insert(struct bch_fs *, struct btree *,
 bool bch2_btree_bset_insert_key(struct btree_iter *, struct btree *,
 				struct btree_node_iter *, struct bkey_i *);
 void bch2_btree_add_journal_pin(struct bch_fs *, struct btree *, u64);
+bool bch2_btree_insert_key_leaf(struct btree_trans *, struct btree_iter *,
+				struct bkey_i *, u64);
 
 enum btree_insert_flags {
 	__BTREE_INSERT_NOUNLOCK,
@@ -25,6 +27,7 @@ enum btree_insert_flags {
 	__BTREE_INSERT_JOURNAL_RECLAIM,
 	__BTREE_INSERT_NOWAIT,
 	__BTREE_INSERT_GC_LOCK_HELD,
+	__BTREE_INSERT_WRITE_BUFFER_FLUSH,
 	__BCH_HASH_SET_MUST_CREATE,
 	__BCH_HASH_SET_MUST_REPLACE,
 };
@@ -56,6 +59,9 @@ enum btree_insert_flags {
 #define BTREE_INSERT_NOWAIT		(1 << __BTREE_INSERT_NOWAIT)
 #define BTREE_INSERT_GC_LOCK_HELD	(1 << __BTREE_INSERT_GC_LOCK_HELD)
 
+/* Insert is from flushing the btree write buffer - don't flush it again: */
+#define BTREE_INSERT_WRITE_BUFFER_FLUSH	(1 << __BTREE_INSERT_WRITE_BUFFER_FLUSH)
+
 #define BCH_HASH_SET_MUST_CREATE	(1 << __BCH_HASH_SET_MUST_CREATE)
 #define BCH_HASH_SET_MUST_REPLACE	(1 << __BCH_HASH_SET_MUST_REPLACE)
 
@@ -140,4 +146,9 @@ static inline int bch2_trans_commit(struct btree_trans *trans,
 	     (_i) < (_trans)->updates + (_trans)->nr_updates;		\
 	     (_i)++)
 
+#define trans_for_each_wb_update(_trans, _i)				\
+	for ((_i) = (_trans)->wb_updates;				\
+	     (_i) < (_trans)->wb_updates + (_trans)->nr_wb_updates;	\
+	     (_i)++)
+
 #endif /* _BCACHEFS_BTREE_UPDATE_H */
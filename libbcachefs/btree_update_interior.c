@@ -184,39 +184,15 @@ void bch2_btree_node_free_inmem(struct bch_fs *c, struct btree *b,
 	six_unlock_intent(&b->c.lock);
 }
 
-static struct btree *__bch2_btree_node_alloc(struct bch_fs *c,
-					     struct disk_reservation *res,
-					     struct closure *cl,
-					     unsigned flags)
+static int btree_node_alloc_disk(struct bch_fs *c, struct btree_alloc *a,
+				 unsigned nr_replicas,
+				 enum alloc_reserve alloc_reserve,
+				 struct closure *cl)
 {
 	struct write_point *wp;
-	struct btree *b;
-	__BKEY_PADDED(k, BKEY_BTREE_PTR_VAL_U64s_MAX) tmp;
-	struct open_buckets ob = { .nr = 0 };
 	struct bch_devs_list devs_have = (struct bch_devs_list) { 0 };
-	unsigned nr_reserve;
-	enum alloc_reserve alloc_reserve;
-
-	if (flags & BTREE_INSERT_USE_RESERVE) {
-		nr_reserve	= 0;
-		alloc_reserve	= RESERVE_BTREE_MOVINGGC;
-	} else {
-		nr_reserve	= BTREE_NODE_RESERVE;
-		alloc_reserve	= RESERVE_BTREE;
-	}
-
-	mutex_lock(&c->btree_reserve_cache_lock);
-	if (c->btree_reserve_cache_nr > nr_reserve) {
-		struct btree_alloc *a =
-			&c->btree_reserve_cache[--c->btree_reserve_cache_nr];
-
-		ob = a->ob;
-		bkey_copy(&tmp.k, &a->k);
-		mutex_unlock(&c->btree_reserve_cache_lock);
-		goto mem_alloc;
-	}
-	mutex_unlock(&c->btree_reserve_cache_lock);
 
+	a->ob.nr = 0;
 retry:
 	wp = bch2_alloc_sectors_start(c,
 				      c->opts.metadata_target ?:
@@ -224,11 +200,11 @@ retry:
 				      0,
 				      writepoint_ptr(&c->btree_write_point),
 				      &devs_have,
-				      res->nr_replicas,
+				      nr_replicas,
 				      c->opts.metadata_replicas_required,
 				      alloc_reserve, 0, cl);
 	if (IS_ERR(wp))
-		return ERR_CAST(wp);
+		return PTR_ERR(wp);
 
 	if (wp->sectors_free < c->opts.btree_node_size) {
 		struct open_bucket *ob;
@@ -243,14 +219,114 @@ retry:
 	}
 
 	if (c->sb.features & (1ULL << BCH_FEATURE_btree_ptr_v2))
-		bkey_btree_ptr_v2_init(&tmp.k);
+		bkey_btree_ptr_v2_init(&a->k);
 	else
-		bkey_btree_ptr_init(&tmp.k);
+		bkey_btree_ptr_init(&a->k);
 
-	bch2_alloc_sectors_append_ptrs(c, wp, &tmp.k, c->opts.btree_node_size);
+	bch2_alloc_sectors_append_ptrs(c, wp, &a->k, c->opts.btree_node_size);
 
-	bch2_open_bucket_get(c, wp, &ob);
+	bch2_open_bucket_get(c, wp, &a->ob);
 	bch2_alloc_sectors_done(c, wp);
+	return 0;
+}
+
+void bch2_btree_reserve_cache_kick(struct bch_fs *c)
+{
+	if (percpu_ref_tryget(&c->writes) &&
+	    !queue_work(system_long_wq, &c->btree_reserve_cache_work))
+		percpu_ref_put(&c->writes);
+}
+
+/*
+ * Keep the btree node reserve caches full, and enough btree node buffers on
+ * the btree cache's freeable list for a worst case split, so that
+ * bch2_btree_update_start() normally doesn't have to wait on the allocator:
+ */
+static void btree_reserve_cache_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs,
+					btree_reserve_cache_work);
+	struct btree_alloc a;
+	unsigned i;
+
+	bch2_btree_cache_prefill(c, BTREE_RESERVE_MAX);
+
+	for (i = 0; i < ARRAY_SIZE(c->btree_reserve_cache); i++)
+		while (READ_ONCE(c->btree_reserve_cache_nr[i]) <
+		       BTREE_RESERVE_CACHE_NR) {
+			if (btree_node_alloc_disk(c, &a, c->opts.metadata_replicas,
+						  RESERVE_BTREE, NULL))
+				goto out;
+
+			mutex_lock(&c->btree_reserve_cache_lock);
+			if (c->btree_reserve_cache_nr[i] < BTREE_RESERVE_CACHE_NR) {
+				struct btree_alloc *dst =
+					&c->btree_reserve_cache[i][c->btree_reserve_cache_nr[i]++];
+
+				dst->ob = a.ob;
+				a.ob.nr = 0;
+				bkey_copy(&dst->k, &a.k);
+			}
+			mutex_unlock(&c->btree_reserve_cache_lock);
+
+			bch2_open_buckets_put(c, &a.ob);
+		}
+out:
+	percpu_ref_put(&c->writes);
+}
+
+static struct btree *__bch2_btree_node_alloc(struct bch_fs *c,
+					     struct disk_reservation *res,
+					     struct closure *cl,
+					     bool interior_node,
+					     unsigned flags)
+{
+	struct btree *b;
+	struct btree_alloc a;
+	unsigned nr_reserve, nr_cached;
+	enum alloc_reserve alloc_reserve;
+	int ret;
+
+	if (flags & BTREE_INSERT_USE_RESERVE) {
+		nr_reserve	= 0;
+		alloc_reserve	= RESERVE_BTREE_MOVINGGC;
+	} else {
+		nr_reserve	= BTREE_RESERVE_CACHE_NR / 2;
+		alloc_reserve	= RESERVE_BTREE;
+	}
+
+	mutex_lock(&c->btree_reserve_cache_lock);
+	nr_cached = c->btree_reserve_cache_nr[interior_node];
+	if (nr_cached > nr_reserve) {
+		struct btree_alloc *src =
+			&c->btree_reserve_cache[interior_node][--c->btree_reserve_cache_nr[interior_node]];
+
+		a.ob = src->ob;
+		bkey_copy(&a.k, &src->k);
+		mutex_unlock(&c->btree_reserve_cache_lock);
+
+		if (nr_cached <= BTREE_RESERVE_CACHE_NR * 3 / 4)
+			bch2_btree_reserve_cache_kick(c);
+		goto mem_alloc;
+	}
+
+	if (!c->blocked_btree_reserve)
+		c->blocked_btree_reserve = local_clock();
+	mutex_unlock(&c->btree_reserve_cache_lock);
+
+	bch2_btree_reserve_cache_kick(c);
+
+	ret = btree_node_alloc_disk(c, &a, res->nr_replicas, alloc_reserve, cl);
+	if (ret)
+		return ERR_PTR(ret);
+
+	mutex_lock(&c->btree_reserve_cache_lock);
+	if (c->blocked_btree_reserve) {
+		bch2_time_stats_update(&c->times[BCH_TIME_blocked_btree_reserve],
+				       c->blocked_btree_reserve);
+		c->blocked_btree_reserve = 0;
+	}
+	mutex_unlock(&c->btree_reserve_cache_lock);
 mem_alloc:
 	b = bch2_btree_node_mem_alloc(c);
 
@@ -258,8 +334,8 @@ mem_alloc:
 	BUG_ON(IS_ERR(b));
 	BUG_ON(b->ob.nr);
 
-	bkey_copy(&b->key, &tmp.k);
-	b->ob = ob;
+	bkey_copy(&b->key, &a.k);
+	b->ob = a.ob;
 
 	return b;
 }
@@ -267,13 +343,14 @@ mem_alloc:
 static struct btree *bch2_btree_node_alloc(struct btree_update *as, unsigned level)
 {
 	struct bch_fs *c = as->c;
+	struct prealloc_nodes *p = &as->prealloc_nodes[!!level];
 	struct btree *b;
 	int ret;
 
 	BUG_ON(level >= BTREE_MAX_DEPTH);
-	BUG_ON(!as->nr_prealloc_nodes);
+	BUG_ON(!p->nr);
 
-	b = as->prealloc_nodes[--as->nr_prealloc_nodes];
+	b = p->b[--p->nr];
 
 	set_btree_node_accessed(b);
 	set_btree_node_dirty(c, b);
@@ -382,44 +459,52 @@ static struct btree *__btree_root_alloc(struct btree_update *as, unsigned level)
 static void bch2_btree_reserve_put(struct btree_update *as)
 {
 	struct bch_fs *c = as->c;
+	struct prealloc_nodes *p;
 
 	mutex_lock(&c->btree_reserve_cache_lock);
 
-	while (as->nr_prealloc_nodes) {
-		struct btree *b = as->prealloc_nodes[--as->nr_prealloc_nodes];
+	for (p = as->prealloc_nodes;
+	     p < as->prealloc_nodes + ARRAY_SIZE(as->prealloc_nodes);
+	     p++) {
+		unsigned i = p - as->prealloc_nodes;
 
-		six_unlock_write(&b->c.lock);
+		while (p->nr) {
+			struct btree *b = p->b[--p->nr];
 
-		if (c->btree_reserve_cache_nr <
-		    ARRAY_SIZE(c->btree_reserve_cache)) {
-			struct btree_alloc *a =
-				&c->btree_reserve_cache[c->btree_reserve_cache_nr++];
+			six_unlock_write(&b->c.lock);
 
-			a->ob = b->ob;
-			b->ob.nr = 0;
-			bkey_copy(&a->k, &b->key);
-		} else {
-			bch2_open_buckets_put(c, &b->ob);
-		}
+			if (c->btree_reserve_cache_nr[i] < BTREE_RESERVE_CACHE_NR) {
+				struct btree_alloc *a =
+					&c->btree_reserve_cache[i][c->btree_reserve_cache_nr[i]++];
 
-		btree_node_lock_type(c, b, SIX_LOCK_write);
-		__btree_node_free(c, b);
-		six_unlock_write(&b->c.lock);
+				a->ob = b->ob;
+				b->ob.nr = 0;
+				bkey_copy(&a->k, &b->key);
+			} else {
+				bch2_open_buckets_put(c, &b->ob);
+			}
 
-		six_unlock_intent(&b->c.lock);
+			btree_node_lock_type(c, b, SIX_LOCK_write);
+			__btree_node_free(c, b);
+			six_unlock_write(&b->c.lock);
+
+			six_unlock_intent(&b->c.lock);
+		}
 	}
 
 	mutex_unlock(&c->btree_reserve_cache_lock);
 }
 
-static int bch2_btree_reserve_get(struct btree_update *as, unsigned nr_nodes,
+static int bch2_btree_reserve_get(struct btree_update *as,
+				  unsigned nr_nodes[2],
 				  unsigned flags, struct closure *cl)
 {
 	struct bch_fs *c = as->c;
 	struct btree *b;
+	unsigned interior;
 	int ret;
 
-	BUG_ON(nr_nodes > BTREE_RESERVE_MAX);
+	BUG_ON(nr_nodes[0] + nr_nodes[1] > BTREE_RESERVE_MAX);
 
 	/*
 	 * Protects reaping from the btree node cache and using the btree node
@@ -429,23 +514,27 @@ static int bch2_btree_reserve_get(struct btree_update *as, unsigned nr_nodes,
 	if (ret)
 		return ret;
 
-	while (as->nr_prealloc_nodes < nr_nodes) {
-		b = __bch2_btree_node_alloc(c, &as->disk_res,
-					    flags & BTREE_INSERT_NOWAIT
-					    ? NULL : cl, flags);
-		if (IS_ERR(b)) {
-			ret = PTR_ERR(b);
-			goto err_free;
-		}
+	for (interior = 0; interior < 2; interior++) {
+		struct prealloc_nodes *p = as->prealloc_nodes + interior;
+
+		while (p->nr < nr_nodes[interior]) {
+			b = __bch2_btree_node_alloc(c, &as->disk_res,
+					flags & BTREE_INSERT_NOWAIT ? NULL : cl,
+					interior, flags);
+			if (IS_ERR(b)) {
+				ret = PTR_ERR(b);
+				goto err_free;
+			}
 
-		as->prealloc_nodes[as->nr_prealloc_nodes++] = b;
+			p->b[p->nr++] = b;
+		}
 	}
 
 	bch2_btree_cache_cannibalize_unlock(c);
 	return 0;
 err_free:
 	bch2_btree_cache_cannibalize_unlock(c);
-	trace_btree_reserve_get_fail(c, nr_nodes, cl);
+	trace_btree_reserve_get_fail(c, nr_nodes[0] + nr_nodes[1], cl);
 	return ret;
 }
 
@@ -926,7 +1015,7 @@ void bch2_btree_update_done(struct btree_update *as)
 
 struct btree_update *
 bch2_btree_update_start(struct btree_iter *iter, unsigned level,
-			unsigned nr_nodes, unsigned flags)
+			bool split, unsigned flags)
 {
 	struct btree_trans *trans = iter->trans;
 	struct bch_fs *c = trans->c;
@@ -935,6 +1024,8 @@ bch2_btree_update_start(struct btree_iter *iter, unsigned level,
 	int disk_res_flags = (flags & BTREE_INSERT_NOFAIL)
 		? BCH_DISK_RESERVATION_NOFAIL : 0;
 	int journal_flags = 0;
+	unsigned nr_nodes[2] = { 0, 0 };
+	unsigned update_level = level;
 	int ret = 0;
 
 	BUG_ON(!iter->should_be_locked);
@@ -963,6 +1054,24 @@ retry:
 		return ERR_PTR(-EINTR);
 	}
 
+	/*
+	 * Number of nodes we might have to allocate at each level, in a worst
+	 * case update: we may split all the way up to the root, then allocate
+	 * a new root, unless we're already at max depth:
+	 */
+	while (1) {
+		nr_nodes[!!update_level] += 1 + split;
+		update_level++;
+
+		if (!btree_iter_node(iter, update_level))
+			break;
+
+		split = update_level + 1 < BTREE_MAX_DEPTH;
+	}
+
+	if (update_level < BTREE_MAX_DEPTH)
+		nr_nodes[1] += 1;
+
 	if (flags & BTREE_INSERT_GC_LOCK_HELD)
 		lockdep_assert_held(&c->gc_lock);
 	else if (!down_read_trylock(&c->gc_lock)) {
@@ -1027,7 +1136,7 @@ retry:
 	}
 
 	ret = bch2_disk_reservation_get(c, &as->disk_res,
-			nr_nodes * c->opts.btree_node_size,
+			(nr_nodes[0] + nr_nodes[1]) * c->opts.btree_node_size,
 			c->opts.metadata_replicas,
 			disk_res_flags);
 	if (ret)
@@ -1248,6 +1357,8 @@ static struct btree *__btree_split_node(struct btree_update *as,
 	set1->u64s = cpu_to_le16((u64 *) set2_start - set1->_data);
 	set_btree_bset_end(n1, n1->set);
 
+	set2->journal_seq	= set1->journal_seq;
+
 	n1->nr.live_u64s	= le16_to_cpu(set1->u64s);
 	n1->nr.bset_u64s[0]	= le16_to_cpu(set1->u64s);
 	n1->nr.packed_keys	= nr_packed;
@@ -1548,8 +1659,7 @@ int bch2_btree_split_leaf(struct bch_fs *c, struct btree_iter *iter,
 	unsigned l;
 	int ret = 0;
 
-	as = bch2_btree_update_start(iter, iter->level,
-		btree_update_reserve_required(c, b), flags);
+	as = bch2_btree_update_start(iter, iter->level, true, flags);
 	if (IS_ERR(as))
 		return PTR_ERR(as);
 
@@ -1661,8 +1771,7 @@ retry:
 		goto out;
 
 	parent = btree_node_parent(iter, b);
-	as = bch2_btree_update_start(iter, level,
-			 btree_update_reserve_required(c, parent) + 1,
+	as = bch2_btree_update_start(iter, level, false,
 			 flags|
 			 BTREE_INSERT_NOFAIL|
 			 BTREE_INSERT_USE_RESERVE);
@@ -1768,11 +1877,7 @@ retry:
 		goto out;
 
 	parent = btree_node_parent(iter, b);
-	as = bch2_btree_update_start(iter, b->c.level,
-		(parent
-		 ? btree_update_reserve_required(c, parent)
-		 : 0) + 1,
-		flags);
+	as = bch2_btree_update_start(iter, b->c.level, false, flags);
 	ret = PTR_ERR_OR_ZERO(as);
 	if (ret == -EINTR)
 		goto retry;
@@ -1930,7 +2035,6 @@ int bch2_btree_node_update_key(struct bch_fs *c, struct btree_iter *iter,
 			       struct btree *b,
 			       struct bkey_i *new_key)
 {
-	struct btree *parent = btree_node_parent(iter, b);
 	struct btree_update *as = NULL;
 	struct btree *new_hash = NULL;
 	struct closure cl;
@@ -1954,9 +2058,8 @@ int bch2_btree_node_update_key(struct bch_fs *c, struct btree_iter *iter,
 		new_hash = bch2_btree_node_mem_alloc(c);
 	}
 
-	as = bch2_btree_update_start(iter, b->c.level,
-		parent ? btree_update_reserve_required(c, parent) : 0,
-		BTREE_INSERT_NOFAIL);
+	as = bch2_btree_update_start(iter, b->c.level, false,
+				     BTREE_INSERT_NOFAIL);
 	if (IS_ERR(as)) {
 		ret = PTR_ERR(as);
 		goto err;
@@ -2122,6 +2225,7 @@ void bch2_fs_btree_interior_update_exit(struct bch_fs *c)
 int bch2_fs_btree_interior_update_init(struct bch_fs *c)
 {
 	mutex_init(&c->btree_reserve_cache_lock);
+	INIT_WORK(&c->btree_reserve_cache_work, btree_reserve_cache_work);
 	INIT_LIST_HEAD(&c->btree_interior_update_list);
 	INIT_LIST_HEAD(&c->btree_interior_updates_unwritten);
 	mutex_init(&c->btree_interior_update_lock);
@@ -74,9 +74,14 @@ struct btree_update {
 	 */
 	struct journal_entry_pin	journal;
 
-	/* Preallocated nodes we reserve when we start the update: */
-	struct btree			*prealloc_nodes[BTREE_UPDATE_NODES_MAX];
-	unsigned			nr_prealloc_nodes;
+	/*
+	 * Preallocated nodes we reserve when we start the update, leaf and
+	 * interior nodes indexed by !!level:
+	 */
+	struct prealloc_nodes {
+		struct btree		*b[BTREE_UPDATE_NODES_MAX];
+		unsigned		nr;
+	}				prealloc_nodes[2];
 
 	/* Nodes being freed: */
 	struct keylist			old_keys;
@@ -117,6 +122,7 @@ void bch2_btree_node_free_inmem(struct bch_fs *, struct btree *,
 				struct btree_iter *);
 void bch2_btree_node_free_never_inserted(struct bch_fs *, struct btree *);
 
+void bch2_btree_reserve_cache_kick(struct bch_fs *);
 void bch2_btree_update_get_open_buckets(struct btree_update *, struct btree *);
 
 struct btree *__bch2_btree_node_alloc_replacement(struct btree_update *,
@@ -125,7 +131,7 @@ struct btree *__bch2_btree_node_alloc_replacement(struct btree_update *,
 
 void bch2_btree_update_done(struct btree_update *);
 struct btree_update *
-bch2_btree_update_start(struct btree_iter *, unsigned, unsigned, unsigned);
+bch2_btree_update_start(struct btree_iter *, unsigned, bool, unsigned);
 
 void bch2_btree_interior_update_will_free_node(struct btree_update *,
 					       struct btree *);
@@ -173,22 +179,6 @@ static inline int bch2_foreground_maybe_merge(struct bch_fs *c,
 void bch2_btree_set_root_for_read(struct bch_fs *, struct btree *);
 void bch2_btree_root_alloc(struct bch_fs *, enum btree_id);
 
-static inline unsigned btree_update_reserve_required(struct bch_fs *c,
-						     struct btree *b)
-{
-	unsigned depth = btree_node_root(c, b)->c.level + 1;
-
-	/*
-	 * Number of nodes we might have to allocate in a worst case btree
-	 * split operation - we split all the way up to the root, then allocate
-	 * a new root, unless we're already at max depth:
-	 */
-	if (depth < BTREE_MAX_DEPTH)
-		return (depth - b->c.level) * 2 + 1;
-	else
-		return (depth - b->c.level) * 2 - 1;
-}
-
 static inline void btree_node_reset_sib_u64s(struct btree *b)
 {
 	b->sib_u64s[0] = b->nr.live_u64s;
@@ -8,6 +8,7 @@
 #include "btree_iter.h"
 #include "btree_key_cache.h"
 #include "btree_locking.h"
+#include "btree_write_buffer.h"
 #include "buckets.h"
 #include "debug.h"
 #include "error.h"
@@ -170,11 +171,13 @@ inline void bch2_btree_add_journal_pin(struct bch_fs *c,
 }
 
 /**
- * btree_insert_key - insert a key one key into a leaf node
+ * bch2_btree_insert_key_leaf - insert a key one key into a leaf node
+ * @journal_seq:	journal sequence number the key was journalled at
  */
-static bool btree_insert_key_leaf(struct btree_trans *trans,
-				  struct btree_iter *iter,
-				  struct bkey_i *insert)
+bool bch2_btree_insert_key_leaf(struct btree_trans *trans,
+				struct btree_iter *iter,
+				struct bkey_i *insert,
+				u64 journal_seq)
 {
 	struct bch_fs *c = trans->c;
 	struct btree *b = iter_l(iter)->b;
@@ -191,10 +194,10 @@ static bool btree_insert_key_leaf(struct btree_trans *trans,
 					&iter_l(iter)->iter, insert)))
 		return false;
 
-	i->journal_seq = cpu_to_le64(max(trans->journal_res.seq,
+	i->journal_seq = cpu_to_le64(max(journal_seq,
 					 le64_to_cpu(i->journal_seq)));
 
-	bch2_btree_add_journal_pin(c, b, trans->journal_res.seq);
+	bch2_btree_add_journal_pin(c, b, journal_seq);
 
 	if (unlikely(!btree_node_dirty(b)))
 		set_btree_node_dirty(c, b);
@@ -326,7 +329,8 @@ static inline void do_btree_insert_one(struct btree_trans *trans,
 	i->k->k.needs_whiteout = false;
 
 	did_work = (btree_iter_type(i->iter) != BTREE_ITER_CACHED)
-		? btree_insert_key_leaf(trans, i->iter, i->k)
+		? bch2_btree_insert_key_leaf(trans, i->iter, i->k,
+					     trans->journal_res.seq)
 		: bch2_btree_insert_key_cached(trans, i->iter, i->k);
 	if (!did_work)
 		return;
@@ -354,6 +358,7 @@ static noinline void bch2_trans_mark_gc(struct btree_trans *trans)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_insert_entry *i;
+	struct btree_write_buffered_update *wb;
 
 	trans_for_each_update(trans, i) {
 		/*
@@ -365,6 +370,16 @@ static noinline void bch2_trans_mark_gc(struct btree_trans *trans)
 			bch2_mark_update(trans, i->iter, i->k,
 					 i->trigger_flags|BTREE_TRIGGER_GC);
 	}
+
+	/*
+	 * Write buffered updates aren't in a btree node yet: use the position
+	 * of the key they'll overwrite. These are alloc keys, which gc only
+	 * marks for BTREE_TRIGGER_BUCKET_INVALIDATE:
+	 */
+	trans_for_each_wb_update(trans, wb)
+		if (gc_visited(c, gc_pos_btree(wb->btree_id, wb->k->k.p, 0)))
+			bch2_mark_buffered_update(trans, wb->k,
+					wb->trigger_flags|BTREE_TRIGGER_GC);
 }
 
 static inline int
@@ -374,9 +389,10 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 {
 	struct bch_fs *c = trans->c;
 	struct btree_insert_entry *i;
+	struct btree_write_buffered_update *wb;
 	struct btree_trans_commit_hook *h;
 	unsigned u64s = 0;
-	bool marking = false;
+	bool marking = false, wb_locked = false;
 	int ret;
 
 	if (race_fault()) {
@@ -418,6 +434,9 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 			marking = true;
 	}
 
+	if (trans->nr_wb_updates)
+		marking = true;
+
 	if (marking) {
 		percpu_down_read(&c->mark_lock);
 	}
@@ -429,6 +448,21 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 		goto err;
 	}
 
+	/*
+	 * The write buffer lock is held from before we get our journal
+	 * reservation until after we've added our keys, so that keys in the
+	 * write buffer are in journal sequence number order:
+	 */
+	if (trans->nr_wb_updates) {
+		mutex_lock(&c->btree_write_buffer.lock);
+		wb_locked = true;
+
+		ret = bch2_btree_write_buffer_can_insert(trans) ?:
+			bch2_trans_wb_updates_stale(trans);
+		if (ret)
+			goto err;
+	}
+
 	/*
 	 * Don't get journal reservation until after we know insert will
 	 * succeed:
@@ -457,12 +491,17 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 	 */
 
 	if (!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)) {
-		if (bch2_journal_seq_verify)
+		if (bch2_journal_seq_verify) {
 			trans_for_each_update(trans, i)
 				i->k->k.version.lo = trans->journal_res.seq;
-		else if (bch2_inject_invalid_keys)
+			trans_for_each_wb_update(trans, wb)
+				wb->k->k.version.lo = trans->journal_res.seq;
+		} else if (bch2_inject_invalid_keys) {
 			trans_for_each_update(trans, i)
 				i->k->k.version = MAX_VERSION;
+			trans_for_each_wb_update(trans, wb)
+				wb->k->k.version = MAX_VERSION;
+		}
 	}
 
 	trans_for_each_update(trans, i)
@@ -470,6 +509,9 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 			bch2_mark_update(trans, i->iter, i->k,
 					 i->trigger_flags);
 
+	trans_for_each_wb_update(trans, wb)
+		bch2_mark_buffered_update(trans, wb->k, wb->trigger_flags);
+
 	if (marking && trans->fs_usage_deltas)
 		bch2_trans_fs_usage_apply(trans, trans->fs_usage_deltas);
 
@@ -478,7 +520,13 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 
 	trans_for_each_update(trans, i)
 		do_btree_insert_one(trans, i);
+
+	if (trans->nr_wb_updates)
+		bch2_btree_write_buffer_add(trans);
 err:
+	if (wb_locked)
+		mutex_unlock(&c->btree_write_buffer.lock);
+
 	if (marking) {
 		percpu_up_read(&c->mark_lock);
 	}
@@ -532,6 +580,7 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 {
 	struct bch_fs *c = trans->c;
 	struct btree_insert_entry *i;
+	struct btree_write_buffered_update *wb;
 	struct btree_iter *iter;
 	int ret;
 
@@ -604,6 +653,18 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 		}
 		btree_insert_entry_checks(trans, i);
 	}
+
+	trans_for_each_wb_update(trans, wb) {
+		const char *invalid = bch2_bkey_invalid(c, bkey_i_to_s_c(wb->k),
+					__btree_node_type(0, wb->btree_id));
+		if (invalid) {
+			char buf[200];
+
+			bch2_bkey_val_to_text(&PBUF(buf), c, bkey_i_to_s_c(wb->k));
+			bch_err(c, "invalid bkey %s on insert: %s\n", buf, invalid);
+			bch2_fatal_error(c);
+		}
+	}
 	bch2_btree_trans_verify_locks(trans);
 
 	trans_for_each_update(trans, i)
@@ -742,6 +803,23 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		trace_trans_restart_journal_reclaim(trans->ip, trace_ip);
 		ret = -EINTR;
 		break;
+	case BTREE_INSERT_NEED_FLUSH_WRITE_BUFFER:
+		/* We hold the flush lock - the caller has to make room: */
+		if (trans->flags & BTREE_INSERT_WRITE_BUFFER_FLUSH)
+			return ret;
+
+		bch2_trans_unlock(trans);
+
+		ret = bch2_btree_write_buffer_make_room(c);
+		if (ret)
+			return ret;
+
+		if (bch2_trans_relock(trans))
+			return 0;
+
+		trace_trans_restart_write_buffer_flush(trans->ip, trace_ip);
+		ret = -EINTR;
+		break;
 	default:
 		BUG_ON(ret >= 0);
 		break;
@@ -881,12 +959,14 @@ out:
 int __bch2_trans_commit(struct btree_trans *trans)
 {
 	struct btree_insert_entry *i = NULL;
+	struct btree_write_buffered_update *wb;
 	struct btree_iter *iter;
 	bool trans_trigger_run;
 	unsigned u64s, reset_flags = 0;
 	int ret = 0;
 
-	if (!trans->nr_updates)
+	if (!trans->nr_updates &&
+	    !trans->nr_wb_updates)
 		goto out_reset;
 
 	if (trans->flags & BTREE_INSERT_GC_LOCK_HELD)
@@ -938,6 +1018,9 @@ int __bch2_trans_commit(struct btree_trans *trans)
 		}
 	} while (trans_trigger_run);
 
+	trans_for_each_wb_update(trans, wb)
+		trans->journal_u64s += jset_u64s(wb->k->k.u64s);
+
 	trans_for_each_update(trans, i) {
 		ret = bch2_btree_iter_traverse(i->iter);
 		if (unlikely(ret)) {
@@ -987,6 +1070,10 @@ retry:
 		if (btree_iter_live(trans, iter) &&
 		    (iter->flags & BTREE_ITER_SET_POS_AFTER_COMMIT))
 			bch2_btree_iter_set_pos(iter, iter->pos_after_commit);
+
+	if (trans->nr_wb_updates &&
+	    bch2_btree_write_buffer_should_flush(trans->c))
+		journal_reclaim_kick(&trans->c->journal);
 out:
 	bch2_journal_preres_put(&trans->c->journal, &trans->journal_preres);
 
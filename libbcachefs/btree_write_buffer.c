@@ -0,0 +1,444 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "alloc_background.h"
+#include "btree_iter.h"
+#include "btree_locking.h"
+#include "btree_update.h"
+#include "btree_update_interior.h"
+#include "btree_write_buffer.h"
+#include "error.h"
+#include "journal.h"
+#include "journal_reclaim.h"
+
+#include <linux/sort.h>
+#include <trace/events/bcachefs.h>
+
+#define BTREE_WRITE_BUFFER_SIZE_DEFAULT		(1U << 12)
+
+static int btree_write_buffered_key_cmp(const void *_l, const void *_r)
+{
+	const struct btree_write_buffered_key *l = _l;
+	const struct btree_write_buffered_key *r = _r;
+
+	return  cmp_int(l->btree, r->btree) ?:
+		bpos_cmp(l->k.k.p, r->k.k.p) ?:
+		cmp_int(l->journal_seq, r->journal_seq) ?:
+		cmp_int(l->idx, r->idx);
+}
+
+/* Transaction side: */
+
+struct bkey_i *bch2_trans_peek_buffered(struct btree_trans *trans,
+					enum btree_id btree, struct bpos pos)
+{
+	struct btree_write_buffered_update *i;
+
+	trans_for_each_wb_update(trans, i)
+		if (i->btree_id == btree &&
+		    !bpos_cmp(i->k->k.p, pos))
+			return i->k;
+
+	return NULL;
+}
+
+/**
+ * bch2_trans_update_buffered - queue an update via the btree write buffer
+ * @old:	in-memory state @k was computed from, if any; the update is
+ *		only applied if it still matches at commit time
+ *
+ * Unlike bch2_trans_update(), no iterator is needed: the key is journalled at
+ * commit time and written to the btree later, when the write buffer is
+ * flushed.
+ */
+int bch2_trans_update_buffered(struct btree_trans *trans, enum btree_id btree,
+			       struct bkey_i *k, struct bkey_i *old,
+			       enum btree_trigger_flags flags)
+{
+	struct btree_write_buffered_update *i, n = {
+		.trigger_flags	= flags,
+		.btree_id	= btree,
+		.k		= k,
+		.old		= old,
+	};
+
+	EBUG_ON(!btree_type_uses_write_buffer(btree));
+	EBUG_ON(k->k.u64s > BKEY_U64s + BTREE_WRITE_BUFFERED_VAL_U64s_MAX);
+
+	trans_for_each_wb_update(trans, i)
+		if (i->btree_id == btree &&
+		    !bpos_cmp(i->k->k.p, k->k.p)) {
+			/* Later updates were computed from the first one: */
+			n.old = i->old ?: n.old;
+			*i = n;
+			return 0;
+		}
+
+	BUG_ON(trans->nr_wb_updates >= BTREE_ITER_MAX);
+
+	trans->wb_updates[trans->nr_wb_updates++] = n;
+	return 0;
+}
+
+/* Commit path - called with the write buffer lock held: */
+
+enum btree_insert_ret
+bch2_btree_write_buffer_can_insert(struct btree_trans *trans)
+{
+	struct btree_write_buffer *wb = &trans->c->btree_write_buffer;
+	size_t size = wb->size;
+
+	lockdep_assert_held(&wb->lock);
+
+	if (!(trans->flags & (BTREE_INSERT_JOURNAL_RECLAIM|
+			      BTREE_INSERT_WRITE_BUFFER_FLUSH)))
+		size -= btree_write_buffer_reserve(wb);
+
+	return wb->nr + trans->nr_wb_updates > size
+		? BTREE_INSERT_NEED_FLUSH_WRITE_BUFFER
+		: BTREE_INSERT_OK;
+}
+
+static bool btree_write_buffered_update_stale(struct bch_fs *c,
+				struct btree_write_buffered_update *i)
+{
+	switch (i->btree_id) {
+	case BTREE_ID_alloc:
+		return bch2_alloc_key_stale(c, bkey_i_to_s_c(i->old));
+	default:
+		return false;
+	}
+}
+
+/*
+ * Buffered updates don't hold locks on the keys they overwrite: if they were
+ * computed from in-memory state, check that it hasn't changed underneath us.
+ *
+ * Must be called with mark_lock held:
+ */
+int bch2_trans_wb_updates_stale(struct btree_trans *trans)
+{
+	struct btree_write_buffered_update *i;
+
+	trans_for_each_wb_update(trans, i)
+		if (i->old &&
+		    btree_write_buffered_update_stale(trans->c, i)) {
+			trace_trans_restart_write_buffer_stale(trans->ip, _RET_IP_);
+			return -EINTR;
+		}
+
+	return 0;
+}
+
+void bch2_btree_write_buffer_add(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct journal *j = &c->journal;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	struct btree_write_buffered_update *i;
+	u64 seq = trans->journal_res.seq;
+
+	lockdep_assert_held(&wb->lock);
+	BUG_ON(wb->nr + trans->nr_wb_updates > wb->size);
+
+	trans_for_each_wb_update(trans, i) {
+		struct btree_write_buffered_key *n = &wb->keys[wb->nr++];
+
+		i->k->k.needs_whiteout = false;
+
+		n->journal_seq	= seq;
+		n->idx		= wb->idx++;
+		n->btree	= i->btree_id;
+		bkey_copy(&n->k, i->k);
+
+		if (likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)))
+			bch2_journal_add_keys(j, &trans->journal_res,
+					      i->btree_id, 0, i->k);
+	}
+
+	bch2_journal_pin_add(j, seq, &wb->journal_pin,
+			     bch2_btree_write_buffer_journal_flush);
+
+	if (trans->journal_seq &&
+	    likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)))
+		*trans->journal_seq = seq;
+}
+
+/* Flushing: */
+
+/*
+ * Fast path: the key was already journalled when it was added to the write
+ * buffer, so if it fits in the leaf we insert it directly, without a
+ * transaction commit or a new journal reservation:
+ */
+static int btree_write_buffered_insert_fast(struct btree_trans *trans,
+					    struct btree_iter *iter,
+					    struct btree_write_buffered_key *wb)
+{
+	struct bch_fs *c = trans->c;
+	struct btree *b;
+	int ret;
+
+	bch2_btree_iter_set_pos(iter, wb->k.k.p);
+
+	ret = bch2_btree_iter_traverse(iter);
+	if (ret)
+		return ret;
+
+	b = iter_l(iter)->b;
+	bch2_btree_node_lock_for_insert(c, b, iter);
+
+	if (!bch2_btree_node_insert_fits(c, b, wb->k.k.u64s)) {
+		bch2_btree_node_unlock_write(b, iter);
+		return BTREE_INSERT_BTREE_NODE_FULL;
+	}
+
+	bch2_btree_insert_key_leaf(trans, iter, &wb->k, wb->journal_seq);
+	bch2_btree_node_unlock_write(b, iter);
+	return 0;
+}
+
+static int btree_write_buffered_insert(struct btree_trans *trans,
+				       struct btree_write_buffered_key *wb)
+{
+	struct btree_iter *iter;
+	int ret;
+
+	iter = bch2_trans_get_iter(trans, wb->btree, wb->k.k.p,
+				   BTREE_ITER_INTENT);
+	ret   = bch2_btree_iter_traverse(iter) ?:
+		bch2_trans_update(trans, iter, &wb->k, BTREE_TRIGGER_NORUN);
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+/* Called with flush_lock held: */
+static int __btree_write_buffer_resize(struct bch_fs *c, size_t new_size)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	struct btree_write_buffered_key *keys, *flushing;
+	size_t old_size;
+
+	lockdep_assert_held(&wb->flush_lock);
+
+	keys		= kvpmalloc(new_size * sizeof(*keys), GFP_KERNEL);
+	flushing	= kvpmalloc(new_size * sizeof(*flushing), GFP_KERNEL);
+	if (!keys || !flushing) {
+		kvpfree(keys, new_size * sizeof(*keys));
+		kvpfree(flushing, new_size * sizeof(*flushing));
+		return -ENOMEM;
+	}
+
+	mutex_lock(&wb->lock);
+	old_size = wb->size;
+
+	if (new_size > old_size) {
+		memcpy(keys, wb->keys, wb->nr * sizeof(*keys));
+		memcpy(flushing, wb->flushing, wb->nr_flushing * sizeof(*flushing));
+
+		swap(keys,	wb->keys);
+		swap(flushing,	wb->flushing);
+		wb->size = new_size;
+	} else {
+		old_size = new_size;
+	}
+	mutex_unlock(&wb->lock);
+
+	kvpfree(keys, old_size * sizeof(*keys));
+	kvpfree(flushing, old_size * sizeof(*flushing));
+	return 0;
+}
+
+static int btree_write_buffer_resize(struct bch_fs *c, size_t new_size)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	int ret;
+
+	mutex_lock(&wb->flush_lock);
+	ret = __btree_write_buffer_resize(c, new_size);
+	mutex_unlock(&wb->flush_lock);
+	return ret;
+}
+
+int __bch2_btree_write_buffer_flush(struct btree_trans *trans,
+				    unsigned commit_flags)
+{
+	struct bch_fs *c = trans->c;
+	struct journal *j = &c->journal;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	struct btree_write_buffered_key *i;
+	struct btree_iter *iter = NULL;
+	size_t idx, nr_flushed = 0, nr_fast = 0;
+	int ret = 0;
+
+	mutex_lock(&wb->flush_lock);
+
+	/*
+	 * If a previous flush failed, its keys are still in @flushing -
+	 * reinserting the ones that did make it is harmless:
+	 */
+	if (!wb->nr_flushing) {
+		mutex_lock(&wb->lock);
+		swap(wb->keys,	wb->flushing);
+		swap(wb->nr,	wb->nr_flushing);
+
+		bch2_journal_pin_copy(j, &wb->flushing_pin, &wb->journal_pin,
+				      bch2_btree_write_buffer_journal_flush);
+		bch2_journal_pin_drop(j, &wb->journal_pin);
+		mutex_unlock(&wb->lock);
+	}
+
+	if (!wb->nr_flushing)
+		goto out;
+
+	sort(wb->flushing, wb->nr_flushing, sizeof(wb->flushing[0]),
+	     btree_write_buffered_key_cmp, NULL);
+
+	for (idx = 0; idx < wb->nr_flushing; idx++) {
+retry:
+		/* @flushing may be reallocated below: */
+		i = wb->flushing + idx;
+
+		/* Only the newest update to a given key has to be written: */
+		if (idx + 1 < wb->nr_flushing &&
+		    i[0].btree == i[1].btree &&
+		    !bpos_cmp(i[0].k.k.p, i[1].k.k.p))
+			continue;
+
+		if (!iter || iter->btree_id != i->btree) {
+			if (iter)
+				bch2_trans_iter_put(trans, iter);
+			iter = bch2_trans_get_iter(trans, i->btree, i->k.k.p,
+						   BTREE_ITER_INTENT);
+		}
+
+		ret = lockrestart_do(trans,
+			btree_write_buffered_insert_fast(trans, iter, i));
+		if (!ret) {
+			nr_fast++;
+		} else if (ret == BTREE_INSERT_BTREE_NODE_FULL) {
+			/*
+			 * Leaf needs to be split: do a normal update, which
+			 * journals the key again:
+			 */
+			ret = __bch2_trans_do(trans, NULL, NULL,
+					BTREE_INSERT_NOCHECK_RW|
+					BTREE_INSERT_NOFAIL|
+					BTREE_INSERT_USE_RESERVE|
+					BTREE_INSERT_WRITE_BUFFER_FLUSH|
+					(i->journal_seq == journal_last_seq(j)
+					 ? BTREE_INSERT_JOURNAL_RESERVED
+					 : 0)|
+					commit_flags,
+				btree_write_buffered_insert(trans, i));
+
+			/*
+			 * The split did alloc updates and the write buffer is
+			 * full: it can't be flushed while we're flushing it,
+			 * so grow it instead:
+			 */
+			if (ret == BTREE_INSERT_NEED_FLUSH_WRITE_BUFFER) {
+				bch2_trans_unlock(trans);
+
+				ret = __btree_write_buffer_resize(c, wb->size * 2);
+				if (!ret)
+					goto retry;
+			}
+		}
+
+		if (ret)
+			break;
+
+		nr_flushed++;
+	}
+
+	if (iter)
+		bch2_trans_iter_put(trans, iter);
+
+	wb->nr_flushes++;
+	wb->nr_keys_flushed	+= nr_flushed;
+	wb->nr_keys_fast_path	+= nr_fast;
+
+	if (ret) {
+		bch2_fs_fatal_err_on(ret != -EAGAIN && !bch2_journal_error(j), c,
+			"error flushing btree write buffer: %i", ret);
+		goto out;
+	}
+
+	wb->nr_flushing = 0;
+	bch2_journal_pin_drop(j, &wb->flushing_pin);
+out:
+	mutex_unlock(&wb->flush_lock);
+	return ret;
+}
+
+int bch2_btree_write_buffer_flush(struct bch_fs *c)
+{
+	return bch2_trans_do(c, NULL, NULL, 0,
+			     __bch2_btree_write_buffer_flush(&trans, 0));
+}
+
+int bch2_btree_write_buffer_journal_flush(struct journal *j,
+				struct journal_entry_pin *pin, u64 seq)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+
+	return bch2_trans_do(c, NULL, NULL, 0,
+			     __bch2_btree_write_buffer_flush(&trans,
+						BTREE_INSERT_JOURNAL_RECLAIM));
+}
+
+/*
+ * Called when a commit found the write buffer full: until interior btree nodes
+ * have been replayed we can't flush it, so we grow it instead.
+ */
+int bch2_btree_write_buffer_make_room(struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	if (!test_bit(BCH_FS_BTREE_INTERIOR_REPLAY_DONE, &c->flags))
+		return btree_write_buffer_resize(c, wb->size * 2);
+
+	return bch2_btree_write_buffer_flush(c);
+}
+
+void bch2_btree_write_buffer_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	pr_buf(out, "size:\t\t%zu\n",		wb->size);
+	pr_buf(out, "nr:\t\t%zu\n",		READ_ONCE(wb->nr));
+	pr_buf(out, "nr_flushing:\t%zu\n",	READ_ONCE(wb->nr_flushing));
+	pr_buf(out, "flushes:\t%llu\n",		wb->nr_flushes);
+	pr_buf(out, "keys flushed:\t%llu\n",	wb->nr_keys_flushed);
+	pr_buf(out, "fast path:\t%llu\n",	wb->nr_keys_fast_path);
+}
+
+void bch2_fs_btree_write_buffer_exit(struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	BUG_ON(wb->nr && !bch2_journal_error(&c->journal));
+
+	kvpfree(wb->flushing, wb->size * sizeof(wb->flushing[0]));
+	kvpfree(wb->keys, wb->size * sizeof(wb->keys[0]));
+}
+
+int bch2_fs_btree_write_buffer_init(struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	BUILD_BUG_ON(sizeof(struct bkey_alloc_buf) > sizeof(struct bkey_i) +
+		     sizeof(u64) * BTREE_WRITE_BUFFERED_VAL_U64s_MAX);
+
+	mutex_init(&wb->lock);
+	mutex_init(&wb->flush_lock);
+
+	wb->size	= BTREE_WRITE_BUFFER_SIZE_DEFAULT;
+	wb->keys	= kvpmalloc(wb->size * sizeof(wb->keys[0]), GFP_KERNEL);
+	wb->flushing	= kvpmalloc(wb->size * sizeof(wb->flushing[0]), GFP_KERNEL);
+	if (!wb->keys || !wb->flushing)
+		return -ENOMEM;
+
+	return 0;
+}
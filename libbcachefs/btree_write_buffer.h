@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_BTREE_WRITE_BUFFER_H
+#define _BCACHEFS_BTREE_WRITE_BUFFER_H
+
+/*
+ * Number of slots kept free for commits from journal reclaim, so that
+ * flushing the write buffer (which can allocate btree nodes, and thus do alloc
+ * updates) never waits on itself:
+ */
+static inline size_t btree_write_buffer_reserve(struct btree_write_buffer *wb)
+{
+	return wb->size / 8;
+}
+
+static inline bool bch2_btree_write_buffer_should_flush(struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	return READ_ONCE(wb->nr) > wb->size * 3 / 4;
+}
+
+int bch2_btree_write_buffer_journal_flush(struct journal *,
+				struct journal_entry_pin *, u64);
+
+int __bch2_btree_write_buffer_flush(struct btree_trans *, unsigned);
+int bch2_btree_write_buffer_flush(struct bch_fs *);
+int bch2_btree_write_buffer_make_room(struct bch_fs *);
+
+int bch2_trans_update_buffered(struct btree_trans *, enum btree_id,
+			       struct bkey_i *, struct bkey_i *,
+			       enum btree_trigger_flags);
+struct bkey_i *bch2_trans_peek_buffered(struct btree_trans *,
+					enum btree_id, struct bpos);
+
+enum btree_insert_ret
+bch2_btree_write_buffer_can_insert(struct btree_trans *);
+int bch2_trans_wb_updates_stale(struct btree_trans *);
+void bch2_btree_write_buffer_add(struct btree_trans *);
+
+void bch2_btree_write_buffer_to_text(struct printbuf *, struct bch_fs *);
+
+void bch2_fs_btree_write_buffer_exit(struct bch_fs *);
+int bch2_fs_btree_write_buffer_init(struct bch_fs *);
+
+#endif /* _BCACHEFS_BTREE_WRITE_BUFFER_H */
@@ -7,9 +7,11 @@
 
 #include "bcachefs.h"
 #include "alloc_background.h"
+#include "alloc_foreground.h"
 #include "bset.h"
 #include "btree_gc.h"
 #include "btree_update.h"
+#include "btree_write_buffer.h"
 #include "buckets.h"
 #include "ec.h"
 #include "error.h"
@@ -1265,6 +1267,24 @@ int bch2_mark_update(struct btree_trans *trans, struct btree_iter *iter,
 	return ret;
 }
 
+/*
+ * Write buffered updates don't have an iterator to look up the key being
+ * overwritten; they're only used for btrees whose triggers don't need it:
+ */
+int bch2_mark_buffered_update(struct btree_trans *trans,
+			      struct bkey_i *new, unsigned flags)
+{
+	struct bkey		_deleted = KEY(0, 0, 0);
+	struct bkey_s_c		deleted = (struct bkey_s_c) { &_deleted, NULL };
+
+	if (unlikely(flags & BTREE_TRIGGER_NORUN))
+		return 0;
+
+	return bch2_mark_key_locked(trans->c, deleted, bkey_i_to_s_c(new),
+				    trans->journal_res.seq,
+				    BTREE_TRIGGER_INSERT|flags);
+}
+
 static noinline __cold
 void fs_usage_apply_warn(struct btree_trans *trans,
 			 unsigned disk_res_sectors,
@@ -1401,45 +1421,46 @@ static struct btree_iter *trans_get_update(struct btree_trans *trans,
 	return NULL;
 }
 
+/*
+ * Alloc updates go through the btree write buffer: they're computed from the
+ * in-memory bucket state, which is what @old records - the update is only
+ * applied if it still matches at commit time:
+ */
 static struct bkey_alloc_buf *
-bch2_trans_start_alloc_update(struct btree_trans *trans, struct btree_iter **_iter,
+bch2_trans_start_alloc_update(struct btree_trans *trans,
 			      const struct bch_extent_ptr *ptr,
-			      struct bkey_alloc_unpacked *u)
+			      struct bkey_alloc_unpacked *u,
+			      struct bkey_i **old)
 {
 	struct bch_fs *c = trans->c;
 	struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
 	struct bpos pos = POS(ptr->dev, PTR_BUCKET_NR(ca, ptr));
 	struct bucket *g;
-	struct btree_iter *iter;
-	struct bkey_s_c k;
-	struct bkey_alloc_buf *a;
-	int ret;
+	struct bkey_i *k;
+	struct bkey_alloc_buf *a, *o;
 
 	a = bch2_trans_kmalloc(trans, sizeof(struct bkey_alloc_buf));
 	if (IS_ERR(a))
 		return a;
 
-	iter = trans_get_update(trans, BTREE_ID_alloc, pos, &k);
-	if (iter) {
-		*u = bch2_alloc_unpack(k);
+	k = bch2_trans_peek_buffered(trans, BTREE_ID_alloc, pos);
+	if (k) {
+		*u = bch2_alloc_unpack(bkey_i_to_s_c(k));
+		*old = NULL;
 	} else {
-		iter = bch2_trans_get_iter(trans, BTREE_ID_alloc, pos,
-					   BTREE_ITER_CACHED|
-					   BTREE_ITER_CACHED_NOFILL|
-					   BTREE_ITER_INTENT);
-		ret = bch2_btree_iter_traverse(iter);
-		if (ret) {
-			bch2_trans_iter_put(trans, iter);
-			return ERR_PTR(ret);
-		}
+		o = bch2_trans_kmalloc(trans, sizeof(struct bkey_alloc_buf));
+		if (IS_ERR(o))
+			return o;
 
 		percpu_down_read(&c->mark_lock);
 		g = bucket(ca, pos.offset);
-		*u = alloc_mem_to_key(iter, g, READ_ONCE(g->mark));
+		*u = alloc_mem_to_key(pos, g, READ_ONCE(g->mark));
 		percpu_up_read(&c->mark_lock);
+
+		bch2_alloc_pack(c, o, *u);
+		*old = &o->k;
 	}
 
-	*_iter = iter;
 	return a;
 }
 
@@ -1448,25 +1469,22 @@ static int bch2_trans_mark_pointer(struct btree_trans *trans,
 			s64 sectors, enum bch_data_type data_type)
 {
 	struct bch_fs *c = trans->c;
-	struct btree_iter *iter;
 	struct bkey_alloc_unpacked u;
 	struct bkey_alloc_buf *a;
+	struct bkey_i *old;
 	int ret;
 
-	a = bch2_trans_start_alloc_update(trans, &iter, &p.ptr, &u);
+	a = bch2_trans_start_alloc_update(trans, &p.ptr, &u, &old);
 	if (IS_ERR(a))
 		return PTR_ERR(a);
 
 	ret = __mark_pointer(c, k, &p.ptr, sectors, data_type, u.gen, &u.data_type,
 			     &u.dirty_sectors, &u.cached_sectors);
 	if (ret)
-		goto out;
+		return ret;
 
 	bch2_alloc_pack(c, a, u);
-	bch2_trans_update(trans, iter, &a->k, 0);
-out:
-	bch2_trans_iter_put(trans, iter);
-	return ret;
+	return bch2_trans_update_buffered(trans, BTREE_ID_alloc, &a->k, old, 0);
 }
 
 static int bch2_trans_mark_stripe_ptr(struct btree_trans *trans,
@@ -1592,12 +1610,11 @@ static int bch2_trans_mark_stripe_alloc_ref(struct btree_trans *trans,
 	struct bch_fs *c = trans->c;
 	const struct bch_extent_ptr *ptr = &s.v->ptrs[idx];
 	struct bkey_alloc_buf *a;
-	struct btree_iter *iter;
 	struct bkey_alloc_unpacked u;
+	struct bkey_i *old;
 	bool parity = idx >= s.v->nr_blocks - s.v->nr_redundant;
-	int ret = 0;
 
-	a = bch2_trans_start_alloc_update(trans, &iter, ptr, &u);
+	a = bch2_trans_start_alloc_update(trans, ptr, &u, &old);
 	if (IS_ERR(a))
 		return PTR_ERR(a);
 
@@ -1615,12 +1632,10 @@ static int bch2_trans_mark_stripe_alloc_ref(struct btree_trans *trans,
 
 	if (!deleting) {
 		if (bch2_fs_inconsistent_on(u.stripe && u.stripe != s.k->p.offset, c,
-				"bucket %llu:%llu gen %u: multiple stripes using same bucket (%u, %llu)",
-				iter->pos.inode, iter->pos.offset, u.gen,
-				u.stripe, s.k->p.offset)) {
-			ret = -EIO;
-			goto err;
-		}
+				"bucket %u:%llu gen %u: multiple stripes using same bucket (%u, %llu)",
+				u.dev, u.bucket, u.gen,
+				u.stripe, s.k->p.offset))
+			return -EIO;
 
 		u.stripe		= s.k->p.offset;
 		u.stripe_redundancy	= s.v->nr_redundant;
@@ -1630,10 +1645,7 @@ static int bch2_trans_mark_stripe_alloc_ref(struct btree_trans *trans,
 	}
 
 	bch2_alloc_pack(c, a, u);
-	bch2_trans_update(trans, iter, &a->k, 0);
-err:
-	bch2_trans_iter_put(trans, iter);
-	return ret;
+	return bch2_trans_update_buffered(trans, BTREE_ID_alloc, &a->k, old, 0);
 }
 
 static int bch2_trans_mark_stripe(struct btree_trans *trans,
@@ -1782,6 +1794,10 @@ static int __bch2_trans_mark_reflink_p(struct btree_trans *trans,
 	if (ret)
 		goto err;
 
+	if (!*refcount)
+		bch2_reflink_free_mark_free(c, bkey_start_offset(&n->k),
+					    n->k.p.offset);
+
 	ret = k.k->p.offset - idx;
 err:
 	bch2_trans_iter_put(trans, iter);
@@ -1890,14 +1906,13 @@ static int __bch2_trans_mark_metadata_bucket(struct btree_trans *trans,
 				    unsigned sectors)
 {
 	struct bch_fs *c = trans->c;
-	struct btree_iter *iter;
 	struct bkey_alloc_unpacked u;
 	struct bkey_alloc_buf *a;
+	struct bkey_i *old;
 	struct bch_extent_ptr ptr = {
 		.dev = ca->dev_idx,
 		.offset = bucket_to_sector(ca, b),
 	};
-	int ret = 0;
 
 	/*
 	 * Backup superblock might be past the end of our normal usable space:
@@ -1905,30 +1920,26 @@ static int __bch2_trans_mark_metadata_bucket(struct btree_trans *trans,
 	if (b >= ca->mi.nbuckets)
 		return 0;
 
-	a = bch2_trans_start_alloc_update(trans, &iter, &ptr, &u);
+	a = bch2_trans_start_alloc_update(trans, &ptr, &u, &old);
 	if (IS_ERR(a))
 		return PTR_ERR(a);
 
 	if (u.data_type && u.data_type != type) {
 		bch2_fsck_err(c, FSCK_CAN_IGNORE|FSCK_NEED_FSCK,
-			"bucket %llu:%llu gen %u different types of data in same bucket: %s, %s\n"
+			"bucket %u:%llu gen %u different types of data in same bucket: %s, %s\n"
 			"while marking %s",
-			iter->pos.inode, iter->pos.offset, u.gen,
+			u.dev, u.bucket, u.gen,
 			bch2_data_types[u.data_type],
 			bch2_data_types[type],
 			bch2_data_types[type]);
-		ret = -EIO;
-		goto out;
+		return -EIO;
 	}
 
 	u.data_type	= type;
 	u.dirty_sectors	= sectors;
 
 	bch2_alloc_pack(c, a, u);
-	bch2_trans_update(trans, iter, &a->k, 0);
-out:
-	bch2_trans_iter_put(trans, iter);
-	return ret;
+	return bch2_trans_update_buffered(trans, BTREE_ID_alloc, &a->k, old, 0);
 }
 
 int bch2_trans_mark_metadata_bucket(struct btree_trans *trans,
@@ -2214,6 +2225,7 @@ void bch2_dev_buckets_free(struct bch_dev *ca)
 	for (i = 0; i < ARRAY_SIZE(ca->usage); i++)
 		free_percpu(ca->usage[i]);
 	kfree(ca->usage_base);
+	kfree(ca->alloc_caches);
 }
 
 int bch2_dev_buckets_alloc(struct bch_fs *c, struct bch_dev *ca)
@@ -2224,6 +2236,11 @@ int bch2_dev_buckets_alloc(struct bch_fs *c, struct bch_dev *ca)
 	if (!ca->usage_base)
 		return -ENOMEM;
 
+	ca->alloc_caches = kcalloc(BCH_ALLOC_CACHES_NR,
+				   sizeof(*ca->alloc_caches), GFP_KERNEL);
+	if (!ca->alloc_caches)
+		return -ENOMEM;
+
 	for (i = 0; i < ARRAY_SIZE(ca->usage); i++) {
 		ca->usage[i] = alloc_percpu(struct bch_dev_usage);
 		if (!ca->usage[i])
@@ -68,6 +68,24 @@ static inline u8 bucket_gc_gen(struct bucket *g)
 	return g->mark.gen - g->oldest_gen;
 }
 
+/*
+ * oldest_gen for a bucket being invalidated, i.e. its gen going from @gen to
+ * @gen + 1:
+ *
+ * Only cached pointers can go stale, so if the bucket has no cached data, and
+ * no pointers into it were already stale (oldest_gen == gen), there are no
+ * pointers into it at all and oldest_gen can follow gen. Thus buckets only
+ * accumulate a gc_gen - and need bch2_gc_gens() to walk the btree - when
+ * cached data is invalidated:
+ */
+static inline u8 bucket_invalidate_oldest_gen(u8 oldest_gen, u8 gen,
+					       unsigned cached_sectors)
+{
+	return !cached_sectors && oldest_gen == gen
+		? gen + 1
+		: oldest_gen;
+}
+
 static inline size_t PTR_BUCKET_NR(const struct bch_dev *ca,
 				   const struct bch_extent_ptr *ptr)
 {
@@ -230,6 +248,7 @@ int bch2_mark_key(struct bch_fs *, struct bkey_s_c, unsigned);
 
 int bch2_mark_update(struct btree_trans *, struct btree_iter *,
 		     struct bkey_i *, unsigned);
+int bch2_mark_buffered_update(struct btree_trans *, struct bkey_i *, unsigned);
 
 int bch2_trans_mark_key(struct btree_trans *, struct bkey_s_c,
 			struct bkey_s_c, unsigned);
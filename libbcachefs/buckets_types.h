@@ -121,4 +121,16 @@ struct copygc_heap_entry {
 
 typedef HEAP(struct copygc_heap_entry) copygc_heap;
 
+#define BUCKET_NOCOW_LOCKS_BITS		10
+#define BUCKET_NOCOW_LOCKS		(1U << BUCKET_NOCOW_LOCKS_BITS)
+
+/*
+ * Locks for buckets being overwritten in place (nocow): a lock is shared by in
+ * place writers (> 0), or by data moves (< 0), but never both at once.
+ */
+struct bucket_nocow_lock_table {
+	atomic_t		l[BUCKET_NOCOW_LOCKS];
+	wait_queue_head_t	wait;
+};
+
 #endif /* _BUCKETS_TYPES_H */
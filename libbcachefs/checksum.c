@@ -9,8 +9,10 @@
 #include <linux/key.h>
 #include <linux/random.h>
 #include <linux/scatterlist.h>
+#include <crypto/aes.h>
 #include <crypto/algapi.h>
 #include <crypto/chacha.h>
+#include <crypto/ghash.h>
 #include <crypto/hash.h>
 #include <crypto/poly1305.h>
 #include <crypto/skcipher.h>
@@ -117,6 +119,40 @@ err:
 	return ret;
 }
 
+/*
+ * aes256_gcm is AES-256 in counter mode with a GHASH MAC over the ciphertext,
+ * i.e. GCM with no associated data, with the counter layout chosen to fit our
+ * nonces:
+ *
+ * The counter block is the nonce as a 128 bit big endian integer, so that
+ * nonce_add() seeks into the keystream just as it does with chacha20. The
+ * per-message MAC mask is the encryption of the nonce with BCH_NONCE_POLY set,
+ * as for the poly1305 key, and the GHASH key is the encryption of the all ones
+ * block - neither can be a counter block used for data.
+ */
+static struct nonce aes_nonce(struct nonce nonce)
+{
+	return (struct nonce) {{
+		[0] = (__force __le32) cpu_to_be32(le32_to_cpu(nonce.d[3])),
+		[1] = (__force __le32) cpu_to_be32(le32_to_cpu(nonce.d[2])),
+		[2] = (__force __le32) cpu_to_be32(le32_to_cpu(nonce.d[1])),
+		[3] = (__force __le32) cpu_to_be32(le32_to_cpu(nonce.d[0])),
+	}};
+}
+
+/* Returns the cipher for @type, with @nonce converted to its IV format: */
+static struct crypto_sync_skcipher *bch2_cipher(struct bch_fs *c,
+						unsigned type,
+						struct nonce *nonce)
+{
+	if (bch2_csum_type_is_aes(type)) {
+		*nonce = aes_nonce(*nonce);
+		return c->aes256;
+	}
+
+	return c->chacha20;
+}
+
 static void gen_poly_key(struct bch_fs *c, struct shash_desc *desc,
 			 struct nonce nonce)
 {
@@ -132,6 +168,40 @@ static void gen_poly_key(struct bch_fs *c, struct shash_desc *desc,
 	crypto_shash_update(desc, key, sizeof(key));
 }
 
+static void gcm_init(struct bch_fs *c, struct shash_desc *desc)
+{
+	desc->tfm = c->ghash;
+	crypto_shash_init(desc);
+}
+
+static struct bch_csum gcm_final(struct bch_fs *c, unsigned type,
+				 struct nonce nonce, struct shash_desc *desc,
+				 u64 len)
+{
+	static const u8 zeroes[GHASH_BLOCK_SIZE];
+	__be64 lens[2] = { 0, cpu_to_be64(len * 8) };
+	u8 digest[GHASH_DIGEST_SIZE], mask[AES_BLOCK_SIZE];
+	struct bch_csum ret = { 0 };
+	unsigned i;
+
+	if (len & (GHASH_BLOCK_SIZE - 1))
+		crypto_shash_update(desc, zeroes,
+			GHASH_BLOCK_SIZE - (len & (GHASH_BLOCK_SIZE - 1)));
+	crypto_shash_update(desc, (void *) lens, sizeof(lens));
+	crypto_shash_final(desc, digest);
+
+	nonce.d[3] ^= BCH_NONCE_POLY;
+
+	memset(mask, 0, sizeof(mask));
+	do_encrypt(c->aes256, aes_nonce(nonce), mask, sizeof(mask));
+
+	for (i = 0; i < sizeof(digest); i++)
+		digest[i] ^= mask[i];
+
+	memcpy(&ret, digest, bch_crc_bytes[type]);
+	return ret;
+}
+
 struct bch_csum bch2_checksum(struct bch_fs *c, unsigned type,
 			      struct nonce nonce, const void *data, size_t len)
 {
@@ -163,6 +233,16 @@ struct bch_csum bch2_checksum(struct bch_fs *c, unsigned type,
 		memcpy(&ret, digest, bch_crc_bytes[type]);
 		return ret;
 	}
+
+	case BCH_CSUM_AES256_GCM_80:
+	case BCH_CSUM_AES256_GCM_128: {
+		SHASH_DESC_ON_STACK(desc, c->ghash);
+
+		gcm_init(c, desc);
+		crypto_shash_update(desc, data, len);
+
+		return gcm_final(c, type, nonce, desc, len);
+	}
 	default:
 		BUG();
 	}
@@ -171,10 +251,13 @@ struct bch_csum bch2_checksum(struct bch_fs *c, unsigned type,
 void bch2_encrypt(struct bch_fs *c, unsigned type,
 		  struct nonce nonce, void *data, size_t len)
 {
+	struct crypto_sync_skcipher *tfm;
+
 	if (!bch2_csum_type_is_encryption(type))
 		return;
 
-	do_encrypt(c->chacha20, nonce, data, len);
+	tfm = bch2_cipher(c, type, &nonce);
+	do_encrypt(tfm, nonce, data, len);
 }
 
 static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
@@ -235,6 +318,29 @@ static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
 		memcpy(&ret, digest, bch_crc_bytes[type]);
 		return ret;
 	}
+
+	case BCH_CSUM_AES256_GCM_80:
+	case BCH_CSUM_AES256_GCM_128: {
+		SHASH_DESC_ON_STACK(desc, c->ghash);
+		u64 len = iter->bi_size;
+
+		gcm_init(c, desc);
+
+#ifdef CONFIG_HIGHMEM
+		__bio_for_each_segment(bv, bio, *iter, *iter) {
+			void *p = kmap_atomic(bv.bv_page) + bv.bv_offset;
+
+			crypto_shash_update(desc, p, bv.bv_len);
+			kunmap_atomic(p);
+		}
+#else
+		__bio_for_each_bvec(bv, bio, *iter, *iter)
+			crypto_shash_update(desc,
+				page_address(bv.bv_page) + bv.bv_offset,
+				bv.bv_len);
+#endif
+		return gcm_final(c, type, nonce, desc, len);
+	}
 	default:
 		BUG();
 	}
@@ -248,6 +354,15 @@ struct bch_csum bch2_checksum_bio(struct bch_fs *c, unsigned type,
 	return __bch2_checksum_bio(c, type, nonce, bio, &iter);
 }
 
+static void bch2_encrypt_sg(struct bch_fs *c, unsigned type,
+			    struct nonce nonce,
+			    struct scatterlist *sg, size_t len)
+{
+	struct crypto_sync_skcipher *tfm = bch2_cipher(c, type, &nonce);
+
+	do_encrypt_sg(tfm, nonce, sg, len);
+}
+
 void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 		      struct nonce nonce, struct bio *bio)
 {
@@ -264,9 +379,9 @@ void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 	bio_for_each_segment(bv, bio, iter) {
 		if (sg == sgl + ARRAY_SIZE(sgl)) {
 			sg_mark_end(sg - 1);
-			do_encrypt_sg(c->chacha20, nonce, sgl, bytes);
+			bch2_encrypt_sg(c, type, nonce, sgl, bytes);
 
-			nonce = nonce_add(nonce, bytes);
+			nonce = nonce_add(nonce, type, bytes);
 			bytes = 0;
 
 			sg_init_table(sgl, ARRAY_SIZE(sgl));
@@ -278,7 +393,7 @@ void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 	}
 
 	sg_mark_end(sg - 1);
-	do_encrypt_sg(c->chacha20, nonce, sgl, bytes);
+	bch2_encrypt_sg(c, type, nonce, sgl, bytes);
 }
 
 struct bch_csum bch2_checksum_merge(unsigned type, struct bch_csum a,
@@ -337,7 +452,7 @@ int bch2_rechecksum_bio(struct bch_fs *c, struct bio *bio,
 						      nonce, bio, &iter);
 		else
 			bio_advance_iter(bio, &iter, i->len << 9);
-		nonce = nonce_add(nonce, i->len << 9);
+		nonce = nonce_add(nonce, crc_old.csum_type, i->len << 9);
 	}
 
 	if (mergeable)
@@ -461,8 +576,28 @@ err:
 	return ret;
 }
 
-static int bch2_alloc_ciphers(struct bch_fs *c)
+static int bch2_alloc_ciphers(struct bch_fs *c, unsigned type)
 {
+	if (type == BCH_ENCRYPTION_aes256_gcm) {
+		if (!c->aes256)
+			c->aes256 = crypto_alloc_sync_skcipher("ctr(aes)", 0, 0);
+		if (IS_ERR(c->aes256)) {
+			bch_err(c, "error requesting ctr(aes) module: %li",
+				PTR_ERR(c->aes256));
+			return PTR_ERR(c->aes256);
+		}
+
+		if (!c->ghash)
+			c->ghash = crypto_alloc_shash("ghash", 0, 0);
+		if (IS_ERR(c->ghash)) {
+			bch_err(c, "error requesting ghash module: %li",
+				PTR_ERR(c->ghash));
+			return PTR_ERR(c->ghash);
+		}
+
+		return 0;
+	}
+
 	if (!c->chacha20)
 		c->chacha20 = crypto_alloc_sync_skcipher("chacha20", 0, 0);
 	if (IS_ERR(c->chacha20)) {
@@ -482,6 +617,31 @@ static int bch2_alloc_ciphers(struct bch_fs *c)
 	return 0;
 }
 
+static int bch2_set_key(struct bch_fs *c, unsigned type, struct bch_key *key)
+{
+	u8 h[GHASH_BLOCK_SIZE];
+	struct nonce all_ones;
+	int ret;
+
+	if (type != BCH_ENCRYPTION_aes256_gcm)
+		return crypto_skcipher_setkey(&c->chacha20->base,
+					      (void *) key, sizeof(*key));
+
+	ret = crypto_skcipher_setkey(&c->aes256->base,
+				     (void *) key, sizeof(*key));
+	if (ret)
+		return ret;
+
+	/* GHASH key: */
+	memset(&all_ones, 0xff, sizeof(all_ones));
+	memset(h, 0, sizeof(h));
+	do_encrypt(c->aes256, all_ones, h, sizeof(h));
+
+	ret = crypto_shash_setkey(c->ghash, h, sizeof(h));
+	memzero_explicit(h, sizeof(h));
+	return ret;
+}
+
 int bch2_disable_encryption(struct bch_fs *c)
 {
 	struct bch_sb_field_crypt *crypt;
@@ -514,7 +674,7 @@ out:
 	return ret;
 }
 
-int bch2_enable_encryption(struct bch_fs *c, bool keyed)
+int bch2_enable_encryption(struct bch_fs *c, unsigned type, bool keyed)
 {
 	struct bch_encrypted_key key;
 	struct bch_key user_key;
@@ -527,7 +687,10 @@ int bch2_enable_encryption(struct bch_fs *c, bool keyed)
 	if (bch2_sb_get_crypt(c->disk_sb.sb))
 		goto err;
 
-	ret = bch2_alloc_ciphers(c);
+	if (!type || type >= BCH_ENCRYPTION_NR)
+		goto err;
+
+	ret = bch2_alloc_ciphers(c, type);
 	if (ret)
 		goto err;
 
@@ -547,8 +710,7 @@ int bch2_enable_encryption(struct bch_fs *c, bool keyed)
 			goto err;
 	}
 
-	ret = crypto_skcipher_setkey(&c->chacha20->base,
-			(void *) &key.key, sizeof(key.key));
+	ret = bch2_set_key(c, type, &key.key);
 	if (ret)
 		goto err;
 
@@ -561,7 +723,10 @@ int bch2_enable_encryption(struct bch_fs *c, bool keyed)
 	crypt->key = key;
 
 	/* write superblock */
-	SET_BCH_SB_ENCRYPTION_TYPE(c->disk_sb.sb, 1);
+	SET_BCH_SB_ENCRYPTION_TYPE(c->disk_sb.sb, type);
+	if (type == BCH_ENCRYPTION_aes256_gcm)
+		c->disk_sb.sb->features[0] |=
+			cpu_to_le64(1ULL << BCH_FEATURE_aes256_gcm);
 	bch2_write_super(c);
 err:
 	mutex_unlock(&c->sb_lock);
@@ -572,6 +737,10 @@ err:
 
 void bch2_fs_encryption_exit(struct bch_fs *c)
 {
+	if (!IS_ERR_OR_NULL(c->ghash))
+		crypto_free_shash(c->ghash);
+	if (!IS_ERR_OR_NULL(c->aes256))
+		crypto_free_sync_skcipher(c->aes256);
 	if (!IS_ERR_OR_NULL(c->poly1305))
 		crypto_free_shash(c->poly1305);
 	if (!IS_ERR_OR_NULL(c->chacha20))
@@ -584,6 +753,7 @@ int bch2_fs_encryption_init(struct bch_fs *c)
 {
 	struct bch_sb_field_crypt *crypt;
 	struct bch_key key;
+	unsigned type;
 	int ret = 0;
 
 	pr_verbose_init(c->opts, "");
@@ -599,7 +769,16 @@ int bch2_fs_encryption_init(struct bch_fs *c)
 	if (!crypt)
 		goto out;
 
-	ret = bch2_alloc_ciphers(c);
+	/*
+	 * Not BCH_SB_ENCRYPTION_TYPE, which is cleared by
+	 * bch2_disable_encryption() - but a filesystem only ever gets one
+	 * encryption key, and thus one cipher:
+	 */
+	type = c->sb.features & (1ULL << BCH_FEATURE_aes256_gcm)
+		? BCH_ENCRYPTION_aes256_gcm
+		: BCH_ENCRYPTION_chacha20_poly1305;
+
+	ret = bch2_alloc_ciphers(c, type);
 	if (ret)
 		goto out;
 
@@ -607,8 +786,7 @@ int bch2_fs_encryption_init(struct bch_fs *c)
 	if (ret)
 		goto out;
 
-	ret = crypto_skcipher_setkey(&c->chacha20->base,
-			(void *) &key.key, sizeof(key.key));
+	ret = bch2_set_key(c, type, &key);
 	if (ret)
 		goto out;
 out:
@@ -7,6 +7,7 @@
 #include "super-io.h"
 
 #include <linux/crc64.h>
+#include <crypto/aes.h>
 #include <crypto/chacha.h>
 
 static inline bool bch2_checksum_mergeable(unsigned type)
@@ -68,7 +69,7 @@ int bch2_decrypt_sb_key(struct bch_fs *, struct bch_sb_field_crypt *,
 			struct bch_key *);
 
 int bch2_disable_encryption(struct bch_fs *);
-int bch2_enable_encryption(struct bch_fs *, bool);
+int bch2_enable_encryption(struct bch_fs *, unsigned, bool);
 
 void bch2_fs_encryption_exit(struct bch_fs *);
 int bch2_fs_encryption_init(struct bch_fs *);
@@ -91,6 +92,11 @@ static inline enum bch_csum_type bch2_csum_opt_to_type(enum bch_csum_opts type,
 static inline enum bch_csum_type bch2_data_checksum_type(struct bch_fs *c,
 							 unsigned opt)
 {
+	if (c->sb.encryption_type == BCH_ENCRYPTION_aes256_gcm)
+		return c->opts.wide_macs
+			? BCH_CSUM_AES256_GCM_128
+			: BCH_CSUM_AES256_GCM_80;
+
 	if (c->sb.encryption_type)
 		return c->opts.wide_macs
 			? BCH_CSUM_CHACHA20_POLY1305_128
@@ -101,6 +107,9 @@ static inline enum bch_csum_type bch2_data_checksum_type(struct bch_fs *c,
 
 static inline enum bch_csum_type bch2_meta_checksum_type(struct bch_fs *c)
 {
+	if (c->sb.encryption_type == BCH_ENCRYPTION_aes256_gcm)
+		return BCH_CSUM_AES256_GCM_128;
+
 	if (c->sb.encryption_type)
 		return BCH_CSUM_CHACHA20_POLY1305_128;
 
@@ -119,7 +128,9 @@ static inline bool bch2_checksum_type_valid(const struct bch_fs *c,
 	if (type >= BCH_CSUM_NR)
 		return false;
 
-	if (bch2_csum_type_is_encryption(type) && !c->chacha20)
+	if (bch2_csum_type_is_aes(type)
+	    ? !c->aes256
+	    : bch2_csum_type_is_encryption(type) && !c->chacha20)
 		return false;
 
 	return true;
@@ -135,12 +146,20 @@ static inline bool bch2_crc_cmp(struct bch_csum l, struct bch_csum r)
 	return ((l.lo ^ r.lo) | (l.hi ^ r.hi)) != 0;
 }
 
-/* for skipping ahead and encrypting/decrypting at an offset: */
-static inline struct nonce nonce_add(struct nonce nonce, unsigned offset)
+/*
+ * For skipping ahead and encrypting/decrypting at an offset: nonce.d[0] is the
+ * block counter, in units of the cipher's block size:
+ */
+static inline struct nonce nonce_add(struct nonce nonce, unsigned type,
+				     unsigned offset)
 {
-	EBUG_ON(offset & (CHACHA_BLOCK_SIZE - 1));
+	unsigned block_size = bch2_csum_type_is_aes(type)
+		? AES_BLOCK_SIZE
+		: CHACHA_BLOCK_SIZE;
+
+	EBUG_ON(offset & (block_size - 1));
 
-	le32_add_cpu(&nonce.d[0], offset / CHACHA_BLOCK_SIZE);
+	le32_add_cpu(&nonce.d[0], offset / block_size);
 	return nonce;
 }
 
@@ -167,7 +186,7 @@ static inline struct nonce extent_nonce(struct bversion version,
 				  (compression_type << 24))^BCH_NONCE_EXTENT,
 	}};
 
-	return nonce_add(nonce, crc.nonce << 9);
+	return nonce_add(nonce, crc.csum_type, crc.nonce << 9);
 }
 
 static inline bool bch2_key_is_encrypted(struct bch_encrypted_key *key)
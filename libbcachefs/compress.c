@@ -150,6 +150,29 @@ static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 #endif
 }
 
+/* Trained dictionaries: */
+
+struct zstd_dict {
+	u32			id;
+	void			*data;
+	size_t			len;
+	void			*cdict_workspace;
+	void			*ddict_workspace;
+	const ZSTD_CDict	*cdict;
+	const ZSTD_DDict	*ddict;
+};
+
+static struct zstd_dict *zstd_dict_get(struct bch_fs *c, u32 id)
+{
+	struct zstd_dict *d;
+
+	for (d = c->zstd_dicts; d < c->zstd_dicts + c->nr_zstd_dicts; d++)
+		if (d->id == id)
+			return d;
+
+	return NULL;
+}
+
 static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 			    void *dst_data, struct bch_extent_crc_unpacked crc)
 {
@@ -192,14 +215,31 @@ static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 	case BCH_COMPRESSION_TYPE_zstd: {
 		ZSTD_DCtx *ctx;
 		size_t real_src_len = le32_to_cpup(src_data.b);
+		struct zstd_dict *dict = NULL;
+		unsigned dict_id;
 
 		if (real_src_len > src_len - 4)
 			goto err;
 
+		dict_id = ZSTD_getDictID_fromFrame(src_data.b + 4, real_src_len);
+		if (dict_id) {
+			dict = zstd_dict_get(c, dict_id);
+			if (!dict) {
+				bch_err_ratelimited(c, "extent compressed with unknown zstd dictionary %u",
+						    dict_id);
+				goto err;
+			}
+		}
+
 		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOIO);
 		ctx = ZSTD_initDCtx(workspace, ZSTD_DCtxWorkspaceBound());
 
-		ret = ZSTD_decompressDCtx(ctx,
+		ret = dict
+			? ZSTD_decompress_usingDDict(ctx,
+				dst_data,	dst_len,
+				src_data.b + 4, real_src_len,
+				dict->ddict)
+			: ZSTD_decompressDCtx(ctx,
 				dst_data,	dst_len,
 				src_data.b + 4, real_src_len);
 
@@ -296,7 +336,8 @@ static int attempt_compress(struct bch_fs *c,
 			    void *workspace,
 			    void *dst, size_t dst_len,
 			    void *src, size_t src_len,
-			    enum bch_compression_type compression_type)
+			    enum bch_compression_type compression_type,
+			    struct zstd_dict *dict)
 {
 	switch (compression_type) {
 	case BCH_COMPRESSION_TYPE_lz4: {
@@ -346,8 +387,16 @@ static int attempt_compress(struct bch_fs *c,
 		 * write just past the end of the buffer - so subtract a fudge
 		 * factor (7 bytes) from the dst buffer size to account for
 		 * that.
+		 *
+		 * Frames compressed with a dictionary record its id, which is
+		 * how we find the dictionary again when decompressing.
 		 */
-		size_t len = ZSTD_compressCCtx(ctx,
+		size_t len = dict
+			? ZSTD_compress_usingCDict(ctx,
+				dst + 4,	dst_len - 4 - 7,
+				src,		src_len,
+				dict->cdict)
+			: ZSTD_compressCCtx(ctx,
 				dst + 4,	dst_len - 4 - 7,
 				src,		src_len,
 				c->zstd_params);
@@ -365,9 +414,13 @@ static int attempt_compress(struct bch_fs *c,
 static unsigned __bio_compress(struct bch_fs *c,
 			       struct bio *dst, size_t *dst_len,
 			       struct bio *src, size_t *src_len,
-			       enum bch_compression_type compression_type)
+			       enum bch_compression_type compression_type,
+			       unsigned compression_dict)
 {
 	struct bbuf src_data = { NULL }, dst_data = { NULL };
+	struct zstd_dict *dict = compression_type == BCH_COMPRESSION_TYPE_zstd
+		? zstd_dict_get(c, compression_dict)
+		: NULL;
 	void *workspace;
 	unsigned pad;
 	int ret = 0;
@@ -400,7 +453,7 @@ static unsigned __bio_compress(struct bch_fs *c,
 		ret = attempt_compress(c, workspace,
 				       dst_data.b,	*dst_len,
 				       src_data.b,	*src_len,
-				       compression_type);
+				       compression_type, dict);
 		if (ret > 0) {
 			*dst_len = ret;
 			ret = 0;
@@ -459,7 +512,8 @@ err:
 unsigned bch2_bio_compress(struct bch_fs *c,
 			   struct bio *dst, size_t *dst_len,
 			   struct bio *src, size_t *src_len,
-			   unsigned compression_type)
+			   unsigned compression_type,
+			   unsigned compression_dict)
 {
 	unsigned orig_dst = dst->bi_iter.bi_size;
 	unsigned orig_src = src->bi_iter.bi_size;
@@ -474,7 +528,8 @@ unsigned bch2_bio_compress(struct bch_fs *c,
 		compression_type = BCH_COMPRESSION_TYPE_lz4;
 
 	compression_type =
-		__bio_compress(c, dst, dst_len, src, src_len, compression_type);
+		__bio_compress(c, dst, dst_len, src, src_len,
+			       compression_type, compression_dict);
 
 	dst->bi_iter.bi_size = orig_dst;
 	src->bi_iter.bi_size = orig_src;
@@ -495,6 +550,7 @@ static const unsigned bch2_compression_opt_to_feature[] = {
 
 static int __bch2_check_set_has_compressed_data(struct bch_fs *c, u64 f)
 {
+	u64 seq;
 	int ret = 0;
 
 	if ((c->sb.features & f) == f)
@@ -514,10 +570,10 @@ static int __bch2_check_set_has_compressed_data(struct bch_fs *c, u64 f)
 	}
 
 	c->disk_sb.sb->features[0] |= cpu_to_le64(f);
-	bch2_write_super(c);
+	seq = bch2_sb_change(c);
 	mutex_unlock(&c->sb_lock);
 
-	return 0;
+	return bch2_write_super_wait(c, seq);
 }
 
 int bch2_check_set_has_compressed_data(struct bch_fs *c,
@@ -531,10 +587,30 @@ int bch2_check_set_has_compressed_data(struct bch_fs *c,
 		: 0;
 }
 
+static void bch2_fs_zstd_dicts_exit(struct bch_fs *c)
+{
+	size_t cdict_size, ddict_size;
+	struct zstd_dict *d;
+
+	if (!c->zstd_dicts)
+		return;
+
+	cdict_size = ZSTD_CDictWorkspaceBound(c->zstd_params.cParams);
+	ddict_size = ZSTD_DDictWorkspaceBound();
+
+	for (d = c->zstd_dicts; d < c->zstd_dicts + c->nr_zstd_dicts; d++) {
+		kvpfree(d->ddict_workspace, ddict_size);
+		kvpfree(d->cdict_workspace, cdict_size);
+		kfree(d->data);
+	}
+	kfree(c->zstd_dicts);
+}
+
 void bch2_fs_compress_exit(struct bch_fs *c)
 {
 	unsigned i;
 
+	bch2_fs_zstd_dicts_exit(c);
 	mempool_exit(&c->decompress_workspace);
 	for (i = 0; i < ARRAY_SIZE(c->compress_workspace); i++)
 		mempool_exit(&c->compress_workspace[i]);
@@ -625,6 +701,57 @@ out:
 	return ret;
 }
 
+/*
+ * Dictionaries are digested once, at startup, and kept for the life of the
+ * filesystem; they only change offline, with bcachefs train-dict:
+ */
+static int bch2_fs_zstd_dicts_init(struct bch_fs *c)
+{
+	struct bch_sb_field_zstd_dicts *f =
+		bch2_sb_get_zstd_dicts(c->disk_sb.sb);
+	size_t cdict_size = ZSTD_CDictWorkspaceBound(c->zstd_params.cParams);
+	size_t ddict_size = ZSTD_DDictWorkspaceBound();
+	struct bch_zstd_dict *i;
+	struct zstd_dict *d;
+	unsigned nr = 0;
+
+	if (!f)
+		return 0;
+
+	for_each_zstd_dict(f, i)
+		nr++;
+
+	c->zstd_dicts = kcalloc(nr, sizeof(*c->zstd_dicts), GFP_KERNEL);
+	if (!c->zstd_dicts)
+		return -ENOMEM;
+
+	for_each_zstd_dict(f, i) {
+		d = c->zstd_dicts + c->nr_zstd_dicts++;
+
+		d->id			= le32_to_cpu(i->id);
+		d->len			= le32_to_cpu(i->len);
+		d->data			= kmemdup(i->data, d->len, GFP_KERNEL);
+		d->cdict_workspace	= kvpmalloc(cdict_size, GFP_KERNEL);
+		d->ddict_workspace	= kvpmalloc(ddict_size, GFP_KERNEL);
+
+		if (!d->data ||
+		    !d->cdict_workspace ||
+		    !d->ddict_workspace)
+			return -ENOMEM;
+
+		d->cdict = ZSTD_initCDict(d->data, d->len, c->zstd_params,
+					  d->cdict_workspace, cdict_size);
+		d->ddict = ZSTD_initDDict(d->data, d->len,
+					  d->ddict_workspace, ddict_size);
+		if (!d->cdict || !d->ddict) {
+			bch_err(c, "error loading zstd dictionary %u", d->id);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
 int bch2_fs_compress_init(struct bch_fs *c)
 {
 	u64 f = c->sb.features;
@@ -635,6 +762,50 @@ int bch2_fs_compress_init(struct bch_fs *c)
 	if (c->opts.background_compression)
 		f |= 1ULL << bch2_compression_opt_to_feature[c->opts.background_compression];
 
-	return __bch2_fs_compress_init(c, f);
+	return __bch2_fs_compress_init(c, f) ?:
+		bch2_fs_zstd_dicts_init(c);
+}
+
+static const char *bch2_sb_zstd_dicts_validate(struct bch_sb *sb,
+					       struct bch_sb_field *f)
+{
+	struct bch_sb_field_zstd_dicts *dicts = field_to_type(f, zstd_dicts);
+	struct bch_zstd_dict *d, *i;
+
+	for_each_zstd_dict(dicts, d) {
+		if ((void *) d->data > vstruct_end(f) ||
+		    (void *) zstd_dict_next(d) > vstruct_end(f))
+			return "invalid dictionary: past end of field";
 
+		if (!le32_to_cpu(d->id))
+			return "invalid dictionary: id 0";
+
+		if (!le32_to_cpu(d->len))
+			return "invalid dictionary: empty";
+
+		for_each_zstd_dict(dicts, i) {
+			if (i == d)
+				break;
+			if (i->id == d->id)
+				return "duplicate dictionary id";
+		}
+	}
+
+	return NULL;
 }
+
+static void bch2_sb_zstd_dicts_to_text(struct printbuf *out,
+				       struct bch_sb *sb,
+				       struct bch_sb_field *f)
+{
+	struct bch_sb_field_zstd_dicts *dicts = field_to_type(f, zstd_dicts);
+	struct bch_zstd_dict *d;
+
+	for_each_zstd_dict(dicts, d)
+		pr_buf(out, " %u:%u", le32_to_cpu(d->id), le32_to_cpu(d->len));
+}
+
+const struct bch_sb_field_ops bch_sb_field_ops_zstd_dicts = {
+	.validate	= bch2_sb_zstd_dicts_validate,
+	.to_text	= bch2_sb_zstd_dicts_to_text,
+};
@@ -3,16 +3,34 @@
 #define _BCACHEFS_COMPRESS_H
 
 #include "extents_types.h"
+#include "vstructs.h"
+
+static inline unsigned zstd_dict_bytes(struct bch_zstd_dict *d)
+{
+	return round_up(sizeof(*d) + le32_to_cpu(d->len), sizeof(u64));
+}
+
+static inline struct bch_zstd_dict *zstd_dict_next(struct bch_zstd_dict *d)
+{
+	return (void *) d + zstd_dict_bytes(d);
+}
+
+#define for_each_zstd_dict(_f, _d)					\
+	for (_d = (_f)->start;						\
+	     (void *) (_d) < vstruct_end(&(_f)->field);			\
+	     (_d) = zstd_dict_next(_d))
 
 int bch2_bio_uncompress_inplace(struct bch_fs *, struct bio *,
 				struct bch_extent_crc_unpacked *);
 int bch2_bio_uncompress(struct bch_fs *, struct bio *, struct bio *,
 		       struct bvec_iter, struct bch_extent_crc_unpacked);
 unsigned bch2_bio_compress(struct bch_fs *, struct bio *, size_t *,
-			   struct bio *, size_t *, unsigned);
+			   struct bio *, size_t *, unsigned, unsigned);
 
 int bch2_check_set_has_compressed_data(struct bch_fs *, unsigned);
 void bch2_fs_compress_exit(struct bch_fs *);
 int bch2_fs_compress_init(struct bch_fs *);
 
+extern const struct bch_sb_field_ops bch_sb_field_ops_zstd_dicts;
+
 #endif /* _BCACHEFS_COMPRESS_H */
@@ -2124,9 +2124,18 @@ int bch2_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	if (ret)
 		return ret;
 out:
-	if (!c->opts.journal_flush_disabled)
+	if (!c->opts.journal_flush_disabled) {
 		ret = bch2_journal_flush_seq(&c->journal,
 					     inode->ei_journal_seq);
+
+		/*
+		 * In place (nocow) writes don't go through the journal; a new
+		 * journal write flushes them, along with the device caches:
+		 */
+		if (!ret && io_opts(c, &inode->ei_inode).nocow)
+			ret = bch2_journal_meta(&c->journal);
+	}
+
 	ret2 = file_check_and_advance_wb_err(file);
 
 	return ret ?: ret2;
@@ -2577,6 +2586,18 @@ reassemble:
 		copy.k->k.p.offset += shift >> 9;
 		bch2_btree_iter_set_pos(dst, bkey_start_pos(&copy.k->k));
 
+		/*
+		 * export keeps extents on the replica by version number, and the
+		 * replica has the old data at this position - so moved extents
+		 * need a new version. Encrypted extents can't get one (it's the
+		 * nonce); export never keeps those:
+		 */
+		if (!bversion_zero(copy.k->k.version) &&
+		    !bch2_bkey_is_encrypted(bkey_i_to_s_c(copy.k)))
+			copy.k->k.version = (struct bversion) {
+				.lo = atomic64_inc_return(&c->key_version),
+			};
+
 		ret = bch2_extent_atomic_end(dst, copy.k, &atomic_end);
 		if (ret)
 			continue;
@@ -14,6 +14,7 @@
 
 #include <linux/bsearch.h>
 #include <linux/dcache.h> /* struct qstr */
+#include <linux/sort.h>
 
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
 
@@ -286,6 +287,71 @@ static int walk_inode(struct btree_trans *trans,
 	return 0;
 }
 
+/*
+ * Incremental fsck only checks the inodes in an inum_list - the inodes that
+ * keys in the journal touched:
+ */
+struct inum_list {
+	size_t		nr;
+	size_t		size;
+	u64		*d;
+};
+
+static int inum_list_add(struct inum_list *l, u64 inum)
+{
+	if (l->nr == l->size) {
+		size_t new_size = max_t(size_t, 256UL, l->size * 2);
+		void *n = krealloc(l->d, new_size * sizeof(l->d[0]),
+				   GFP_KERNEL);
+		if (!n)
+			return -ENOMEM;
+
+		l->d = n;
+		l->size = new_size;
+	}
+
+	l->d[l->nr++] = inum;
+	return 0;
+}
+
+/* Returns the first inode in @l >= @inum, or NULL: */
+static u64 *inum_list_next(struct inum_list *l, u64 inum)
+{
+	size_t lo = 0, hi = l->nr;
+
+	while (lo < hi) {
+		size_t m = lo + (hi - lo) / 2;
+
+		if (l->d[m] < inum)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+
+	return lo < l->nr ? &l->d[lo] : NULL;
+}
+
+/*
+ * For btrees keyed by inode number: if @inum isn't to be checked, move @iter
+ * to the next inode that is and reset the inode walker:
+ */
+static bool fsck_skip_inode(struct inum_list *l, struct btree_iter *iter,
+			    struct inode_walker *w, u64 inum)
+{
+	u64 *next;
+
+	if (!l)
+		return false;
+
+	next = inum_list_next(l, inum);
+	if (next && *next == inum)
+		return false;
+
+	bch2_btree_iter_set_pos(iter, next ? POS(*next, 0) : POS_MAX);
+	*w = inode_walker_init();
+	return true;
+}
+
 static int hash_redo_key(struct btree_trans *trans,
 			 const struct bch_hash_desc desc,
 			 struct bch_hash_info *hash_info,
@@ -608,7 +674,7 @@ static bool inode_backpointer_matches(struct bkey_s_c_dirent d,
  * that i_size an i_sectors are consistent
  */
 noinline_for_stack
-static int check_extents(struct bch_fs *c)
+static int check_extents(struct bch_fs *c, struct inum_list *l)
 {
 	struct inode_walker w = inode_walker_init();
 	struct btree_trans trans;
@@ -645,6 +711,9 @@ retry:
 				break;
 		}
 
+		if (fsck_skip_inode(l, iter, &w, k.k->p.inode))
+			continue;
+
 		if (bkey_cmp(prev.k->k.p, bkey_start_pos(k.k)) > 0) {
 			char buf1[200];
 			char buf2[200];
@@ -709,7 +778,7 @@ fsck_err:
  * validate d_type
  */
 noinline_for_stack
-static int check_dirents(struct bch_fs *c)
+static int check_dirents(struct bch_fs *c, struct inum_list *l)
 {
 	struct inode_walker w = inode_walker_init();
 	struct bch_hash_info hash_info;
@@ -749,6 +818,9 @@ retry:
 				break;
 		}
 
+		if (fsck_skip_inode(l, iter, &w, k.k->p.inode))
+			continue;
+
 		ret = walk_inode(&trans, &w, k.k->p.inode);
 		if (ret)
 			break;
@@ -915,7 +987,7 @@ fsck_err:
  * Walk xattrs: verify that they all have a corresponding inode
  */
 noinline_for_stack
-static int check_xattrs(struct bch_fs *c)
+static int check_xattrs(struct bch_fs *c, struct inum_list *l)
 {
 	struct inode_walker w = inode_walker_init();
 	struct bch_hash_info hash_info;
@@ -935,6 +1007,9 @@ static int check_xattrs(struct bch_fs *c)
 retry:
 	while ((k = bch2_btree_iter_peek(iter)).k &&
 	       !(ret = bkey_err(k))) {
+		if (fsck_skip_inode(l, iter, &w, k.k->p.inode))
+			continue;
+
 		ret = walk_inode(&trans, &w, k.k->p.inode);
 		if (ret)
 			break;
@@ -1405,9 +1480,9 @@ int bch2_fsck_full(struct bch_fs *c)
 	struct bch_inode_unpacked root_inode;
 
 	return  check_inodes(c, true) ?:
-		check_extents(c) ?:
-		check_dirents(c) ?:
-		check_xattrs(c) ?:
+		check_extents(c, NULL) ?:
+		check_dirents(c, NULL) ?:
+		check_xattrs(c, NULL) ?:
 		check_root(c, &root_inode) ?:
 		check_directory_structure(c) ?:
 		check_nlinks(c);
@@ -1417,3 +1492,233 @@ int bch2_fsck_walk_inodes_only(struct bch_fs *c)
 {
 	return check_inodes(c, false);
 }
+
+/* Incremental fsck: */
+
+static int u64_cmp(const void *_l, const void *_r)
+{
+	const u64 *l = _l, *r = _r;
+
+	return cmp_int(*l, *r);
+}
+
+/*
+ * The keys in the journal cover every transaction that might not have been
+ * completely written out, so the inodes they touch are the only ones that can
+ * have been left inconsistent by a crash. Updates to an inode's links change
+ * both the dirent and the inode in the same transaction, so the targets of
+ * deleted dirents are in the journal too:
+ */
+static int fsck_journal_inodes(struct bch_fs *c, struct inum_list *l)
+{
+	struct journal_keys *keys = &c->journal_keys;
+	struct journal_key *i;
+	size_t src, dst;
+	int ret = 0;
+
+	for (i = keys->d; i < keys->d + keys->nr && !ret; i++) {
+		if (i->level)
+			continue;
+
+		switch (i->btree_id) {
+		case BTREE_ID_inodes:
+			ret = inum_list_add(l, i->k->k.p.offset);
+			break;
+		case BTREE_ID_dirents:
+			ret = inum_list_add(l, i->k->k.p.inode);
+			if (!ret && i->k->k.type == KEY_TYPE_dirent)
+				ret = inum_list_add(l,
+					le64_to_cpu(bkey_i_to_dirent(i->k)->v.d_inum));
+			break;
+		case BTREE_ID_extents:
+		case BTREE_ID_xattrs:
+			ret = inum_list_add(l, i->k->k.p.inode);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (ret)
+		return ret;
+
+	sort(l->d, l->nr, sizeof(l->d[0]), u64_cmp, NULL);
+
+	for (src = dst = 0; src < l->nr; src++)
+		if (!dst || l->d[src] != l->d[dst - 1])
+			l->d[dst++] = l->d[src];
+	l->nr = dst;
+
+	return 0;
+}
+
+noinline_for_stack
+static int check_inodes_list(struct bch_fs *c, struct inum_list *l)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	size_t i;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	for (i = 0; i < l->nr && !ret; i++) {
+		iter = bch2_trans_get_iter(&trans, BTREE_ID_inodes,
+					   POS(0, l->d[i]), BTREE_ITER_INTENT);
+		k = bch2_btree_iter_peek_slot(iter);
+
+		ret = bkey_err(k);
+		if (!ret && k.k->type == KEY_TYPE_inode)
+			ret = check_inode(&trans, iter, bkey_s_c_to_inode(k));
+		bch2_trans_iter_put(&trans, iter);
+	}
+
+	BUG_ON(ret == -EINTR);
+
+	return bch2_trans_exit(&trans) ?: ret;
+}
+
+noinline_for_stack
+static int check_directory_structure_list(struct bch_fs *c,
+					  struct inum_list *l)
+{
+	struct btree_trans trans;
+	struct bch_inode_unpacked u;
+	struct pathbuf path = { 0, 0, NULL };
+	u32 snapshot;
+	size_t i;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	for (i = 0; i < l->nr; i++) {
+		ret = lockrestart_do(&trans,
+			lookup_inode(&trans, l->d[i], &u, &snapshot));
+		if (ret == -ENOENT) {
+			ret = 0;
+			continue;
+		}
+		if (ret)
+			break;
+
+		ret = check_path(&trans, &path, &u);
+		if (ret)
+			break;
+	}
+
+	kfree(path.entries);
+
+	return bch2_trans_exit(&trans) ?: ret;
+}
+
+static int check_nlink_one(struct btree_trans *trans, struct nlink *link)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter *iter;
+	struct bch_inode_unpacked u;
+	int ret;
+
+	iter = bch2_inode_peek(trans, &u, link->inum, BTREE_ITER_INTENT);
+	ret = PTR_ERR_OR_ZERO(iter);
+	if (ret)
+		return ret == -ENOENT ? 0 : ret;
+
+	if (fsck_err_on(bch2_inode_nlink_get(&u) != link->count, c,
+			"inode %llu has wrong i_nlink (type %u i_nlink %u, should be %u)",
+			u.bi_inum, mode_to_type(u.bi_mode),
+			bch2_inode_nlink_get(&u), link->count)) {
+		bch2_inode_nlink_set(&u, link->count);
+
+		ret = bch2_inode_write(trans, iter, &u) ?:
+			bch2_trans_commit(trans, NULL, NULL,
+					  BTREE_INSERT_NOFAIL|
+					  BTREE_INSERT_LAZY_RW);
+	}
+fsck_err:
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+/*
+ * Link counts still need a walk of every dirent - but only the inodes in @l
+ * are counted, and then only if one of them could have hardlinks:
+ */
+noinline_for_stack
+static int check_nlinks_list(struct bch_fs *c, struct inum_list *l)
+{
+	struct btree_trans trans;
+	struct nlink_table links = { 0 };
+	struct bch_inode_unpacked u;
+	u32 snapshot;
+	size_t i;
+	int ret = 0;
+
+	bch_verbose(c, "checking inode nlinks");
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	for (i = 0; i < l->nr; i++) {
+		ret = lockrestart_do(&trans,
+			lookup_inode(&trans, l->d[i], &u, &snapshot));
+		if (ret == -ENOENT) {
+			ret = 0;
+			continue;
+		}
+		if (ret)
+			goto err;
+
+		if (S_ISDIR(u.bi_mode) || !u.bi_nlink)
+			continue;
+
+		ret = add_nlink(&links, l->d[i], snapshot);
+		if (ret)
+			goto err;
+	}
+
+	if (!links.nr)
+		goto err;
+
+	ret = check_nlinks_walk_dirents(c, &links, 0, U64_MAX);
+	if (ret)
+		goto err;
+
+	for (i = 0; i < links.nr; i++) {
+		ret = lockrestart_do(&trans,
+			check_nlink_one(&trans, &links.d[i]));
+		if (ret)
+			break;
+	}
+err:
+	kvfree(links.d);
+
+	return bch2_trans_exit(&trans) ?: ret;
+}
+
+/*
+ * Like bch2_fsck_full(), but only checks inodes touched by keys in the journal
+ * - after a crash, those are the only ones that can be inconsistent:
+ */
+int bch2_fsck_incremental(struct bch_fs *c)
+{
+	struct bch_inode_unpacked root_inode;
+	struct inum_list l = { 0 };
+	int ret;
+
+	ret = fsck_journal_inodes(c, &l);
+	if (ret)
+		goto err;
+
+	bch_info(c, "checking %zu inodes touched by the journal", l.nr);
+
+	ret =   check_root(c, &root_inode) ?:
+		check_inodes_list(c, &l) ?:
+		check_extents(c, &l) ?:
+		check_dirents(c, &l) ?:
+		check_xattrs(c, &l) ?:
+		check_directory_structure_list(c, &l) ?:
+		check_nlinks_list(c, &l);
+err:
+	kfree(l.d);
+	return ret;
+}
@@ -4,5 +4,6 @@
 
 int bch2_fsck_full(struct bch_fs *);
 int bch2_fsck_walk_inodes_only(struct bch_fs *);
+int bch2_fsck_incremental(struct bch_fs *);
 
 #endif /* _BCACHEFS_FSCK_H */
@@ -469,47 +469,152 @@ static inline u32 bkey_generation(struct bkey_s_c k)
 	}
 }
 
-struct btree_iter *bch2_inode_create(struct btree_trans *trans,
-				     struct bch_inode_unpacked *inode_u,
-				     u32 snapshot, u64 cpu)
+static struct inode_alloc_shard *inode_alloc_shard(struct bch_fs *c, u64 cpu,
+						   u64 *min, u64 *max)
 {
-	struct bch_fs *c = trans->c;
-	struct btree_iter *iter = NULL;
-	struct bkey_s_c k;
-	u64 min, max, start, pos, *hint;
-	int ret = 0;
 	unsigned bits = (c->opts.inodes_32bit ? 31 : 63);
 
 	if (c->opts.shard_inode_numbers) {
 		bits -= c->inode_shard_bits;
 
-		min = (cpu << bits);
-		max = (cpu << bits) | ~(ULLONG_MAX << bits);
+		*min = (cpu << bits);
+		*max = (cpu << bits) | ~(ULLONG_MAX << bits);
 
-		min = max_t(u64, min, BLOCKDEV_INODE_MAX);
-		hint = c->unused_inode_hints + cpu;
+		*min = max_t(u64, *min, BLOCKDEV_INODE_MAX);
+		return c->inode_alloc_shards + cpu;
 	} else {
-		min = BLOCKDEV_INODE_MAX;
-		max = ~(ULLONG_MAX << bits);
-		hint = c->unused_inode_hints;
+		*min = BLOCKDEV_INODE_MAX;
+		*max = ~(ULLONG_MAX << bits);
+		return c->inode_alloc_shards;
 	}
+}
+
+static void inode_free_range_add(struct inode_alloc_shard *s,
+				 u64 start, u64 end)
+{
+	struct inode_free_range *r;
+
+	if (start >= end)
+		return;
+
+	spin_lock(&s->lock);
+	for (r = s->r; r < s->r + s->nr; r++)
+		if (start <= r->end && end >= r->start) {
+			r->start	= min(r->start, start);
+			r->end		= max(r->end, end);
+			goto out;
+		}
+
+	if (s->nr < ARRAY_SIZE(s->r))
+		s->r[s->nr++] = (struct inode_free_range) { start, end };
+out:
+	spin_unlock(&s->lock);
+}
+
+static bool inode_free_range_pop(struct inode_alloc_shard *s,
+				 u64 min, u64 max, u64 *inum)
+{
+	bool ret = false;
+
+	spin_lock(&s->lock);
+	while (s->nr && !ret) {
+		struct inode_free_range *r = &s->r[s->nr - 1];
+
+		if (r->start >= min && r->start < min_t(u64, r->end, max)) {
+			*inum = r->start++;
+			ret = true;
+		}
+
+		if (r->start >= min_t(u64, r->end, max) || r->start < min)
+			s->nr--;
+	}
+	spin_unlock(&s->lock);
+
+	return ret;
+}
+
+/*
+ * Returns 1 if inode number @inum is free in @snapshot - there's no key at all
+ * in the inodes btree at that offset, or just a deleted inode in @snapshot:
+ */
+static int inode_slot_free(struct btree_trans *trans, struct btree_iter *iter,
+			   u64 inum, u32 snapshot)
+{
+	struct bch_fs *c = trans->c;
+	struct bkey_s_c k;
+	int ret;
+
+	if (bch2_btree_key_cache_find(c, BTREE_ID_inodes, POS(0, inum)) ||
+	    bch2_btree_key_cache_find(c, BTREE_ID_inodes, SPOS(0, inum, snapshot)))
+		return 0;
+
+	bch2_btree_iter_set_pos(iter, POS(0, inum));
+	k = bch2_btree_iter_peek(iter);
+	ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	if (!k.k || bkey_cmp(k.k->p, SPOS(0, inum, U32_MAX)) > 0)
+		return 1;
+
+	if (k.k->p.snapshot != snapshot ||
+	    k.k->type == KEY_TYPE_inode)
+		return 0;
+
+	k = bch2_btree_iter_next(iter);
+	ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	return !k.k || bkey_cmp(k.k->p, SPOS(0, inum, U32_MAX)) > 0;
+}
 
-	start = READ_ONCE(*hint);
+struct btree_iter *bch2_inode_create(struct btree_trans *trans,
+				     struct bch_inode_unpacked *inode_u,
+				     u32 snapshot, u64 cpu)
+{
+	struct bch_fs *c = trans->c;
+	struct inode_alloc_shard *shard;
+	struct btree_iter *iter = NULL;
+	struct bkey_s_c k;
+	u64 min, max, start, pos;
+	int ret = 0;
+
+	shard = inode_alloc_shard(c, cpu, &min, &max);
+
+	start = READ_ONCE(shard->hint);
 
 	if (start >= max || start < min)
 		start = min;
 
-	pos = start;
-	iter = bch2_trans_get_iter(trans, BTREE_ID_inodes, POS(0, pos),
+	iter = bch2_trans_get_iter(trans, BTREE_ID_inodes, POS(0, start),
 				   BTREE_ITER_ALL_SNAPSHOTS|
 				   BTREE_ITER_INTENT);
+
+	while (inode_free_range_pop(shard, min, max, &pos)) {
+		ret = inode_slot_free(trans, iter, pos, snapshot);
+		if (ret < 0) {
+			bch2_trans_iter_put(trans, iter);
+			return ERR_PTR(ret);
+		}
+
+		if (ret)
+			goto found_slot;
+	}
+	ret = 0;
+
+	pos = start;
+	bch2_btree_iter_set_pos(iter, POS(0, pos));
 again:
 	while ((k = bch2_btree_iter_peek(iter)).k &&
 	       !(ret = bkey_err(k)) &&
 	       bkey_cmp(k.k->p, POS(0, max)) < 0) {
 		while (pos < iter->pos.offset) {
-			if (!bch2_btree_key_cache_find(c, BTREE_ID_inodes, POS(0, pos)))
+			if (!bch2_btree_key_cache_find(c, BTREE_ID_inodes, POS(0, pos))) {
+				inode_free_range_add(shard, pos + 1,
+						     iter->pos.offset);
 				goto found_slot;
+			}
 
 			pos++;
 		}
@@ -530,8 +635,10 @@ again:
 	}
 
 	while (!ret && pos < max) {
-		if (!bch2_btree_key_cache_find(c, BTREE_ID_inodes, POS(0, pos)))
+		if (!bch2_btree_key_cache_find(c, BTREE_ID_inodes, POS(0, pos))) {
+			inode_free_range_add(shard, pos + 1, max);
 			goto found_slot;
+		}
 
 		pos++;
 	}
@@ -562,12 +669,29 @@ found_slot:
 	    bch2_btree_key_cache_find(c, BTREE_ID_inodes, k.k->p))
 		goto again;
 
-	*hint			= k.k->p.offset;
+	WRITE_ONCE(shard->hint, k.k->p.offset);
 	inode_u->bi_inum	= k.k->p.offset;
 	inode_u->bi_generation	= bkey_generation(k);
 	return iter;
 }
 
+static void bch2_inode_free_add(struct bch_fs *c, u64 inode_nr)
+{
+	struct inode_alloc_shard *shard;
+	u64 cpu = 0, min, max;
+
+	if (c->opts.shard_inode_numbers) {
+		cpu = inode_nr >> ((c->opts.inodes_32bit ? 31 : 63) -
+				   c->inode_shard_bits);
+		if (cpu >= 1U << c->inode_shard_bits)
+			return;
+	}
+
+	shard = inode_alloc_shard(c, cpu, &min, &max);
+	if (inode_nr >= min && inode_nr < max)
+		inode_free_range_add(shard, inode_nr, inode_nr + 1);
+}
+
 int bch2_inode_rm(struct bch_fs *c, u64 inode_nr, bool cached)
 {
 	struct btree_trans trans;
@@ -634,6 +758,9 @@ err:
 		goto retry;
 
 	bch2_trans_exit(&trans);
+
+	if (!ret)
+		bch2_inode_free_add(c, inode_nr);
 	return ret;
 }
 
@@ -655,3 +782,23 @@ int bch2_inode_find_by_inum(struct bch_fs *c, u64 inode_nr,
 	return bch2_trans_do(c, NULL, NULL, 0,
 		bch2_inode_find_by_inum_trans(&trans, inode_nr, inode));
 }
+
+void bch2_fs_inode_exit(struct bch_fs *c)
+{
+	kfree(c->inode_alloc_shards);
+}
+
+int bch2_fs_inode_init(struct bch_fs *c)
+{
+	unsigned i, nr = 1U << c->inode_shard_bits;
+
+	c->inode_alloc_shards = kcalloc(nr, sizeof(*c->inode_alloc_shards),
+					GFP_KERNEL);
+	if (!c->inode_alloc_shards)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++)
+		spin_lock_init(&c->inode_alloc_shards[i].lock);
+
+	return 0;
+}
@@ -69,6 +69,28 @@ void bch2_inode_init(struct bch_fs *, struct bch_inode_unpacked *,
 		     uid_t, gid_t, umode_t, dev_t,
 		     struct bch_inode_unpacked *);
 
+/*
+ * bch2_inode_create() allocates inode numbers from one shard per cpu (or a
+ * single shard, without shard_inode_numbers). Each shard caches ranges of inode
+ * numbers known to be free - gaps found when scanning the inodes btree, and
+ * inodes freed by bch2_inode_rm() - so that creates don't have to rescan the
+ * btree every time. These are only hints: a number is always checked against
+ * the btree before it's used.
+ */
+#define INODE_FREE_RANGES_NR	8
+
+struct inode_free_range {
+	u64			start;
+	u64			end;
+};
+
+struct inode_alloc_shard {
+	spinlock_t		lock;
+	u64			hint;
+	unsigned		nr;
+	struct inode_free_range	r[INODE_FREE_RANGES_NR];
+};
+
 struct btree_iter *bch2_inode_create(struct btree_trans *,
 				     struct bch_inode_unpacked *, u32, u64);
 
@@ -76,6 +98,9 @@ int bch2_inode_rm(struct bch_fs *, u64, bool);
 
 int bch2_inode_find_by_inum(struct bch_fs *, u64, struct bch_inode_unpacked *);
 
+void bch2_fs_inode_exit(struct bch_fs *);
+int bch2_fs_inode_init(struct bch_fs *);
+
 static inline struct bch_io_opts bch2_inode_opts_get(struct bch_inode_unpacked *inode)
 {
 	struct bch_io_opts ret = { 0 };
@@ -26,6 +26,7 @@
 #include "journal.h"
 #include "keylist.h"
 #include "move.h"
+#include "nocow_locking.h"
 #include "rebalance.h"
 #include "super.h"
 #include "super-io.h"
@@ -899,6 +900,27 @@ static enum prep_encoded_ret {
 	return PREP_ENCODED_OK;
 }
 
+/*
+ * Max size of a checksummed, uncompressed extent at op->pos: with the
+ * csum_granularity option set, extents are split on csum_granularity boundaries
+ * so that small reads only have to read and verify a single chunk:
+ */
+static unsigned bch2_write_csum_sectors(struct bch_write_op *op)
+{
+	struct bch_fs *c = op->c;
+	unsigned sectors = c->sb.encoded_extent_max;
+	unsigned granularity = op->opts.csum_granularity;
+
+	if (granularity) {
+		granularity = max_t(unsigned, c->opts.block_size,
+				    rounddown_pow_of_two(granularity));
+		granularity = min(granularity, sectors);
+		sectors = granularity - (op->pos.offset & (granularity - 1));
+	}
+
+	return sectors;
+}
+
 static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 			     struct bio **_dst)
 {
@@ -972,7 +994,8 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 			? BCH_COMPRESSION_TYPE_incompressible
 			: op->compression_type
 			? bch2_bio_compress(c, dst, &dst_len, src, &src_len,
-					    op->compression_type)
+					    op->compression_type,
+					    op->opts.compression_dict)
 			: 0;
 		if (!crc_is_compressed(crc)) {
 			dst_len = min(dst->bi_iter.bi_size, src->bi_iter.bi_size);
@@ -980,7 +1003,7 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 
 			if (op->csum_type)
 				dst_len = min_t(unsigned, dst_len,
-						c->sb.encoded_extent_max << 9);
+						bch2_write_csum_sectors(op) << 9);
 
 			if (bounce) {
 				swap(dst->bi_iter.bi_size, dst_len);
@@ -1285,6 +1308,182 @@ err:
 	bch2_write_done(&op->cl);
 }
 
+/* In place (nocow) writes: */
+
+/*
+ * An extent can be overwritten in place if it's a plain extent - not reflinked,
+ * not erasure coded, no cached copies that would go stale - with uncompressed,
+ * unchecksummed data on rw devices, and as many replicas as a new write would
+ * get:
+ */
+static bool bch2_extent_nocow_ok(struct bch_write_op *op, struct bkey_s_c k)
+{
+	struct bch_fs *c = op->c;
+	struct bkey_ptrs_c ptrs;
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	unsigned nr_ptrs = 0;
+
+	if (k.k->type != KEY_TYPE_extent)
+		return false;
+
+	ptrs = bch2_bkey_ptrs_c(k);
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, p.ptr.dev);
+
+		if (p.ptr.cached ||
+		    p.has_ec ||
+		    crc_is_compressed(p.crc) ||
+		    p.crc.csum_type ||
+		    ca->mi.state != BCH_MEMBER_STATE_rw ||
+		    ptr_stale(ca, &p.ptr))
+			return false;
+
+		nr_ptrs++;
+	}
+
+	return nr_ptrs >= op->nr_replicas;
+}
+
+/*
+ * Looks up the extent we'd be overwriting, and if it can be written in place,
+ * locks its buckets and adds it - trimmed to the range being written - to
+ * op->insert_keys:
+ */
+static bool bch2_nocow_write_start(struct bch_write_op *op)
+{
+	struct bch_fs *c = op->c;
+	struct btree_trans trans;
+	struct btree_iter *iter, *inode_iter;
+	struct bch_inode_unpacked inode_u;
+	struct bkey_s_c k;
+	struct bkey_i *insert;
+	u64 start = op->pos.offset;
+	u64 end = start + bio_sectors(&op->wbio.bio);
+	bool ret = false;
+	int err;
+
+	if (bch2_keylist_realloc(&op->insert_keys, op->inline_keys,
+				 ARRAY_SIZE(op->inline_keys),
+				 BKEY_EXTENT_U64s_MAX))
+		return false;
+
+	bch2_trans_init(&trans, c, 0, 0);
+retry:
+	bch2_trans_begin(&trans);
+
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_extents,
+				   POS(op->pos.inode, start),
+				   BTREE_ITER_SLOTS);
+	k = bch2_btree_iter_peek_slot(iter);
+	err = bkey_err(k);
+	if (err)
+		goto out;
+
+	if (bkey_start_offset(k.k) > start ||
+	    k.k->p.offset < end ||
+	    !bch2_extent_nocow_ok(op, k))
+		goto out;
+
+	/* Writes that extend i_size have to update the inode: */
+	if (op->new_i_size != U64_MAX) {
+		inode_iter = bch2_inode_peek(&trans, &inode_u,
+					     op->pos.inode, 0);
+		err = PTR_ERR_OR_ZERO(inode_iter);
+		if (err)
+			goto out;
+		bch2_trans_iter_put(&trans, inode_iter);
+
+		if (op->new_i_size > inode_u.bi_size)
+			goto out;
+	}
+
+	/*
+	 * We still have the leaf locked, so the extent can't be changed by a
+	 * move that started before we got the bucket locks:
+	 */
+	if (!bch2_bkey_nocow_trylock(c, k, BUCKET_NOCOW_LOCK_UPDATE))
+		goto out;
+
+	insert = op->insert_keys.top;
+	bkey_reassemble(insert, k);
+	bch2_cut_front(POS(op->pos.inode, start), insert);
+	bch2_cut_back(POS(op->pos.inode, end), insert);
+	bch2_keylist_push(&op->insert_keys);
+	ret = true;
+out:
+	bch2_trans_iter_put(&trans, iter);
+	if (err == -EINTR)
+		goto retry;
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+static void bch2_nocow_write_done(struct closure *cl)
+{
+	struct bch_write_op *op = container_of(cl, struct bch_write_op, cl);
+	struct bkey_i *k = op->insert_keys.keys;
+
+	bch2_bkey_nocow_unlock(op->c, bkey_i_to_s_c(k),
+			       BUCKET_NOCOW_LOCK_UPDATE);
+
+	if (!bitmap_weight(op->failed.d, BCH_SB_MEMBERS_MAX)) {
+		op->written += k->k.size;
+		op->insert_keys.top = op->insert_keys.keys;
+	} else {
+		/*
+		 * Replicas we failed to write to now have stale data: rewrite
+		 * the extent without them:
+		 */
+		__bch2_write_index(op);
+	}
+
+	op->flags |= BCH_WRITE_DONE;
+	continue_at_nobarrier(cl, bch2_write_done, NULL);
+}
+
+static void bch2_nocow_write(struct bch_write_op *op)
+{
+	struct bio *bio = &op->wbio.bio;
+	struct bkey_i *k = op->insert_keys.keys;
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(k));
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	__BKEY_PADDED(k, BKEY_EXTENT_VAL_U64s_MAX) dst;
+
+	/* Where the data for the start of the range lives on each device: */
+	bkey_extent_init(&dst.k);
+	bkey_for_each_ptr_decode(&k->k, ptrs, p, entry) {
+		p.ptr.offset += p.crc.offset;
+		bch2_bkey_append_ptr(&dst.k, p.ptr);
+	}
+
+	op->pos.offset	= k->k.p.offset;
+
+	bio->bi_end_io	= bch2_write_endio;
+	bio->bi_private	= &op->cl;
+	bio->bi_opf	|= REQ_OP_WRITE;
+	if (op->flags & BCH_WRITE_FLUSH)
+		bio->bi_opf |= REQ_FUA;
+
+	closure_get(&op->cl);
+	bch2_submit_wbio_replicas(to_wbio(bio), op->c, BCH_DATA_user, &dst.k);
+	continue_at(&op->cl, bch2_nocow_write_done, index_update_wq(op));
+}
+
+static bool bch2_write_may_nocow(struct bch_write_op *op)
+{
+	return op->opts.nocow &&
+		!op->opts.erasure_code &&
+		/* export finds changed data by version number: */
+		!op->c->opts.track_changes &&
+		!bch2_csum_type_is_encryption(op->csum_type) &&
+		!(op->flags & (BCH_WRITE_CACHED|
+			       BCH_WRITE_DATA_ENCODED|
+			       BCH_WRITE_FROM_INTERNAL|
+			       BCH_WRITE_ONLY_SPECIFIED_DEVS));
+}
+
 /**
  * bch_write - handle a write to a cache device or flash only volume
  *
@@ -1331,6 +1530,23 @@ void bch2_write(struct closure *cl)
 
 	bch2_increment_clock(c, bio_sectors(bio), WRITE);
 
+	/*
+	 * Encrypted extents always get a new version (it's the nonce); with
+	 * track_changes, give unencrypted writes one too so that new data can
+	 * be told apart from old. Moves keep the version of what they moved:
+	 */
+	if (c->opts.track_changes &&
+	    bversion_zero(op->version) &&
+	    !(op->flags & BCH_WRITE_DATA_ENCODED) &&
+	    !bch2_csum_type_is_encryption(op->csum_type))
+		op->version.lo = atomic64_inc_return(&c->key_version);
+
+	if (bch2_write_may_nocow(op) &&
+	    bch2_nocow_write_start(op)) {
+		bch2_nocow_write(op);
+		return;
+	}
+
 	data_len = min_t(u64, bio->bi_iter.bi_size,
 			 op->new_i_size - (op->pos.offset << 9));
 
@@ -1382,6 +1598,10 @@ static inline bool should_promote(struct bch_fs *c, struct bkey_s_c k,
 	if (!(flags & BCH_READ_MAY_PROMOTE))
 		return false;
 
+	/* A cached copy would go stale when the original is written in place: */
+	if (opts.nocow)
+		return false;
+
 	if (!opts.promote_target)
 		return false;
 
@@ -1849,7 +2069,7 @@ static void __bch2_read_endio(struct work_struct *work)
 			goto decompression_err;
 	} else {
 		/* don't need to decrypt the entire bio: */
-		nonce = nonce_add(nonce, crc.offset << 9);
+		nonce = nonce_add(nonce, crc.csum_type, crc.offset << 9);
 		bio_advance(src, crc.offset << 9);
 
 		BUG_ON(src->bi_iter.bi_size < dst_iter.bi_size);
@@ -2168,9 +2388,11 @@ get_bio:
 
 	/*
 	 * If it's being moved internally, we don't want to flag it as a cache
-	 * hit:
+	 * hit - and rebalance needs read times for dirty data too, to tell
+	 * which data is cold:
 	 */
-	if (pick.ptr.cached && !(flags & BCH_READ_NODECODE))
+	if ((pick.ptr.cached || bch2_rebalance_heat_aware(c)) &&
+	    !(flags & BCH_READ_NODECODE))
 		bch2_bucket_io_time_reset(trans, pick.ptr.dev,
 			PTR_BUCKET_NR(ca, &pick.ptr), READ);
 
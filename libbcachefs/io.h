@@ -98,6 +98,17 @@ static inline void bch2_write_op_init(struct bch_write_op *op, struct bch_fs *c,
 	op->new_i_size		= U64_MAX;
 	op->i_sectors_delta	= 0;
 	op->index_update_fn	= bch2_write_index_default;
+
+	/*
+	 * Data that may be overwritten in place can't be checksummed or
+	 * compressed - unless it's encrypted, and then it can't be overwritten
+	 * in place:
+	 */
+	if (opts.nocow &&
+	    !bch2_csum_type_is_encryption(op->csum_type)) {
+		op->csum_type		= 0;
+		op->compression_type	= 0;
+	}
 }
 
 void bch2_write(struct closure *);
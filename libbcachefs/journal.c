@@ -1146,6 +1146,7 @@ int bch2_fs_journal_init(struct journal *j)
 
 	j->write_delay_ms	= 1000;
 	j->reclaim_delay_ms	= 100;
+	j->reclaim_target	= 50;
 
 	atomic64_set(&j->reservations.counter,
 		((union journal_res_state)
@@ -1197,6 +1198,12 @@ void __bch2_journal_debug_to_text(struct printbuf *out, struct journal *j)
 	       "nr background reclaim:\t%llu\n"
 	       "reclaim kicked:\t\t%u\n"
 	       "reclaim runs in:\t%u ms\n"
+	       "reclaim target free:\t%u%%\n"
+	       "reclaim fill rate:\t%llu entries/sec\n"
+	       "reclaim flush rate:\t%llu pins/sec\n"
+	       "nr reclaim paced:\t%llu\n"
+	       "nr reclaim behind:\t%llu\n"
+	       "nr reclaim budget limited:\t%llu\n"
 	       "current entry sectors:\t%u\n"
 	       "current entry error:\t%u\n"
 	       "current entry:\t\t",
@@ -1214,6 +1221,12 @@ void __bch2_journal_debug_to_text(struct printbuf *out, struct journal *j)
 	       j->nr_background_reclaim,
 	       j->reclaim_kicked,
 	       jiffies_to_msecs(j->next_reclaim - jiffies),
+	       j->reclaim_target,
+	       j->reclaim_fill_rate,
+	       j->reclaim_flush_rate,
+	       j->nr_reclaim_paced,
+	       j->nr_reclaim_behind,
+	       j->nr_reclaim_budget_limited,
 	       j->cur_entry_sectors,
 	       j->cur_entry_error);
 
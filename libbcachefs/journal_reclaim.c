@@ -2,6 +2,7 @@
 
 #include "bcachefs.h"
 #include "btree_key_cache.h"
+#include "btree_write_buffer.h"
 #include "error.h"
 #include "journal.h"
 #include "journal_io.h"
@@ -540,41 +541,84 @@ static size_t journal_flush_pins(struct journal *j, u64 seq_to_flush,
 	return nr_flushed;
 }
 
+/*
+ * Journal reclaim is paced by a feedback controller, instead of letting the
+ * journal fill up to a watermark and then flushing in a burst:
+ *
+ * Each pass flushes enough pins to free as many journal entries as were written
+ * since the previous pass, as measured by the fill rate - plus a quarter of
+ * however far we are from keeping j->reclaim_target percent of the journal
+ * free. Unless we're at risk of running out of journal space, a pass won't try
+ * to flush more pins than the measured flush rate says we can get through
+ * before the next pass.
+ */
 static u64 journal_seq_to_flush(struct journal *j)
 {
-	struct bch_fs *c = container_of(j, struct bch_fs, journal);
-	struct bch_dev *ca;
-	u64 seq_to_flush = 0;
-	unsigned iter;
+	struct journal_entry_pin_list *pin_list;
+	u64 now = local_clock(), dt, cur_seq, last_seq, seq, seq_to_flush = 0;
+	u64 nr_dirty, nr_to_free, budget, pins = 0;
+	s64 used, target_used;
+	unsigned total;
 
 	spin_lock(&j->lock);
+	cur_seq		= journal_cur_seq(j);
+	last_seq	= journal_last_seq(j);
+	dt		= now - j->reclaim_last_time;
+
+	if (dt >= NSEC_PER_MSEC) {
+		j->reclaim_fill_rate = ewma_add(j->reclaim_fill_rate,
+			div64_u64((cur_seq - j->reclaim_last_seq) * NSEC_PER_SEC,
+				  dt), 2);
+		j->reclaim_last_time	= now;
+		j->reclaim_last_seq	= cur_seq;
+	} else {
+		dt = 0;
+	}
 
-	for_each_rw_member(ca, c, iter) {
-		struct journal_device *ja = &ca->journal;
-		unsigned nr_buckets, bucket_to_flush;
+	/* Feed forward: keep up with the rate we're filling the journal */
+	nr_to_free = div64_u64(j->reclaim_fill_rate * dt, NSEC_PER_SEC);
 
-		if (!ja->nr)
-			continue;
+	/* Feedback: approach the target amount of free space */
+	total		= j->space[journal_space_total].total;
+	used		= total - j->space[journal_space_clean].total;
+	/* include pre-reservations: */
+	used		+= DIV_ROUND_UP(j->prereserved.reserved, 64);
+	target_used	= div_u64((u64) total * (100 - j->reclaim_target), 100);
+	nr_dirty	= cur_seq - last_seq;
+
+	if (used > target_used && nr_dirty) {
+		j->nr_reclaim_behind++;
+		nr_to_free += div64_u64((used - target_used) * nr_dirty,
+					used * 4) ?: 1;
+	}
 
-		/* Try to keep the journal at most half full: */
-		nr_buckets = ja->nr / 2;
+	if (nr_to_free) {
+		j->nr_reclaim_paced++;
+		seq_to_flush = last_seq + min(nr_to_free, nr_dirty) - 1;
+	}
 
-		/* And include pre-reservations: */
-		nr_buckets += DIV_ROUND_UP(j->prereserved.reserved,
-					   (ca->mi.bucket_size << 6) -
-					   journal_entry_overhead(j));
+	/*
+	 * Limit this pass to what we can flush before the next one, unless
+	 * we're in danger of running out of space:
+	 */
+	budget = div_u64(j->reclaim_flush_rate * j->reclaim_delay_ms, 1000);
 
-		nr_buckets = min(nr_buckets, ja->nr);
+	if (budget && used * 4 < total * 3)
+		fifo_for_each_entry_ptr(pin_list, &j->pin, seq) {
+			if (seq > seq_to_flush)
+				break;
 
-		bucket_to_flush = (ja->cur_idx + nr_buckets) % ja->nr;
-		seq_to_flush = max(seq_to_flush,
-				   ja->bucket_seq[bucket_to_flush]);
-	}
+			pins += atomic_read(&pin_list->count);
+			if (pins > budget) {
+				j->nr_reclaim_budget_limited++;
+				seq_to_flush = max(seq, last_seq + 1) - 1;
+				break;
+			}
+		}
 
 	/* Also flush if the pin fifo is more than half full */
 	seq_to_flush = max_t(s64, seq_to_flush,
-			     (s64) journal_cur_seq(j) -
-			     (j->pin.size >> 1));
+			     (s64) cur_seq - (j->pin.size >> 1));
 	spin_unlock(&j->lock);
 
 	return seq_to_flush;
@@ -590,9 +634,8 @@ static u64 journal_seq_to_flush(struct journal *j)
  * - FIFO has fewer than 512 entries left
  * - fewer than 25% journal buckets free
  *
- * Background reclaim runs until low watermarks are reached:
- * - FIFO has more than 1024 entries left
- * - more than 50% journal buckets free
+ * Background reclaim is paced to keep j->reclaim_target percent of the journal
+ * free (and the FIFO at most half full) - see journal_seq_to_flush().
  *
  * As long as a reclaim can complete in the time it takes to fill up
  * 512 journal entries or 25% of all journal buckets, then
@@ -602,7 +645,7 @@ static int __bch2_journal_reclaim(struct journal *j, bool direct)
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	bool kthread = (current->flags & PF_KTHREAD) != 0;
-	u64 seq_to_flush;
+	u64 seq_to_flush, start_time;
 	size_t min_nr, min_key_cache, nr_flushed;
 	unsigned flags;
 	int ret = 0;
@@ -655,9 +698,28 @@ static int __bch2_journal_reclaim(struct journal *j, bool direct)
 
 		min_key_cache = min(bch2_nr_btree_keys_need_flush(c), 128UL);
 
+		/*
+		 * Flush the btree write buffer when it's getting full, not just
+		 * when its journal pin is the oldest - otherwise updates start
+		 * blocking on flushing it themselves:
+		 */
+		if (bch2_btree_write_buffer_should_flush(c)) {
+			ret = bch2_btree_write_buffer_journal_flush(j,
+					&c->btree_write_buffer.journal_pin, 0);
+			if (ret && ret != -EAGAIN)
+				break;
+			ret = 0;
+		}
+
+		start_time = local_clock();
 		nr_flushed = journal_flush_pins(j, seq_to_flush,
 						min_nr, min_key_cache);
 
+		if (nr_flushed)
+			j->reclaim_flush_rate = ewma_add(j->reclaim_flush_rate,
+				div64_u64(nr_flushed * NSEC_PER_SEC,
+					  max(local_clock() - start_time, 1ULL)), 2);
+
 		if (direct)
 			j->nr_direct_reclaim += nr_flushed;
 		else
@@ -689,6 +751,8 @@ static int bch2_journal_reclaim_thread(void *arg)
 	kthread_wait_freezable(test_bit(JOURNAL_RECLAIM_STARTED, &j->flags));
 
 	j->last_flushed = jiffies;
+	j->reclaim_last_time = local_clock();
+	j->reclaim_last_seq = journal_cur_seq(j);
 
 	while (!ret && !kthread_should_stop()) {
 		j->reclaim_kicked = false;
@@ -254,6 +254,19 @@ struct journal {
 	u64			nr_direct_reclaim;
 	u64			nr_background_reclaim;
 
+	/*
+	 * Journal reclaim rate controller - see journal_seq_to_flush(); rates
+	 * are per second:
+	 */
+	unsigned		reclaim_target;
+	u64			reclaim_last_time;
+	u64			reclaim_last_seq;
+	u64			reclaim_fill_rate;
+	u64			reclaim_flush_rate;
+	u64			nr_reclaim_paced;
+	u64			nr_reclaim_behind;
+	u64			nr_reclaim_budget_limited;
+
 	unsigned long		last_flushed;
 	struct journal_entry_pin *flush_in_progress;
 	bool			flush_in_progress_dropped;
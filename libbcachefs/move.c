@@ -12,6 +12,7 @@
 #include "io.h"
 #include "journal_reclaim.h"
 #include "move.h"
+#include "nocow_locking.h"
 #include "replicas.h"
 #include "super-io.h"
 #include "keylist.h"
@@ -31,6 +32,9 @@ struct moving_io {
 	unsigned		read_sectors;
 	unsigned		write_sectors;
 
+	/* the extent we're moving - its buckets are nocow locked: */
+	struct bkey_buf		k;
+
 	struct bch_read_bio	rbio;
 
 	struct migrate_write	write;
@@ -245,12 +249,12 @@ int bch2_migrate_write_init(struct bch_fs *c, struct migrate_write *m,
 
 	bch2_write_op_init(&m->op, c, io_opts);
 
-	if (!bch2_bkey_is_incompressible(k))
+	if (bch2_bkey_is_incompressible(k))
+		m->op.incompressible = true;
+	else if (!io_opts.nocow)
 		m->op.compression_type =
 			bch2_compression_opt_to_type[io_opts.background_compression ?:
 						     io_opts.compression];
-	else
-		m->op.incompressible = true;
 
 	m->op.target	= data_opts.target,
 	m->op.write_point = wp;
@@ -333,6 +337,10 @@ static void move_free(struct closure *cl)
 
 	bch2_disk_reservation_put(io->write.op.c, &io->write.op.res);
 
+	bch2_bkey_nocow_unlock(io->write.op.c, bkey_i_to_s_c(io->k.k),
+			       BUCKET_NOCOW_LOCK_MOVE);
+	bch2_bkey_buf_exit(&io->k, io->write.op.c);
+
 	bio_for_each_segment_all(bv, &io->write.op.wbio.bio, iter)
 		if (bv->bv_page)
 			__free_page(bv->bv_page);
@@ -480,6 +488,23 @@ static int bch2_move_extent(struct btree_trans *trans,
 	if (ret)
 		goto err_free_pages;
 
+	/*
+	 * In place writes to the buckets we're reading from would be lost when
+	 * we update the extent to point to the new copy:
+	 */
+	bch2_bkey_buf_init(&io->k);
+	bch2_bkey_buf_reassemble(&io->k, c, k);
+	/* @k points into the btree node, which we may unlock below: */
+	k = bkey_i_to_s_c(io->k.k);
+
+	if (!bch2_bkey_nocow_trylock(c, k,
+				     BUCKET_NOCOW_LOCK_MOVE)) {
+		/* Don't wait for in place writes with btree locks held: */
+		bch2_trans_unlock(trans);
+		bch2_bkey_nocow_lock(c, k,
+				     BUCKET_NOCOW_LOCK_MOVE);
+	}
+
 	atomic64_inc(&ctxt->stats->keys_moved);
 	atomic64_add(k.k->size, &ctxt->stats->sectors_moved);
 
@@ -928,7 +953,7 @@ int bch2_scan_old_btree_nodes(struct bch_fs *c, struct bch_move_stats *stats)
 		c->disk_sb.sb->compat[0] |= cpu_to_le64(1ULL << BCH_COMPAT_extents_above_btree_updates_done);
 		c->disk_sb.sb->compat[0] |= cpu_to_le64(1ULL << BCH_COMPAT_bformat_overflow_done);
 		c->disk_sb.sb->version_min = c->disk_sb.sb->version;
-		bch2_write_super(c);
+		bch2_write_super_async(c);
 		mutex_unlock(&c->sb_lock);
 	}
 
@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_NOCOW_LOCKING_H
+#define _BCACHEFS_NOCOW_LOCKING_H
+
+#include "bcachefs.h"
+#include "buckets.h"
+#include "extents.h"
+
+#include <linux/hash.h>
+
+/*
+ * In place (nocow) writes change data without changing the extent that points
+ * to it - so they must not race with anything that reads the data and then
+ * updates the extent based on what it read, i.e. data moves, and the bucket
+ * mustn't be reused while a write to it is in flight.
+ *
+ * Writers never wait: if a move holds the lock, the write falls back to copy on
+ * write. Moves wait for in place writes to finish.
+ */
+
+enum bucket_nocow_lock_type {
+	BUCKET_NOCOW_LOCK_MOVE		= -1,
+	BUCKET_NOCOW_LOCK_UPDATE	= 1,
+};
+
+static inline atomic_t *bucket_nocow_lock(struct bucket_nocow_lock_table *t,
+					  unsigned dev, u64 bucket)
+{
+	u64 h = hash_64(((u64) dev << 56) ^ bucket, BUCKET_NOCOW_LOCKS_BITS);
+
+	return &t->l[h];
+}
+
+static inline bool bch2_bucket_nocow_is_locked(struct bucket_nocow_lock_table *t,
+					       unsigned dev, u64 bucket)
+{
+	return atomic_read(bucket_nocow_lock(t, dev, bucket)) > 0;
+}
+
+static inline bool __bch2_bucket_nocow_trylock(atomic_t *l, int v)
+{
+	int old, new = atomic_read(l);
+
+	do {
+		old = new;
+		if (old && (old > 0) != (v > 0))
+			return false;
+	} while ((new = atomic_cmpxchg(l, old, old + v)) != old);
+
+	return true;
+}
+
+static inline void __bch2_bucket_nocow_unlock(struct bucket_nocow_lock_table *t,
+					      atomic_t *l, int v)
+{
+	if (!atomic_sub_return(v, l))
+		wake_up(&t->wait);
+}
+
+#define bkey_for_each_nocow_lock(_c, _ptrs, _ptr, _l)			\
+	bkey_for_each_ptr(_ptrs, _ptr)					\
+		if (!(_ptr)->cached &&					\
+		    ((_l) = bucket_nocow_lock(&(_c)->nocow_locks,	\
+				(_ptr)->dev,				\
+				PTR_BUCKET_NR(bch_dev_bkey_exists(_c,	\
+					(_ptr)->dev), _ptr))))
+
+static inline void bch2_bkey_nocow_unlock(struct bch_fs *c, struct bkey_s_c k,
+					  enum bucket_nocow_lock_type v)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+	atomic_t *l;
+
+	bkey_for_each_nocow_lock(c, ptrs, ptr, l)
+		__bch2_bucket_nocow_unlock(&c->nocow_locks, l, v);
+}
+
+/* Locks the buckets of all dirty pointers in @k, or none of them: */
+static inline bool bch2_bkey_nocow_trylock(struct bch_fs *c, struct bkey_s_c k,
+					   enum bucket_nocow_lock_type v)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr, *ptr2;
+	atomic_t *l;
+
+	bkey_for_each_nocow_lock(c, ptrs, ptr, l)
+		if (!__bch2_bucket_nocow_trylock(l, v)) {
+			bkey_for_each_nocow_lock(c, ptrs, ptr2, l) {
+				if (ptr2 == ptr)
+					break;
+				__bch2_bucket_nocow_unlock(&c->nocow_locks, l, v);
+			}
+			return false;
+		}
+
+	return true;
+}
+
+static inline void bch2_bkey_nocow_lock(struct bch_fs *c, struct bkey_s_c k,
+					enum bucket_nocow_lock_type v)
+{
+	wait_event(c->nocow_locks.wait, bch2_bkey_nocow_trylock(c, k, v));
+}
+
+#endif /* _BCACHEFS_NOCOW_LOCKING_H */
@@ -36,6 +36,11 @@ const char * const bch2_csum_opts[] = {
 	NULL
 };
 
+const char * const bch2_encryption_types[] = {
+	BCH_ENCRYPTION_TYPES()
+	NULL
+};
+
 const char * const bch2_compression_opts[] = {
 	BCH_COMPRESSION_OPTS()
 	NULL
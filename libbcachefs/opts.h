@@ -13,6 +13,7 @@ extern const char * const bch2_sb_features[];
 extern const char * const bch2_sb_compat[];
 extern const char * const bch2_btree_ids[];
 extern const char * const bch2_csum_opts[];
+extern const char * const bch2_encryption_types[];
 extern const char * const bch2_compression_opts[];
 extern const char * const bch2_str_hash_types[];
 extern const char * const bch2_data_types[];
@@ -122,6 +123,12 @@ enum opt_type {
 	  OPT_STR(bch2_csum_opts),					\
 	  BCH_SB_DATA_CSUM_TYPE,	BCH_CSUM_OPT_crc32c,		\
 	  NULL,		NULL)						\
+	x(csum_granularity,		u16,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
+	  OPT_SECTORS(0, U16_MAX - 1),				\
+	  BCH_SB_CSUM_GRANULARITY,	0,				\
+	  "size",	"Checksum uncompressed data in chunks of this size,\n"\
+			"so small reads don't have to read whole extents")\
 	x(compression,			u8,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
 	  OPT_STR(bch2_compression_opts),				\
@@ -132,6 +139,12 @@ enum opt_type {
 	  OPT_STR(bch2_compression_opts),				\
 	  BCH_SB_BACKGROUND_COMPRESSION_TYPE,BCH_COMPRESSION_OPT_none,	\
 	  NULL,		NULL)						\
+	x(compression_dict,		u16,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
+	  OPT_UINT(0, U16_MAX - 1),					\
+	  BCH_SB_COMPRESSION_DICT,	0,				\
+	  "id",		"zstd dictionary to compress with, from\n"	\
+			"bcachefs train-dict (0 for none)")		\
 	x(str_hash,			u8,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
 	  OPT_STR(bch2_str_hash_types),					\
@@ -157,11 +170,35 @@ enum opt_type {
 	  OPT_FN(bch2_opt_target),					\
 	  BCH_SB_PROMOTE_TARGET,	0,				\
 	  "(target)",	"Device or disk group to promote data to on read")\
+	x(background_min_age,		u32,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
+	  OPT_SECTORS(0, U32_MAX),					\
+	  BCH_SB_BACKGROUND_MIN_AGE,	0,				\
+	  "size",	"Only move data to the background target once it\n"\
+			"hasn't been read or written for this much IO")\
+	x(foreground_watermark,		u8,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
+	  OPT_UINT(0, 100),						\
+	  BCH_SB_FOREGROUND_WATERMARK,	0,				\
+	  "%",		"Move the coldest data to the background target\n"\
+			"when a foreground device is fuller than this")\
+	x(track_changes,		u8,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
+	  OPT_BOOL(),							\
+	  BCH_SB_TRACK_CHANGES,		false,				\
+	  NULL,		"Give each data write a new key version, for\n"\
+			"bcachefs export --since")\
 	x(erasure_code,			u16,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
 	  OPT_BOOL(),							\
 	  BCH_SB_ERASURE_CODE,		false,				\
 	  NULL,		"Enable erasure coding (DO NOT USE YET)")	\
+	x(nocow,			u8,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
+	  OPT_BOOL(),							\
+	  BCH_SB_NOCOW,			false,				\
+	  NULL,		"Overwrite existing data in place where possible;\n"\
+			"implies no data checksums or compression")	\
 	x(inodes_32bit,			u8,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
 	  OPT_BOOL(),							\
@@ -250,6 +287,11 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  NO_SB_OPT,			false,				\
 	  NULL,		"Run fsck on mount")				\
+	x(fsck_incremental,		u8,				\
+	  OPT_MOUNT,							\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			false,				\
+	  NULL,		"Only fsck inodes touched by keys in the journal")\
 	x(fix_errors,			u8,				\
 	  OPT_MOUNT,							\
 	  OPT_BOOL(),							\
@@ -53,6 +53,7 @@ void bch2_quota_to_text(struct printbuf *out, struct bch_fs *c,
 
 #include <linux/cred.h>
 #include <linux/fs.h>
+#include <linux/jhash.h>
 #include <linux/quota.h>
 
 static inline unsigned __next_qtype(unsigned i, unsigned qtypes)
@@ -218,6 +219,182 @@ static int bch2_quota_check_limit(struct bch_fs *c,
 	return 0;
 }
 
+/* Per cpu usage deltas: */
+
+static inline struct quota_pcpu_slot *quota_pcpu_slot(struct quota_pcpu *pc,
+						      struct bch_qid qid)
+{
+	return pc->s + (jhash_3words(qid.q[QTYP_USR],
+				     qid.q[QTYP_GRP],
+				     qid.q[QTYP_PRJ], 0) % QUOTA_PCPU_SLOTS);
+}
+
+/*
+ * How much usage of a counter may be added by a single cache entry without
+ * checking limits: no limits means no checks, but otherwise every entry in the
+ * cache could be charging the same id:
+ */
+static u64 quota_pcpu_budget(struct memquota_counter *qc)
+{
+	u64 limit = min_not_zero(qc->hardlimit, qc->softlimit);
+
+	if (qc->warning_issued)
+		return 0;
+
+	if (!limit)
+		return QUOTA_PCPU_BUDGET_MAX;
+
+	if (qc->v >= limit)
+		return 0;
+
+	return min(QUOTA_PCPU_BUDGET_MAX,
+		   div_u64(limit - qc->v,
+			   2 * num_possible_cpus() * QUOTA_PCPU_SLOTS));
+}
+
+/*
+ * Whether bch_memquota has to be made exact before checking a change against
+ * it: cached deltas can't matter for ids that are far from their limits,
+ * except for not letting usage appear to go negative.
+ */
+static bool quota_pcpu_need_fold(struct memquota_counter *qc, s64 v)
+{
+	return  (s64) (qc->v + v) < 0 ||
+		abs(v) > QUOTA_PCPU_BUDGET_MAX ||
+		quota_pcpu_budget(qc) < QUOTA_PCPU_BUDGET_MAX;
+}
+
+static void quota_pcpu_slot_flush(struct bch_fs *c, unsigned qtype,
+				  struct quota_pcpu_slot *s)
+{
+	/* entries are only created for ids that have been allocated: */
+	struct bch_memquota *mq =
+		genradix_ptr(&c->quotas[qtype].table, s->qid.q[qtype]);
+	unsigned i;
+
+	for (i = 0; i < Q_COUNTERS; i++) {
+		mq->c[i].v += s->delta[qtype][i];
+		s->delta[qtype][i] = 0;
+	}
+}
+
+/*
+ * Applies every cpu's cached deltas for @qtype, making bch_memquota exact, and
+ * shrinks budgets to what's left below the limits:
+ */
+static void bch2_quota_fold(struct bch_fs *c, unsigned qtype)
+{
+	struct quota_pcpu *pc;
+	struct quota_pcpu_slot *s;
+	struct bch_memquota *mq;
+	unsigned cpu, i;
+
+	lockdep_assert_held(&c->quotas[qtype].lock);
+
+	if (!c->quotas_pcpu ||
+	    !(enabled_qtypes(c) & (1U << qtype)))
+		return;
+
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(c->quotas_pcpu, cpu);
+
+		spin_lock(&pc->lock);
+		for (s = pc->s; s < pc->s + ARRAY_SIZE(pc->s); s++)
+			if (s->valid)
+				quota_pcpu_slot_flush(c, qtype, s);
+		spin_unlock(&pc->lock);
+	}
+
+	/* Budgets depend on usage for the id across all cpus: */
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(c->quotas_pcpu, cpu);
+
+		spin_lock(&pc->lock);
+		for (s = pc->s; s < pc->s + ARRAY_SIZE(pc->s); s++) {
+			if (!s->valid)
+				continue;
+
+			mq = genradix_ptr(&c->quotas[qtype].table,
+					  s->qid.q[qtype]);
+
+			for (i = 0; i < Q_COUNTERS; i++)
+				s->budget[qtype][i] =
+					min(s->budget[qtype][i],
+					    quota_pcpu_budget(&mq->c[i]));
+		}
+		spin_unlock(&pc->lock);
+	}
+}
+
+/*
+ * Points this cpu's cache entry for @qid at it, with fresh budgets - deltas are
+ * flushed first, so an entry never holds more than one budget's worth:
+ */
+static void bch2_quota_pcpu_fill(struct bch_fs *c, unsigned qtypes,
+				 struct bch_qid qid, struct bch_memquota **mq)
+{
+	struct bch_memquota_type *q;
+	struct quota_pcpu *pc = raw_cpu_ptr(c->quotas_pcpu);
+	struct quota_pcpu_slot *s = quota_pcpu_slot(pc, qid);
+	unsigned i, j;
+
+	spin_lock(&pc->lock);
+	if (s->valid)
+		for_each_set_qtype(c, i, q, qtypes)
+			quota_pcpu_slot_flush(c, i, s);
+
+	if (!s->valid || memcmp(&s->qid, &qid, sizeof(qid))) {
+		memset(s, 0, sizeof(*s));
+		s->qid		= qid;
+		s->valid	= true;
+	}
+
+	for_each_set_qtype(c, i, q, qtypes)
+		for (j = 0; j < Q_COUNTERS; j++)
+			s->budget[i][j] = quota_pcpu_budget(&mq[i]->c[j]);
+	spin_unlock(&pc->lock);
+}
+
+/*
+ * Usage changes for ids with room below their limits only touch this cpu's
+ * cache:
+ */
+static bool bch2_quota_acct_fast(struct bch_fs *c, unsigned qtypes,
+				 struct bch_qid qid,
+				 enum quota_counters counter, s64 v)
+{
+	struct bch_memquota_type *q;
+	struct quota_pcpu *pc;
+	struct quota_pcpu_slot *s;
+	u64 need = max_t(s64, v, 1);
+	unsigned i;
+	bool ret = false;
+
+	if (!c->quotas_pcpu)
+		return false;
+
+	pc = raw_cpu_ptr(c->quotas_pcpu);
+	s = quota_pcpu_slot(pc, qid);
+
+	spin_lock(&pc->lock);
+	if (!s->valid || memcmp(&s->qid, &qid, sizeof(qid)))
+		goto out;
+
+	for_each_set_qtype(c, i, q, qtypes)
+		if (s->budget[i][counter] < need)
+			goto out;
+
+	for_each_set_qtype(c, i, q, qtypes) {
+		s->delta[i][counter] += v;
+		if (v > 0)
+			s->budget[i][counter] -= v;
+	}
+	ret = true;
+out:
+	spin_unlock(&pc->lock);
+	return ret;
+}
+
 int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 		    enum quota_counters counter, s64 v,
 		    enum quota_acct_mode mode)
@@ -229,6 +406,9 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 	unsigned i;
 	int ret = 0;
 
+	if (bch2_quota_acct_fast(c, qtypes, qid, counter, v))
+		return 0;
+
 	memset(&msgs, 0, sizeof(msgs));
 
 	for_each_set_qtype(c, i, q, qtypes)
@@ -241,6 +421,9 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 			goto err;
 		}
 
+		if (quota_pcpu_need_fold(&mq[i]->c[counter], v))
+			bch2_quota_fold(c, i);
+
 		ret = bch2_quota_check_limit(c, i, mq[i], &msgs, counter, v, mode);
 		if (ret)
 			goto err;
@@ -248,6 +431,16 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 
 	for_each_set_qtype(c, i, q, qtypes)
 		mq[i]->c[counter].v += v;
+
+	if (c->quotas_pcpu) {
+		bch2_quota_pcpu_fill(c, qtypes, qid, mq);
+
+		/* Less room below the limits may mean smaller budgets: */
+		for_each_set_qtype(c, i, q, qtypes)
+			if (v > 0 &&
+			    quota_pcpu_budget(&mq[i]->c[counter]) < QUOTA_PCPU_BUDGET_MAX)
+				bch2_quota_fold(c, i);
+	}
 err:
 	for_each_set_qtype(c, i, q, qtypes)
 		mutex_unlock(&q->lock);
@@ -287,6 +480,8 @@ int bch2_quota_transfer(struct bch_fs *c, unsigned qtypes,
 		mutex_lock_nested(&q->lock, i);
 
 	for_each_set_qtype(c, i, q, qtypes) {
+		bch2_quota_fold(c, i);
+
 		src_q[i] = genradix_ptr_alloc(&q->table, src.q[i], GFP_NOFS);
 		dst_q[i] = genradix_ptr_alloc(&q->table, dst.q[i], GFP_NOFS);
 
@@ -311,6 +506,7 @@ int bch2_quota_transfer(struct bch_fs *c, unsigned qtypes,
 	for_each_set_qtype(c, i, q, qtypes) {
 		__bch2_quota_transfer(src_q[i], dst_q[i], Q_SPC, space);
 		__bch2_quota_transfer(src_q[i], dst_q[i], Q_INO, 1);
+		bch2_quota_fold(c, i);
 	}
 
 err:
@@ -348,6 +544,8 @@ static int __bch2_quota_set(struct bch_fs *c, struct bkey_s_c k)
 			mq->c[i].softlimit = le64_to_cpu(dq.v->c[i].softlimit);
 		}
 
+		/* new limits may leave less room for cached changes: */
+		bch2_quota_fold(c, k.k->p.inode);
 		mutex_unlock(&q->lock);
 	}
 
@@ -383,6 +581,8 @@ void bch2_fs_quota_exit(struct bch_fs *c)
 
 	for (i = 0; i < ARRAY_SIZE(c->quotas); i++)
 		genradix_free(&c->quotas[i].table);
+
+	free_percpu(c->quotas_pcpu);
 }
 
 void bch2_fs_quota_init(struct bch_fs *c)
@@ -422,8 +622,18 @@ int bch2_fs_quota_read(struct bch_fs *c)
 	struct btree_iter *iter;
 	struct bch_inode_unpacked u;
 	struct bkey_s_c k;
+	unsigned cpu;
 	int ret;
 
+	if (!c->quotas_pcpu) {
+		c->quotas_pcpu = alloc_percpu(struct quota_pcpu);
+		if (!c->quotas_pcpu)
+			return -ENOMEM;
+
+		for_each_possible_cpu(cpu)
+			spin_lock_init(&per_cpu_ptr(c->quotas_pcpu, cpu)->lock);
+	}
+
 	mutex_lock(&c->sb_lock);
 	bch2_sb_quota_read(c);
 	mutex_unlock(&c->sb_lock);
@@ -680,6 +890,7 @@ static int bch2_get_quota(struct super_block *sb, struct kqid kqid,
 	memset(qdq, 0, sizeof(*qdq));
 
 	mutex_lock(&q->lock);
+	bch2_quota_fold(c, kqid.type);
 	mq = genradix_ptr(&q->table, qid);
 	if (mq)
 		__bch2_quota_get(qdq, mq);
@@ -699,6 +910,7 @@ static int bch2_get_next_quota(struct super_block *sb, struct kqid *kqid,
 	int ret = 0;
 
 	mutex_lock(&q->lock);
+	bch2_quota_fold(c, kqid->type);
 
 	genradix_for_each_from(&q->table, iter, mq, qid)
 		if (memcmp(mq, page_address(ZERO_PAGE(0)), sizeof(*mq))) {
@@ -40,4 +40,24 @@ struct bch_memquota_type {
 	struct mutex			lock;
 };
 
+/*
+ * Per cpu cache of quota usage changes not yet applied to bch_memquota: an
+ * entry can take changes up to its budget, which is kept small enough that the
+ * entries for an id can't take it over its limits between folds.
+ */
+#define QUOTA_PCPU_SLOTS		8
+#define QUOTA_PCPU_BUDGET_MAX		(1ULL << 16)
+
+struct quota_pcpu_slot {
+	struct bch_qid			qid;
+	bool				valid;
+	s64				delta[QTYP_NR][Q_COUNTERS];
+	u64				budget[QTYP_NR][Q_COUNTERS];
+};
+
+struct quota_pcpu {
+	spinlock_t			lock;
+	struct quota_pcpu_slot		s[QUOTA_PCPU_SLOTS];
+};
+
 #endif /* _BCACHEFS_QUOTA_TYPES_H */
@@ -7,6 +7,7 @@
 #include "clock.h"
 #include "disk_groups.h"
 #include "extents.h"
+#include "eytzinger.h"
 #include "io.h"
 #include "move.h"
 #include "rebalance.h"
@@ -30,7 +31,12 @@ static int __bch2_rebalance_pred(struct bch_fs *c,
 	const union bch_extent_entry *entry;
 	struct extent_ptr_decoded p;
 
+	/*
+	 * nocow data is written uncompressed, so that it can be overwritten in
+	 * place: moving it would never make it compressed:
+	 */
 	if (io_opts->background_compression &&
+	    !io_opts->nocow &&
 	    !bch2_bkey_is_incompressible(k))
 		bkey_for_each_ptr_decode(k.k, ptrs, p, entry)
 			if (!p.ptr.cached &&
@@ -38,7 +44,12 @@ static int __bch2_rebalance_pred(struct bch_fs *c,
 			    bch2_compression_opt_to_type[io_opts->background_compression])
 				return p.ptr.dev;
 
-	if (io_opts->background_target)
+	/*
+	 * In heat aware mode, data that isn't on the background target is found
+	 * by rebalance_find_cold_buckets(), not here:
+	 */
+	if (io_opts->background_target &&
+	    !bch2_rebalance_heat_aware(c))
 		bkey_for_each_ptr_decode(k.k, ptrs, p, entry)
 			if (!p.ptr.cached &&
 			    !bch2_dev_in_target(c, p.ptr.dev, io_opts->background_target))
@@ -66,12 +77,58 @@ void bch2_rebalance_add_key(struct bch_fs *c,
 		rebalance_wakeup(c);
 }
 
+static int bucket_offset_cmp(const void *_l, const void *_r, size_t size)
+{
+	const struct rebalance_heap_entry *l = _l;
+	const struct rebalance_heap_entry *r = _r;
+
+	return  cmp_int(l->dev,    r->dev) ?:
+		cmp_int(l->offset, r->offset);
+}
+
+/* Does @k have a pointer, not on the background target, in a cold bucket? */
+static bool rebalance_key_cold(struct bch_fs *c, struct bkey_s_c k,
+			       struct bch_io_opts *io_opts)
+{
+	rebalance_heap *h = &c->rebalance.cold;
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+
+	if (!io_opts->background_target || !h->used)
+		return false;
+
+	bkey_for_each_ptr(ptrs, ptr) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
+		struct rebalance_heap_entry search = {
+			.dev	= ptr->dev,
+			.offset	= ptr->offset,
+		};
+		ssize_t i;
+
+		if (ptr->cached ||
+		    bch2_dev_in_target(c, ptr->dev, io_opts->background_target))
+			continue;
+
+		i = eytzinger0_find_le(h->data, h->used,
+				       sizeof(h->data[0]),
+				       bucket_offset_cmp, &search);
+		if (i >= 0 &&
+		    h->data[i].dev == ptr->dev &&
+		    ptr->offset < h->data[i].offset + ca->mi.bucket_size &&
+		    ptr->gen == h->data[i].gen)
+			return true;
+	}
+
+	return false;
+}
+
 static enum data_cmd rebalance_pred(struct bch_fs *c, void *arg,
 				    struct bkey_s_c k,
 				    struct bch_io_opts *io_opts,
 				    struct data_opts *data_opts)
 {
-	if (__bch2_rebalance_pred(c, k, io_opts) >= 0) {
+	if (__bch2_rebalance_pred(c, k, io_opts) >= 0 ||
+	    rebalance_key_cold(c, k, io_opts)) {
 		data_opts->target		= io_opts->background_target;
 		data_opts->nr_replicas		= 1;
 		data_opts->btree_insert_flags	= 0;
@@ -152,6 +209,139 @@ static void rebalance_work_reset(struct bch_fs *c)
 	atomic64_set(&c->rebalance.work_unknown_dev, 0);
 }
 
+static inline int bucket_age_cmp(rebalance_heap *h,
+				 struct rebalance_heap_entry l,
+				 struct rebalance_heap_entry r)
+{
+	return cmp_int(l.age, r.age);
+}
+
+static unsigned dev_percent_full(struct bch_dev *ca)
+{
+	u64 nbuckets = ca->mi.nbuckets - ca->mi.first_bucket;
+
+	return 100 - div64_u64(min(dev_buckets_available(ca), nbuckets) * 100,
+			       nbuckets);
+}
+
+/*
+ * Heat aware tiering: pick the buckets on foreground devices whose data should
+ * be demoted to the background target next.
+ *
+ * A bucket's age is the amount of IO since it was last read or written,
+ * according to the bucket IO clocks; a bucket is a candidate if it's older
+ * than background_min_age, or if its device is fuller than
+ * foreground_watermark. We keep the coldest candidates - as many as fit in the
+ * heap - so that each pass demotes the coldest data first, and the foreground
+ * devices are left holding the working set.
+ *
+ * Returns the number of sectors in the buckets picked:
+ */
+static u64 rebalance_find_cold_buckets(struct bch_fs *c)
+{
+	rebalance_heap *h = &c->rebalance.cold;
+	struct rebalance_heap_entry *i;
+	struct bucket_array *buckets;
+	struct bch_dev *ca;
+	u64 now[2] = {
+		atomic64_read(&c->io_clock[READ].now),
+		atomic64_read(&c->io_clock[WRITE].now),
+	};
+	u64 min_age = c->opts.background_min_age;
+	unsigned watermark = c->opts.foreground_watermark;
+	unsigned dev_idx;
+	size_t b, heap_size = 0;
+
+	h->used = 0;
+	c->rebalance.cold_sectors = 0;
+
+	if (!bch2_rebalance_heat_aware(c))
+		return 0;
+
+	for_each_rw_member(ca, c, dev_idx)
+		heap_size += ca->mi.nbuckets >> 7;
+
+	/* Small filesystems have fewer than 128 buckets per device: */
+	heap_size = max_t(size_t, heap_size, 1);
+
+	if (h->size < heap_size) {
+		free_heap(h);
+		if (!init_heap(h, heap_size, GFP_KERNEL)) {
+			bch_err(c, "error allocating rebalance heap");
+			return 0;
+		}
+	}
+
+	for_each_rw_member(ca, c, dev_idx) {
+		bool over_watermark = watermark &&
+			dev_percent_full(ca) >= watermark;
+
+		if (bch2_dev_in_target(c, dev_idx, c->opts.background_target))
+			continue;
+
+		if (!min_age && !over_watermark)
+			continue;
+
+		down_read(&ca->bucket_lock);
+		buckets = bucket_array(ca);
+
+		for (b = buckets->first_bucket; b < buckets->nbuckets; b++) {
+			struct bucket *g = buckets->b + b;
+			struct bucket_mark m = READ_ONCE(g->mark);
+			struct rebalance_heap_entry e;
+			u64 age;
+
+			if (m.owned_by_allocator ||
+			    m.data_type != BCH_DATA_user ||
+			    !bucket_sectors_used(m))
+				continue;
+
+			age = min(max_t(s64, 0, now[READ]  - g->io_time[READ]),
+				  max_t(s64, 0, now[WRITE] - g->io_time[WRITE]));
+			if (age < min_age && !over_watermark)
+				continue;
+
+			e = (struct rebalance_heap_entry) {
+				.dev		= dev_idx,
+				.gen		= m.gen,
+				.sectors	= bucket_sectors_used(m),
+				.age		= age,
+				.offset		= bucket_to_sector(ca, b),
+			};
+			heap_add_or_replace(h, e, bucket_age_cmp, NULL);
+		}
+		up_read(&ca->bucket_lock);
+	}
+
+	for (i = h->data; i < h->data + h->used; i++)
+		c->rebalance.cold_sectors += i->sectors;
+
+	eytzinger0_sort(h->data, h->used,
+			sizeof(h->data[0]),
+			bucket_offset_cmp, NULL);
+
+	return c->rebalance.cold_sectors;
+}
+
+/*
+ * Data only gets colder as IO happens elsewhere, and the foreground devices
+ * fill up as data is written - so when there's no work, rescan for cold
+ * buckets after some amount of write IO, or time:
+ */
+static u64 rebalance_rescan_wait(struct bch_fs *c)
+{
+	return max_t(u64, c->opts.background_min_age >> 3, 1 << 11);
+}
+
+static void rebalance_wait_for_cold(struct bch_fs *c)
+{
+	struct io_clock *clock = &c->io_clock[WRITE];
+
+	bch2_kthread_io_clock_wait(clock,
+			atomic64_read(&clock->now) + rebalance_rescan_wait(c),
+			10 * HZ);
+}
+
 static unsigned long curr_cputime(void)
 {
 	u64 utime, stime;
@@ -166,6 +356,8 @@ static int bch2_rebalance_thread(void *arg)
 	struct bch_fs_rebalance *r = &c->rebalance;
 	struct io_clock *clock = &c->io_clock[WRITE];
 	struct rebalance_work w, p;
+	u64 cold, rescan_at = 0;
+	bool moved = true;
 	unsigned long start, prev_start;
 	unsigned long prev_run_time, prev_run_cputime;
 	unsigned long cputime, prev_cputime;
@@ -191,9 +383,24 @@ static int bch2_rebalance_thread(void *arg)
 		w			= rebalance_work(c);
 		BUG_ON(!w.dev_most_full_capacity);
 
-		if (!w.total_work) {
+		/*
+		 * Scanning every bucket is expensive: only rescan once the last
+		 * pass has moved data out of the buckets we found, or after
+		 * enough IO that other data may have gone cold:
+		 */
+		cold = 0;
+		if (moved || atomic64_read(&clock->now) >= rescan_at) {
+			cold		= rebalance_find_cold_buckets(c);
+			rescan_at	= atomic64_read(&clock->now) +
+				rebalance_rescan_wait(c);
+		}
+
+		if (!w.total_work && !cold) {
 			r->state = REBALANCE_WAITING;
-			kthread_wait_freezable(rebalance_work(c).total_work);
+			if (bch2_rebalance_heat_aware(c))
+				rebalance_wait_for_cold(c);
+			else
+				kthread_wait_freezable(rebalance_work(c).total_work);
 			continue;
 		}
 
@@ -204,7 +411,7 @@ static int bch2_rebalance_thread(void *arg)
 			max(1U, w.dev_most_full_percent) -
 			prev_run_time;
 
-		if (w.dev_most_full_percent < 20 && throttle > 0) {
+		if (!cold && w.dev_most_full_percent < 20 && throttle > 0) {
 			r->throttled_until_iotime = io_start +
 				div_u64(w.dev_most_full_capacity *
 					(20 - w.dev_most_full_percent),
@@ -246,6 +453,16 @@ static int bch2_rebalance_thread(void *arg)
 			       writepoint_ptr(&c->rebalance_write_point),
 			       rebalance_pred, NULL,
 			       &r->move_stats);
+
+		/*
+		 * If nothing could be moved - e.g. the cold data belongs to
+		 * inodes without a background target - don't spin retrying it:
+		 */
+		moved = atomic64_read(&r->move_stats.sectors_moved) != 0;
+		if (!moved) {
+			r->state = REBALANCE_WAITING;
+			rebalance_wait_for_cold(c);
+		}
 	}
 
 	return 0;
@@ -266,6 +483,11 @@ void bch2_rebalance_work_to_text(struct printbuf *out, struct bch_fs *c)
 	bch2_hprint(&PBUF(h2), c->capacity << 9);
 	pr_buf(out, "total work:\t\t%s/%s\n", h1, h2);
 
+	if (bch2_rebalance_heat_aware(c)) {
+		bch2_hprint(&PBUF(h1), r->cold_sectors << 9);
+		pr_buf(out, "cold buckets:\t\t%zu (%s)\n", r->cold.used, h1);
+	}
+
 	pr_buf(out, "rate:\t\t\t%u\n", r->pd.rate.rate);
 
 	switch (r->state) {
@@ -306,6 +528,8 @@ void bch2_rebalance_stop(struct bch_fs *c)
 		kthread_stop(p);
 		put_task_struct(p);
 	}
+
+	free_heap(&c->rebalance.cold);
 }
 
 int bch2_rebalance_start(struct bch_fs *c)
@@ -15,6 +15,16 @@ static inline void rebalance_wakeup(struct bch_fs *c)
 	rcu_read_unlock();
 }
 
+/*
+ * With background_min_age or foreground_watermark set, data is only moved to
+ * the background target once it's cold:
+ */
+static inline bool bch2_rebalance_heat_aware(struct bch_fs *c)
+{
+	return c->opts.background_target &&
+		(c->opts.background_min_age || c->opts.foreground_watermark);
+}
+
 void bch2_rebalance_add_key(struct bch_fs *, struct bkey_s_c,
 			    struct bch_io_opts *);
 void bch2_rebalance_add_work(struct bch_fs *, u64);
@@ -4,6 +4,16 @@
 
 #include "move_types.h"
 
+struct rebalance_heap_entry {
+	u8			dev;
+	u8			gen;
+	u32			sectors;
+	u64			age;
+	u64			offset;
+};
+
+typedef HEAP(struct rebalance_heap_entry) rebalance_heap;
+
 enum rebalance_state {
 	REBALANCE_WAITING,
 	REBALANCE_THROTTLED,
@@ -16,6 +26,10 @@ struct bch_fs_rebalance {
 
 	atomic64_t		work_unknown_dev;
 
+	/* Buckets picked for demotion to the background target, coldest first: */
+	rebalance_heap		cold;
+	u64			cold_sectors;
+
 	enum rebalance_state	state;
 	u64			throttled_until_iotime;
 	unsigned long		throttled_until_cputime;
@@ -6,6 +6,7 @@
 #include "btree_gc.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
+#include "btree_write_buffer.h"
 #include "btree_io.h"
 #include "buckets.h"
 #include "dirent.h"
@@ -19,6 +20,7 @@
 #include "move.h"
 #include "quota.h"
 #include "recovery.h"
+#include "reflink.h"
 #include "replicas.h"
 #include "super-io.h"
 
@@ -529,21 +531,6 @@ static int bch2_journal_replay_key(struct bch_fs *c, struct journal_key *k)
 			     __bch2_journal_replay_key(&trans, k->btree_id, k->level, k->k));
 }
 
-static int __bch2_alloc_replay_key(struct btree_trans *trans, struct bkey_i *k)
-{
-	struct btree_iter *iter;
-	int ret;
-
-	iter = bch2_trans_get_iter(trans, BTREE_ID_alloc, k->k.p,
-				   BTREE_ITER_CACHED|
-				   BTREE_ITER_CACHED_NOFILL|
-				   BTREE_ITER_INTENT);
-	ret   = bch2_btree_iter_traverse(iter) ?:
-		bch2_trans_update(trans, iter, k, BTREE_TRIGGER_NORUN);
-	bch2_trans_iter_put(trans, iter);
-	return ret;
-}
-
 static int bch2_alloc_replay_key(struct bch_fs *c, struct bkey_i *k)
 {
 	return bch2_trans_do(c, NULL, NULL,
@@ -551,7 +538,8 @@ static int bch2_alloc_replay_key(struct bch_fs *c, struct bkey_i *k)
 			     BTREE_INSERT_USE_RESERVE|
 			     BTREE_INSERT_LAZY_RW|
 			     BTREE_INSERT_JOURNAL_REPLAY,
-			__bch2_alloc_replay_key(&trans, k));
+			bch2_trans_update_buffered(&trans, BTREE_ID_alloc, k,
+						   NULL, BTREE_TRIGGER_NORUN));
 }
 
 static int journal_sort_seq_cmp(const void *_l, const void *_r)
@@ -581,8 +569,9 @@ static int bch2_journal_replay(struct bch_fs *c,
 	seq = j->replay_journal_seq;
 
 	/*
-	 * First replay updates to the alloc btree - these will only update the
-	 * btree key cache:
+	 * First replay updates to the alloc btree - these will only go to the
+	 * btree write buffer, which grows as needed until interior nodes have
+	 * been replayed and it can be flushed:
 	 */
 	for_each_journal_key(keys, i) {
 		cond_resched();
@@ -611,8 +600,8 @@ static int bch2_journal_replay(struct bch_fs *c,
 
 	/*
 	 * Now that the btree is in a consistent state, we can start journal
-	 * reclaim (which will be flushing entries from the btree key cache back
-	 * to the btree:
+	 * reclaim (which will be flushing entries from the btree key cache and
+	 * write buffer back to the btree:
 	 */
 	set_bit(BCH_FS_BTREE_INTERIOR_REPLAY_DONE, &c->flags);
 	set_bit(JOURNAL_RECLAIM_STARTED, &j->flags);
@@ -989,6 +978,7 @@ int bch2_fs_recovery(struct bch_fs *c)
 	if (!(c->sb.features & (1ULL << BCH_FEATURE_alloc_v2))) {
 		bch_info(c, "alloc_v2 feature bit not set, fsck required");
 		c->opts.fsck = true;
+		c->opts.fsck_incremental = false;
 		c->opts.fix_errors = FSCK_OPT_YES;
 	}
 
@@ -1002,6 +992,7 @@ int bch2_fs_recovery(struct bch_fs *c)
 		bch_info(c, "version prior to inode backpointers, upgrade and fsck required");
 		c->opts.version_upgrade	= true;
 		c->opts.fsck		= true;
+		c->opts.fsck_incremental = false;
 		c->opts.fix_errors	= FSCK_OPT_YES;
 	}
 
@@ -1115,7 +1106,7 @@ use_clean:
 
 	set_bit(BCH_FS_ALLOC_READ_DONE, &c->flags);
 
-	if (c->opts.fsck ||
+	if ((c->opts.fsck && !c->opts.fsck_incremental) ||
 	    !(c->sb.compat & (1ULL << BCH_COMPAT_alloc_info)) ||
 	    !(c->sb.compat & (1ULL << BCH_COMPAT_alloc_metadata)) ||
 	    test_bit(BCH_FS_REBUILD_REPLICAS, &c->flags)) {
@@ -1172,7 +1163,9 @@ use_clean:
 	if (c->opts.fsck) {
 		bch_info(c, "starting fsck");
 		err = "error in fsck";
-		ret = bch2_fsck_full(c);
+		ret = c->opts.fsck_incremental
+			? bch2_fsck_incremental(c)
+			: bch2_fsck_full(c);
 		if (ret)
 			goto err;
 		bch_verbose(c, "fsck done");
@@ -1193,6 +1186,10 @@ use_clean:
 		bch_verbose(c, "quotas done");
 	}
 
+	ret = bch2_reflink_free_index_read(c);
+	if (ret)
+		goto err;
+
 	if (!(c->sb.compat & (1ULL << BCH_COMPAT_extents_above_btree_updates_done)) ||
 	    !(c->sb.compat & (1ULL << BCH_COMPAT_bformat_overflow_done))) {
 		struct bch_move_stats stats = { 0 };
@@ -1220,7 +1217,9 @@ use_clean:
 		write_sb = true;
 	}
 
+	/* An incremental fsck doesn't check enough to clear the error flags: */
 	if (c->opts.fsck &&
+	    !c->opts.fsck_incremental &&
 	    !test_bit(BCH_FS_ERROR, &c->flags) &&
 	    !test_bit(BCH_FS_ERRORS_NOT_FIXED, &c->flags)) {
 		SET_BCH_SB_HAS_ERRORS(c->disk_sb.sb, 0);
@@ -1360,6 +1359,10 @@ int bch2_fs_initialize(struct bch_fs *c)
 			goto err;
 	}
 
+	ret = bch2_reflink_free_index_read(c);
+	if (ret)
+		goto err;
+
 	err = "error writing first journal entry";
 	ret = bch2_journal_meta(&c->journal);
 	if (ret)
@@ -9,6 +9,7 @@
 #include "reflink.h"
 
 #include <linux/sched/signal.h>
+#include <linux/sort.h>
 
 static inline unsigned bkey_type_to_indirect(const struct bkey *k)
 {
@@ -111,38 +112,378 @@ void bch2_indirect_inline_data_to_text(struct printbuf *out,
 	       min(datalen, 32U), d.v->data);
 }
 
-static int bch2_make_extent_indirect(struct btree_trans *trans,
-				     struct btree_iter *extent_iter,
-				     struct bkey_i *orig)
+/* free space index */
+
+/*
+ * New indirect extents are placed using an in memory index of free space in the
+ * reflink btree, so that finding room for one is a binary search instead of a
+ * walk of the btree.
+ *
+ * The index is only a hint - candidates are always checked against the btree,
+ * under the same locks as the insert - so it's built at mount and then updated
+ * as indirect extents are created and deleted, without worrying about
+ * transactions that fail to commit.
+ */
+
+static inline u64 reflink_free_range_size(struct reflink_free_range r)
+{
+	return r.end - r.start;
+}
+
+static inline int reflink_free_size_cmp(struct reflink_free_range l,
+					struct reflink_free_range r)
+{
+	return  cmp_int(reflink_free_range_size(l),
+			reflink_free_range_size(r)) ?:
+		cmp_int(l.start, r.start);
+}
+
+static int reflink_free_size_cmp_p(const void *l, const void *r)
+{
+	return reflink_free_size_cmp(*((struct reflink_free_range *) l),
+				     *((struct reflink_free_range *) r));
+}
+
+/* Index of the first range in by_start that ends after @pos: */
+static size_t reflink_free_start_idx(struct reflink_free_index *f, u64 pos)
+{
+	size_t l = 0, r = f->nr;
+
+	while (l < r) {
+		size_t m = l + (r - l) / 2;
+
+		if (f->by_start[m].end <= pos)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+/* Index of the first range in by_size that isn't smaller than @search: */
+static size_t reflink_free_size_idx(struct reflink_free_index *f,
+				    struct reflink_free_range search)
+{
+	size_t l = 0, r = f->nr;
+
+	while (l < r) {
+		size_t m = l + (r - l) / 2;
+
+		if (reflink_free_size_cmp(f->by_size[m], search) < 0)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+static int reflink_free_realloc(struct reflink_free_index *f, size_t nr)
+{
+	struct reflink_free_range *by_start, *by_size;
+	size_t new_size;
+
+	if (nr <= f->size)
+		return 0;
+
+	new_size = max_t(size_t, roundup_pow_of_two(nr), 16);
+
+	by_start = krealloc(f->by_start, new_size * sizeof(f->by_start[0]),
+			    GFP_NOFS);
+	if (!by_start)
+		return -ENOMEM;
+	f->by_start = by_start;
+
+	by_size = krealloc(f->by_size, new_size * sizeof(f->by_size[0]),
+			   GFP_NOFS);
+	if (!by_size)
+		return -ENOMEM;
+	f->by_size = by_size;
+
+	f->size = new_size;
+	return 0;
+}
+
+/* @r must not overlap or be adjacent to any range in the index: */
+static int reflink_free_add(struct reflink_free_index *f,
+			    struct reflink_free_range r)
+{
+	size_t nr;
+	int ret;
+
+	if (r.start >= r.end)
+		return 0;
+
+	ret = reflink_free_realloc(f, f->nr + 1);
+	if (ret)
+		return ret;
+
+	nr = f->nr;
+	array_insert_item(f->by_start, nr,
+			  reflink_free_start_idx(f, r.start), r);
+	nr = f->nr;
+	array_insert_item(f->by_size, nr,
+			  reflink_free_size_idx(f, r), r);
+	f->nr++;
+	return 0;
+}
+
+static void reflink_free_del(struct reflink_free_index *f, size_t i)
+{
+	struct reflink_free_range r = f->by_start[i];
+	size_t j = reflink_free_size_idx(f, r), nr;
+
+	EBUG_ON(j >= f->nr || reflink_free_size_cmp(f->by_size[j], r));
+
+	nr = f->nr;
+	array_remove_item(f->by_start, nr, i);
+	nr = f->nr;
+	array_remove_item(f->by_size, nr, j);
+	f->nr--;
+}
+
+static void reflink_free_invalidate(struct bch_fs *c)
+{
+	struct reflink_free_index *f = &c->reflink_free;
+
+	bch_err_ratelimited(c, "error updating reflink free space index");
+	f->valid	= false;
+	f->nr		= 0;
+}
+
+void bch2_reflink_free_mark_used(struct bch_fs *c, u64 start, u64 end)
+{
+	struct reflink_free_index *f = &c->reflink_free;
+	struct reflink_free_range r;
+	u64 below_end = min(end, f->end);
+	size_t i;
+	int ret = 0;
+
+	mutex_lock(&f->lock);
+	if (!f->valid)
+		goto out;
+
+	while ((i = reflink_free_start_idx(f, start)) < f->nr &&
+	       f->by_start[i].start < below_end) {
+		r = f->by_start[i];
+		reflink_free_del(f, i);
+
+		ret =   reflink_free_add(f, (struct reflink_free_range) {
+					 r.start, min(r.end, start) }) ?:
+			reflink_free_add(f, (struct reflink_free_range) {
+					 max(r.start, below_end), r.end });
+		if (ret)
+			goto err;
+	}
+
+	if (end > f->end) {
+		ret = reflink_free_add(f, (struct reflink_free_range) {
+				       f->end, start });
+		if (ret)
+			goto err;
+		f->end = end;
+	}
+out:
+	mutex_unlock(&f->lock);
+	return;
+err:
+	reflink_free_invalidate(c);
+	goto out;
+}
+
+void bch2_reflink_free_mark_free(struct bch_fs *c, u64 start, u64 end)
+{
+	struct reflink_free_index *f = &c->reflink_free;
+	struct reflink_free_range r;
+	size_t i;
+
+	mutex_lock(&f->lock);
+	if (!f->valid)
+		goto out;
+
+	/* Coalesce with overlapping and adjacent ranges: */
+	while ((i = reflink_free_start_idx(f, start ? start - 1 : 0)) < f->nr &&
+	       f->by_start[i].start <= end) {
+		r = f->by_start[i];
+		reflink_free_del(f, i);
+
+		start	= min(start, r.start);
+		end	= max(end, r.end);
+	}
+
+	if (end >= f->end)
+		f->end = min(f->end, start);
+	else if (reflink_free_add(f, (struct reflink_free_range) { start, end }))
+		reflink_free_invalidate(c);
+out:
+	mutex_unlock(&f->lock);
+}
+
+/* Finds a candidate position for an indirect extent of @size sectors: */
+static bool bch2_reflink_free_find(struct bch_fs *c, u64 size, u64 *pos)
+{
+	struct reflink_free_index *f = &c->reflink_free;
+	size_t i;
+	bool ret;
+
+	mutex_lock(&f->lock);
+	ret = f->valid;
+	if (ret) {
+		/* best fit: */
+		i = reflink_free_size_idx(f, (struct reflink_free_range) {
+					  0, size });
+		*pos = i < f->nr ? f->by_size[i].start : f->end;
+	}
+	mutex_unlock(&f->lock);
+
+	return ret;
+}
+
+int bch2_reflink_free_index_read(struct bch_fs *c)
+{
+	struct reflink_free_index *f = &c->reflink_free, n = { 0 };
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_reflink, POS_MIN, 0, k, ret) {
+		if (k.k->p.inode)
+			break;
+
+		if (bkey_start_offset(k.k) > n.end) {
+			ret = reflink_free_realloc(&n, n.nr + 1);
+			if (ret)
+				break;
+
+			n.by_start[n.nr++] = (struct reflink_free_range) {
+				n.end, bkey_start_offset(k.k)
+			};
+		}
+
+		n.end = max(n.end, k.k->p.offset);
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	ret = bch2_trans_exit(&trans) ?: ret;
+	if (ret) {
+		bch_err(c, "error reading reflink free space: %i", ret);
+		goto err;
+	}
+
+	if (n.nr)
+		memcpy(n.by_size, n.by_start, n.nr * sizeof(n.by_start[0]));
+	sort(n.by_size, n.nr, sizeof(n.by_size[0]),
+	     reflink_free_size_cmp_p, NULL);
+
+	mutex_lock(&f->lock);
+	swap(f->by_start,	n.by_start);
+	swap(f->by_size,	n.by_size);
+	swap(f->size,		n.size);
+	f->nr		= n.nr;
+	f->end		= n.end;
+	f->valid	= true;
+	mutex_unlock(&f->lock);
+err:
+	kfree(n.by_start);
+	kfree(n.by_size);
+	return ret;
+}
+
+void bch2_fs_reflink_exit(struct bch_fs *c)
+{
+	kfree(c->reflink_free.by_start);
+	kfree(c->reflink_free.by_size);
+}
+
+/*
+ * Returns an iterator at the start of a hole in the reflink btree big enough
+ * for an indirect extent of @size sectors - holes are checked with
+ * BTREE_ITER_WITH_UPDATES, since the transaction may already have created
+ * indirect extents that aren't committed yet:
+ */
+static struct btree_iter *bch2_reflink_slot_get(struct btree_trans *trans,
+						u64 size)
 {
 	struct bch_fs *c = trans->c;
-	struct btree_iter *reflink_iter;
+	struct btree_iter *iter;
 	struct bkey_s_c k;
-	struct bkey_i *r_v;
-	struct bkey_i_reflink_p *r_p;
-	__le64 *refcount;
+	unsigned tries;
+	u64 pos;
 	int ret;
 
-	if (orig->k.type == KEY_TYPE_inline_data)
-		bch2_check_set_feature(c, BCH_FEATURE_reflink_inline_data);
+	for (tries = 0;
+	     tries < 3 && bch2_reflink_free_find(c, size, &pos);
+	     tries++) {
+		iter = bch2_trans_get_iter(trans, BTREE_ID_reflink, POS(0, pos),
+					   BTREE_ITER_INTENT|
+					   BTREE_ITER_SLOTS|
+					   BTREE_ITER_WITH_UPDATES);
+		k = bch2_btree_iter_peek_slot(iter);
+		ret = bkey_err(k);
+		if (ret) {
+			bch2_trans_iter_put(trans, iter);
+			return ERR_PTR(ret);
+		}
 
-	for_each_btree_key(trans, reflink_iter, BTREE_ID_reflink,
+		if (bkey_deleted(k.k) &&
+		    bkey_start_offset(k.k) == pos &&
+		    k.k->p.offset >= pos + size)
+			return iter;
+
+		/* The index was out of date: */
+		if (bkey_deleted(k.k))
+			bch2_reflink_free_mark_used(c, k.k->p.offset, pos + size);
+		else
+			bch2_reflink_free_mark_used(c, pos, k.k->p.offset);
+		bch2_trans_iter_put(trans, iter);
+	}
+
+	for_each_btree_key(trans, iter, BTREE_ID_reflink,
 			   POS(0, c->reflink_hint),
-			   BTREE_ITER_INTENT|BTREE_ITER_SLOTS, k, ret) {
-		if (reflink_iter->pos.inode) {
-			bch2_btree_iter_set_pos(reflink_iter, POS_MIN);
+			   BTREE_ITER_INTENT|
+			   BTREE_ITER_SLOTS|
+			   BTREE_ITER_WITH_UPDATES, k, ret) {
+		if (iter->pos.inode) {
+			bch2_btree_iter_set_pos(iter, POS_MIN);
 			continue;
 		}
 
-		if (bkey_deleted(k.k) && orig->k.size <= k.k->size)
+		if (bkey_deleted(k.k) && size <= k.k->size)
 			break;
 	}
 
-	if (ret)
-		goto err;
+	if (ret) {
+		bch2_trans_iter_put(trans, iter);
+		return ERR_PTR(ret);
+	}
 
 	/* rewind iter to start of hole, if necessary: */
-	bch2_btree_iter_set_pos_to_extent_start(reflink_iter);
+	bch2_btree_iter_set_pos_to_extent_start(iter);
+	return iter;
+}
+
+static int bch2_make_extent_indirect(struct btree_trans *trans,
+				     struct btree_iter *extent_iter,
+				     struct bkey_i *orig)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter *reflink_iter;
+	struct bkey_i *r_v;
+	struct bkey_i_reflink_p *r_p;
+	__le64 *refcount;
+	int ret;
+
+	if (orig->k.type == KEY_TYPE_inline_data)
+		bch2_check_set_feature(c, BCH_FEATURE_reflink_inline_data);
+
+	reflink_iter = bch2_reflink_slot_get(trans, orig->k.size);
+	ret = PTR_ERR_OR_ZERO(reflink_iter);
+	if (ret)
+		return ret;
 
 	r_v = bch2_trans_kmalloc(trans, sizeof(__le64) + bkey_bytes(&orig->k));
 	ret = PTR_ERR_OR_ZERO(r_v);
@@ -171,14 +512,33 @@ static int bch2_make_extent_indirect(struct btree_trans *trans,
 	r_p->v.idx = cpu_to_le64(bkey_start_offset(&r_v->k));
 
 	ret = bch2_trans_update(trans, extent_iter, &r_p->k_i, 0);
+	if (ret)
+		goto err;
+
+	/*
+	 * Callers must give the range back with reflink_p_unmark() if the
+	 * transaction doesn't commit:
+	 */
+	bch2_reflink_free_mark_used(c, bkey_start_offset(&r_v->k),
+				    r_v->k.p.offset);
 err:
-	if (!IS_ERR(reflink_iter))
-		c->reflink_hint = reflink_iter->pos.offset;
+	c->reflink_hint = reflink_iter->pos.offset;
 	bch2_trans_iter_put(trans, reflink_iter);
 
 	return ret;
 }
 
+/*
+ * Returns the space an uncommitted indirect extent was given to the free space
+ * index, after its transaction failed to commit:
+ */
+static void reflink_p_unmark(struct bch_fs *c, struct bkey_i *k)
+{
+	u64 idx = le64_to_cpu(bkey_i_to_reflink_p(k)->v.idx);
+
+	bch2_reflink_free_mark_free(c, idx, idx + k->k.size);
+}
+
 static struct bkey_s_c get_next_src(struct btree_iter *iter, struct bpos end)
 {
 	struct bkey_s_c k;
@@ -196,6 +556,93 @@ static struct bkey_s_c get_next_src(struct btree_iter *iter, struct bpos end)
 	return bkey_s_c_null;
 }
 
+/*
+ * Number of extents converted per transaction commit by
+ * bch2_make_range_indirect() - each one is at least two updates:
+ */
+#define REFLINK_INDIRECT_BATCH	8
+
+/*
+ * Converts every extent in a source range to an indirect extent up front, a
+ * batch per commit, so that remapping a large range doesn't pay for a
+ * transaction per source extent:
+ */
+static int bch2_make_range_indirect(struct btree_trans *trans,
+				    struct bpos start, struct bpos end,
+				    u64 *journal_seq)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bkey_i *batch[REFLINK_INDIRECT_BATCH];
+	struct bpos batch_start;
+	unsigned i, nr;
+	int ret = 0;
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_extents, start,
+				   BTREE_ITER_INTENT);
+
+	while (1) {
+		bch2_trans_begin(trans);
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		batch_start = iter->pos;
+		nr = 0;
+
+		while (nr < REFLINK_INDIRECT_BATCH &&
+		       (k = get_next_src(iter, end)).k) {
+			if (k.k->type == KEY_TYPE_reflink_p) {
+				bch2_btree_iter_set_pos(iter, k.k->p);
+				continue;
+			}
+
+			/*
+			 * Pending updates point to the keys, so each one needs
+			 * its own copy - big enough to become a reflink_p:
+			 */
+			batch[nr] = bch2_trans_kmalloc(trans,
+					max_t(size_t, bkey_bytes(k.k),
+					      sizeof(struct bkey_i_reflink_p)));
+			ret = PTR_ERR_OR_ZERO(batch[nr]);
+			if (ret)
+				break;
+
+			bkey_reassemble(batch[nr], k);
+			bch2_btree_iter_set_pos_to_extent_start(iter);
+
+			ret = bch2_make_extent_indirect(trans, iter, batch[nr]);
+			if (ret)
+				break;
+
+			bch2_btree_iter_set_pos(iter, batch[nr]->k.p);
+			nr++;
+		}
+
+		if (!ret && nr)
+			ret = bch2_trans_commit(trans, NULL, journal_seq,
+						BTREE_INSERT_NOFAIL);
+		if (ret)
+			for (i = 0; i < nr; i++)
+				reflink_p_unmark(c, batch[i]);
+
+		if (ret == -EINTR) {
+			bch2_btree_iter_set_pos(iter, batch_start);
+			ret = 0;
+			continue;
+		}
+
+		if (ret || bkey_cmp(iter->pos, end) >= 0)
+			break;
+	}
+
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
 s64 bch2_remap_range(struct bch_fs *c,
 		     struct bpos dst_start, struct bpos src_start,
 		     u64 remap_sectors, u64 *journal_seq,
@@ -222,6 +669,8 @@ s64 bch2_remap_range(struct bch_fs *c,
 	bch2_bkey_buf_init(&new_src);
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 4096);
 
+	ret = bch2_make_range_indirect(&trans, src_start, src_end, journal_seq);
+
 	src_iter = bch2_trans_get_iter(&trans, BTREE_ID_extents, src_start,
 				       BTREE_ITER_INTENT);
 	dst_iter = bch2_trans_get_iter(&trans, BTREE_ID_extents, dst_start,
@@ -230,6 +679,7 @@ s64 bch2_remap_range(struct bch_fs *c,
 	while ((ret == 0 || ret == -EINTR) &&
 	       bkey_cmp(dst_iter->pos, dst_end) < 0) {
 		struct disk_reservation disk_res = { 0 };
+		bool made_indirect = false;
 
 		bch2_trans_begin(&trans);
 
@@ -268,6 +718,7 @@ s64 bch2_remap_range(struct bch_fs *c,
 				continue;
 
 			BUG_ON(src_k.k->type != KEY_TYPE_reflink_p);
+			made_indirect = true;
 		}
 
 		if (src_k.k->type == KEY_TYPE_reflink_p) {
@@ -294,6 +745,9 @@ s64 bch2_remap_range(struct bch_fs *c,
 					 new_i_size, i_sectors_delta,
 					 true);
 		bch2_disk_reservation_put(c, &disk_res);
+
+		if (ret && made_indirect)
+			reflink_p_unmark(c, new_src.k);
 	}
 	bch2_trans_iter_put(&trans, dst_iter);
 	bch2_trans_iter_put(&trans, src_iter);
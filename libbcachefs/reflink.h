@@ -57,7 +57,13 @@ static inline __le64 *bkey_refcount(struct bkey_i *k)
 	}
 }
 
+void bch2_reflink_free_mark_used(struct bch_fs *, u64, u64);
+void bch2_reflink_free_mark_free(struct bch_fs *, u64, u64);
+int bch2_reflink_free_index_read(struct bch_fs *);
+
 s64 bch2_remap_range(struct bch_fs *, struct bpos, struct bpos,
 		     u64, u64 *, u64, s64 *);
 
+void bch2_fs_reflink_exit(struct bch_fs *);
+
 #endif /* _BCACHEFS_REFLINK_H */
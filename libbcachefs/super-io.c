@@ -4,6 +4,7 @@
 #include "btree_update_interior.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "error.h"
@@ -720,6 +721,8 @@ int bch2_write_super(struct bch_fs *c)
 	closure_init_stack(cl);
 	memset(&sb_written, 0, sizeof(sb_written));
 
+	c->sb_nr_writes++;
+
 	le64_add_cpu(&c->disk_sb.sb->seq, 1);
 
 	if (test_bit(BCH_FS_ERROR, &c->flags))
@@ -810,20 +813,69 @@ int bch2_write_super(struct bch_fs *c)
 		"Unable to write superblock to sufficient devices"))
 		ret = -1;
 out:
+	/* Everything changed so far went out with this write: */
+	c->sb_seq_written	= c->sb_seq_changed;
+	c->sb_write_ret		= ret;
+
 	/* Make new options visible after they're persistent: */
 	bch2_sb_update(c);
 	return ret;
 }
 
+/*
+ * Waits for the change recorded by bch2_sb_change() as @seq to be written,
+ * writing it if no other thread has - a single write covers every change
+ * recorded before it, so a burst of changes costs one write per device:
+ *
+ * Must not be called with sb_lock held.
+ */
+int bch2_write_super_wait(struct bch_fs *c, u64 seq)
+{
+	int ret;
+
+	if (READ_ONCE(c->sb_seq_written) >= seq)
+		return READ_ONCE(c->sb_write_ret);
+
+	mutex_lock(&c->sb_lock);
+	ret = c->sb_seq_written < seq
+		? bch2_write_super(c)
+		: c->sb_write_ret;
+	mutex_unlock(&c->sb_lock);
+
+	return ret;
+}
+
+void bch2_write_super_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, sb_write_work);
+
+	bch2_write_super_wait(c, READ_ONCE(c->sb_seq_changed));
+}
+
+/*
+ * For changes that don't need to be persistent before the caller continues:
+ * records the change and returns without waiting, it'll be written by the next
+ * superblock write.
+ */
+void bch2_write_super_async(struct bch_fs *c)
+{
+	bch2_sb_change(c);
+	queue_work(system_long_wq, &c->sb_write_work);
+}
+
 void __bch2_check_set_feature(struct bch_fs *c, unsigned feat)
 {
+	u64 seq = 0;
+
 	mutex_lock(&c->sb_lock);
 	if (!(c->sb.features & (1ULL << feat))) {
 		c->disk_sb.sb->features[0] |= cpu_to_le64(1ULL << feat);
-
-		bch2_write_super(c);
+		seq = bch2_sb_change(c);
 	}
 	mutex_unlock(&c->sb_lock);
+
+	if (seq)
+		bch2_write_super_wait(c, seq);
 }
 
 /* BCH_SB_FIELD_journal: */
@@ -1166,6 +1218,37 @@ static const struct bch_sb_field_ops bch_sb_field_ops_clean = {
 	.validate	= bch2_sb_validate_clean,
 };
 
+/* BCH_SB_FIELD_import: */
+
+static const char *bch2_sb_validate_import(struct bch_sb *sb,
+					   struct bch_sb_field *f)
+{
+	struct bch_sb_field_import *import = field_to_type(f, import);
+
+	if (vstruct_bytes(&import->field) < sizeof(*import))
+		return "invalid field import: wrong size";
+
+	return NULL;
+}
+
+static void bch2_sb_import_to_text(struct printbuf *out, struct bch_sb *sb,
+				   struct bch_sb_field *f)
+{
+	struct bch_sb_field_import *import = field_to_type(f, import);
+	unsigned i;
+
+	pr_buf(out, "replica of ");
+	for (i = 0; i < sizeof(import->uuid); i++)
+		pr_buf(out, "%02x", import->uuid[i]);
+	pr_buf(out, ", at token %llu:%llu",
+	       le64_to_cpu(import->seq), le64_to_cpu(import->keyver));
+}
+
+static const struct bch_sb_field_ops bch_sb_field_ops_import = {
+	.validate	= bch2_sb_validate_import,
+	.to_text	= bch2_sb_import_to_text,
+};
+
 static const struct bch_sb_field_ops *bch2_sb_field_ops[] = {
 #define x(f, nr)					\
 	[BCH_SB_FIELD_##f] = &bch_sb_field_ops_##f,
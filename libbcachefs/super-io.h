@@ -70,8 +70,22 @@ const char *bch2_sb_validate(struct bch_sb_handle *);
 
 int bch2_read_super(const char *, struct bch_opts *, struct bch_sb_handle *);
 int bch2_write_super(struct bch_fs *);
+int bch2_write_super_wait(struct bch_fs *, u64);
+void bch2_write_super_async(struct bch_fs *);
+void bch2_write_super_work(struct work_struct *);
 void __bch2_check_set_feature(struct bch_fs *, unsigned);
 
+/*
+ * Records a change to c->disk_sb, without writing it: returns the sequence
+ * number to pass to bch2_write_super_wait(), after dropping sb_lock.
+ */
+static inline u64 bch2_sb_change(struct bch_fs *c)
+{
+	lockdep_assert_held(&c->sb_lock);
+
+	return ++c->sb_seq_changed;
+}
+
 static inline void bch2_check_set_feature(struct bch_fs *c, unsigned feat)
 {
 	if (!(c->sb.features & (1ULL << feat)))
@@ -14,6 +14,7 @@
 #include "btree_cache.h"
 #include "btree_gc.h"
 #include "btree_key_cache.h"
+#include "btree_write_buffer.h"
 #include "btree_update_interior.h"
 #include "btree_io.h"
 #include "chardev.h"
@@ -38,6 +39,7 @@
 #include "quota.h"
 #include "rebalance.h"
 #include "recovery.h"
+#include "reflink.h"
 #include "replicas.h"
 #include "super.h"
 #include "super-io.h"
@@ -440,6 +442,8 @@ static int __bch2_fs_read_write(struct bch_fs *c, bool early)
 	percpu_ref_reinit(&c->writes);
 	set_bit(BCH_FS_RW, &c->flags);
 	set_bit(BCH_FS_WAS_RW, &c->flags);
+
+	bch2_btree_reserve_cache_kick(c);
 	return 0;
 err:
 	__bch2_fs_read_only(c);
@@ -463,18 +467,19 @@ int bch2_fs_read_write_early(struct bch_fs *c)
 static void __bch2_fs_free(struct bch_fs *c)
 {
 	unsigned i;
-	int cpu;
 
 	for (i = 0; i < BCH_TIME_STAT_NR; i++)
 		bch2_time_stats_exit(&c->times[i]);
 
 	bch2_fs_quota_exit(c);
+	bch2_fs_reflink_exit(c);
 	bch2_fs_fsio_exit(c);
 	bch2_fs_ec_exit(c);
 	bch2_fs_encryption_exit(c);
 	bch2_fs_io_exit(c);
 	bch2_fs_btree_interior_update_exit(c);
 	bch2_fs_btree_iter_exit(c);
+	bch2_fs_btree_write_buffer_exit(c);
 	bch2_fs_btree_key_cache_exit(&c->btree_key_cache);
 	bch2_fs_btree_cache_exit(c);
 	bch2_fs_replicas_exit(c);
@@ -486,12 +491,7 @@ static void __bch2_fs_free(struct bch_fs *c)
 	bch2_journal_entries_free(&c->journal_entries);
 	percpu_free_rwsem(&c->mark_lock);
 
-	if (c->btree_iters_bufs)
-		for_each_possible_cpu(cpu)
-			kfree(per_cpu_ptr(c->btree_iters_bufs, cpu)->iter);
-
 	free_percpu(c->online_reserved);
-	free_percpu(c->btree_iters_bufs);
 	free_percpu(c->pcpu);
 	mempool_exit(&c->large_bkey_pool);
 	mempool_exit(&c->btree_bounce_pool);
@@ -500,7 +500,8 @@ static void __bch2_fs_free(struct bch_fs *c)
 	percpu_ref_exit(&c->writes);
 	kfree(rcu_dereference_protected(c->disk_groups, 1));
 	kfree(c->journal_seq_blacklist_table);
-	kfree(c->unused_inode_hints);
+	bch2_fs_inode_exit(c);
+	bch2_fs_alloc_caches_exit(c);
 	free_heap(&c->copygc_heap);
 
 	if (c->io_complete_wq )
@@ -563,6 +564,9 @@ void __bch2_fs_stop(struct bch_fs *c)
 	cancel_work_sync(&c->btree_write_error_work);
 	cancel_work_sync(&c->read_only_work);
 
+	/* write out any superblock changes that were left to be batched: */
+	flush_work(&c->sb_write_work);
+
 	for (i = 0; i < c->sb.nr_devices; i++)
 		if (c->devs[i])
 			bch2_free_super(&c->devs[i]->disk_sb);
@@ -666,6 +670,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 
 	init_rwsem(&c->state_lock);
 	mutex_init(&c->sb_lock);
+	INIT_WORK(&c->sb_write_work, bch2_write_super_work);
 	mutex_init(&c->replicas_gc_lock);
 	mutex_init(&c->btree_root_lock);
 	INIT_WORK(&c->read_only_work, bch2_fs_read_only_work);
@@ -687,6 +692,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	mutex_init(&c->usage_scratch_lock);
 
 	mutex_init(&c->bio_bounce_pages_lock);
+	init_waitqueue_head(&c->nocow_locks.wait);
 
 	bio_list_init(&c->btree_write_error_list);
 	spin_lock_init(&c->btree_write_error_lock);
@@ -709,6 +715,8 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 
 	spin_lock_init(&c->ec_stripes_heap_lock);
 
+	mutex_init(&c->reflink_free.lock);
+
 	seqcount_init(&c->gc_pos_lock);
 
 	seqcount_init(&c->usage_lock);
@@ -774,19 +782,19 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 			    offsetof(struct btree_write_bio, wbio.bio)),
 			BIOSET_NEED_BVECS) ||
 	    !(c->pcpu = alloc_percpu(struct bch_fs_pcpu)) ||
-	    !(c->btree_iters_bufs = alloc_percpu(struct btree_iter_buf)) ||
 	    !(c->online_reserved = alloc_percpu(u64)) ||
 	    mempool_init_kvpmalloc_pool(&c->btree_bounce_pool, 1,
 					btree_bytes(c)) ||
 	    mempool_init_kmalloc_pool(&c->large_bkey_pool, 1, 2048) ||
-	    !(c->unused_inode_hints = kcalloc(1U << c->inode_shard_bits,
-					      sizeof(u64), GFP_KERNEL)) ||
+	    bch2_fs_inode_init(c) ||
+	    bch2_fs_alloc_caches_init(c) ||
 	    bch2_io_clock_init(&c->io_clock[READ]) ||
 	    bch2_io_clock_init(&c->io_clock[WRITE]) ||
 	    bch2_fs_journal_init(&c->journal) ||
 	    bch2_fs_replicas_init(c) ||
 	    bch2_fs_btree_cache_init(c) ||
 	    bch2_fs_btree_key_cache_init(&c->btree_key_cache) ||
+	    bch2_fs_btree_write_buffer_init(c) ||
 	    bch2_fs_btree_iter_init(c) ||
 	    bch2_fs_btree_interior_update_init(c) ||
 	    bch2_fs_io_init(c) ||
@@ -1441,20 +1449,13 @@ int bch2_dev_set_state(struct bch_fs *c, struct bch_dev *ca,
 
 static int bch2_dev_remove_alloc(struct bch_fs *c, struct bch_dev *ca)
 {
-	struct btree_trans trans;
-	size_t i;
 	int ret;
 
-	bch2_trans_init(&trans, c, 0, 0);
-
-	for (i = 0; i < ca->mi.nbuckets; i++) {
-		ret = bch2_btree_key_cache_flush(&trans,
-				BTREE_ID_alloc, POS(ca->dev_idx, i));
-		if (ret)
-			break;
-	}
-	bch2_trans_exit(&trans);
-
+	/*
+	 * Alloc updates go through the btree write buffer: flush it so that
+	 * nothing for this device gets written after we delete its keys:
+	 */
+	ret = bch2_btree_write_buffer_flush(c);
 	if (ret)
 		return ret;
 
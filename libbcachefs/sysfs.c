@@ -15,6 +15,7 @@
 #include "btree_io.h"
 #include "btree_iter.h"
 #include "btree_key_cache.h"
+#include "btree_write_buffer.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
 #include "btree_gc.h"
@@ -169,6 +170,7 @@ read_attribute(btree_updates);
 read_attribute(dirty_btree_nodes);
 read_attribute(btree_cache);
 read_attribute(btree_key_cache);
+read_attribute(btree_write_buffer);
 read_attribute(btree_transactions);
 read_attribute(stripes_heap);
 
@@ -184,6 +186,7 @@ read_attribute(extent_migrate_raced);
 
 rw_attribute(journal_write_delay_ms);
 rw_attribute(journal_reclaim_delay_ms);
+rw_attribute(journal_reclaim_target);
 
 rw_attribute(discard);
 rw_attribute(cache_replacement_policy);
@@ -329,6 +332,7 @@ SHOW(bch2_fs)
 
 	sysfs_print(journal_write_delay_ms,	c->journal.write_delay_ms);
 	sysfs_print(journal_reclaim_delay_ms,	c->journal.reclaim_delay_ms);
+	sysfs_print(journal_reclaim_target,	c->journal.reclaim_target);
 
 	sysfs_print(block_size,			block_bytes(c));
 	sysfs_print(btree_node_size,		btree_bytes(c));
@@ -399,6 +403,11 @@ SHOW(bch2_fs)
 		return out.pos - buf;
 	}
 
+	if (attr == &sysfs_btree_write_buffer) {
+		bch2_btree_write_buffer_to_text(&out, c);
+		return out.pos - buf;
+	}
+
 	if (attr == &sysfs_btree_transactions) {
 		bch2_btree_trans_to_text(&out, c);
 		return out.pos - buf;
@@ -437,6 +446,8 @@ STORE(bch2_fs)
 
 	sysfs_strtoul(journal_write_delay_ms, c->journal.write_delay_ms);
 	sysfs_strtoul(journal_reclaim_delay_ms, c->journal.reclaim_delay_ms);
+	sysfs_strtoul_clamp(journal_reclaim_target,
+			    c->journal.reclaim_target, 0, 90);
 
 	if (attr == &sysfs_btree_gc_periodic) {
 		ssize_t ret = strtoul_safe(buf, c->btree_gc_periodic)
@@ -531,6 +542,7 @@ struct attribute *bch2_fs_files[] = {
 
 	&sysfs_journal_write_delay_ms,
 	&sysfs_journal_reclaim_delay_ms,
+	&sysfs_journal_reclaim_target,
 
 	&sysfs_promote_whole_extents,
 
@@ -565,6 +577,7 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_dirty_btree_nodes,
 	&sysfs_btree_cache,
 	&sysfs_btree_key_cache,
+	&sysfs_btree_write_buffer,
 	&sysfs_btree_transactions,
 	&sysfs_stripes_heap,
 
@@ -641,7 +654,9 @@ STORE(bch2_fs_opts_dir)
 	bch2_opt_set_by_id(&c->opts, id, v);
 
 	if ((id == Opt_background_target ||
-	     id == Opt_background_compression) && v) {
+	     id == Opt_background_compression ||
+	     id == Opt_background_min_age ||
+	     id == Opt_foreground_watermark) && v) {
 		bch2_rebalance_add_work(c, S64_MAX);
 		rebalance_wakeup(c);
 	}
@@ -826,7 +841,7 @@ static void dev_alloc_debug_to_text(struct printbuf *out, struct bch_dev *ca)
 	       "open_buckets_wait\t%s\n"
 	       "open_buckets_btree\t%u\n"
 	       "open_buckets_user\t%u\n"
-	       "btree reserve cache\t%u\n"
+	       "btree reserve cache\t%u/%u\n"
 	       "thread state:\t\t%s\n",
 	       stats.buckets_ec,
 	       __dev_buckets_available(ca, stats),
@@ -840,7 +855,8 @@ static void dev_alloc_debug_to_text(struct printbuf *out, struct bch_dev *ca)
 	       c->open_buckets_wait.list.first		? "waiting" : "empty",
 	       nr[BCH_DATA_btree],
 	       nr[BCH_DATA_user],
-	       c->btree_reserve_cache_nr,
+	       c->btree_reserve_cache_nr[0],
+	       c->btree_reserve_cache_nr[1],
 	       bch2_allocator_states[ca->allocator_state]);
 }
 
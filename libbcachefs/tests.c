@@ -3,11 +3,17 @@
 
 #include "bcachefs.h"
 #include "btree_update.h"
+#include "inode.h"
+#include "io.h"
 #include "journal_reclaim.h"
+#include "quota.h"
+#include "reflink.h"
+#include "super-io.h"
 #include "tests.h"
 
 #include "linux/kthread.h"
 #include "linux/random.h"
+#include "linux/timer.h"
 
 static void delete_test_keys(struct bch_fs *c)
 {
@@ -461,6 +467,310 @@ static int test_extent_overwrite_all(struct bch_fs *c, u64 nr)
 		__test_extent_overwrite(c, 32, 64, 32, 128);
 }
 
+/* reflink unit tests */
+
+#define REFLINK_TEST_SRC	(U32_MAX - 1)
+#define REFLINK_TEST_DST	(U32_MAX - 2)
+#define REFLINK_TEST_NR		64
+
+static int reflink_test_inode_create(struct btree_trans *trans, u64 inum)
+{
+	struct bch_inode_unpacked inode_u;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	bch2_inode_init(trans->c, &inode_u, 0, 0, S_IFREG|0600, 0, NULL);
+	inode_u.bi_inum = inum;
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_inodes, POS(0, inum),
+				   BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
+	k = bch2_btree_iter_peek_slot(iter);
+	ret   = bkey_err(k) ?:
+		bch2_inode_write(trans, iter, &inode_u);
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+/* Extent i covers [i * 8, i * 8 + 4) and holds i as inline data: */
+static int reflink_test_insert_src(struct bch_fs *c, u64 i)
+{
+	struct {
+		struct bkey_i_inline_data	k;
+		__le64				data;
+	} e;
+
+	bkey_inline_data_init(&e.k.k_i);
+	e.k.k.p		= POS(REFLINK_TEST_SRC, i * 8 + 4);
+	e.k.k.size	= 4;
+	set_bkey_val_bytes(&e.k.k, sizeof(e.data));
+	e.data		= cpu_to_le64(i);
+
+	return bch2_btree_insert(c, BTREE_ID_extents, &e.k.k_i, NULL, NULL, 0);
+}
+
+/*
+ * Checks that extent i of @inum is a reflink_p to its own indirect extent,
+ * holding the original data:
+ */
+static int reflink_test_verify(struct btree_trans *trans, u64 inum)
+{
+	struct btree_iter *iter, *r_iter;
+	struct bkey_s_c k, r;
+	u64 i = 0, idx;
+	int ret;
+
+	for_each_btree_key(trans, iter, BTREE_ID_extents, POS(inum, 0), 0, k, ret) {
+		if (k.k->p.inode != inum)
+			break;
+
+		if (k.k->type != KEY_TYPE_reflink_p ||
+		    bkey_start_offset(k.k) != i * 8 ||
+		    k.k->size != 4) {
+			bch_err(trans->c, "extent %llu of inode %llu wrong", i, inum);
+			ret = -EINVAL;
+			break;
+		}
+
+		idx = le64_to_cpu(bkey_s_c_to_reflink_p(k).v->idx);
+
+		r_iter = bch2_trans_get_iter(trans, BTREE_ID_reflink,
+					     POS(0, idx), 0);
+		r = bch2_btree_iter_peek(r_iter);
+		ret = bkey_err(r);
+		if (!ret &&
+		    (!r.k ||
+		     r.k->type != KEY_TYPE_indirect_inline_data ||
+		     bkey_start_offset(r.k) != idx ||
+		     r.k->size != 4 ||
+		     le64_to_cpup(bkey_inline_data_p(r)) != i)) {
+			bch_err(trans->c, "indirect extent for extent %llu of inode %llu wrong",
+				i, inum);
+			ret = -EINVAL;
+		}
+		bch2_trans_iter_put(trans, r_iter);
+
+		if (ret)
+			break;
+		i++;
+	}
+	bch2_trans_iter_put(trans, iter);
+
+	if (!ret && i != REFLINK_TEST_NR) {
+		bch_err(trans->c, "inode %llu has %llu extents, should have %u",
+			inum, i, REFLINK_TEST_NR);
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+/* Returns the indirect extent extent i of @inum points to: */
+static int reflink_test_idx(struct btree_trans *trans, u64 inum, u64 i,
+			    u64 *idx)
+{
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_extents,
+				   POS(inum, i * 8), 0);
+	k = bch2_btree_iter_peek(iter);
+	ret = bkey_err(k);
+	if (!ret && (!k.k || k.k->type != KEY_TYPE_reflink_p)) {
+		bch_err(trans->c, "extent %llu of inode %llu not reflinked",
+			i, inum);
+		ret = -EINVAL;
+	}
+	if (!ret)
+		*idx = le64_to_cpu(bkey_s_c_to_reflink_p(k).v->idx);
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+/*
+ * Checks that the reflink free space index, as kept up to date by remap and the
+ * reflink_p trigger, matches what a fresh read of the reflink btree gives:
+ */
+static int reflink_test_check_free_index(struct bch_fs *c)
+{
+	struct reflink_free_index *f = &c->reflink_free;
+	struct reflink_free_range *ranges = NULL;
+	size_t nr;
+	u64 end;
+	bool valid;
+	int ret;
+
+	mutex_lock(&f->lock);
+	valid	= f->valid;
+	nr	= f->nr;
+	end	= f->end;
+	if (nr)
+		ranges = kmemdup(f->by_start, nr * sizeof(ranges[0]),
+				 GFP_KERNEL);
+	mutex_unlock(&f->lock);
+
+	if (nr && !ranges)
+		return -ENOMEM;
+
+	ret = bch2_reflink_free_index_read(c);
+	if (ret)
+		goto err;
+
+	mutex_lock(&f->lock);
+	if (!valid || nr != f->nr || end != f->end ||
+	    (nr && memcmp(ranges, f->by_start, nr * sizeof(ranges[0])))) {
+		bch_err(c, "reflink free space index wrong: %zu ranges below %llu, should be %zu below %llu",
+			nr, end, f->nr, f->end);
+		ret = -EINVAL;
+	}
+	mutex_unlock(&f->lock);
+err:
+	kfree(ranges);
+	return ret;
+}
+
+/*
+ * Remaps a fragmented source, half with the reflink free space index and half
+ * without - checking that indirect extents created in the same transaction
+ * never share space.
+ *
+ * Then frees every fourth indirect extent, plants a stale entry in the index,
+ * and remaps the freed extents again - checking that they're placed in the
+ * holes, and that the index ends up matching the reflink btree:
+ */
+static int test_reflink_remap_fragmented(struct bch_fs *c, u64 nr)
+{
+	struct btree_trans trans;
+	u64 half = REFLINK_TEST_NR * 8 / 2, i, idx, end;
+	s64 i_sectors_delta = 0;
+	s64 ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	ret   = __bch2_trans_do(&trans, NULL, NULL, 0,
+			reflink_test_inode_create(&trans, REFLINK_TEST_SRC)) ?:
+		__bch2_trans_do(&trans, NULL, NULL, 0,
+			reflink_test_inode_create(&trans, REFLINK_TEST_DST));
+	if (ret) {
+		bch_err(c, "error creating inodes in test_reflink_remap_fragmented: %lli", ret);
+		goto err;
+	}
+
+	for (i = 0; i < REFLINK_TEST_NR && !ret; i++)
+		ret = reflink_test_insert_src(c, i);
+	if (ret) {
+		bch_err(c, "insert error in test_reflink_remap_fragmented: %lli", ret);
+		goto err;
+	}
+
+	ret = bch2_remap_range(c, POS(REFLINK_TEST_DST, 0),
+			       POS(REFLINK_TEST_SRC, 0), half,
+			       NULL, half << 9, &i_sectors_delta);
+	if (ret != half) {
+		bch_err(c, "remap error in test_reflink_remap_fragmented: %lli", ret);
+		ret = ret < 0 ? ret : -EIO;
+		goto err;
+	}
+
+	mutex_lock(&c->reflink_free.lock);
+	c->reflink_free.valid = false;
+	mutex_unlock(&c->reflink_free.lock);
+
+	ret = bch2_remap_range(c, POS(REFLINK_TEST_DST, half),
+			       POS(REFLINK_TEST_SRC, half), half,
+			       NULL, (half * 2) << 9, &i_sectors_delta);
+
+	bch2_reflink_free_index_read(c);
+
+	if (ret != half) {
+		bch_err(c, "remap error in test_reflink_remap_fragmented: %lli", ret);
+		ret = ret < 0 ? ret : -EIO;
+		goto err;
+	}
+
+	ret   = reflink_test_verify(&trans, REFLINK_TEST_SRC) ?:
+		reflink_test_verify(&trans, REFLINK_TEST_DST);
+	if (ret)
+		goto err;
+
+	end = c->reflink_free.end;
+
+	/* Free the indirect extents of every fourth extent: */
+	for (i = 1; i < REFLINK_TEST_NR && !ret; i += 4)
+		ret   = bch2_fpunch(c, REFLINK_TEST_SRC, i * 8, i * 8 + 4,
+				    NULL, &i_sectors_delta) ?:
+			bch2_fpunch(c, REFLINK_TEST_DST, i * 8, i * 8 + 4,
+				    NULL, &i_sectors_delta);
+	if (ret) {
+		bch_err(c, "punch error in test_reflink_remap_fragmented: %lli", ret);
+		goto err;
+	}
+
+	ret = reflink_test_check_free_index(c);
+	if (ret)
+		goto err;
+
+	/*
+	 * Claim that a live indirect extent, with live neighbours, is free -
+	 * remap has to notice and correct the index:
+	 */
+	ret = lockrestart_do(&trans,
+		reflink_test_idx(&trans, REFLINK_TEST_SRC, 3, &idx));
+	if (ret)
+		goto err;
+
+	bch2_reflink_free_mark_free(c, idx, idx + 4);
+
+	for (i = 1; i < REFLINK_TEST_NR && !ret; i += 4)
+		ret = reflink_test_insert_src(c, i);
+	if (ret) {
+		bch_err(c, "insert error in test_reflink_remap_fragmented: %lli", ret);
+		goto err;
+	}
+
+	ret = bch2_remap_range(c, POS(REFLINK_TEST_DST, 0),
+			       POS(REFLINK_TEST_SRC, 0), half * 2,
+			       NULL, (half * 2) << 9, &i_sectors_delta);
+	if (ret != half * 2) {
+		bch_err(c, "remap error in test_reflink_remap_fragmented: %lli", ret);
+		ret = ret < 0 ? ret : -EIO;
+		goto err;
+	}
+
+	ret   = reflink_test_verify(&trans, REFLINK_TEST_SRC) ?:
+		reflink_test_verify(&trans, REFLINK_TEST_DST);
+	if (ret)
+		goto err;
+
+	for (i = 1; i < REFLINK_TEST_NR && !ret; i += 4) {
+		ret = lockrestart_do(&trans,
+			reflink_test_idx(&trans, REFLINK_TEST_SRC, i, &idx));
+		if (!ret && idx + 4 > end) {
+			bch_err(c, "extent %llu not placed in a hole: at %llu, end %llu",
+				i, idx, end);
+			ret = -EINVAL;
+		}
+	}
+	if (ret)
+		goto err;
+
+	if (c->reflink_free.end != end) {
+		bch_err(c, "reflink btree grew from %llu to %llu with holes to fill",
+			end, c->reflink_free.end);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	ret = reflink_test_check_free_index(c);
+err:
+	bch2_trans_exit(&trans);
+
+	bch2_inode_rm(c, REFLINK_TEST_SRC, false);
+	bch2_inode_rm(c, REFLINK_TEST_DST, false);
+	return ret;
+}
+
 /* perf tests */
 
 static u64 test_rand(void)
@@ -743,6 +1053,296 @@ static int seq_delete(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+/* Timers: */
+
+#define TIMER_TEST_NR		1024
+
+static void timer_test_fn(struct timer_list *timer)
+{
+}
+
+/* Arms, rearms and cancels timers, with TIMER_TEST_NR pending at a time: */
+static int timer_arm_cancel(struct bch_fs *c, u64 nr)
+{
+	struct timer_list *timers;
+	u64 i;
+
+	timers = kcalloc(TIMER_TEST_NR, sizeof(*timers), GFP_KERNEL);
+	if (!timers)
+		return -ENOMEM;
+
+	for (i = 0; i < TIMER_TEST_NR; i++)
+		timer_setup(&timers[i], timer_test_fn, 0);
+
+	for (i = 0; i < nr; i++) {
+		struct timer_list *timer = &timers[i % TIMER_TEST_NR];
+		u64 v = test_rand();
+
+		if (v & 1)
+			del_timer(timer);
+		else
+			mod_timer(timer, jiffies + HZ + (v >> 1) % (60 * HZ));
+	}
+
+	for (i = 0; i < TIMER_TEST_NR; i++)
+		del_timer_sync(&timers[i]);
+
+	kfree(timers);
+	return 0;
+}
+
+/* Slab caches: */
+
+#define KMEM_TEST_NR		(KMEM_DEPOT_MAX + 4 * KMEM_MAGAZINE_SIZE)
+
+struct kmem_test {
+	struct kmem_cache	*cache;
+	void			*objs[KMEM_TEST_NR];
+	unsigned		nr;
+	int			ret;
+
+	struct completion	allocated;
+	struct completion	recycle;
+	struct completion	recycled;
+	struct completion	destroyed;
+	struct completion	done;
+};
+
+/* Objects cached in the depot and in magazines, and the number of magazines: */
+static unsigned kmem_test_cached(struct kmem_cache *cache, unsigned *magazines)
+{
+	struct kmem_magazine *m;
+	unsigned nr;
+
+	*magazines = 0;
+
+	spin_lock(&cache->lock);
+	nr = cache->depot_nr;
+	list_for_each_entry(m, &cache->magazines, list) {
+		nr += m->nr;
+		(*magazines)++;
+	}
+	spin_unlock(&cache->lock);
+
+	return nr;
+}
+
+static int kmem_test_check(struct kmem_cache *cache, const char *when)
+{
+	struct kmem_cache_stats s;
+	unsigned magazines, cached = kmem_test_cached(cache, &magazines);
+
+	kmem_cache_stats(cache, &s);
+
+	if (cache->depot_nr > KMEM_DEPOT_MAX ||
+	    s.allocs != s.frees ||
+	    s.backing_allocs - s.backing_frees != cached) {
+		pr_err("kmem_cache stats wrong %s: %llu allocs %llu frees, %llu backing allocs %llu backing frees, %u cached (%u in depot)",
+		       when, s.allocs, s.frees, s.backing_allocs,
+		       s.backing_frees, cached, cache->depot_nr);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int kmem_test_thread(void *arg)
+{
+	struct kmem_test *t = arg;
+	struct kmem_cache *cache = t->cache;
+	void *objs[KMEM_DEPOT_MAX];
+	unsigned i;
+
+	for (i = 0; i < KMEM_TEST_NR; i++)
+		if (!(t->objs[i] = kmem_cache_alloc(cache, GFP_KERNEL)))
+			t->ret = -ENOMEM;
+
+	/* Keep a few in this thread's magazine, hand off the rest: */
+	t->nr = KMEM_TEST_NR;
+	for (i = 0; i < KMEM_MAGAZINE_SIZE / 2; i++)
+		kmem_cache_free(cache, t->objs[--t->nr]);
+	complete(&t->allocated);
+
+	/* Take back what the other thread freed to the depot: */
+	wait_for_completion(&t->recycle);
+	for (i = 0; i < ARRAY_SIZE(objs); i++)
+		if (!(objs[i] = kmem_cache_alloc(cache, GFP_KERNEL)))
+			t->ret = -ENOMEM;
+	for (i = 0; i < ARRAY_SIZE(objs); i++)
+		kmem_cache_free(cache, objs[i]);
+	complete(&t->recycled);
+
+	/* Our magazine's cache is destroyed; use its replacement: */
+	wait_for_completion(&t->destroyed);
+	cache = t->cache;
+
+	for (i = 0; cache && i < KMEM_MAGAZINE_SIZE; i++)
+		if (!(objs[i] = kmem_cache_alloc(cache, GFP_KERNEL)))
+			t->ret = -ENOMEM;
+	for (i = 0; cache && i < KMEM_MAGAZINE_SIZE; i++)
+		kmem_cache_free(cache, objs[i]);
+
+	/* and exit with objects in our magazine: */
+	complete(&t->done);
+	return 0;
+}
+
+/*
+ * Allocates from a slab cache in one thread and frees in another, checking the
+ * stats and the depot bound; then destroys the cache while the other thread
+ * still has objects in its magazine, and checks that the magazine of an exiting
+ * thread is returned to the depot:
+ */
+static int test_kmem_cache(struct bch_fs *c, u64 nr)
+{
+	struct kmem_test *t;
+	struct kmem_cache_stats s;
+	struct task_struct *p;
+	u64 backing_allocs;
+	unsigned i, magazines;
+	int ret;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	init_completion(&t->allocated);
+	init_completion(&t->recycle);
+	init_completion(&t->recycled);
+	init_completion(&t->destroyed);
+	init_completion(&t->done);
+
+	t->cache = kmem_cache_create("kmem_test", 64);
+	if (!t->cache) {
+		kfree(t);
+		return -ENOMEM;
+	}
+
+	p = kthread_run(kmem_test_thread, t, "kmem_test");
+	if (IS_ERR(p)) {
+		kmem_cache_destroy(t->cache);
+		kfree(t);
+		return PTR_ERR(p);
+	}
+
+	wait_for_completion(&t->allocated);
+
+	/* Freeing more than the depot holds overflows to the system allocator: */
+	for (i = 0; i < t->nr; i++)
+		kmem_cache_free(t->cache, t->objs[i]);
+
+	kmem_cache_stats(t->cache, &s);
+	ret = t->ret ?: kmem_test_check(t->cache, "after freeing");
+	if (!ret &&
+	    (s.allocs != KMEM_TEST_NR ||
+	     !s.refills || !s.flushes || !s.backing_frees)) {
+		pr_err("kmem_cache didn't refill and flush: %llu allocs, %llu refills, %llu flushes, %llu backing frees",
+		       s.allocs, s.refills, s.flushes, s.backing_frees);
+		ret = -EINVAL;
+	}
+	backing_allocs = s.backing_allocs;
+
+	/* The other thread reallocates what we freed, without new objects: */
+	complete(&t->recycle);
+	wait_for_completion(&t->recycled);
+
+	kmem_cache_stats(t->cache, &s);
+	ret = ret ?: t->ret ?: kmem_test_check(t->cache, "after recycling");
+	if (!ret && s.backing_allocs != backing_allocs) {
+		pr_err("kmem_cache allocated %llu new objects with %u cached",
+		       s.backing_allocs - backing_allocs, KMEM_DEPOT_MAX);
+		ret = -EINVAL;
+	}
+
+	/* Both threads have objects in their magazines: */
+	kmem_cache_destroy(t->cache);
+
+	t->cache = kmem_cache_create("kmem_test", 64);
+	complete(&t->destroyed);
+	wait_for_completion(&t->done);
+
+	if (!t->cache) {
+		kfree(t);
+		return -ENOMEM;
+	}
+
+	/* Wait for the other thread's magazine to be returned as it exits: */
+	for (i = 0; i < 10 * HZ; i++) {
+		kmem_test_cached(t->cache, &magazines);
+		if (!magazines)
+			break;
+
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_timeout(1);
+	}
+
+	if (!ret && magazines) {
+		pr_err("kmem_cache magazine not returned on thread exit");
+		ret = -EINVAL;
+	}
+
+	ret = ret ?: t->ret ?: kmem_test_check(t->cache, "after thread exit");
+	if (!ret && !t->cache->depot_nr) {
+		pr_err("kmem_cache depot empty after thread exit");
+		ret = -EINVAL;
+	}
+
+	kmem_cache_destroy(t->cache);
+	kfree(t);
+	return ret;
+}
+
+/*
+ * Foreground threads making superblock changes they have to wait on, as when
+ * setting feature bits on the write path - reports how long they stalled, and
+ * how many superblock writes that took:
+ */
+static int sb_write_stall(struct bch_fs *c, u64 nr)
+{
+	u64 i, seq, start, stall, stall_max = 0, stall_total = 0;
+	u64 nr_writes = READ_ONCE(c->sb_nr_writes);
+	int ret = 0;
+
+	for (i = 0; i < nr && !ret; i++) {
+		mutex_lock(&c->sb_lock);
+		seq = bch2_sb_change(c);
+		mutex_unlock(&c->sb_lock);
+
+		start = sched_clock();
+		ret = bch2_write_super_wait(c, seq);
+		stall = sched_clock() - start;
+
+		stall_max = max(stall_max, stall);
+		stall_total += stall;
+	}
+
+	nr_writes = READ_ONCE(c->sb_nr_writes) - nr_writes;
+
+	pr_info("%llu superblock changes in %llu writes, stalled %llu nsec avg, %llu nsec max",
+		i, nr_writes, i ? div64_u64(stall_total, i) : 0, stall_max);
+	return ret;
+}
+
+/*
+ * Space accounting as done by writes and truncates, from every thread against
+ * the same ids - needs quotas enabled to measure anything:
+ */
+static int quota_acct_multi(struct bch_fs *c, u64 nr)
+{
+	struct bch_qid qid = { .q = { 0 } };
+	u64 i;
+	int ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		ret =   bch2_quota_acct(c, qid, Q_SPC, 8, KEY_TYPE_QUOTA_PREALLOC) ?:
+			bch2_quota_acct(c, qid, Q_SPC, -8, KEY_TYPE_QUOTA_WARN);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
 typedef int (*perf_test_fn)(struct bch_fs *, u64);
 
 struct test_job {
@@ -814,6 +1414,10 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(seq_overwrite);
 	perf_test(seq_delete);
 
+	perf_test(timer_arm_cancel);
+	perf_test(sb_write_stall);
+	perf_test(quota_acct_multi);
+
 	/* a unit test, not a perf test: */
 	perf_test(test_delete);
 	perf_test(test_delete_written);
@@ -829,6 +1433,10 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(test_extent_overwrite_middle);
 	perf_test(test_extent_overwrite_all);
 
+	perf_test(test_reflink_remap_fragmented);
+
+	perf_test(test_kmem_cache);
+
 	if (!j.fn) {
 		pr_err("unknown test %s", testname);
 		return -EINVAL;
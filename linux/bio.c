@@ -188,9 +188,13 @@ void bio_advance(struct bio *bio, unsigned bytes)
 
 static void bio_free(struct bio *bio)
 {
-	unsigned front_pad = bio->bi_pool ? bio->bi_pool->front_pad : 0;
+	struct bio_set *bs = bio->bi_pool;
+	unsigned front_pad = bs ? bs->front_pad : 0;
 
-	kfree((void *) bio - front_pad);
+	if (bs && bs->bio_slab && bio->bi_max_vecs == BIO_INLINE_VECS)
+		kmem_cache_free(bs->bio_slab, (void *) bio - front_pad);
+	else
+		kfree((void *) bio - front_pad);
 }
 
 void bio_put(struct bio *bio)
@@ -297,10 +301,15 @@ struct bio *bio_alloc_bioset(gfp_t gfp_mask, int nr_iovecs, struct bio_set *bs)
 	struct bio *bio;
 	void *p;
 
-	p = kmalloc(front_pad +
-		    sizeof(struct bio) +
-		    nr_iovecs * sizeof(struct bio_vec),
-		    gfp_mask);
+	if (bs && bs->bio_slab && nr_iovecs <= BIO_INLINE_VECS) {
+		p = kmem_cache_alloc(bs->bio_slab, gfp_mask);
+		nr_iovecs = BIO_INLINE_VECS;
+	} else {
+		p = kmalloc(front_pad +
+			    sizeof(struct bio) +
+			    nr_iovecs * sizeof(struct bio_vec),
+			    gfp_mask);
+	}
 
 	if (unlikely(!p))
 		return NULL;
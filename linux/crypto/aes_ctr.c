@@ -0,0 +1,664 @@
+/*
+ * AES-256 in counter mode
+ *
+ * The counter block is a 128 bit big endian integer, incremented once per
+ * block, as in the kernel's ctr(aes). Uses AES-NI when the CPU supports it
+ * (checked at runtime), otherwise a constant time generic implementation:
+ * SubBytes is a bitsliced circuit run on four blocks at a time, and the rest
+ * of the round is branch free byte arithmetic, so there are no table lookups
+ * or branches that depend on the key or data. It's much slower than AES-NI.
+ *
+ * Both implementations are checked against known answer tests (FIPS-197,
+ * SP 800-38A) and against each other when the module is loaded, and the
+ * algorithm isn't registered if either fails.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <linux/byteorder.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/printk.h>
+#include <linux/random.h>
+#include <linux/scatterlist.h>
+#include <linux/string.h>
+
+#include <linux/crypto.h>
+#include <crypto/aes.h>
+#include <crypto/algapi.h>
+#include <crypto/skcipher.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#define AES256_ROUNDS		14
+
+static struct skcipher_alg alg;
+
+static bool aes_ni;
+
+struct aes_ctr_tfm {
+	struct crypto_skcipher	tfm;
+	u8			rk[AES256_ROUNDS + 1][AES_BLOCK_SIZE];
+};
+
+static inline u8 aes_xtime(u8 x)
+{
+	return (x << 1) ^ (((x >> 7) & 1) * 0x1b);
+}
+
+/*
+ * The S-box, bitsliced: @q[i] is bit i of 64 bytes, and the S-box is computed
+ * on all of them at once with Boyar and Peralta's 113 gate circuit ("A depth-16
+ * circuit for the AES S-box", 2011):
+ */
+static void aes_sbox_bitsliced(u64 q[8])
+{
+	u64 x0, x1, x2, x3, x4, x5, x6, x7;
+	u64 y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11;
+	u64 y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+	u64 z0, z1, z2, z3, z4, z5, z6, z7, z8, z9, z10, z11;
+	u64 z12, z13, z14, z15, z16, z17;
+	u64 t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11;
+	u64 t12, t13, t14, t15, t16, t17, t18, t19, t20, t21, t22, t23;
+	u64 t24, t25, t26, t27, t28, t29, t30, t31, t32, t33, t34, t35;
+	u64 t36, t37, t38, t39, t40, t41, t42, t43, t44, t45, t46, t47;
+	u64 t48, t49, t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+	u64 t60, t61, t62, t63, t64, t65, t66, t67;
+	u64 s0, s1, s2, s3, s4, s5, s6, s7;
+
+	x0 = q[7]; x1 = q[6]; x2 = q[5]; x3 = q[4];
+	x4 = q[3]; x5 = q[2]; x6 = q[1]; x7 = q[0];
+
+	/* Top linear transformation: */
+	y14 = x3 ^ x5;
+	y13 = x0 ^ x6;
+	y9 = x0 ^ x3;
+	y8 = x0 ^ x5;
+	t0 = x1 ^ x2;
+	y1 = t0 ^ x7;
+	y4 = y1 ^ x3;
+	y12 = y13 ^ y14;
+	y2 = y1 ^ x0;
+	y5 = y1 ^ x6;
+	y3 = y5 ^ y8;
+	t1 = x4 ^ y12;
+	y15 = t1 ^ x5;
+	y20 = t1 ^ x1;
+	y6 = y15 ^ x7;
+	y10 = y15 ^ t0;
+	y11 = y20 ^ y9;
+	y7 = x7 ^ y11;
+	y17 = y10 ^ y11;
+	y19 = y10 ^ y8;
+	y16 = t0 ^ y11;
+	y21 = y13 ^ y16;
+	y18 = x0 ^ y16;
+
+	/* Nonlinear section: */
+	t2 = y12 & y15;
+	t3 = y3 & y6;
+	t4 = t3 ^ t2;
+	t5 = y4 & x7;
+	t6 = t5 ^ t2;
+	t7 = y13 & y16;
+	t8 = y5 & y1;
+	t9 = t8 ^ t7;
+	t10 = y2 & y7;
+	t11 = t10 ^ t7;
+	t12 = y9 & y11;
+	t13 = y14 & y17;
+	t14 = t13 ^ t12;
+	t15 = y8 & y10;
+	t16 = t15 ^ t12;
+	t17 = t4 ^ t14;
+	t18 = t6 ^ t16;
+	t19 = t9 ^ t14;
+	t20 = t11 ^ t16;
+	t21 = t17 ^ y20;
+	t22 = t18 ^ y19;
+	t23 = t19 ^ y21;
+	t24 = t20 ^ y18;
+	t25 = t21 ^ t22;
+	t26 = t21 & t23;
+	t27 = t24 ^ t26;
+	t28 = t25 & t27;
+	t29 = t28 ^ t22;
+	t30 = t23 ^ t24;
+	t31 = t22 ^ t26;
+	t32 = t31 & t30;
+	t33 = t32 ^ t24;
+	t34 = t23 ^ t33;
+	t35 = t27 ^ t33;
+	t36 = t24 & t35;
+	t37 = t36 ^ t34;
+	t38 = t27 ^ t36;
+	t39 = t29 & t38;
+	t40 = t25 ^ t39;
+	t41 = t40 ^ t37;
+	t42 = t29 ^ t33;
+	t43 = t29 ^ t40;
+	t44 = t33 ^ t37;
+	t45 = t42 ^ t41;
+	z0 = t44 & y15;
+	z1 = t37 & y6;
+	z2 = t33 & x7;
+	z3 = t43 & y16;
+	z4 = t40 & y1;
+	z5 = t29 & y7;
+	z6 = t42 & y11;
+	z7 = t45 & y17;
+	z8 = t41 & y10;
+	z9 = t44 & y12;
+	z10 = t37 & y3;
+	z11 = t33 & y4;
+	z12 = t43 & y13;
+	z13 = t40 & y5;
+	z14 = t29 & y2;
+	z15 = t42 & y9;
+	z16 = t45 & y14;
+	z17 = t41 & y8;
+
+	/* Bottom linear transformation: */
+	t46 = z15 ^ z16;
+	t47 = z10 ^ z11;
+	t48 = z5 ^ z13;
+	t49 = z9 ^ z10;
+	t50 = z2 ^ z12;
+	t51 = z2 ^ z5;
+	t52 = z7 ^ z8;
+	t53 = z0 ^ z3;
+	t54 = z6 ^ z7;
+	t55 = z16 ^ z17;
+	t56 = z12 ^ t48;
+	t57 = t50 ^ t53;
+	t58 = z4 ^ t46;
+	t59 = z3 ^ t54;
+	t60 = t46 ^ t57;
+	t61 = z14 ^ t57;
+	t62 = t52 ^ t58;
+	t63 = t49 ^ t58;
+	t64 = z4 ^ t59;
+	t65 = t61 ^ t62;
+	t66 = z1 ^ t63;
+	s0 = t59 ^ t63;
+	s6 = t56 ^ ~t62;
+	s7 = t48 ^ ~t60;
+	t67 = t64 ^ t65;
+	s3 = t53 ^ t66;
+	s4 = t51 ^ t66;
+	s5 = t47 ^ t65;
+	s1 = t64 ^ ~s3;
+	s2 = t55 ^ ~t67;
+
+	q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+	q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+/* Transposes the 8x8 bit matrix in @x, with a row per byte: */
+static inline u64 transpose8x8(u64 x)
+{
+	u64 t;
+
+	t = (x ^ (x >>  7)) & 0x00aa00aa00aa00aaULL; x ^= t ^ (t <<  7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL; x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL; x ^= t ^ (t << 28);
+	return x;
+}
+
+/* Transposes the 8x8 byte matrix in @q, with a row per u64: */
+static inline void transpose_bytes(u64 q[8])
+{
+	static const u64 masks[] = {
+		0x00000000ffffffffULL,
+		0x0000ffff0000ffffULL,
+		0x00ff00ff00ff00ffULL,
+	};
+	unsigned i, j, shift;
+
+	for (i = 0, shift = 32; i < ARRAY_SIZE(masks); i++, shift >>= 1)
+		for (j = 0; j < 8; j++)
+			if (!(j & (shift >> 3))) {
+				u64 *a = &q[j], *b = &q[j + (shift >> 3)];
+				u64 t = ((*a >> shift) ^ *b) & masks[i];
+
+				*a ^= t << shift;
+				*b ^= t;
+			}
+}
+
+#define AES_GENERIC_BLOCKS	4
+
+/*
+ * SubBytes on the AES_GENERIC_BLOCKS blocks at @p: transposed into bit planes,
+ * so that there are no lookups indexed by key or data:
+ */
+static void aes_sub_bytes(u8 *p)
+{
+	u64 q[8];
+	unsigned i;
+
+	memcpy(q, p, sizeof(q));
+
+	for (i = 0; i < 8; i++)
+		q[i] = transpose8x8(q[i]);
+	transpose_bytes(q);
+
+	aes_sbox_bitsliced(q);
+
+	transpose_bytes(q);
+	for (i = 0; i < 8; i++)
+		q[i] = transpose8x8(q[i]);
+
+	memcpy(p, q, sizeof(q));
+}
+
+static void aes256_expand_key(u8 rk[AES256_ROUNDS + 1][AES_BLOCK_SIZE],
+			      const u8 *key)
+{
+	u8 *w = &rk[0][0], t[AES_BLOCK_SIZE * AES_GENERIC_BLOCKS], rcon = 1;
+	unsigned i, j;
+
+	memcpy(w, key, AES_KEYSIZE_256);
+
+	for (i = AES_KEYSIZE_256; i < (AES256_ROUNDS + 1) * AES_BLOCK_SIZE; i += 4) {
+		memcpy(t, w + i - 4, 4);
+
+		if (i % AES_KEYSIZE_256 == 0) {
+			u8 t0 = t[0];
+
+			t[0] = t[1];
+			t[1] = t[2];
+			t[2] = t[3];
+			t[3] = t0;
+			aes_sub_bytes(t);
+			t[0] ^= rcon;
+			rcon = aes_xtime(rcon);
+		} else if (i % AES_KEYSIZE_256 == 16) {
+			aes_sub_bytes(t);
+		}
+
+		for (j = 0; j < 4; j++)
+			w[i + j] = w[i + j - AES_KEYSIZE_256] ^ t[j];
+	}
+
+	memzero_explicit(t, sizeof(t));
+}
+
+/* Encrypts AES_GENERIC_BLOCKS blocks at @buf, in place: */
+static void aes256_encrypt_generic(u8 rk[AES256_ROUNDS + 1][AES_BLOCK_SIZE],
+				   u8 *buf)
+{
+	u8 t[AES_BLOCK_SIZE];
+	unsigned r, b, i;
+
+	for (b = 0; b < AES_GENERIC_BLOCKS; b++)
+		for (i = 0; i < AES_BLOCK_SIZE; i++)
+			buf[b * AES_BLOCK_SIZE + i] ^= rk[0][i];
+
+	for (r = 1; r <= AES256_ROUNDS; r++) {
+		aes_sub_bytes(buf);
+
+		for (b = 0; b < AES_GENERIC_BLOCKS; b++) {
+			u8 *s = buf + b * AES_BLOCK_SIZE;
+
+			/* ShiftRows: */
+			for (i = 0; i < AES_BLOCK_SIZE; i++)
+				t[i] = s[(i + 4 * (i & 3)) & 15];
+
+			/* MixColumns: */
+			if (r != AES256_ROUNDS) {
+				for (i = 0; i < AES_BLOCK_SIZE; i += 4) {
+					u8 a0 = t[i + 0], a1 = t[i + 1],
+					   a2 = t[i + 2], a3 = t[i + 3];
+					u8 e = a0 ^ a1 ^ a2 ^ a3;
+
+					s[i + 0] = a0 ^ e ^ aes_xtime(a0 ^ a1);
+					s[i + 1] = a1 ^ e ^ aes_xtime(a1 ^ a2);
+					s[i + 2] = a2 ^ e ^ aes_xtime(a2 ^ a3);
+					s[i + 3] = a3 ^ e ^ aes_xtime(a3 ^ a0);
+				}
+			} else {
+				memcpy(s, t, sizeof(t));
+			}
+
+			for (i = 0; i < AES_BLOCK_SIZE; i++)
+				s[i] ^= rk[r][i];
+		}
+	}
+}
+
+static inline void ctr_inc(u8 *ctr)
+{
+	int i;
+
+	for (i = AES_BLOCK_SIZE - 1; i >= 0; --i)
+		if (++ctr[i])
+			break;
+}
+
+static inline void xor_bytes(u8 *dst, const u8 *src, unsigned len)
+{
+	while (len--)
+		*dst++ ^= *src++;
+}
+
+static void aes256_ctr_generic(struct aes_ctr_tfm *ctx, u8 *ctr,
+			       u8 *buf, size_t len)
+{
+	u8 ks[AES_BLOCK_SIZE * AES_GENERIC_BLOCKS];
+
+	while (len) {
+		unsigned i, n = min_t(size_t, len, sizeof(ks));
+
+		for (i = 0; i < AES_GENERIC_BLOCKS; i++) {
+			memcpy(ks + i * AES_BLOCK_SIZE, ctr, AES_BLOCK_SIZE);
+			if (i * AES_BLOCK_SIZE < n)
+				ctr_inc(ctr);
+		}
+
+		aes256_encrypt_generic(ctx->rk, ks);
+
+		xor_bytes(buf, ks, n);
+		buf += n;
+		len -= n;
+	}
+
+	memzero_explicit(ks, sizeof(ks));
+}
+
+#ifdef __x86_64__
+__attribute__((target("aes,sse2")))
+static inline __m128i aes256_encrypt_ni(const __m128i *k, __m128i b)
+{
+	unsigned r;
+
+	b = _mm_xor_si128(b, k[0]);
+	for (r = 1; r < AES256_ROUNDS; r++)
+		b = _mm_aesenc_si128(b, k[r]);
+	return _mm_aesenclast_si128(b, k[AES256_ROUNDS]);
+}
+
+__attribute__((target("aes,sse2")))
+static void aes256_ctr_ni(struct aes_ctr_tfm *ctx, u8 *ctr,
+			  u8 *buf, size_t len)
+{
+	__m128i k[AES256_ROUNDS + 1], b[4];
+	u8 ks[AES_BLOCK_SIZE];
+	unsigned i, r;
+
+	for (r = 0; r <= AES256_ROUNDS; r++)
+		k[r] = _mm_loadu_si128((void *) ctx->rk[r]);
+
+	/* Four blocks at a time, to keep the AES units busy: */
+	while (len >= AES_BLOCK_SIZE * 4) {
+		for (i = 0; i < 4; i++) {
+			b[i] = _mm_xor_si128(_mm_loadu_si128((void *) ctr), k[0]);
+			ctr_inc(ctr);
+		}
+
+		for (r = 1; r < AES256_ROUNDS; r++)
+			for (i = 0; i < 4; i++)
+				b[i] = _mm_aesenc_si128(b[i], k[r]);
+
+		for (i = 0; i < 4; i++) {
+			__m128i *p = (void *) (buf + i * AES_BLOCK_SIZE);
+
+			b[i] = _mm_aesenclast_si128(b[i], k[AES256_ROUNDS]);
+			_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), b[i]));
+		}
+
+		buf += AES_BLOCK_SIZE * 4;
+		len -= AES_BLOCK_SIZE * 4;
+	}
+
+	while (len) {
+		unsigned n = min_t(size_t, len, AES_BLOCK_SIZE);
+
+		_mm_storeu_si128((void *) ks,
+			aes256_encrypt_ni(k, _mm_loadu_si128((void *) ctr)));
+		ctr_inc(ctr);
+
+		xor_bytes(buf, ks, n);
+		buf += n;
+		len -= n;
+	}
+}
+#endif
+
+/* Self tests: */
+
+struct aes_ctr_testvec {
+	const char	*key;
+	const char	*iv;
+	const char	*ptext;
+	const char	*ctext;
+	unsigned	len;
+};
+
+static const struct aes_ctr_testvec aes_ctr_tv[] = {
+	/* FIPS-197 C.3 - the first keystream block is E(key, iv): */
+	{
+		.key	= "\x00\x01\x02\x03\x04\x05\x06\x07"
+			  "\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+			  "\x10\x11\x12\x13\x14\x15\x16\x17"
+			  "\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f",
+		.iv	= "\x00\x11\x22\x33\x44\x55\x66\x77"
+			  "\x88\x99\xaa\xbb\xcc\xdd\xee\xff",
+		.ptext	= "\x00\x00\x00\x00\x00\x00\x00\x00"
+			  "\x00\x00\x00\x00\x00\x00\x00\x00",
+		.ctext	= "\x8e\xa2\xb7\xca\x51\x67\x45\xbf"
+			  "\xea\xfc\x49\x90\x4b\x49\x60\x89",
+		.len	= 16,
+	},
+	/* SP 800-38A F.5.5, CTR-AES256.Encrypt: */
+	{
+		.key	= "\x60\x3d\xeb\x10\x15\xca\x71\xbe"
+			  "\x2b\x73\xae\xf0\x85\x7d\x77\x81"
+			  "\x1f\x35\x2c\x07\x3b\x61\x08\xd7"
+			  "\x2d\x98\x10\xa3\x09\x14\xdf\xf4",
+		.iv	= "\xf0\xf1\xf2\xf3\xf4\xf5\xf6\xf7"
+			  "\xf8\xf9\xfa\xfb\xfc\xfd\xfe\xff",
+		.ptext	= "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96"
+			  "\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+			  "\xae\x2d\x8a\x57\x1e\x03\xac\x9c"
+			  "\x9e\xb7\x6f\xac\x45\xaf\x8e\x51"
+			  "\x30\xc8\x1c\x46\xa3\x5c\xe4\x11"
+			  "\xe5\xfb\xc1\x19\x1a\x0a\x52\xef"
+			  "\xf6\x9f\x24\x45\xdf\x4f\x9b\x17"
+			  "\xad\x2b\x41\x7b\xe6\x6c\x37\x10",
+		.ctext	= "\x60\x1e\xc3\x13\x77\x57\x89\xa5"
+			  "\xb7\xa7\xf5\x04\xbb\xf3\xd2\x28"
+			  "\xf4\x43\xe3\xca\x4d\x62\xb5\x9a"
+			  "\xca\x84\xe9\x90\xca\xca\xf5\xc5"
+			  "\x2b\x09\x30\xda\xa2\x3d\xe9\x4c"
+			  "\xe8\x70\x17\xba\x2d\x84\x98\x8d"
+			  "\xdf\xc9\xc5\x8d\xb6\x7a\xad\xa6"
+			  "\x13\xc2\xdd\x08\x45\x79\x41\xa6",
+		.len	= 64,
+	},
+	/* The counter carries across all 128 bits; partial last block: */
+	{
+		.key	= "\x60\x3d\xeb\x10\x15\xca\x71\xbe"
+			  "\x2b\x73\xae\xf0\x85\x7d\x77\x81"
+			  "\x1f\x35\x2c\x07\x3b\x61\x08\xd7"
+			  "\x2d\x98\x10\xa3\x09\x14\xdf\xf4",
+		.iv	= "\xff\xff\xff\xff\xff\xff\xff\xff"
+			  "\xff\xff\xff\xff\xff\xff\xff\xfe",
+		.ptext	= "\x00\x00\x00\x00\x00\x00\x00\x00"
+			  "\x00\x00\x00\x00\x00\x00\x00\x00"
+			  "\x00\x00\x00\x00\x00\x00\x00\x00"
+			  "\x00\x00\x00\x00\x00\x00\x00\x00"
+			  "\x00\x00\x00\x00\x00\x00\x00\x00",
+		.ctext	= "\x4f\x9d\xb7\x42\x15\x5a\xc5\x02"
+			  "\xc2\xae\x28\x02\x3b\x33\x36\xe4"
+			  "\x3b\x3c\x29\x21\xc8\x5a\x24\xde"
+			  "\x9a\xc6\x06\xce\x6d\x1d\x60\xcc"
+			  "\xe5\x68\xf6\x81\x94\xcf\x76\xd6",
+		.len	= 40,
+	},
+};
+
+typedef void (*aes256_ctr_fn)(struct aes_ctr_tfm *, u8 *, u8 *, size_t);
+
+static int aes_ctr_test_kat(aes256_ctr_fn fn, const char *name)
+{
+	struct aes_ctr_tfm ctx;
+	const struct aes_ctr_testvec *tv;
+	u8 ctr[AES_BLOCK_SIZE], buf[64];
+
+	for (tv = aes_ctr_tv; tv < aes_ctr_tv + ARRAY_SIZE(aes_ctr_tv); tv++) {
+		aes256_expand_key(ctx.rk, (const u8 *) tv->key);
+
+		memcpy(ctr, tv->iv, sizeof(ctr));
+		memcpy(buf, tv->ptext, tv->len);
+		fn(&ctx, ctr, buf, tv->len);
+
+		if (memcmp(buf, tv->ctext, tv->len)) {
+			pr_err("ctr(aes) %s: known answer test %zu failed",
+			       name, tv - aes_ctr_tv);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef __x86_64__
+/* The generic and AES-NI paths must agree, on arbitrary lengths: */
+static int aes_ctr_test_ni(void)
+{
+	struct aes_ctr_tfm ctx;
+	u8 key[AES_KEYSIZE_256], iv[AES_BLOCK_SIZE], ctr1[AES_BLOCK_SIZE],
+	   ctr2[AES_BLOCK_SIZE], buf1[200], buf2[200];
+	unsigned i, len;
+
+	for (i = 0; i < 16; i++) {
+		get_random_bytes(key, sizeof(key));
+		get_random_bytes(iv, sizeof(iv));
+		get_random_bytes(buf1, sizeof(buf1));
+		memcpy(buf2, buf1, sizeof(buf1));
+
+		/* make some of the counters carry out of the low bytes: */
+		if (i & 1)
+			memset(iv + 12, 0xff, 4);
+
+		len = get_random_u32() % sizeof(buf1);
+
+		aes256_expand_key(ctx.rk, key);
+		memcpy(ctr1, iv, sizeof(iv));
+		memcpy(ctr2, iv, sizeof(iv));
+
+		aes256_ctr_generic(&ctx, ctr1, buf1, len);
+		aes256_ctr_ni(&ctx, ctr2, buf2, len);
+
+		if (memcmp(buf1, buf2, sizeof(buf1)) ||
+		    memcmp(ctr1, ctr2, sizeof(ctr1))) {
+			pr_err("ctr(aes): generic and aesni differ");
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+static int aes_ctr_selftest(void)
+{
+	int ret = aes_ctr_test_kat(aes256_ctr_generic, "generic");
+
+#ifdef __x86_64__
+	if (!ret && aes_ni)
+		ret = aes_ctr_test_kat(aes256_ctr_ni, "aesni") ?:
+			aes_ctr_test_ni();
+#endif
+	return ret;
+}
+
+static int crypto_aes_ctr_setkey(struct crypto_skcipher *tfm, const u8 *key,
+				 unsigned int keysize)
+{
+	struct aes_ctr_tfm *ctx =
+		container_of(tfm, struct aes_ctr_tfm, tfm);
+
+	if (keysize != AES_KEYSIZE_256)
+		return -EINVAL;
+
+	aes256_expand_key(ctx->rk, key);
+	return 0;
+}
+
+static int crypto_aes_ctr_crypt(struct skcipher_request *req)
+{
+	struct aes_ctr_tfm *ctx =
+		container_of(req->tfm, struct aes_ctr_tfm, tfm.base);
+	struct scatterlist *sg = req->src;
+	unsigned nbytes = req->cryptlen;
+	u8 ctr[AES_BLOCK_SIZE];
+
+	BUG_ON(req->src != req->dst);
+
+	memcpy(ctr, req->iv, sizeof(ctr));
+
+	while (1) {
+#ifdef __x86_64__
+		if (aes_ni)
+			aes256_ctr_ni(ctx, ctr, sg_virt(sg), sg->length);
+		else
+#endif
+			aes256_ctr_generic(ctx, ctr, sg_virt(sg), sg->length);
+
+		nbytes -= sg->length;
+
+		if (sg_is_last(sg))
+			break;
+
+		BUG_ON(sg->length % AES_BLOCK_SIZE);
+		sg = sg_next(sg);
+	};
+
+	BUG_ON(nbytes);
+
+	return 0;
+}
+
+static void *crypto_aes_ctr_alloc_tfm(void)
+{
+	struct aes_ctr_tfm *tfm = kzalloc(sizeof(*tfm), GFP_KERNEL);
+
+	if (!tfm)
+		return NULL;
+
+	tfm->tfm.base.alg	= &alg.base;
+	tfm->tfm.setkey		= crypto_aes_ctr_setkey;
+	tfm->tfm.encrypt	= crypto_aes_ctr_crypt;
+	tfm->tfm.decrypt	= crypto_aes_ctr_crypt;
+	tfm->tfm.ivsize		= AES_BLOCK_SIZE;
+	tfm->tfm.keysize	= AES_KEYSIZE_256;
+
+	return tfm;
+}
+
+static struct skcipher_alg alg = {
+	.base.cra_name		= "ctr(aes)",
+	.base.alloc_tfm		= crypto_aes_ctr_alloc_tfm,
+};
+
+__attribute__((constructor(110)))
+static int aes_ctr_mod_init(void)
+{
+	int ret;
+
+#ifdef __x86_64__
+	aes_ni = __builtin_cpu_supports("aes");
+#endif
+	ret = aes_ctr_selftest();
+	if (ret)
+		return ret;
+
+	return crypto_register_skcipher(&alg);
+}
@@ -0,0 +1,386 @@
+/*
+ * GHASH: the universal hash used by GCM, as specified in NIST SP 800-38D
+ *
+ * Multiplication in GF(2^128) uses PCLMULQDQ when the CPU supports it
+ * (checked at runtime), otherwise a bit serial implementation that's constant
+ * time: each step is masked in, rather than branching on key or data bits.
+ *
+ * Both implementations are checked against known answer tests (the AES-256
+ * GCM test cases from the GCM specification, as used for SP 800-38D
+ * validation) and against each other when the module is loaded, and the
+ * algorithm isn't registered if either fails.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <linux/byteorder.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/printk.h>
+#include <linux/random.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <asm/unaligned.h>
+
+#include <linux/crypto.h>
+#include <crypto/ghash.h>
+#include <crypto/hash.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+static struct shash_alg ghash_alg;
+
+static bool ghash_clmul;
+
+struct ghash_tfm {
+	struct crypto_shash	tfm;
+	u8			h[GHASH_BLOCK_SIZE];
+};
+
+struct ghash_desc_ctx {
+	u8			acc[GHASH_BLOCK_SIZE];
+	u8			buf[GHASH_BLOCK_SIZE];
+	unsigned		bytes;
+};
+
+static void gf128_mul_generic(u8 *x, const u8 *h)
+{
+	u64 vh = get_unaligned_be64(h);
+	u64 vl = get_unaligned_be64(h + 8);
+	u64 zh = 0, zl = 0;
+	unsigned i;
+
+	for (i = 0; i < 128; i++) {
+		u64 bit = -(u64) ((x[i >> 3] >> (7 - (i & 7))) & 1);
+		u64 lsb = -(vl & 1);
+
+		zh ^= vh & bit;
+		zl ^= vl & bit;
+
+		vl = (vl >> 1) | (vh << 63);
+		vh = (vh >> 1) ^ ((0xe1ULL << 56) & lsb);
+	}
+
+	put_unaligned_be64(zh, x);
+	put_unaligned_be64(zl, x + 8);
+}
+
+#ifdef __x86_64__
+/*
+ * Carry-less multiply followed by reduction modulo x^128 + x^7 + x^2 + x + 1,
+ * on byte reversed operands - see Intel's "Carry-Less Multiplication
+ * Instruction and its Usage for Computing the GCM Mode":
+ */
+__attribute__((target("pclmul,ssse3")))
+static void gf128_mul_clmul(u8 *x, const u8 *h)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((void *) x), bswap);
+	__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((void *) h), bswap);
+	__m128i lo, hi, mid, t1, t2, t3;
+
+	lo  = _mm_clmulepi64_si128(a, b, 0x00);
+	hi  = _mm_clmulepi64_si128(a, b, 0x11);
+	mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+			    _mm_clmulepi64_si128(a, b, 0x01));
+
+	lo  = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+	hi  = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+	/* Shift the 256 bit product left by one, for the reflected operands: */
+	t1  = _mm_srli_epi32(lo, 31);
+	t2  = _mm_srli_epi32(hi, 31);
+	lo  = _mm_slli_epi32(lo, 1);
+	hi  = _mm_slli_epi32(hi, 1);
+
+	t3  = _mm_srli_si128(t1, 12);
+	t2  = _mm_slli_si128(t2, 4);
+	t1  = _mm_slli_si128(t1, 4);
+	lo  = _mm_or_si128(lo, t1);
+	hi  = _mm_or_si128(hi, t2);
+	hi  = _mm_or_si128(hi, t3);
+
+	/* Reduce: */
+	t1  = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31),
+					  _mm_slli_epi32(lo, 30)),
+					  _mm_slli_epi32(lo, 25));
+	t2  = _mm_srli_si128(t1, 4);
+	t1  = _mm_slli_si128(t1, 12);
+	lo  = _mm_xor_si128(lo, t1);
+
+	t3  = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1),
+					  _mm_srli_epi32(lo, 2)),
+					  _mm_srli_epi32(lo, 7));
+	t3  = _mm_xor_si128(t3, t2);
+	lo  = _mm_xor_si128(lo, t3);
+	hi  = _mm_xor_si128(hi, lo);
+
+	_mm_storeu_si128((void *) x, _mm_shuffle_epi8(hi, bswap));
+}
+#endif
+
+static inline void gf128_mul(u8 *x, const u8 *h)
+{
+#ifdef __x86_64__
+	if (ghash_clmul) {
+		gf128_mul_clmul(x, h);
+		return;
+	}
+#endif
+	gf128_mul_generic(x, h);
+}
+
+static inline const u8 *ghash_key(struct shash_desc *desc)
+{
+	return container_of(desc->tfm, struct ghash_tfm, tfm)->h;
+}
+
+static int ghash_setkey(struct crypto_shash *tfm, const u8 *key,
+			unsigned keylen)
+{
+	struct ghash_tfm *ctx = container_of(tfm, struct ghash_tfm, tfm);
+
+	if (keylen != GHASH_BLOCK_SIZE)
+		return -EINVAL;
+
+	memcpy(ctx->h, key, GHASH_BLOCK_SIZE);
+	return 0;
+}
+
+static int ghash_init(struct shash_desc *desc)
+{
+	struct ghash_desc_ctx *dctx = (void *) desc->ctx;
+
+	memset(dctx, 0, sizeof(*dctx));
+	return 0;
+}
+
+static void ghash_block(u8 *acc, const u8 *h, const u8 *src)
+{
+	unsigned i;
+
+	for (i = 0; i < GHASH_BLOCK_SIZE; i++)
+		acc[i] ^= src[i];
+	gf128_mul(acc, h);
+}
+
+static int ghash_update(struct shash_desc *desc, const u8 *src,
+			unsigned int len)
+{
+	struct ghash_desc_ctx *dctx = (void *) desc->ctx;
+	const u8 *h = ghash_key(desc);
+
+	if (dctx->bytes) {
+		unsigned n = min(len, GHASH_BLOCK_SIZE - dctx->bytes);
+
+		memcpy(dctx->buf + dctx->bytes, src, n);
+		dctx->bytes	+= n;
+		src		+= n;
+		len		-= n;
+
+		if (dctx->bytes < GHASH_BLOCK_SIZE)
+			return 0;
+
+		ghash_block(dctx->acc, h, dctx->buf);
+		dctx->bytes = 0;
+	}
+
+	while (len >= GHASH_BLOCK_SIZE) {
+		ghash_block(dctx->acc, h, src);
+		src += GHASH_BLOCK_SIZE;
+		len -= GHASH_BLOCK_SIZE;
+	}
+
+	memcpy(dctx->buf, src, len);
+	dctx->bytes = len;
+	return 0;
+}
+
+/* A trailing partial block is zero padded: */
+static int ghash_final(struct shash_desc *desc, u8 *out)
+{
+	struct ghash_desc_ctx *dctx = (void *) desc->ctx;
+
+	if (dctx->bytes) {
+		memset(dctx->buf + dctx->bytes, 0,
+		       GHASH_BLOCK_SIZE - dctx->bytes);
+		ghash_block(dctx->acc, ghash_key(desc), dctx->buf);
+	}
+
+	memcpy(out, dctx->acc, GHASH_DIGEST_SIZE);
+	memset(dctx, 0, sizeof(*dctx));
+	return 0;
+}
+
+/* Self tests: */
+
+struct ghash_testvec {
+	const char	*key;
+	const char	*ptext;
+	const char	*digest;
+	unsigned	len;
+};
+
+static const struct ghash_testvec ghash_tv[] = {
+	/* Test case 14: the ciphertext block, then the lengths block: */
+	{
+		.key	= "\xdc\x95\xc0\x78\xa2\x40\x89\x89"
+			  "\xad\x48\xa2\x14\x92\x84\x20\x87",
+		.ptext	= "\xce\xa7\x40\x3d\x4d\x60\x6b\x6e"
+			  "\x07\x4e\xc5\xd3\xba\xf3\x9d\x18"
+			  "\x00\x00\x00\x00\x00\x00\x00\x00"
+			  "\x00\x00\x00\x00\x00\x00\x00\x80",
+		.digest	= "\x83\xde\x42\x5c\x5e\xdc\x5d\x49"
+			  "\x8f\x38\x2c\x44\x10\x41\xca\x92",
+		.len	= 32,
+	},
+	/* Test case 16: 20 bytes of AAD, 60 of ciphertext, lengths block: */
+	{
+		.key	= "\xac\xbe\xf2\x05\x79\xb4\xb8\xeb"
+			  "\xce\x88\x9b\xac\x87\x32\xda\xd7",
+		.ptext	= "\xfe\xed\xfa\xce\xde\xad\xbe\xef"
+			  "\xfe\xed\xfa\xce\xde\xad\xbe\xef"
+			  "\xab\xad\xda\xd2\x00\x00\x00\x00"
+			  "\x00\x00\x00\x00\x00\x00\x00\x00"
+			  "\x52\x2d\xc1\xf0\x99\x56\x7d\x07"
+			  "\xf4\x7f\x37\xa3\x2a\x84\x42\x7d"
+			  "\x64\x3a\x8c\xdc\xbf\xe5\xc0\xc9"
+			  "\x75\x98\xa2\xbd\x25\x55\xd1\xaa"
+			  "\x8c\xb0\x8e\x48\x59\x0d\xbb\x3d"
+			  "\xa7\xb0\x8b\x10\x56\x82\x88\x38"
+			  "\xc5\xf6\x1e\x63\x93\xba\x7a\x0a"
+			  "\xbc\xc9\xf6\x62\x00\x00\x00\x00"
+			  "\x00\x00\x00\x00\x00\x00\x00\xa0"
+			  "\x00\x00\x00\x00\x00\x00\x01\xe0",
+		.digest	= "\x8b\xd0\xc4\xd8\xaa\xcd\x39\x1e"
+			  "\x67\xcc\xa4\x47\xe8\xc3\x8f\x65",
+		.len	= 112,
+	},
+};
+
+typedef void (*gf128_mul_fn)(u8 *, const u8 *);
+
+static void ghash_test_digest(gf128_mul_fn mul, const u8 *h,
+			      const u8 *src, unsigned len, u8 *out)
+{
+	u8 buf[GHASH_BLOCK_SIZE];
+	unsigned i, n;
+
+	memset(out, 0, GHASH_DIGEST_SIZE);
+
+	while (len) {
+		n = min_t(unsigned, len, GHASH_BLOCK_SIZE);
+
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, src, n);
+
+		for (i = 0; i < GHASH_BLOCK_SIZE; i++)
+			out[i] ^= buf[i];
+		mul(out, h);
+
+		src += n;
+		len -= n;
+	}
+}
+
+static int ghash_test_kat(gf128_mul_fn mul, const char *name)
+{
+	const struct ghash_testvec *tv;
+	u8 digest[GHASH_DIGEST_SIZE];
+
+	for (tv = ghash_tv; tv < ghash_tv + ARRAY_SIZE(ghash_tv); tv++) {
+		ghash_test_digest(mul, (const u8 *) tv->key,
+				  (const u8 *) tv->ptext, tv->len, digest);
+
+		if (memcmp(digest, tv->digest, sizeof(digest))) {
+			pr_err("ghash %s: known answer test %zu failed",
+			       name, tv - ghash_tv);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef __x86_64__
+/* The generic and PCLMULQDQ paths must agree: */
+static int ghash_test_clmul(void)
+{
+	u8 h[GHASH_BLOCK_SIZE], buf[200];
+	u8 digest1[GHASH_DIGEST_SIZE], digest2[GHASH_DIGEST_SIZE];
+	unsigned i, len;
+
+	for (i = 0; i < 16; i++) {
+		get_random_bytes(h, sizeof(h));
+		get_random_bytes(buf, sizeof(buf));
+		len = get_random_u32() % sizeof(buf);
+
+		ghash_test_digest(gf128_mul_generic, h, buf, len, digest1);
+		ghash_test_digest(gf128_mul_clmul, h, buf, len, digest2);
+
+		if (memcmp(digest1, digest2, sizeof(digest1))) {
+			pr_err("ghash: generic and pclmul differ");
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+static int ghash_selftest(void)
+{
+	int ret = ghash_test_kat(gf128_mul_generic, "generic");
+
+#ifdef __x86_64__
+	if (!ret && ghash_clmul)
+		ret = ghash_test_kat(gf128_mul_clmul, "pclmul") ?:
+			ghash_test_clmul();
+#endif
+	return ret;
+}
+
+static void *ghash_alloc_tfm(void)
+{
+	struct ghash_tfm *tfm = kzalloc(sizeof(*tfm), GFP_KERNEL);
+
+	if (!tfm)
+		return NULL;
+
+	tfm->tfm.base.alg = &ghash_alg.base;
+	tfm->tfm.descsize = sizeof(struct ghash_desc_ctx);
+	return tfm;
+}
+
+static struct shash_alg ghash_alg = {
+	.digestsize	= GHASH_DIGEST_SIZE,
+	.setkey		= ghash_setkey,
+	.init		= ghash_init,
+	.update		= ghash_update,
+	.final		= ghash_final,
+	.descsize	= sizeof(struct ghash_desc_ctx),
+	.base.cra_name	= "ghash",
+	.base.alloc_tfm	= ghash_alloc_tfm,
+};
+
+__attribute__((constructor(110)))
+static int __init ghash_mod_init(void)
+{
+	int ret;
+
+#ifdef __x86_64__
+	ghash_clmul = __builtin_cpu_supports("pclmul") &&
+		__builtin_cpu_supports("ssse3");
+#endif
+	ret = ghash_selftest();
+	if (ret)
+		return ret;
+
+	return crypto_register_shash(&ghash_alg);
+}
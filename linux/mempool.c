@@ -156,6 +156,9 @@ void mempool_exit(mempool_t *pool)
 	}
 	kfree(pool->elements);
 	pool->elements = NULL;
+
+	kmem_cache_destroy(pool->slab);
+	pool->slab = NULL;
 }
 EXPORT_SYMBOL(mempool_exit);
 
@@ -522,6 +525,35 @@ void mempool_kfree(void *element, void *pool_data)
 }
 EXPORT_SYMBOL(mempool_kfree);
 
+int mempool_init_kmalloc_pool(mempool_t *pool, int min_nr, size_t size)
+{
+	struct kmem_cache *slab = kmem_cache_create("mempool", size);
+	int ret;
+
+	if (!slab)
+		return -ENOMEM;
+
+	ret = mempool_init(pool, min_nr, mempool_alloc_slab,
+			   mempool_free_slab, slab);
+	pool->slab = slab;
+	if (ret)
+		mempool_exit(pool);
+	return ret;
+}
+EXPORT_SYMBOL(mempool_init_kmalloc_pool);
+
+mempool_t *mempool_create_kmalloc_pool(int min_nr, size_t size)
+{
+	mempool_t *pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+
+	if (pool && mempool_init_kmalloc_pool(pool, min_nr, size)) {
+		kfree(pool);
+		pool = NULL;
+	}
+	return pool;
+}
+EXPORT_SYMBOL(mempool_create_kmalloc_pool);
+
 /*
  * A simple mempool-backed page allocator that allocates pages
  * of the order specified by pool_data.
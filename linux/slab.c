@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <pthread.h>
+
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+/*
+ * Each thread has a magazine per cache, indexed by kmem_cache->idx; magazines
+ * are on their cache's list so that kmem_cache_destroy() can empty them.
+ *
+ * kmem_caches_lock protects the cache slots and the magazine <-> cache
+ * linkage against kmem_cache_destroy() and thread exit; kmem_cache->lock
+ * protects the depot and the stats.
+ */
+
+__thread struct kmem_magazine *kmem_magazines[KMEM_CACHES_MAX];
+
+static DEFINE_MUTEX(kmem_caches_lock);
+static struct kmem_cache *kmem_caches[KMEM_CACHES_MAX];
+
+static pthread_key_t kmem_magazines_key;
+static pthread_once_t kmem_magazines_once = PTHREAD_ONCE_INIT;
+
+static void *kmem_cache_backing_alloc(struct kmem_cache *c)
+{
+	void *p;
+
+	return posix_memalign(&p, c->align, c->obj_size) ? NULL : p;
+}
+
+static void kmem_magazine_fold_stats(struct kmem_cache *c,
+				     struct kmem_magazine *m)
+{
+	if (m) {
+		c->stats.allocs	+= m->allocs;
+		c->stats.frees	+= m->frees;
+		m->allocs	= 0;
+		m->frees	= 0;
+	}
+}
+
+/* Called with c->lock held; returns the number of objects added: */
+static unsigned kmem_depot_add(struct kmem_cache *c, void **objs, unsigned nr)
+{
+	unsigned n = min_t(unsigned, nr, KMEM_DEPOT_MAX - c->depot_nr);
+
+	memcpy(c->depot + c->depot_nr, objs, n * sizeof(void *));
+	c->depot_nr += n;
+	c->stats.backing_frees += nr - n;
+	return n;
+}
+
+/* Slowpath for an empty magazine: refill half of it in one batch */
+void *__kmem_cache_refill(struct kmem_cache *c, struct kmem_magazine *m)
+{
+	unsigned want = m ? KMEM_MAGAZINE_SIZE / 2 : 0, nr = 0;
+	void *p = NULL;
+
+	spin_lock(&c->lock);
+	kmem_magazine_fold_stats(c, m);
+	c->stats.refills++;
+
+	if (c->depot_nr) {
+		p = c->depot[--c->depot_nr];
+		c->stats.allocs++;
+
+		if (m) {
+			m->nr = min(want, c->depot_nr);
+			c->depot_nr -= m->nr;
+			memcpy(m->objs, c->depot + c->depot_nr,
+			       m->nr * sizeof(void *));
+		}
+	}
+	spin_unlock(&c->lock);
+
+	if (p)
+		return p;
+
+	run_shrinkers();
+
+	p = kmem_cache_backing_alloc(c);
+	if (p) {
+		nr++;
+
+		while (m && m->nr < want) {
+			void *q = kmem_cache_backing_alloc(c);
+
+			if (!q)
+				break;
+			m->objs[m->nr++] = q;
+			nr++;
+		}
+	}
+
+	spin_lock(&c->lock);
+	c->stats.allocs		+= p != NULL;
+	c->stats.backing_allocs	+= nr;
+	spin_unlock(&c->lock);
+
+	return p;
+}
+
+/* Slowpath for a full magazine: flush the oldest half of it in one batch */
+void __kmem_cache_flush(struct kmem_cache *c, struct kmem_magazine *m, void *p)
+{
+	void *objs[KMEM_MAGAZINE_SIZE / 2 + 1];
+	unsigned i, nr = 0;
+
+	if (m) {
+		/* Keep the most recently freed objects, they're cache hot: */
+		nr = KMEM_MAGAZINE_SIZE / 2;
+		memcpy(objs, m->objs, nr * sizeof(void *));
+		memmove(m->objs, m->objs + nr, (m->nr - nr) * sizeof(void *));
+		m->nr -= nr;
+		m->objs[m->nr++] = p;
+		m->frees++;
+	} else {
+		objs[nr++] = p;
+	}
+
+	spin_lock(&c->lock);
+	kmem_magazine_fold_stats(c, m);
+	c->stats.frees += !m;
+	c->stats.flushes++;
+	i = kmem_depot_add(c, objs, nr);
+	spin_unlock(&c->lock);
+
+	while (i < nr)
+		free(objs[i++]);
+}
+
+static void kmem_magazines_exit(void *p)
+{
+	struct kmem_magazine **magazines = p;
+	unsigned i, j;
+
+	mutex_lock(&kmem_caches_lock);
+	for (i = 0; i < KMEM_CACHES_MAX; i++) {
+		struct kmem_magazine *m = magazines[i];
+		struct kmem_cache *c = m ? m->cache : NULL;
+
+		if (c) {
+			spin_lock(&c->lock);
+			kmem_magazine_fold_stats(c, m);
+			list_del(&m->list);
+			j = kmem_depot_add(c, m->objs, m->nr);
+			spin_unlock(&c->lock);
+
+			while (j < m->nr)
+				free(m->objs[j++]);
+		}
+
+		free(m);
+		magazines[i] = NULL;
+	}
+	mutex_unlock(&kmem_caches_lock);
+}
+
+static void kmem_magazines_key_init(void)
+{
+	pthread_key_create(&kmem_magazines_key, kmem_magazines_exit);
+}
+
+/*
+ * Slowpath for the first use of a cache by a thread - or a cache without a
+ * magazine slot, in which case every allocation goes to the depot:
+ */
+struct kmem_magazine *__kmem_cache_magazine(struct kmem_cache *c)
+{
+	struct kmem_magazine *m;
+
+	if (c->idx < 0)
+		return NULL;
+
+	m = kmem_magazines[c->idx];
+	if (!m) {
+		pthread_once(&kmem_magazines_once, kmem_magazines_key_init);
+
+		m = malloc(sizeof(*m));
+		if (!m)
+			return NULL;
+
+		kmem_magazines[c->idx] = m;
+		pthread_setspecific(kmem_magazines_key, kmem_magazines);
+	}
+
+	/* Otherwise, the magazine's previous cache was destroyed and emptied it: */
+	m->nr		= 0;
+	m->allocs	= 0;
+	m->frees	= 0;
+
+	spin_lock(&c->lock);
+	list_add(&m->list, &c->magazines);
+	WRITE_ONCE(m->cache, c);
+	spin_unlock(&c->lock);
+
+	return m;
+}
+
+void kmem_cache_stats(struct kmem_cache *c, struct kmem_cache_stats *stats)
+{
+	struct kmem_magazine *m;
+
+	spin_lock(&c->lock);
+	*stats = c->stats;
+
+	/* Not yet folded in - these may be slightly stale: */
+	list_for_each_entry(m, &c->magazines, list) {
+		stats->allocs	+= READ_ONCE(m->allocs);
+		stats->frees	+= READ_ONCE(m->frees);
+	}
+	spin_unlock(&c->lock);
+}
+
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+	struct kmem_magazine *m, *n;
+
+	if (!c)
+		return;
+
+	mutex_lock(&kmem_caches_lock);
+	list_for_each_entry_safe(m, n, &c->magazines, list) {
+		while (m->nr)
+			free(m->objs[--m->nr]);
+
+		list_del(&m->list);
+		WRITE_ONCE(m->cache, NULL);
+	}
+
+	if (c->idx >= 0)
+		kmem_caches[c->idx] = NULL;
+	mutex_unlock(&kmem_caches_lock);
+
+	while (c->depot_nr)
+		free(c->depot[--c->depot_nr]);
+	free(c);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size)
+{
+	struct kmem_cache *c = calloc(1, sizeof(*c));
+	unsigned i;
+
+	if (!c)
+		return NULL;
+
+	obj_size	= max_t(size_t, obj_size, 1);
+
+	c->name		= name;
+	c->obj_size	= obj_size;
+	c->align	= max(sizeof(void *),
+			      min(rounddown_pow_of_two(obj_size),
+				  (size_t) PAGE_SIZE));
+	c->idx		= -1;
+	spin_lock_init(&c->lock);
+	INIT_LIST_HEAD(&c->magazines);
+
+	mutex_lock(&kmem_caches_lock);
+	for (i = 0; i < KMEM_CACHES_MAX; i++)
+		if (!kmem_caches[i]) {
+			kmem_caches[i] = c;
+			c->idx = i;
+			break;
+		}
+	mutex_unlock(&kmem_caches_lock);
+
+	return c;
+}
@@ -23,149 +23,149 @@ static struct timespec timespec_add_ns(struct timespec a, u64 ns)
 	return a;
 }
 
-#define DECLARE_HEAP(type)						\
-struct {								\
-	size_t size, used;						\
-	type *data;							\
-}
-
-#define heap_init(heap, _size)						\
-({									\
-	size_t _bytes;							\
-	(heap)->used = 0;						\
-	(heap)->size = (_size);						\
-	_bytes = (heap)->size * sizeof(*(heap)->data);			\
-	(heap)->data = malloc(_bytes);					\
-	(heap)->data;							\
-})
-
-#define heap_free(heap)							\
-do {									\
-	kvfree((heap)->data);						\
-	(heap)->data = NULL;						\
-} while (0)
-
-#define heap_swap(h, i, j)	swap((h)->data[i], (h)->data[j])
-
-#define heap_sift(h, i, cmp)						\
-do {									\
-	size_t _r, _j = i;						\
-									\
-	for (; _j * 2 + 1 < (h)->used; _j = _r) {			\
-		_r = _j * 2 + 1;					\
-		if (_r + 1 < (h)->used &&				\
-		    cmp((h)->data[_r], (h)->data[_r + 1]))		\
-			_r++;						\
-									\
-		if (cmp((h)->data[_r], (h)->data[_j]))			\
-			break;						\
-		heap_swap(h, _r, _j);					\
-	}								\
-} while (0)
-
-#define heap_sift_down(h, i, cmp)					\
-do {									\
-	while (i) {							\
-		size_t p = (i - 1) / 2;					\
-		if (cmp((h)->data[i], (h)->data[p]))			\
-			break;						\
-		heap_swap(h, i, p);					\
-		i = p;							\
-	}								\
-} while (0)
-
-#define heap_add(h, d, cmp)						\
-({									\
-	bool _r = !heap_full(h);					\
-	if (_r) {							\
-		size_t _i = (h)->used++;				\
-		(h)->data[_i] = d;					\
-									\
-		heap_sift_down(h, _i, cmp);				\
-		heap_sift(h, _i, cmp);					\
-	}								\
-	_r;								\
-})
-
-#define heap_del(h, i, cmp)						\
-do {									\
-	size_t _i = (i);						\
-									\
-	BUG_ON(_i >= (h)->used);					\
-	(h)->used--;							\
-	heap_swap(h, _i, (h)->used);					\
-	heap_sift_down(h, _i, cmp);					\
-	heap_sift(h, _i, cmp);						\
-} while (0)
-
-#define heap_pop(h, d, cmp)						\
-({									\
-	bool _r = (h)->used;						\
-	if (_r) {							\
-		(d) = (h)->data[0];					\
-		heap_del(h, 0, cmp);					\
-	}								\
-	_r;								\
-})
-
-#define heap_peek(h)	((h)->used ? &(h)->data[0] : NULL)
-#define heap_full(h)	((h)->used == (h)->size)
-#define heap_empty(h)	((h)->used == 0)
-
-#define heap_resort(heap, cmp)						\
-do {									\
-	ssize_t _i;							\
-	for (_i = (ssize_t) (heap)->used / 2 -  1; _i >= 0; --_i)	\
-		heap_sift(heap, _i, cmp);				\
-} while (0)
-
-struct pending_timer {
-	struct timer_list	*timer;
-	unsigned long		expires;
-};
-
-static inline bool pending_timer_cmp(struct pending_timer a,
-				     struct pending_timer b)
-{
-	return a.expires < b.expires;
-}
+/*
+ * Pending timers are kept in a hierarchical timer wheel, as in older kernels:
+ * the first level has a slot for each of the next 256 jiffies, and each level
+ * after that has 64 slots, each covering a whole turn of the level below.
+ * Timers are on intrusive lists, so adding and removing one is O(1); each time
+ * the first level wraps around, the next slot of the level above is cascaded
+ * down.
+ */
 
-static DECLARE_HEAP(struct pending_timer) pending_timers;
+#define TVR_BITS	8
+#define TVN_BITS	6
+#define TVR_SIZE	(1 << TVR_BITS)
+#define TVN_SIZE	(1 << TVN_BITS)
+#define TVR_MASK	(TVR_SIZE - 1)
+#define TVN_MASK	(TVN_SIZE - 1)
+#define TVN_NR		4
+#define MAX_TVAL	((1UL << (TVR_BITS + TVN_NR * TVN_BITS)) - 1)
+
+static struct {
+	/* next jiffy to be processed: */
+	unsigned long		clk;
+	/* timers in the wheel, or expired and waiting to run: */
+	unsigned long		nr_pending;
+	struct list_head	expired;
+	struct list_head	tv1[TVR_SIZE];
+	struct list_head	tvn[TVN_NR][TVN_SIZE];
+} wheel;
+
+#define INDEX(N)	((wheel.clk >> (TVR_BITS + (N) * TVN_BITS)) & TVN_MASK)
 
 static pthread_mutex_t	timer_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t	timer_cond = PTHREAD_COND_INITIALIZER;
 static pthread_cond_t	timer_running_cond = PTHREAD_COND_INITIALIZER;
 static unsigned long	timer_seq;
+static struct timer_list *running_timer;
+
+/* When the timer thread is asleep, and when it's going to wake up: */
+static bool		timer_thread_sleeping;
+static bool		timer_thread_wake_at_valid;
+static unsigned long	timer_thread_wake_at;
 
 static inline bool timer_running(void)
 {
 	return timer_seq & 1;
 }
 
-static ssize_t timer_idx(struct timer_list *timer)
+static void wheel_add(struct timer_list *timer)
 {
-	size_t i;
+	unsigned long expires = timer->expires;
+	unsigned long idx = expires - wheel.clk;
+	struct list_head *vec;
+	unsigned i;
+
+	if ((long) idx < 0) {
+		/* Already expired: run it on the next tick */
+		vec = wheel.tv1 + (wheel.clk & TVR_MASK);
+	} else if (idx < TVR_SIZE) {
+		vec = wheel.tv1 + (expires & TVR_MASK);
+	} else {
+		/* Too far out: it'll be put back when it's cascaded down */
+		if (idx > MAX_TVAL) {
+			idx = MAX_TVAL;
+			expires = wheel.clk + idx;
+		}
 
-	for (i = 0; i < pending_timers.used; i++)
-		if (pending_timers.data[i].timer == timer)
-			return i;
+		for (i = 0; idx >> (TVR_BITS + (i + 1) * TVN_BITS); i++)
+			;
 
-	return -1;
+		vec = wheel.tvn[i] +
+			((expires >> (TVR_BITS + i * TVN_BITS)) & TVN_MASK);
+	}
+
+	list_add_tail(&timer->entry, vec);
 }
 
-int del_timer(struct timer_list *timer)
+static unsigned cascade(unsigned n, unsigned index)
 {
-	ssize_t idx;
+	struct timer_list *timer, *tmp;
+	LIST_HEAD(list);
 
-	pthread_mutex_lock(&timer_lock);
-	idx = timer_idx(timer);
-	if (idx >= 0)
-		heap_del(&pending_timers, idx, pending_timer_cmp);
+	list_splice_init(wheel.tvn[n] + index, &list);
+
+	list_for_each_entry_safe(timer, tmp, &list, entry)
+		wheel_add(timer);
+
+	return index;
+}
+
+/* Moves every timer that's expired as of @now to wheel.expired: */
+static void wheel_advance(unsigned long now)
+{
+	while (time_after_eq(now, wheel.clk)) {
+		unsigned index = wheel.clk & TVR_MASK;
+
+		if (!index &&
+		    !cascade(0, INDEX(0)) &&
+		    !cascade(1, INDEX(1)) &&
+		    !cascade(2, INDEX(2)))
+			cascade(3, INDEX(3));
+
+		wheel.clk++;
+		list_splice_init(wheel.tv1 + index, &wheel.expired);
+	}
+}
+
+/*
+ * The next jiffy the timer thread has work to do: the next nonempty slot in the
+ * first level, or when the first level wraps around and the next level has to
+ * be cascaded:
+ */
+static unsigned long wheel_next(void)
+{
+	unsigned long clk = wheel.clk;
 
+	if (!(clk & TVR_MASK))
+		return clk;
+
+	do {
+		if (!list_empty(wheel.tv1 + (clk & TVR_MASK)))
+			break;
+	} while (++clk & TVR_MASK);
+
+	return clk;
+}
+
+static void __del_timer(struct timer_list *timer)
+{
+	list_del(&timer->entry);
 	timer->pending = false;
+	wheel.nr_pending--;
+}
+
+int del_timer(struct timer_list *timer)
+{
+	int ret;
+
+	pthread_mutex_lock(&timer_lock);
+	ret = timer->pending;
+	if (ret)
+		__del_timer(timer);
 	pthread_mutex_unlock(&timer_lock);
 
-	return idx >= 0;
+	return ret;
 }
 
 void flush_timers(void)
@@ -182,73 +182,63 @@ void flush_timers(void)
 
 int del_timer_sync(struct timer_list *timer)
 {
-	unsigned long seq;
-	ssize_t idx;
+	int ret = 0;
 
 	pthread_mutex_lock(&timer_lock);
-	idx = timer_idx(timer);
-	if (idx >= 0)
-		heap_del(&pending_timers, idx, pending_timer_cmp);
+	while (1) {
+		/* The callback may have rearmed it: */
+		if (timer->pending) {
+			__del_timer(timer);
+			ret = 1;
+		}
 
-	timer->pending = false;
+		if (running_timer != timer)
+			break;
 
-	seq = timer_seq;
-	while (timer_running() && seq == timer_seq)
 		pthread_cond_wait(&timer_running_cond, &timer_lock);
+	}
 	pthread_mutex_unlock(&timer_lock);
 
-	return idx >= 0;
+	return ret;
 }
 
 int mod_timer(struct timer_list *timer, unsigned long expires)
 {
-	ssize_t idx;
+	int ret;
 
 	pthread_mutex_lock(&timer_lock);
-	timer->expires = expires;
-	timer->pending = true;
-	idx = timer_idx(timer);
+	ret = timer->pending;
 
-	if (idx >= 0 &&
-	    pending_timers.data[idx].expires == expires)
+	if (ret && timer->expires == expires)
 		goto out;
 
-	if (idx >= 0) {
-		pending_timers.data[idx].expires = expires;
+	if (ret)
+		__del_timer(timer);
 
-		heap_sift_down(&pending_timers, idx, pending_timer_cmp);
-		heap_sift(&pending_timers, idx, pending_timer_cmp);
-	} else {
-		if (heap_full(&pending_timers)) {
-			pending_timers.size *= 2;
-			pending_timers.data =
-				realloc(pending_timers.data,
-					pending_timers.size *
-					sizeof(struct pending_timer));
-
-			BUG_ON(!pending_timers.data);
-		}
+	/* Nothing to catch up on if the wheel is empty: */
+	if (!wheel.nr_pending)
+		wheel.clk = jiffies;
 
-		heap_add(&pending_timers,
-			 ((struct pending_timer) {
-				.timer = timer,
-				.expires = expires,
-			 }),
-			 pending_timer_cmp);
-	}
+	timer->expires = expires;
+	timer->pending = true;
+	wheel_add(timer);
+	wheel.nr_pending++;
 
-	pthread_cond_signal(&timer_cond);
+	if (timer_thread_sleeping &&
+	    (!timer_thread_wake_at_valid ||
+	     time_before(expires, timer_thread_wake_at)))
+		pthread_cond_signal(&timer_cond);
 out:
 	pthread_mutex_unlock(&timer_lock);
 
-	return idx >= 0;
+	return ret;
 }
 
 static bool timer_thread_stop = false;
 
 static int timer_thread(void *arg)
 {
-	struct pending_timer *p;
+	struct timer_list *timer;
 	struct timespec ts;
 	unsigned long now;
 	int ret;
@@ -257,39 +247,50 @@ static int timer_thread(void *arg)
 
 	while (!timer_thread_stop) {
 		now = jiffies;
-		p = heap_peek(&pending_timers);
-
-		if (!p) {
-			pthread_cond_wait(&timer_cond, &timer_lock);
-			continue;
-		}
-
-		if (time_after_eq(now, p->expires)) {
-			struct timer_list *timer = p->timer;
-
-			heap_del(&pending_timers, 0, pending_timer_cmp);
-			BUG_ON(!timer_pending(timer));
-			timer->pending = false;
+		wheel_advance(now);
 
+		if (!list_empty(&wheel.expired)) {
 			timer_seq++;
 			BUG_ON(!timer_running());
 
-			pthread_mutex_unlock(&timer_lock);
-			timer->function(timer);
-			pthread_mutex_lock(&timer_lock);
+			while (!list_empty(&wheel.expired)) {
+				timer = list_first_entry(&wheel.expired,
+						struct timer_list, entry);
+				__del_timer(timer);
+				running_timer = timer;
+
+				pthread_mutex_unlock(&timer_lock);
+				timer->function(timer);
+				pthread_mutex_lock(&timer_lock);
+
+				running_timer = NULL;
+				pthread_cond_broadcast(&timer_running_cond);
+			}
 
 			timer_seq++;
 			pthread_cond_broadcast(&timer_running_cond);
 			continue;
 		}
 
+		timer_thread_sleeping = true;
 
-		ret = clock_gettime(CLOCK_REALTIME, &ts);
-		BUG_ON(ret);
+		if (!wheel.nr_pending) {
+			timer_thread_wake_at_valid = false;
+			pthread_cond_wait(&timer_cond, &timer_lock);
+		} else {
+			timer_thread_wake_at_valid = true;
+			timer_thread_wake_at = wheel_next();
 
-		ts = timespec_add_ns(ts, jiffies_to_nsecs(p->expires - now));
+			ret = clock_gettime(CLOCK_REALTIME, &ts);
+			BUG_ON(ret);
+
+			ts = timespec_add_ns(ts,
+				jiffies_to_nsecs(timer_thread_wake_at - now));
+
+			pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+		}
 
-		pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+		timer_thread_sleeping = false;
 	}
 
 	pthread_mutex_unlock(&timer_lock);
@@ -302,8 +303,15 @@ struct task_struct *timer_task;
 __attribute__((constructor(103)))
 static void timers_init(void)
 {
-	heap_init(&pending_timers, 64);
-	BUG_ON(!pending_timers.data);
+	unsigned i, j;
+
+	wheel.clk = jiffies;
+	INIT_LIST_HEAD(&wheel.expired);
+	for (i = 0; i < TVR_SIZE; i++)
+		INIT_LIST_HEAD(wheel.tv1 + i);
+	for (i = 0; i < TVN_NR; i++)
+		for (j = 0; j < TVN_SIZE; j++)
+			INIT_LIST_HEAD(wheel.tvn[i] + j);
 
 	timer_task = kthread_run(timer_thread, NULL, "timers");
 	BUG_ON(IS_ERR(timer_task));
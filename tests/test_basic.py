@@ -2,6 +2,8 @@
 #
 # Basic bcachefs functionality tests.
 
+import json
+import os
 import re
 import util
 
@@ -20,6 +22,28 @@ def test_format(tmpdir):
     assert len(ret.stdout) > 0
     assert len(ret.stderr) == 0
 
+def test_format_multi(tmpdir):
+    devs = [util.sparse_file(tmpdir / 'dev{}'.format(i), 1024**3)
+            for i in range(4)]
+
+    # Old contents of image files should be discarded:
+    with open(devs[0], 'r+b') as f:
+        f.seek(512 << 20)
+        f.write(os.urandom(1 << 20))
+
+    ret = util.run_bch('format', *devs, valgrind=True)
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+    for dev in devs:
+        assert "{}: formatted in".format(dev) in ret.stdout
+        assert os.path.getsize(dev) == 1024**3
+    assert "initialized in" in ret.stdout
+    assert os.stat(devs[0]).st_blocks * 512 < (64 << 20)
+
+    ret = util.run_bch('fsck', '-n', *devs, valgrind=True)
+    assert ret.returncode == 0
+
 def test_fsck(tmpdir):
     dev = util.format_1g(tmpdir)
 
@@ -29,6 +53,16 @@ def test_fsck(tmpdir):
     assert len(ret.stdout) > 0
     assert len(ret.stderr) == 0
 
+def test_fsck_incremental(tmpdir):
+    dev = util.format_1g(tmpdir)
+
+    ret = util.run_bch('fsck', '-n', '--incremental', '-v', dev,
+                       valgrind=True)
+
+    assert ret.returncode == 0
+    assert "inodes touched by the journal" in ret.stdout
+    assert len(ret.stderr) == 0
+
 def test_list(tmpdir):
     dev = util.format_1g(tmpdir)
 
@@ -64,3 +98,44 @@ def test_list_dirent(tmpdir):
     # snap 0 len 0 ver 0: lost+found -> 4097
     last = ret.stdout.splitlines()[-1]
     assert re.match(r'^.*type dirent.*: lost\+found ->.*$', last)
+
+def test_du(tmpdir):
+    dev = util.format_1g(tmpdir)
+
+    ret = util.run_bch('du', '--apparent-size', dev, valgrind=True)
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+
+    paths = [l.split('\t')[-1] for l in ret.stdout.splitlines() if '\t' in l]
+    assert sorted(paths) == ['/', '/lost+found']
+
+def test_query(tmpdir):
+    dev = util.format_1g(tmpdir)
+
+    ret = util.run_bch('query', '--type=dir', '--json', dev, valgrind=True)
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+
+    lines = [json.loads(l) for l in ret.stdout.splitlines() if l.startswith('{')]
+    assert sorted(l['path'] for l in lines) == ['/', '/lost+found']
+    assert all(l['type'] == 'dir' for l in lines)
+
+    ret = util.run_bch('query', '--type=file', dev, valgrind=True)
+
+    assert ret.returncode == 0
+    assert not any('\t' in l for l in ret.stdout.splitlines())
+
+def test_defrag_report(tmpdir):
+    dev = util.format_1g(tmpdir)
+
+    ret = util.run_bch('defrag', '--report', dev, valgrind=True)
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+    assert "0 files, 0 extents, 0 fragments, 0 files fragmented" in ret.stdout
+
+    ret = util.run_bch('defrag', '--older-than=0', '--inode=4096', dev)
+    assert ret.returncode != 0
+    assert "--older-than only applies to --all" in ret.stderr
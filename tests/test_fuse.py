@@ -3,7 +3,10 @@
 # Tests of the fuse mount functionality.
 
 import pytest
+import errno
+import json
 import os
+import re
 import util
 
 pytestmark = pytest.mark.skipif(
@@ -234,3 +237,447 @@ def test_write(bfuse):
 
     bfuse.unmount()
     bfuse.verify()
+
+def test_csum_granularity(tmpdir):
+    dev = util.device_1g(tmpdir)
+    ret = util.run_bch('format', '--csum_granularity=16k', dev, valgrind=True)
+    assert ret.returncode == 0
+    bfuse = util.BFuse(dev, util.mountpoint(tmpdir))
+
+    chunk = 16 << 10
+    data = os.urandom(1 << 20)
+
+    bfuse.mount()
+    (bfuse.mnt / "file").write_bytes(data)
+    bfuse.unmount()
+    bfuse.verify()
+
+    def pread(off, size):
+        fd = os.open(bfuse.mnt / "file", os.O_RDONLY)
+        try:
+            os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_RANDOM)
+            return os.pread(fd, size, off)
+        finally:
+            os.close(fd)
+
+    bfuse.mount()
+    assert pread(5 * chunk + 1000, 4096) == data[5 * chunk + 1000:][:4096]
+    bfuse.unmount()
+    bfuse.verify()
+
+    # Flip a byte in the middle of one chunk on the device:
+    bad = 8 * chunk
+    needle = data[bad:bad + 512]
+    with open(dev, 'r+b') as f:
+        pos = 0
+        while True:
+            buf = f.read(1 << 20)
+            assert buf
+            i = buf.find(needle)
+            if i >= 0:
+                break
+            pos += len(buf) - len(needle)
+            f.seek(pos)
+
+        f.seek(pos + i + 8192)
+        b = f.read(1)
+        f.seek(pos + i + 8192)
+        f.write(bytes([b[0] ^ 1]))
+
+    # Only reads of that chunk see the checksum error:
+    bfuse.mount()
+    assert pread(bad + chunk, 4096) == data[bad + chunk:][:4096]
+    assert pread(bad - 4096, 4096) == data[bad - 4096:][:4096]
+    with pytest.raises(OSError) as e:
+        pread(bad + 4096, 4096)
+    assert e.value.errno == errno.EIO
+    bfuse.unmount()
+    bfuse.verify()
+
+@pytest.mark.parametrize("enc", ["chacha20_poly1305", "aes256_gcm"])
+def test_encrypted(tmpdir, enc):
+    dev = util.device_1g(tmpdir)
+    ret = util.run_bch('format', '--encryption_type=' + enc, '--no_passphrase',
+                       dev, valgrind=True)
+    assert ret.returncode == 0
+    bfuse = util.BFuse(dev, util.mountpoint(tmpdir))
+
+    # Something we can look for in the clear on the device:
+    marker = b'not encrypted! ' * 4
+    data = (marker + os.urandom(4096 - len(marker))) * 64
+
+    bfuse.mount()
+    (bfuse.mnt / "file").write_bytes(data)
+    bfuse.unmount()
+    bfuse.verify()
+
+    with open(dev, 'rb') as f:
+        for chunk in iter(lambda: f.read(1 << 20), b''):
+            assert marker not in chunk
+
+    bfuse.mount()
+    assert (bfuse.mnt / "file").read_bytes() == data
+    bfuse.unmount()
+    bfuse.verify()
+
+    ret = util.run_bch('fsck', '-n', dev, valgrind=True)
+    assert ret.returncode == 0
+
+def test_fsck_incremental_unclean(bfuse):
+    files = {"f%u" % i: os.urandom(4096) for i in range(8)}
+
+    bfuse.mount()
+    (bfuse.mnt / "d").mkdir()
+    for name, data in files.items():
+        with open(bfuse.mnt / "d" / name, "wb") as f:
+            f.write(data)
+            os.fsync(f.fileno())
+
+    # Crash, leaving those changes in the journal:
+    bfuse.proc.kill()
+    bfuse.unmount()
+    assert bfuse.returncode != 0
+
+    ret = util.run_bch('fsck', '-n', '--incremental', '-v', bfuse.dev,
+                       valgrind=True)
+    assert ret.returncode == 0
+
+    m = re.search(r'checking (\d+) inodes touched by the journal', ret.stdout)
+    assert m
+    assert int(m.group(1)) > 1
+
+    ret = util.run_bch('fsck', '--incremental', bfuse.dev, valgrind=True)
+    assert ret.returncode == 0
+
+    ret = util.run_bch('fsck', '-n', bfuse.dev, valgrind=True)
+    assert ret.returncode == 0
+
+    bfuse.mount()
+    for name, data in files.items():
+        assert (bfuse.mnt / "d" / name).read_bytes() == data
+    bfuse.unmount()
+    bfuse.verify()
+
+def test_du_query(bfuse):
+    files = {
+        "top":      12 << 10,
+        "a/f1":     16 << 10,
+        "a/f2":     4 << 10,
+        "a/b/f3":   64 << 10,
+        "c/f4":     8 << 10,
+    }
+
+    bfuse.mount()
+    for name, size in files.items():
+        path = bfuse.mnt / name
+        path.parent.mkdir(parents=True, exist_ok=True)
+        path.write_bytes(os.urandom(size))
+    bfuse.unmount()
+    bfuse.verify()
+
+    def run_json(*args):
+        ret = util.run_bch(*args, '--json', bfuse.dev, valgrind=True)
+        assert ret.returncode == 0
+        assert len(ret.stderr) == 0
+
+        lines = [json.loads(l) for l in ret.stdout.splitlines() if l.startswith('{')]
+        return {l['path']: l for l in lines}
+
+    # Every inode is listed under the path its dirents give it:
+    inodes = run_json('query')
+    assert sorted(inodes) == sorted(['/', '/lost+found', '/a', '/a/b', '/c'] +
+                                    ['/' + n for n in files])
+
+    for name, size in files.items():
+        i = inodes['/' + name]
+        assert i['type'] == 'file'
+        assert i['size'] == size
+        assert i['bytes'] == size
+
+    # Each directory's totals include everything beneath it:
+    dirs = run_json('du')
+    assert sorted(dirs) == sorted(p for p, i in inodes.items() if i['type'] == 'dir')
+
+    for path, d in dirs.items():
+        prefix = path.rstrip('/') + '/'
+        below = [i for p, i in inodes.items() if p == path or p.startswith(prefix)]
+
+        assert d['inum'] == inodes[path]['inum']
+        assert d['inodes'] == len(below)
+        assert d['bytes'] == sum(i['bytes'] for i in below)
+        assert d['apparent_bytes'] == sum(i['size'] for i in below)
+
+    assert dirs['/']['bytes'] == sum(files.values())
+    assert dirs['/a']['bytes'] == files['a/f1'] + files['a/f2'] + files['a/b/f3']
+    assert dirs['/a/b']['bytes'] == files['a/b/f3']
+    assert dirs['/c']['bytes'] == files['c/f4']
+
+    # --max-depth only limits what's shown, not the totals:
+    shallow = run_json('du', '--max-depth=1')
+    assert sorted(shallow) == ['/', '/a', '/c', '/lost+found']
+    assert all(shallow[p] == dirs[p] for p in shallow)
+
+    ret = util.run_bch('query', '--type=file', '--min-size=16k', bfuse.dev,
+                       valgrind=True)
+    assert ret.returncode == 0
+    paths = [l.split('\t')[-1] for l in ret.stdout.splitlines() if '\t' in l]
+    assert sorted(paths) == ['/a/b/f3', '/a/f1']
+
+def test_dedup(bfuse):
+    bfuse.mount()
+
+    data = os.urandom(256 << 10)
+    (bfuse.mnt / "a").write_bytes(data)
+    (bfuse.mnt / "b").write_bytes(data)
+    (bfuse.mnt / "c").write_bytes(os.urandom(256 << 10))
+
+    bfuse.unmount()
+    bfuse.verify()
+
+    # Space used, from the filesystem's usage counters:
+    def used():
+        bfuse.mount()
+        st = os.statvfs(bfuse.mnt)
+        bfuse.unmount()
+        bfuse.verify()
+        return (st.f_blocks - st.f_bfree) * st.f_frsize
+
+    before = used()
+
+    ret = util.run_bch('dedup', '--block-size=64k', bfuse.dev, valgrind=True)
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+    assert " in 1 ranges" in ret.stdout
+
+    # One copy of the duplicated data is gone, allowing for metadata:
+    assert before - used() >= 192 << 10
+
+    bfuse.mount()
+
+    assert (bfuse.mnt / "a").read_bytes() == data
+    assert (bfuse.mnt / "b").read_bytes() == data
+
+    bfuse.unmount()
+    bfuse.verify()
+
+def test_defrag(bfuse):
+    bfuse.mount()
+
+    # Interleave synced writes to two files, so that their extents alternate:
+    data = os.urandom(64 << 10)
+    fds = [os.open(bfuse.mnt / n, os.O_CREAT|os.O_WRONLY, 0o600)
+           for n in ("a", "b")]
+    for i in range(0, len(data), 4096):
+        for fd in fds:
+            os.write(fd, data[i:i + 4096])
+            os.fsync(fd)
+    for fd in fds:
+        os.close(fd)
+
+    bfuse.unmount()
+    bfuse.verify()
+
+    ret = util.run_bch('defrag', '--path=/a', bfuse.dev, valgrind=True)
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+
+    m = re.search(r'in (\d+) fragments -> \d+ extents in (\d+) fragments',
+                  ret.stdout)
+    assert m
+    assert int(m.group(2)) < int(m.group(1))
+
+    bfuse.mount()
+    assert (bfuse.mnt / "a").read_bytes() == data
+    assert (bfuse.mnt / "b").read_bytes() == data
+    bfuse.unmount()
+    bfuse.verify()
+
+def test_nocow(tmpdir):
+    dev = util.device_1g(tmpdir)
+    util.run_bch('format', '--nocow', dev, check=True)
+    bfuse = util.BFuse(dev, util.mountpoint(tmpdir))
+
+    def overwrite(data, offset, new):
+        with open(bfuse.mnt / "a", "r+b") as f:
+            f.seek(offset)
+            f.write(new)
+            f.flush()
+            os.fsync(f.fileno())
+        return data[:offset] + new + data[offset + len(new):]
+
+    bfuse.mount()
+
+    # Interleave synced writes to two files, so that defrag moves them:
+    a = os.urandom(64 << 10)
+    b = os.urandom(64 << 10)
+    fds = [os.open(bfuse.mnt / n, os.O_CREAT|os.O_WRONLY, 0o600)
+           for n in ("a", "b")]
+    for i in range(0, len(a), 4096):
+        for fd, data in zip(fds, (a, b)):
+            os.write(fd, data[i:i + 4096])
+            os.fsync(fd)
+    for fd in fds:
+        os.close(fd)
+
+    # Overwrites of whole extents are done in place:
+    a = overwrite(a, 8192, os.urandom(4096))
+    a = overwrite(a, 0, os.urandom(16384))
+    assert (bfuse.mnt / "a").read_bytes() == a
+
+    bfuse.unmount()
+    bfuse.verify()
+
+    ret = util.run_bch('defrag', '--path=/a', dev, valgrind=True)
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+
+    bfuse.mount()
+    assert (bfuse.mnt / "a").read_bytes() == a
+    assert (bfuse.mnt / "b").read_bytes() == b
+
+    # And to the extents the move created:
+    a = overwrite(a, 32768, os.urandom(8192))
+    assert (bfuse.mnt / "a").read_bytes() == a
+
+    bfuse.unmount()
+    bfuse.verify()
+
+    bfuse.mount()
+    assert (bfuse.mnt / "a").read_bytes() == a
+    bfuse.unmount()
+    bfuse.verify()
+
+def test_export(bfuse, tmpdir):
+    replica = tmpdir.mkdir('replica')
+    rdev = util.format_1g(replica)
+    rfuse = util.BFuse(rdev, util.mountpoint(replica))
+    stream = tmpdir / 'stream'
+
+    def export_import(since):
+        ret = util.run_bch('export', '--since=' + since, '-o', stream,
+                           bfuse.dev, valgrind=True)
+        assert ret.returncode == 0
+
+        m = re.search(r'^token: (\d+:\d+)$', ret.stderr, re.MULTILINE)
+        assert m
+
+        ret = util.run_bch('import', '-i', stream, rdev, valgrind=True)
+        assert ret.returncode == 0
+        assert len(ret.stderr) == 0
+        assert "token: " + m.group(1) in ret.stdout
+
+        return m.group(1)
+
+    bfuse.mount()
+    a = os.urandom(256 << 10)
+    b = os.urandom(64 << 10)
+    (bfuse.mnt / "a").write_bytes(a)
+    (bfuse.mnt / "b").write_bytes(b)
+    bfuse.unmount()
+    bfuse.verify()
+
+    token = export_import("0")
+
+    bfuse.mount()
+    c = os.urandom(4096)
+    with open(bfuse.mnt / "a", "r+b") as f:
+        f.seek(8192)
+        f.write(c)
+    a = a[:8192] + c + a[8192 + 4096:]
+    (bfuse.mnt / "b").unlink()
+    bfuse.unmount()
+    bfuse.verify()
+
+    export_import(token)
+
+    def import_fails(msg):
+        ret = util.run_bch('import', '-i', stream, rdev, valgrind=True)
+        assert ret.returncode != 0
+        assert msg in ret.stderr
+
+    # The same incremental stream again, and one that skips ahead:
+    import_fails("but this replica is at token")
+
+    bfuse.mount()
+    (bfuse.mnt / "c").write_bytes(os.urandom(4096))
+    bfuse.unmount()
+
+    ret = util.run_bch('export', '--since=' + token, '-o', stream,
+                       bfuse.dev, valgrind=True)
+    assert ret.returncode == 0
+    import_fails("but this replica is at token")
+
+    # A stream from some other filesystem, and one from the replica itself:
+    other = tmpdir.mkdir('other')
+    ret = util.run_bch('export', '--since=0', '-o', stream,
+                       util.format_1g(other), valgrind=True)
+    assert ret.returncode == 0
+    import_fails("but this is a replica of")
+
+    ret = util.run_bch('export', '--since=0', '-o', stream, rdev,
+                       valgrind=True)
+    assert ret.returncode == 0
+    import_fails("was exported from this filesystem")
+
+    rfuse.mount()
+    assert (rfuse.mnt / "a").read_bytes() == a
+    assert not (rfuse.mnt / "b").exists()
+    assert not (rfuse.mnt / "c").exists()
+    rfuse.unmount()
+    rfuse.verify()
+
+def test_train_dict(tmpdir):
+    dev = util.device_1g(tmpdir)
+    ret = util.run_bch('format', '--compression=zstd', dev, valgrind=True)
+    assert ret.returncode == 0
+    bfuse = util.BFuse(dev, util.mountpoint(tmpdir))
+
+    # Small files with shared structure, that zstd alone does poorly on:
+    def json_file(i, n):
+        return ("".join('{"id": %u, "name": "file-%u", "tags": ["a", "b"]}\n'
+                        % (j, i * j) for j in range(n))).encode()
+
+    files = {"f%u" % i: json_file(i, 64) for i in range(256)}
+
+    bfuse.mount()
+    for name, data in files.items():
+        (bfuse.mnt / name).write_bytes(data)
+    bfuse.unmount()
+    bfuse.verify()
+
+    # --default sets compression_dict to the new dictionary:
+    ret = util.run_bch('train-dict', '--size=4k', '--default', dev,
+                       valgrind=True)
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+
+    m = re.search(r'^dictionary 1: \d+ bytes, samples compress to (\d+)% \((\d+)% without\)$',
+                  ret.stdout, re.MULTILINE)
+    assert m
+    assert int(m.group(1)) < int(m.group(2))
+
+    ret = util.run_bch('show-super', '--fields=zstd_dicts', dev)
+    assert ret.returncode == 0
+    assert "zstd_dicts" in ret.stdout
+
+    # Written after training, so compressed with the dictionary:
+    bfuse.mount()
+    for i in range(256, 512):
+        files["f%u" % i] = json_file(i, 64)
+        (bfuse.mnt / ("f%u" % i)).write_bytes(files["f%u" % i])
+    big = b''.join(json_file(i, 1024) for i in range(16))
+    (bfuse.mnt / "big").write_bytes(big)
+    bfuse.unmount()
+    bfuse.verify()
+
+    bfuse.mount()
+    for name, data in files.items():
+        assert (bfuse.mnt / name).read_bytes() == data
+    assert (bfuse.mnt / "big").read_bytes() == big
+    bfuse.unmount()
+    bfuse.verify()
+
+    ret = util.run_bch('fsck', '-n', dev, valgrind=True)
+    assert ret.returncode == 0
@@ -255,6 +255,48 @@ unsigned get_blocksize(const char *path, int fd)
 	return ret >> 9;
 }
 
+/*
+ * Discard a range of a block device, or punch a hole in a file - errors are
+ * ignored, discard is only a hint:
+ */
+void discard_range(int fd, u64 offset, u64 len)
+{
+	struct stat statbuf = xfstat(fd);
+
+	if (S_ISBLK(statbuf.st_mode)) {
+		u64 range[2] = { offset, len };
+
+		ioctl(fd, BLKDISCARD, range);
+	} else {
+		fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			  offset, len);
+	}
+}
+
+/* Zero a range, letting the device do it if it can: */
+void zero_range(int fd, u64 offset, u64 len)
+{
+	struct stat statbuf = xfstat(fd);
+	static const char zeroes[4096];
+
+	if (S_ISBLK(statbuf.st_mode)) {
+		u64 range[2] = { offset, len };
+
+		if (!ioctl(fd, BLKZEROOUT, range))
+			return;
+	} else if (!fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, len)) {
+		return;
+	}
+
+	while (len) {
+		size_t n = min_t(u64, len, sizeof(zeroes));
+
+		xpwrite(fd, zeroes, n, offset);
+		offset	+= n;
+		len	-= n;
+	}
+}
+
 /* Open a block device, do magic blkid stuff to probe for existing filesystems: */
 int open_for_format(const char *dev, bool force)
 {
@@ -76,6 +76,8 @@ ssize_t read_string_list_or_die(const char *, const char * const[],
 
 u64 get_size(const char *, int);
 unsigned get_blocksize(const char *, int);
+void discard_range(int, u64, u64);
+void zero_range(int, u64, u64);
 int open_for_format(const char *, bool);
 
 bool ask_yn(void);